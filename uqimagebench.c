@@ -0,0 +1,641 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <FreeImage.h>
+#include <csse2310_freeimage.h>
+
+#define MAX_SIZE "--max-size"
+#define MIN_TIME "--min-time"
+#define JSON "--json"
+#define FILTER "--only"
+#define WRITE_CORPUS "--write-corpus"
+#define COMMAND_LINE_ERROR 2
+#define FAILED_GENERATE 3
+#define FAILED_WRITE 4
+#define BASE10 10
+#define DEFAULT_MAX_WIDTH 7680
+#define DEFAULT_MIN_TIME_MS 200
+#define MIN_RUNS 3
+#define MAX_RUNS 1000
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+#define NANOSECONDS_PER_MILLISECOND 1000000ULL
+#define SEED 0x2545F4914F6CDD1DULL
+#define PALETTE_COLOURS 256
+#define PI 3.14159265358979323846
+
+/**
+ * An enum for the kinds of synthetic image the corpus contains
+ */
+typedef enum {
+    KIND_GRADIENT, // Smooth horizontal and vertical colour ramps
+    KIND_NOISE, // Uniform random pixels, the worst case for compression
+    KIND_PHOTO, // Low-frequency shapes with a little sensor-like noise
+    KIND_PALETTE, // 8-bit palettized blocks
+    KIND_ALPHA, // A 32-bit gradient with a varying alpha channel
+    NUM_KINDS
+} ImageKind;
+
+/**
+ * An enum for the kernels that are timed on each image
+ */
+typedef enum {
+    KERNEL_DECODE, // Decoding the image's PNG encoding
+    KERNEL_ROTATE_0, // Rotating by 0 degrees
+    KERNEL_ROTATE_90, // Rotating by 90 degrees
+    KERNEL_ROTATE_37, // Rotating by 37 degrees
+    KERNEL_FLIP_H, // Flipping horizontally
+    KERNEL_FLIP_V, // Flipping vertically
+    KERNEL_SCALE_UP, // Scaling to double the width and height
+    KERNEL_SCALE_DOWN, // Scaling to half the width and height
+    KERNEL_ENCODE, // Encoding the image as PNG
+    NUM_KERNELS
+} Kernel;
+
+/**
+ * A struct storing the dimensions of one corpus resolution
+ */
+typedef struct {
+    int width; // The width in pixels
+    int height; // The height in pixels
+} Resolution;
+
+/**
+ * A struct storing information regarding command line parameters
+ */
+typedef struct {
+    int maxWidth; // The widest resolution to benchmark
+    uint64_t minTimeNs; // The minimum total time to spend on each kernel
+    bool json; // Whether to print JSON lines instead of a table
+    const char* only; // Only benchmark kernels with this name, or NULL
+    const char* corpusDir; // Write the corpus here instead, or NULL
+} CommandParameters;
+
+/**
+ * A struct storing the timings of a kernel on one image
+ */
+typedef struct {
+    int runs; // The number of times the kernel was run
+    uint64_t minNs; // The fastest run
+    uint64_t medianNs; // The median run
+} Timing;
+
+/**
+ * The names of the image kinds, as reported
+ */
+static const char* const kindNames[NUM_KINDS]
+        = {"gradient", "noise", "photo", "palette", "alpha"};
+
+/**
+ * The names of the kernels, as reported
+ */
+static const char* const kernelNames[NUM_KERNELS] = {"decode", "rotate_0",
+        "rotate_90", "rotate_37", "flip_h", "flip_v", "scale_up", "scale_down",
+        "encode"};
+
+/**
+ * The corpus resolutions, from 64x64 up to 8K UHD
+ */
+static const Resolution resolutions[] = {{64, 64}, {256, 256}, {640, 480},
+        {1024, 1024}, {1920, 1080}, {3840, 2160}, {7680, 4320}};
+
+/*******************************DECLARATIONS***********************************/
+CommandParameters command_line_arguments(int argc, char** argv);
+int convert_to_int(char* intString, int min, int max);
+void command_line_error();
+
+FIBITMAP* generate_image(ImageKind kind, int width, int height);
+void fill_rgb(FIBITMAP* bitmap, ImageKind kind, uint64_t* random);
+void fill_palette(FIBITMAP* bitmap, uint64_t* random);
+unsigned char photo_value(int x, int y, int width, int height, int channel,
+        uint64_t* random);
+uint64_t next_random(uint64_t* state);
+
+void write_corpus(CommandParameters params);
+void benchmark_image(CommandParameters params, ImageKind kind, int width,
+        int height);
+Timing time_kernel(CommandParameters params, Kernel kernel, FIBITMAP* image,
+        const unsigned char* png, unsigned long pngBytes);
+bool run_kernel(Kernel kernel, FIBITMAP* image, const unsigned char* png,
+        unsigned long pngBytes);
+void report(CommandParameters params, ImageKind kind, FIBITMAP* image,
+        unsigned long pngBytes, Kernel kernel, Timing timing);
+uint64_t now_ns();
+int compare_ns(const void* a, const void* b);
+
+/******************************************************************************/
+
+/**
+ * main()
+ * ------------
+ *  Benchmarks every kernel on every image of the synthetic corpus up to the
+ *  maximum size, printing a result for each, or writes the corpus out
+ *
+ *  int argc: the number of command line parameters
+ *  char** argv: the command line parameters
+ *
+ *  Returns: 0 on successful exit of program
+ */
+int main(int argc, char** argv)
+{
+    CommandParameters params = command_line_arguments(argc, argv);
+    if (params.corpusDir != NULL) {
+        write_corpus(params);
+        return 0;
+    }
+    if (!params.json) {
+        printf("%-8s %11s %3s %-10s %5s %12s %12s %9s %9s\n", "image", "size",
+                "bpp", "kernel", "runs", "median_ns", "min_ns", "ns/pixel",
+                "Mpixel/s");
+    }
+    int numResolutions = sizeof(resolutions) / sizeof(resolutions[0]);
+    for (int r = 0; r < numResolutions; r++) {
+        if (resolutions[r].width > params.maxWidth) {
+            break;
+        }
+        for (int kind = 0; kind < NUM_KINDS; kind++) {
+            benchmark_image(params, kind, resolutions[r].width,
+                    resolutions[r].height);
+        }
+    }
+    return 0;
+}
+
+/**
+ * command_line_arguments()
+ * ----------------------------
+ *  Parses the command line arguments
+ *
+ *  int argc: the number of parameters in the command line arguments
+ *  char** argv: the command line arguments
+ *
+ *  Returns: a CommandParameters struct storing the arguments
+ */
+CommandParameters command_line_arguments(int argc, char** argv)
+{
+    CommandParameters params = {DEFAULT_MAX_WIDTH,
+            DEFAULT_MIN_TIME_MS * NANOSECONDS_PER_MILLISECOND, false, NULL,
+            NULL};
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], MAX_SIZE) == 0 && i + 1 < argc) {
+            params.maxWidth = convert_to_int(
+                    argv[++i], resolutions[0].width, DEFAULT_MAX_WIDTH);
+        } else if (strcmp(argv[i], MIN_TIME) == 0 && i + 1 < argc) {
+            params.minTimeNs = convert_to_int(argv[++i], 1, INT32_MAX)
+                    * NANOSECONDS_PER_MILLISECOND;
+        } else if (strcmp(argv[i], JSON) == 0) {
+            params.json = true;
+        } else if (strcmp(argv[i], FILTER) == 0 && i + 1 < argc) {
+            params.only = argv[++i];
+        } else if (strcmp(argv[i], WRITE_CORPUS) == 0 && i + 1 < argc) {
+            params.corpusDir = argv[++i];
+        } else {
+            command_line_error();
+        }
+    }
+    return params;
+}
+
+/**
+ * convert_to_int()
+ * --------------------
+ *  Converts a string to an integer, running command_line_error() if it is
+ *  not a number within the given bounds
+ *
+ *  char* intString: the string to convert
+ *  int min: the minimum bound for the int
+ *  int max: the maximum bound for the int
+ *
+ *  Returns: the converted integer
+ */
+int convert_to_int(char* intString, int min, int max)
+{
+    char* endPtr;
+    long int converted = strtol(intString, &endPtr, BASE10);
+    if (*intString == '\0' || *endPtr != '\0' || converted < min
+            || converted > max) {
+        command_line_error();
+    }
+    return (int)converted;
+}
+
+/**
+ * command_line_error()
+ * -----------------------
+ *  Prints the usage message to stderr and exits
+ */
+void command_line_error()
+{
+    fprintf(stderr,
+            "Usage: uqimagebench [--max-size width] [--min-time ms] "
+            "[--only kernel] [--json]\n"
+            "       uqimagebench --write-corpus directory "
+            "[--max-size width]\n");
+    exit(COMMAND_LINE_ERROR);
+}
+
+/**
+ * generate_image()
+ * -------------------
+ *  Generates a synthetic image. The same arguments always give the same
+ *  pixels, so results are comparable between commits and machines.
+ *
+ *  ImageKind kind: the kind of image to generate
+ *  int width: the width in pixels
+ *  int height: the height in pixels
+ *
+ *  Returns: the generated image
+ */
+FIBITMAP* generate_image(ImageKind kind, int width, int height)
+{
+    int bpp = kind == KIND_PALETTE ? 8 : (kind == KIND_ALPHA ? 32 : 24);
+    FIBITMAP* bitmap = FreeImage_Allocate(width, height, bpp, 0, 0, 0);
+    if (bitmap == NULL) {
+        fprintf(stderr, "uqimagebench: cannot allocate %dx%d image\n", width,
+                height);
+        exit(FAILED_GENERATE);
+    }
+    uint64_t random = SEED ^ ((uint64_t)kind << 32) ^ (width * height);
+    if (kind == KIND_PALETTE) {
+        fill_palette(bitmap, &random);
+    } else {
+        fill_rgb(bitmap, kind, &random);
+    }
+    return bitmap;
+}
+
+/**
+ * fill_rgb()
+ * -------------
+ *  Fills a 24 or 32 bit image with the pixels of the given kind
+ *
+ *  FIBITMAP* bitmap: the image to fill
+ *  ImageKind kind: the kind of image
+ *  uint64_t* random: the state of the random number generator
+ */
+void fill_rgb(FIBITMAP* bitmap, ImageKind kind, uint64_t* random)
+{
+    int width = FreeImage_GetWidth(bitmap);
+    int height = FreeImage_GetHeight(bitmap);
+    int bytesPerPixel = FreeImage_GetBPP(bitmap) / 8;
+    for (int y = 0; y < height; y++) {
+        BYTE* pixel = FreeImage_GetScanLine(bitmap, y);
+        for (int x = 0; x < width; x++, pixel += bytesPerPixel) {
+            if (kind == KIND_NOISE) {
+                uint64_t value = next_random(random);
+                pixel[FI_RGBA_RED] = value;
+                pixel[FI_RGBA_GREEN] = value >> 8;
+                pixel[FI_RGBA_BLUE] = value >> 16;
+            } else if (kind == KIND_PHOTO) {
+                pixel[FI_RGBA_RED]
+                        = photo_value(x, y, width, height, 0, random);
+                pixel[FI_RGBA_GREEN]
+                        = photo_value(x, y, width, height, 1, random);
+                pixel[FI_RGBA_BLUE]
+                        = photo_value(x, y, width, height, 2, random);
+            } else {
+                pixel[FI_RGBA_RED] = x * 255 / width;
+                pixel[FI_RGBA_GREEN] = y * 255 / height;
+                pixel[FI_RGBA_BLUE] = (x + y) * 255 / (width + height);
+            }
+            if (kind == KIND_ALPHA) {
+                pixel[FI_RGBA_ALPHA]
+                        = 255 - (x + 2 * y) * 255 / (width + 2 * height);
+            }
+        }
+    }
+}
+
+/**
+ * fill_palette()
+ * -----------------
+ *  Fills an 8 bit image with a random palette and blocks of random indices,
+ *  like a GIF-style illustration
+ *
+ *  FIBITMAP* bitmap: the image to fill
+ *  uint64_t* random: the state of the random number generator
+ */
+void fill_palette(FIBITMAP* bitmap, uint64_t* random)
+{
+    RGBQUAD* palette = FreeImage_GetPalette(bitmap);
+    for (int i = 0; i < PALETTE_COLOURS; i++) {
+        uint64_t value = next_random(random);
+        palette[i].rgbRed = value;
+        palette[i].rgbGreen = value >> 8;
+        palette[i].rgbBlue = value >> 16;
+    }
+    int width = FreeImage_GetWidth(bitmap);
+    int height = FreeImage_GetHeight(bitmap);
+    int blockSize = width / 16 > 1 ? width / 16 : 1;
+    int blocksAcross = (width + blockSize - 1) / blockSize;
+    BYTE* rowIndices = malloc(blocksAcross);
+    for (int y = 0; y < height; y++) {
+        if (y % blockSize == 0) {
+            for (int b = 0; b < blocksAcross; b++) {
+                rowIndices[b] = next_random(random);
+            }
+        }
+        BYTE* pixel = FreeImage_GetScanLine(bitmap, y);
+        for (int x = 0; x < width; x++) {
+            pixel[x] = rowIndices[x / blockSize];
+        }
+    }
+    free(rowIndices);
+}
+
+/**
+ * photo_value()
+ * ----------------
+ *  Computes one channel of a photo-like pixel: a few overlapping soft blobs
+ *  and waves, so large areas are smooth but not flat, plus slight noise
+ *
+ *  int x, int y: the coordinates of the pixel
+ *  int width, int height: the dimensions of the image
+ *  int channel: 0, 1 or 2 for red, green or blue
+ *  uint64_t* random: the state of the random number generator
+ *
+ *  Returns: the channel value
+ */
+unsigned char photo_value(int x, int y, int width, int height, int channel,
+        uint64_t* random)
+{
+    double u = (double)x / width;
+    double v = (double)y / height;
+    double value = 0.5 + 0.25 * sin(2 * PI * (u * (channel + 1) + v))
+            + 0.15 * cos(2 * PI * (3 * v - u * (2 - channel)))
+            + 0.1 * exp(-((u - 0.6) * (u - 0.6) + (v - 0.4) * (v - 0.4)) * 20);
+    int noise = (int)(next_random(random) % 9) - 4;
+    int level = (int)(value * 255) + noise;
+    return level < 0 ? 0 : (level > 255 ? 255 : level);
+}
+
+/**
+ * next_random()
+ * ----------------
+ *  Advances an xorshift64* random number generator
+ *
+ *  uint64_t* state: the generator's state (never 0)
+ *
+ *  Returns: the next random number
+ */
+uint64_t next_random(uint64_t* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * SEED;
+}
+
+/**
+ * write_corpus()
+ * -----------------
+ *  Writes the PNG encoding of every corpus image up to the maximum size to
+ *  the corpus directory, as kind_widthxheight.png, for tools that need the
+ *  corpus as files
+ *
+ *  CommandParameters params: the command line parameters
+ */
+void write_corpus(CommandParameters params)
+{
+    int numResolutions = sizeof(resolutions) / sizeof(resolutions[0]);
+    for (int r = 0; r < numResolutions; r++) {
+        if (resolutions[r].width > params.maxWidth) {
+            break;
+        }
+        for (int kind = 0; kind < NUM_KINDS; kind++) {
+            int width = resolutions[r].width;
+            int height = resolutions[r].height;
+            FIBITMAP* image = generate_image(kind, width, height);
+            unsigned long pngBytes;
+            unsigned char* png
+                    = fi_save_png_image_to_buffer(image, &pngBytes);
+            FreeImage_Unload(image);
+            int nameSize = 1 + snprintf(NULL, 0, "%s/%s_%dx%d.png",
+                    params.corpusDir, kindNames[kind], width, height);
+            char name[nameSize];
+            snprintf(name, nameSize, "%s/%s_%dx%d.png", params.corpusDir,
+                    kindNames[kind], width, height);
+            FILE* file = fopen(name, "w");
+            if (png == NULL || file == NULL
+                    || fwrite(png, 1, pngBytes, file) != pngBytes
+                    || fclose(file) != 0) {
+                fprintf(stderr, "uqimagebench: cannot write %s\n", name);
+                exit(FAILED_WRITE);
+            }
+            free(png);
+        }
+    }
+}
+
+/**
+ * benchmark_image()
+ * --------------------
+ *  Generates an image and reports the timing of every kernel on it
+ *
+ *  CommandParameters params: the command line parameters
+ *  ImageKind kind: the kind of image to generate
+ *  int width: the width in pixels
+ *  int height: the height in pixels
+ */
+void benchmark_image(CommandParameters params, ImageKind kind, int width,
+        int height)
+{
+    FIBITMAP* image = generate_image(kind, width, height);
+    unsigned long pngBytes;
+    unsigned char* png = fi_save_png_image_to_buffer(image, &pngBytes);
+    if (png == NULL) {
+        fprintf(stderr, "uqimagebench: cannot encode %s %dx%d\n",
+                kindNames[kind], width, height);
+        exit(FAILED_GENERATE);
+    }
+    for (int kernel = 0; kernel < NUM_KERNELS; kernel++) {
+        if (params.only != NULL
+                && strcmp(params.only, kernelNames[kernel]) != 0) {
+            continue;
+        }
+        Timing timing = time_kernel(params, kernel, image, png, pngBytes);
+        report(params, kind, image, pngBytes, kernel, timing);
+    }
+    free(png);
+    FreeImage_Unload(image);
+}
+
+/**
+ * time_kernel()
+ * ----------------
+ *  Runs a kernel at least MIN_RUNS times and until params.minTimeNs has
+ *  passed, timing each run
+ *
+ *  CommandParameters params: the command line parameters
+ *  Kernel kernel: the kernel to time
+ *  FIBITMAP* image: the image to run it on
+ *  const unsigned char* png: the image's PNG encoding, for decoding
+ *  unsigned long pngBytes: the number of bytes in png
+ *
+ *  Returns: the timing of the kernel (with no runs if it failed)
+ */
+Timing time_kernel(CommandParameters params, Kernel kernel, FIBITMAP* image,
+        const unsigned char* png, unsigned long pngBytes)
+{
+    uint64_t runNs[MAX_RUNS];
+    Timing timing = {0, 0, 0};
+    uint64_t totalNs = 0;
+    while (timing.runs < MAX_RUNS
+            && (timing.runs < MIN_RUNS || totalNs < params.minTimeNs)) {
+        uint64_t start = now_ns();
+        if (!run_kernel(kernel, image, png, pngBytes)) {
+            timing.runs = 0;
+            return timing;
+        }
+        runNs[timing.runs] = now_ns() - start;
+        totalNs += runNs[timing.runs++];
+    }
+    qsort(runNs, timing.runs, sizeof(uint64_t), compare_ns);
+    timing.minNs = runNs[0];
+    timing.medianNs = runNs[timing.runs / 2];
+    return timing;
+}
+
+/**
+ * run_kernel()
+ * ---------------
+ *  Runs a kernel once, the same way uqimageproc does for a request. Flips are
+ *  done in place on the corpus image, which only rearranges its pixels, so
+ *  the kernels timed after them see the same content.
+ *
+ *  Kernel kernel: the kernel to run
+ *  FIBITMAP* image: the image to run it on
+ *  const unsigned char* png: the image's PNG encoding, for decoding
+ *  unsigned long pngBytes: the number of bytes in png
+ *
+ *  Returns: true if the kernel succeeded
+ */
+bool run_kernel(Kernel kernel, FIBITMAP* image, const unsigned char* png,
+        unsigned long pngBytes)
+{
+    int width = FreeImage_GetWidth(image);
+    int height = FreeImage_GetHeight(image);
+    FIBITMAP* result = NULL;
+    unsigned char* encoded = NULL;
+    unsigned long encodedBytes;
+    switch (kernel) {
+    case KERNEL_DECODE:
+        result = fi_load_image_from_buffer(png, pngBytes);
+        break;
+    case KERNEL_ROTATE_0:
+        result = FreeImage_Rotate(image, 0, NULL);
+        break;
+    case KERNEL_ROTATE_90:
+        result = FreeImage_Rotate(image, 90, NULL);
+        break;
+    case KERNEL_ROTATE_37:
+        result = FreeImage_Rotate(image, 37, NULL);
+        break;
+    case KERNEL_FLIP_H:
+        return FreeImage_FlipHorizontal(image);
+    case KERNEL_FLIP_V:
+        return FreeImage_FlipVertical(image);
+    case KERNEL_SCALE_UP:
+        result = FreeImage_Rescale(
+                image, width * 2, height * 2, FILTER_BILINEAR);
+        break;
+    case KERNEL_SCALE_DOWN:
+        result = FreeImage_Rescale(image, width / 2 > 0 ? width / 2 : 1,
+                height / 2 > 0 ? height / 2 : 1, FILTER_BILINEAR);
+        break;
+    case KERNEL_ENCODE:
+        encoded = fi_save_png_image_to_buffer(image, &encodedBytes);
+        if (encoded == NULL) {
+            return false;
+        }
+        free(encoded);
+        return true;
+    default:
+        return false;
+    }
+    if (result == NULL) {
+        return false;
+    }
+    FreeImage_Unload(result);
+    return true;
+}
+
+/**
+ * report()
+ * -----------
+ *  Prints the timing of a kernel on an image, as a table row or a JSON line.
+ *  Per-pixel figures are relative to the input image's pixels.
+ *
+ *  CommandParameters params: the command line parameters
+ *  ImageKind kind: the kind of image
+ *  FIBITMAP* image: the image
+ *  unsigned long pngBytes: the size of the image's PNG encoding
+ *  Kernel kernel: the kernel that was timed
+ *  Timing timing: its timing
+ */
+void report(CommandParameters params, ImageKind kind, FIBITMAP* image,
+        unsigned long pngBytes, Kernel kernel, Timing timing)
+{
+    unsigned width = FreeImage_GetWidth(image);
+    unsigned height = FreeImage_GetHeight(image);
+    double pixels = (double)width * height;
+    double nsPerPixel = timing.medianNs / pixels;
+    double megapixelsPerSecond
+            = timing.medianNs == 0 ? 0 : pixels * 1000 / timing.medianNs;
+    if (params.json) {
+        printf("{\"image\":\"%s\",\"width\":%u,\"height\":%u,\"bpp\":%u,"
+               "\"png_bytes\":%lu,\"kernel\":\"%s\",\"ok\":%s,\"runs\":%d,"
+               "\"median_ns\":%" PRIu64 ",\"min_ns\":%" PRIu64
+               ",\"ns_per_pixel\":%.4f,\"mpixels_per_s\":%.2f}\n",
+                kindNames[kind], width, height, FreeImage_GetBPP(image),
+                pngBytes, kernelNames[kernel],
+                timing.runs > 0 ? "true" : "false", timing.runs,
+                timing.medianNs, timing.minNs, nsPerPixel,
+                megapixelsPerSecond);
+    } else if (timing.runs == 0) {
+        printf("%-8s %5ux%-5u %3u %-10s failed\n", kindNames[kind], width,
+                height, FreeImage_GetBPP(image), kernelNames[kernel]);
+    } else {
+        printf("%-8s %5ux%-5u %3u %-10s %5d %12" PRIu64 " %12" PRIu64
+               " %9.3f %9.1f\n",
+                kindNames[kind], width, height, FreeImage_GetBPP(image),
+                kernelNames[kernel], timing.runs, timing.medianNs,
+                timing.minNs, nsPerPixel, megapixelsPerSecond);
+    }
+    fflush(stdout);
+}
+
+/**
+ * now_ns()
+ * -----------
+ *  Reads the monotonic clock
+ *
+ *  Returns: the current time in nanoseconds
+ */
+uint64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NANOSECONDS_PER_SECOND + now.tv_nsec;
+}
+
+/**
+ * compare_ns()
+ * ---------------
+ *  Compares two durations for qsort()
+ *
+ *  const void* a, const void* b: pointers to the uint64_t durations
+ *
+ *  Returns: negative, zero or positive as a is less than, equal to or greater
+ *  than b
+ */
+int compare_ns(const void* a, const void* b)
+{
+    uint64_t first = *(const uint64_t*)a;
+    uint64_t second = *(const uint64_t*)b;
+    return (first > second) - (first < second);
+}
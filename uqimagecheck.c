@@ -0,0 +1,153 @@
+// uqimagecheck runs requests through uqimageproc's own request handling and
+// checks the responses
+#define UQIMAGEPROC_NO_MAIN
+#include "uqimageproc.c"
+
+#define CHECK_IMAGE_SIZE 64
+#define CHECK_JPEG_QUALITY 90
+#define CHECK_FAILED 1
+
+/**
+ * A struct describing one request to check
+ */
+typedef struct {
+    const char* path; // The operation path of the request
+    const char* contentType; // The Content-Type the response must have
+} ResponseCheck;
+
+/**
+ * The requests made of the JPEG. Chains that leave the image as it is must
+ * still be decoded and sent as a PNG; ones that change it are done
+ * losslessly.
+ */
+static const ResponseCheck jpegChecks[] = {
+        {"/rotate,0", "image/png"},
+        {"/flip,h/flip,h", "image/png"},
+        {"/rotate,90/rotate,-90", "image/png"},
+        {"/rotate,90", "image/jpeg"}};
+
+/*******************************DECLARATIONS***********************************/
+unsigned char* check_jpeg(unsigned long* numBytes);
+bool check_response(ServerState* server, const unsigned char* image,
+        unsigned long numBytes, ResponseCheck check);
+
+/******************************************************************************/
+
+/**
+ * main()
+ * ------------
+ *  Runs every check against a server state with the default options
+ *
+ *  Returns: 0 if every check passed, CHECK_FAILED otherwise
+ */
+int main()
+{
+    char* argv[] = {"uqimageproc", NULL};
+    CommandParameters params = command_line_arguments(1, argv);
+    ServerState server = init_server_state(params);
+    Statistics stats = {0, 0, 0, 0, 0};
+    pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+    server.stats = &stats;
+    server.statsMutex = &statsMutex;
+    unsigned long numBytes;
+    unsigned char* jpeg = check_jpeg(&numBytes);
+    int failed = 0;
+    int numChecks = sizeof(jpegChecks) / sizeof(jpegChecks[0]);
+    for (int i = 0; i < numChecks; i++) {
+        failed += !check_response(&server, jpeg, numBytes, jpegChecks[i]);
+    }
+    free(jpeg);
+    printf("%d of %d checks passed\n", numChecks - failed, numChecks);
+    return failed > 0 ? CHECK_FAILED : 0;
+}
+
+/**
+ * check_jpeg()
+ * ---------------
+ *  Encodes a colour JPEG whose size is a whole number of MCUs, so that every
+ *  right angle rotation of it can be done losslessly
+ *
+ *  unsigned long* numBytes: set to the number of bytes in the JPEG
+ *
+ *  Returns: the malloc'd JPEG
+ */
+unsigned char* check_jpeg(unsigned long* numBytes)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr errors;
+    cinfo.err = jpeg_std_error(&errors);
+    jpeg_create_compress(&cinfo);
+    unsigned char* jpeg = NULL;
+    *numBytes = 0;
+    jpeg_mem_dest(&cinfo, &jpeg, numBytes);
+    cinfo.image_width = CHECK_IMAGE_SIZE;
+    cinfo.image_height = CHECK_IMAGE_SIZE;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, CHECK_JPEG_QUALITY, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    unsigned char row[CHECK_IMAGE_SIZE * 3];
+    while (cinfo.next_scanline < cinfo.image_height) {
+        for (int x = 0; x < CHECK_IMAGE_SIZE; x++) {
+            row[x * 3] = x * 4;
+            row[x * 3 + 1] = cinfo.next_scanline * 4;
+            row[x * 3 + 2] = (x + cinfo.next_scanline) * 2;
+        }
+        JSAMPROW rows[1] = {row};
+        jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return jpeg;
+}
+
+/**
+ * check_response()
+ * -------------------
+ *  Handles a POST of the image to a path and checks that the response is a
+ *  200 with the expected Content-Type, printing the result
+ *
+ *  ServerState* server: the server state to handle the request with
+ *  const unsigned char* image: the image to send
+ *  unsigned long numBytes: the number of bytes in the image
+ *  ResponseCheck check: the request and the expected response
+ *
+ *  Returns: true if the check passed, false otherwise
+ */
+bool check_response(ServerState* server, const unsigned char* image,
+        unsigned long numBytes, ResponseCheck check)
+{
+    ThreadArgs args;
+    memset(&args, 0, sizeof(args));
+    args.stats = server->stats;
+    args.statsMutex = server->statsMutex;
+    args.server = server;
+    HttpRequest request;
+    memset(&request, 0, sizeof(request));
+    request.method = strdup(POST);
+    request.address = strdup(check.path);
+    request.headers = calloc(1, sizeof(HttpHeader*));
+    request.body = malloc(numBytes);
+    memcpy(request.body, image, numBytes);
+    request.len = numBytes;
+    char* response;
+    size_t length;
+    FILE* to = open_memstream(&response, &length);
+    handle_request(&args, &request, to);
+    fclose(to);
+    int expectedSize = 1
+            + snprintf(NULL, 0, "\r\nContent-Type: %s\r\n", check.contentType);
+    char expected[expectedSize];
+    snprintf(expected, expectedSize, "\r\nContent-Type: %s\r\n",
+            check.contentType);
+    const char* status = HTTP_VERSION " 200 ";
+    char* headersEnd = strstr(response, "\r\n\r\n");
+    char* type = strstr(response, expected);
+    bool passed = strncmp(response, status, strlen(status)) == 0
+            && headersEnd != NULL && type != NULL && type < headersEnd;
+    printf("%-4s POST %s is %s\n", passed ? "ok" : "FAIL", check.path,
+            check.contentType);
+    free(response);
+    return passed;
+}
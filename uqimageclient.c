@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <csse2310a4.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -12,6 +14,10 @@
 #define BUFFER_SIZE 1024
 #define INPUT "--input"
 #define OUTPUT "--output"
+#define ETAG "--etag"
+#define SAVE_ETAG "--save-etag"
+#define RENDITION "--rendition"
+#define MAX_RENDITIONS 16
 #define ROTATE "--rotate"
 #define MIN_ROTATE (-359)
 #define MAX_ROTATE (359)
@@ -19,11 +25,17 @@
 #define SCALE "--scale"
 #define MIN_SCALE 1
 #define MAX_SCALE 10000
+#define CROP "--crop"
+#define MIN_CROP_OFFSET 0
+#define MIN_CROP_SIZE 1
+#define MAX_CROP 16777216
 #define HORIZONTAL_FLIP "h"
 #define VERTICAL_FLIP "v"
 #define COMMAND_LINE_ERROR 7
 #define BASE10 10
+#define HEX_BASE 16
 #define HTTP_OK 200
+#define HTTP_NOT_MODIFIED 304
 #define NO_REDIRECTION (-5)
 #define INPUT_FAIL 8
 #define OUTPUT_FAIL 2
@@ -47,8 +59,21 @@ typedef struct {
     int heightScale; // Image height scaling
     bool flip; // Bool to represent if user specified flip
     char direction; // Horizontal or Vertical
+    bool crop; // Bool to represent if user specified crop
+    int cropX; // Left edge of the region to crop to
+    int cropY; // Top edge of the region to crop to
+    int cropWidth; // Width of the region to crop to
+    int cropHeight; // Height of the region to crop to
     bool outputFile; // Bool to represent if user specified output file
     char* outputName; // Name of output file
+    bool etag; // Bool to represent if user specified an ETag to revalidate
+    char* etagValue; // The ETag sent in If-None-Match
+    bool saveEtag; // Bool to represent if user specified a file for the ETag
+    char* saveEtagName; // Name of the file to save the received ETag to
+    int numRenditions; // The number of renditions requested, 0 if none
+    char** renditionChains; // The operation chain of each rendition
+    char** renditionNames; // The name of each rendition's output file
+    int* renditionFds; // The opened output file of each rendition
 
 } CommandParameters;
 
@@ -69,6 +94,9 @@ void flip_check(CommandParameters* params, int argc, char** argv, int i,
         bool operationGiven);
 void scale_check(CommandParameters* params, int argc, char** argv, int i,
         bool operationGiven);
+void crop_check(CommandParameters* params, int argc, char** argv, int i,
+        bool operationGiven);
+void rendition_check(CommandParameters* params, int argc, char** argv, int i);
 void check_empty_string(char* arg);
 void cmd_line_check_port(char** argv);
 void check_out_of_bounds(int num, int bound);
@@ -82,6 +110,8 @@ FILE* connect_to_server(CommandParameters params);
 void redirection(CommandParameters params);
 int redirect_input(CommandParameters params);
 int redirect_output(CommandParameters params);
+char* open_partial_output(const char* outputName);
+void open_rendition_outputs(CommandParameters params);
 void failed_connection(CommandParameters params);
 void no_data_error();
 ImageData construct_image_data();
@@ -89,17 +119,30 @@ unsigned char* construct_http_request(
         CommandParameters params, ImageData body, int* size);
 void construct_http_request_type(
         CommandParameters params, unsigned char** httpRequest, int* textSize);
-void construct_http_headers(
-        ImageData body, unsigned char** httpRequest, int* textSize);
+void construct_http_headers(CommandParameters params, ImageData body,
+        unsigned char** httpRequest, int* textSize);
 void construct_http_body(
         ImageData body, unsigned char** httpRequest, int* textSize);
 
-void process_http_response(FILE* from);
+void process_http_response(FILE* from, CommandParameters params);
+void save_etag(HttpHeader** headers, CommandParameters params);
+void process_renditions(
+        FILE* from, HttpHeader** headers, CommandParameters params);
+bool read_http_head(FILE* from, int* status, HttpHeader*** headers);
+bool read_http_headers(FILE* from, HttpHeader*** headers);
+bool read_http_body(
+        FILE* from, HttpHeader** headers, int to, unsigned long* len);
+bool copy_http_body(
+        FILE* from, unsigned long count, int to, unsigned long* len);
+const char* find_header(HttpHeader** headers, const char* name);
 
 void free_command_parameters(CommandParameters* params);
 
 /******************************************************************************/
 
+// uqimageload includes this file for its request construction, with its own
+// main()
+#ifndef UQIMAGECLIENT_NO_MAIN
 /**
  * main()
  * ------------
@@ -114,10 +157,11 @@ int main(int argc, char** argv)
 {
     CommandParameters params = command_line_arguments(argc, argv);
     FILE* from = connect_to_server(params);
-    process_http_response(from);
+    process_http_response(from, params);
     free_command_parameters(&params);
     return 0;
 }
+#endif
 
 /**
  * command_line_arguments()
@@ -136,7 +180,8 @@ CommandParameters command_line_arguments(int argc, char** argv)
 {
     bool operationGiven = false;
     CommandParameters params = {argv[1], false, NULL, false, 0, false, 0, 0,
-            false, ' ', false, NULL};
+            false, ' ', false, 0, 0, 0, 0, false, NULL, false, NULL, false,
+            NULL, 0, NULL, NULL, NULL};
     if (argc == 1) {
         command_line_error();
     }
@@ -158,6 +203,16 @@ CommandParameters command_line_arguments(int argc, char** argv)
             check_out_of_bounds(i + 1, argc);
             set_string(argv[i + 1], &params.outputName, &params.outputFile);
             i++;
+        } else if (strcmp(ETAG, argv[i]) == 0) {
+            check_boolean(params.etag);
+            check_out_of_bounds(i + 1, argc);
+            set_string(argv[i + 1], &params.etagValue, &params.etag);
+            i++;
+        } else if (strcmp(SAVE_ETAG, argv[i]) == 0) {
+            check_boolean(params.saveEtag);
+            check_out_of_bounds(i + 1, argc);
+            set_string(argv[i + 1], &params.saveEtagName, &params.saveEtag);
+            i++;
         } else if (strcmp(ROTATE, argv[i]) == 0) {
             rotate_check(&params, argc, argv, i, operationGiven);
             operationGiven = true;
@@ -170,10 +225,24 @@ CommandParameters command_line_arguments(int argc, char** argv)
             scale_check(&params, argc, argv, i, operationGiven);
             operationGiven = true;
             i += 2;
+        } else if (strcmp(CROP, argv[i]) == 0) {
+            crop_check(&params, argc, argv, i, operationGiven);
+            operationGiven = true;
+            i += 4;
+        } else if (strcmp(RENDITION, argv[i]) == 0) {
+            rendition_check(&params, argc, argv, i);
+            i += 2;
         } else {
             command_line_error();
         }
     }
+    // Renditions each name their own chain and output, and are not
+    // revalidated
+    if (params.numRenditions > 0
+            && (operationGiven || params.outputFile || params.etag
+                    || params.saveEtag)) {
+        command_line_error();
+    }
     return params;
 }
 
@@ -245,6 +314,67 @@ void scale_check(CommandParameters* params, int argc, char** argv, int i,
     params->scale = true;
 }
 
+/**
+ * crop_check()
+ * ----------------------
+ *  Checks the specified crop arguments (left, top, width and height) in the
+ *  command line and check if they are valid, throwing an error if not
+ *
+ *  CommandParameters* params: a pointer to the parameters structure
+ *  int argc: the number of command line arguments
+ *  char** argv: the array of command line arguments
+ *  int i: the command line argument number being checked
+ *  bool operationGiven: true if an operation has already been specified
+ */
+void crop_check(CommandParameters* params, int argc, char** argv, int i,
+        bool operationGiven)
+{
+    check_boolean(operationGiven);
+    check_out_of_bounds(i + 4, argc);
+    for (int j = 1; j <= 4; j++) {
+        check_empty_string(argv[i + j]);
+    }
+    params->cropX = convert_to_int(argv[i + 1], MIN_CROP_OFFSET, MAX_CROP);
+    params->cropY = convert_to_int(argv[i + 2], MIN_CROP_OFFSET, MAX_CROP);
+    params->cropWidth = convert_to_int(argv[i + 3], MIN_CROP_SIZE, MAX_CROP);
+    params->cropHeight = convert_to_int(argv[i + 4], MIN_CROP_SIZE, MAX_CROP);
+    params->crop = true;
+}
+
+/**
+ * rendition_check()
+ * ----------------------
+ *  Checks the specified rendition arguments (an operation chain written as
+ *  the server's address, e.g. /scale,200,200/flip,h, and the file to save
+ *  the result to) in the command line and adds them if they are valid,
+ *  throwing an error if not
+ *
+ *  CommandParameters* params: a pointer to the parameters structure
+ *  int argc: the number of command line arguments
+ *  char** argv: the array of command line arguments
+ *  int i: the command line argument number being checked
+ */
+void rendition_check(CommandParameters* params, int argc, char** argv, int i)
+{
+    check_out_of_bounds(i + 2, argc);
+    check_empty_string(argv[i + 2]);
+    // The chains are joined into the request's query
+    const char* chain = argv[i + 1];
+    if (params->numRenditions == MAX_RENDITIONS || chain[0] != '/'
+            || strcspn(chain, "&? \t\r\n") != strlen(chain)) {
+        command_line_error();
+    }
+    int count = params->numRenditions + 1;
+    params->renditionChains
+            = realloc(params->renditionChains, count * sizeof(char*));
+    params->renditionNames
+            = realloc(params->renditionNames, count * sizeof(char*));
+    params->renditionFds = realloc(params->renditionFds, count * sizeof(int));
+    params->renditionChains[params->numRenditions] = strdup(chain);
+    params->renditionNames[params->numRenditions] = strdup(argv[i + 2]);
+    params->numRenditions = count;
+}
+
 /**
  * check_empty_string()
  * ------------------------
@@ -274,7 +404,10 @@ void cmd_line_check_port(char** argv)
     // Ensure it is not an optional parameter
     if (!strcmp(argv[i], INPUT) || !strcmp(argv[i], OUTPUT)
             || !strcmp(argv[i], ROTATE) || !strcmp(argv[i], FLIP)
-            || !strcmp(argv[i], SCALE) || strcmp(argv[i], "") == 0) {
+            || !strcmp(argv[i], SCALE) || !strcmp(argv[i], CROP)
+            || !strcmp(argv[i], ETAG) || !strcmp(argv[i], SAVE_ETAG)
+            || !strcmp(argv[i], RENDITION)
+            || strcmp(argv[i], "") == 0) {
         command_line_error();
     }
 }
@@ -385,8 +518,9 @@ void command_line_error()
 {
     fprintf(stderr,
             "Usage: uqimageclient portno [--input infile] [--rotate angle | "
-            "--scale width height | --flip direction] [--output "
-            "outputfilename]\n");
+            "--scale width height | --flip direction | --crop x y width "
+            "height] [--output outputfilename] [--etag etag] [--save-etag "
+            "etagfilename] [--rendition chain outputfilename ...]\n");
     exit(COMMAND_LINE_ERROR);
 }
 
@@ -450,6 +584,7 @@ void redirection(CommandParameters params)
         dup2(outputfd, STDOUT_FILENO);
         close(outputfd);
     }
+    open_rendition_outputs(params);
 }
 
 /**
@@ -480,7 +615,10 @@ int redirect_input(CommandParameters params)
  * redirect_output()
  * --------------------
  *  If the user specified an output redirection, open the file and return the
- *  fd, if an error, exit appropriately
+ *  fd, if an error, exit appropriately. When revalidating with an ETag, the
+ *  file is only checked to be writable: a new image is written beside it by
+ *  open_partial_output() and only replaces it once complete, so that a 304
+ *  response or a dropped connection leaves the previously saved image intact.
  *
  *  CommandParameters params: the struct storing information regarding the
  *  command line parameters
@@ -488,19 +626,78 @@ int redirect_input(CommandParameters params)
 int redirect_output(CommandParameters params)
 {
     if (params.outputFile) {
-        int output = open(
-                params.outputName, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+        int flags = O_WRONLY | O_CREAT | (params.etag ? 0 : O_TRUNC);
+        int output = open(params.outputName, flags, S_IRWXU);
         if (output < 0) {
             fprintf(stderr,
                     "uqimageclient: unable to open file \"%s\" for writing\n",
                     params.outputName);
             exit(OUTPUT_FAIL);
         }
+        if (params.etag) {
+            close(output);
+            return NO_REDIRECTION;
+        }
         return output;
     }
     return NO_REDIRECTION;
 }
 
+/**
+ * open_partial_output()
+ * ------------------------
+ *  Creates a temporary file beside the output file, with the same
+ *  permissions, and redirects stdout to it, if an error, exit appropriately
+ *
+ *  const char* outputName: the name of the output file
+ *
+ *  Returns: the malloc'd name of the temporary file, to be renamed over the
+ *  output file once it is complete
+ */
+char* open_partial_output(const char* outputName)
+{
+    int length = snprintf(NULL, 0, "%s.XXXXXX", outputName);
+    char* partialName = malloc(sizeof(char) * (length + 1));
+    snprintf(partialName, length + 1, "%s.XXXXXX", outputName);
+    int output = mkstemp(partialName);
+    if (output < 0) {
+        fprintf(stderr,
+                "uqimageclient: unable to open file \"%s\" for writing\n",
+                outputName);
+        exit(OUTPUT_FAIL);
+    }
+    struct stat existing;
+    if (stat(outputName, &existing) == 0) {
+        fchmod(output, existing.st_mode & ~S_IFMT);
+    }
+    dup2(output, STDOUT_FILENO);
+    close(output);
+    return partialName;
+}
+
+/**
+ * open_rendition_outputs()
+ * ---------------------------
+ *  Opens the output file of every rendition the user requested, if an
+ *  error, exit appropriately
+ *
+ *  CommandParameters params: the struct storing information regarding the
+ *  command line parameters
+ */
+void open_rendition_outputs(CommandParameters params)
+{
+    for (int i = 0; i < params.numRenditions; i++) {
+        params.renditionFds[i] = open(params.renditionNames[i],
+                O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+        if (params.renditionFds[i] < 0) {
+            fprintf(stderr,
+                    "uqimageclient: unable to open file \"%s\" for writing\n",
+                    params.renditionNames[i]);
+            exit(OUTPUT_FAIL);
+        }
+    }
+}
+
 /**
  * construct_image_data()
  * ---------------------------
@@ -551,7 +748,7 @@ unsigned char* construct_http_request(
     unsigned char* httpRequest = malloc(sizeof(unsigned char));
     memset(httpRequest, 0, sizeof(unsigned char));
     construct_http_request_type(params, &httpRequest, size);
-    construct_http_headers(body, &httpRequest, size);
+    construct_http_headers(params, body, &httpRequest, size);
     construct_http_body(body, &httpRequest, size);
     return httpRequest;
 }
@@ -573,7 +770,22 @@ void construct_http_request_type(
 {
     int size;
     char* requestType;
-    if (params.rotate) {
+    if (params.numRenditions > 0) {
+        // The chains are joined with '&' after the fan-out path
+        size = strlen("POST /renditions? HTTP/1.1\r\n") + params.numRenditions;
+        for (int i = 0; i < params.numRenditions; i++) {
+            size += strlen(params.renditionChains[i]);
+        }
+        requestType = malloc(sizeof(char) * size);
+        strcpy(requestType, "POST /renditions?");
+        for (int i = 0; i < params.numRenditions; i++) {
+            if (i > 0) {
+                strcat(requestType, "&");
+            }
+            strcat(requestType, params.renditionChains[i]);
+        }
+        strcat(requestType, " HTTP/1.1\r\n");
+    } else if (params.rotate) {
         size = snprintf(NULL, 0, "POST /rotate,%d HTTP/1.1\r\n", params.angle)
                 + 1;
         requestType = malloc(sizeof(char) * size);
@@ -590,6 +802,15 @@ void construct_http_request_type(
                 + 1;
         requestType = malloc(sizeof(char) * size);
         sprintf(requestType, "POST /flip,%c HTTP/1.1\r\n", params.direction);
+    } else if (params.crop) {
+        size = snprintf(NULL, 0, "POST /crop,%d,%d,%d,%d HTTP/1.1\r\n",
+                       params.cropX, params.cropY, params.cropWidth,
+                       params.cropHeight)
+                + 1;
+        requestType = malloc(sizeof(char) * size);
+        sprintf(requestType, "POST /crop,%d,%d,%d,%d HTTP/1.1\r\n",
+                params.cropX, params.cropY, params.cropWidth,
+                params.cropHeight);
     } else {
         // Default case, rotate by 0
         size = snprintf(NULL, 0, "POST /rotate,%d HTTP/1.1\r\n", 0) + 1;
@@ -608,17 +829,33 @@ void construct_http_request_type(
  * construct_http_headers()
  * -----------------------------
  *  Constructs the header part of the HTTP request with the Content-Length
- *  size of the image to be sent over
+ *  size of the image to be sent over, and the If-None-Match ETag if the user
+ *  specified one
  *
+ *  CommandParameters params: the struct storing command line parameters
+ *  information
  *  ImageData body: a struct containing information about the image to be sent,
  *  including the size
  *  unsigned char** httpRequest: a pointer to the string detailing the HTTP
  * request being constructed int* textSize: pointer to integer representing the
  * request size
  */
-void construct_http_headers(
-        ImageData body, unsigned char** httpRequest, int* textSize)
+void construct_http_headers(CommandParameters params, ImageData body,
+        unsigned char** httpRequest, int* textSize)
 {
+    if (params.etag) {
+        int length = snprintf(
+                NULL, 0, "If-None-Match: %s\r\n", params.etagValue);
+        char* ifNoneMatch = malloc(sizeof(char) * (length + 1));
+        sprintf(ifNoneMatch, "If-None-Match: %s\r\n", params.etagValue);
+        *httpRequest = realloc(*httpRequest,
+                sizeof(unsigned char)
+                        * (strlen((char*)*httpRequest) + length + 1));
+        strcat((char*)*httpRequest, ifNoneMatch);
+        free(ifNoneMatch);
+        // Unlike the other parts, no terminator byte is counted here
+        *textSize += length;
+    }
     int size = snprintf(NULL, 0, "Content-Length: %lu\r\n", body.size) + 1;
     char* requestLength = malloc(sizeof(char) * size);
     sprintf(requestLength, "Content-Length: %lu\r\n", body.size);
@@ -686,39 +923,321 @@ void no_data_error()
 /**
  * process_http_response()
  * ---------------------------
- *  Processes the received HTTP response appropriately
+ *  Processes the received HTTP response appropriately, writing the body out
+ *  as it arrives. A 304 response to an ETag revalidation leaves the output
+ *  untouched, as does a new image that does not arrive in full, and the
+ *  parts of a successful response to a request for renditions each go to
+ *  their own output. The ETag of a new image is saved once it is complete.
  *
  *  FILE* from: the fd for reading the HTTP response from
+ *  CommandParameters params: the struct storing command line parameters
+ *  information
  */
-void process_http_response(FILE* from)
+void process_http_response(FILE* from, CommandParameters params)
 {
     int status;
-    char* statusExplanation;
-    unsigned char* bodyText;
-    unsigned long len;
     HttpHeader** headers;
-    if (!get_HTTP_response(
-                from, &status, &statusExplanation, &headers, &bodyText, &len)) {
+    if (!read_http_head(from, &status, &headers)) {
         fprintf(stderr, "uqimageclient: server connection terminated\n");
         exit(CONNECTION_CLOSED);
     }
+    if (status == HTTP_OK && params.numRenditions > 0) {
+        process_renditions(from, headers, params);
+        free_array_of_headers(headers);
+        fclose(from);
+        return;
+    }
+    int to = STDERR_FILENO;
+    char* partialName = NULL;
     if (status == HTTP_OK) {
-        if (write(STDOUT_FILENO, bodyText, len) < 0) {
-            fprintf(stderr, "uqimageclient: unable to write output\n");
-            exit(WRITE_FAIL);
+        if (params.etag && params.outputFile) {
+            partialName = open_partial_output(params.outputName);
         }
-    } else {
-        if (len) {
-            fprintf(stderr, "%.*s", (int)len, bodyText);
-            exit(BAD_HTTP_RESPONSE);
+        to = STDOUT_FILENO;
+    }
+    unsigned long len = 0;
+    if (status != HTTP_NOT_MODIFIED
+            && !read_http_body(from, headers, to, &len)) {
+        if (partialName != NULL) {
+            unlink(partialName);
+        }
+        fprintf(stderr, "uqimageclient: server connection terminated\n");
+        exit(CONNECTION_CLOSED);
+    }
+    if (partialName != NULL) {
+        if (rename(partialName, params.outputName) < 0) {
+            unlink(partialName);
+            fprintf(stderr,
+                    "uqimageclient: unable to open file \"%s\" for writing\n",
+                    params.outputName);
+            exit(OUTPUT_FAIL);
         }
+        free(partialName);
+    }
+    if (status == HTTP_OK && params.saveEtag) {
+        save_etag(headers, params);
+    }
+    if (status != HTTP_OK && status != HTTP_NOT_MODIFIED && len) {
+        exit(BAD_HTTP_RESPONSE);
     }
-    free(statusExplanation);
-    free(bodyText);
     free_array_of_headers(headers);
     fclose(from);
 }
 
+/**
+ * save_etag()
+ * --------------
+ *  Writes the ETag of a successful response, followed by a newline, to the
+ *  file the user asked for, replacing its contents, if an error, exit
+ *  appropriately. A response without an ETag leaves the file empty, so that
+ *  a tag saved for an earlier image is not revalidated against this one.
+ *
+ *  HttpHeader** headers: the headers of the response
+ *  CommandParameters params: the struct storing command line parameters
+ *  information
+ */
+void save_etag(HttpHeader** headers, CommandParameters params)
+{
+    const char* etag = find_header(headers, "ETag");
+    FILE* file = fopen(params.saveEtagName, "w");
+    if (file == NULL || (etag != NULL && fprintf(file, "%s\n", etag) < 0)
+            || fclose(file) == EOF) {
+        fprintf(stderr,
+                "uqimageclient: unable to open file \"%s\" for writing\n",
+                params.saveEtagName);
+        exit(OUTPUT_FAIL);
+    }
+}
+
+/**
+ * process_renditions()
+ * -----------------------
+ *  Processes the multipart/mixed body of a successful response to a request
+ *  for renditions, writing each part out to the output of the rendition it
+ *  is for as it arrives. The parts come in the order the renditions were
+ *  requested, each with a Content-Length.
+ *
+ *  FILE* from: the fd for reading the HTTP response from
+ *  HttpHeader** headers: the headers of the response
+ *  CommandParameters params: the struct storing command line parameters
+ *  information
+ */
+void process_renditions(
+        FILE* from, HttpHeader** headers, CommandParameters params)
+{
+    const char* type = find_header(headers, "Content-Type");
+    const char* boundary = type == NULL ? NULL : strstr(type, "boundary=");
+    bool read = boundary != NULL;
+    char* line = NULL;
+    size_t size = 0;
+    for (int i = 0; read && i < params.numRenditions; i++) {
+        HttpHeader** partHeaders;
+        read = getline(&line, &size, from) > 0;
+        if (read) {
+            line[strcspn(line, "\r\n")] = '\0';
+        }
+        // Each part starts with a line of "--" and the boundary
+        read = read && strncmp(line, "--", 2) == 0
+                && strcmp(line + 2, boundary + strlen("boundary=")) == 0
+                && read_http_headers(from, &partHeaders);
+        if (!read) {
+            break;
+        }
+        const char* length = find_header(partHeaders, "Content-Length");
+        unsigned long len = 0;
+        read = length != NULL
+                && copy_http_body(from, strtoul(length, NULL, BASE10),
+                        params.renditionFds[i], &len)
+                && getline(&line, &size, from) > 0
+                && strcmp(line, "\r\n") == 0;
+        free_array_of_headers(partHeaders);
+        close(params.renditionFds[i]);
+    }
+    free(line);
+    if (!read) {
+        fprintf(stderr, "uqimageclient: server connection terminated\n");
+        exit(CONNECTION_CLOSED);
+    }
+}
+
+/**
+ * read_http_head()
+ * -------------------
+ *  Reads the status line and headers of an HTTP response
+ *
+ *  FILE* from: the fd for reading the HTTP response from
+ *  int* status: where to store the response status
+ *  HttpHeader*** headers: where to store the NULL terminated headers, freed
+ *  with free_array_of_headers()
+ *
+ *  Returns: true if a well formed head was read, false otherwise
+ */
+bool read_http_head(FILE* from, int* status, HttpHeader*** headers)
+{
+    char* line = NULL;
+    size_t size = 0;
+    int offset = 0;
+    if (getline(&line, &size, from) < 0
+            || sscanf(line, "HTTP/1.1 %3d %n", status, &offset) < 1
+            || offset == 0) {
+        free(line);
+        return false;
+    }
+    free(line);
+    return read_http_headers(from, headers);
+}
+
+/**
+ * read_http_headers()
+ * ----------------------
+ *  Reads header lines up to the empty line ending them, as in the head of
+ *  an HTTP response or a part of a multipart body
+ *
+ *  FILE* from: the fd for reading the headers from
+ *  HttpHeader*** headers: where to store the NULL terminated headers, freed
+ *  with free_array_of_headers()
+ *
+ *  Returns: true if well formed headers were read, false otherwise
+ */
+bool read_http_headers(FILE* from, HttpHeader*** headers)
+{
+    char* line = NULL;
+    size_t size = 0;
+    int numHeaders = 0;
+    *headers = malloc(sizeof(HttpHeader*));
+    (*headers)[0] = NULL;
+    ssize_t length;
+    while ((length = getline(&line, &size, from)) > 0) {
+        // Each line ends "\r\n", and an empty one ends the head
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            free(line);
+            return true;
+        }
+        char* colon = strchr(line, ':');
+        if (colon == NULL) {
+            break;
+        }
+        HttpHeader* header = malloc(sizeof(HttpHeader));
+        header->name = strndup(line, colon - line);
+        header->value = strdup(colon + 1 + strspn(colon + 1, " \t"));
+        *headers = realloc(*headers, (numHeaders + 2) * sizeof(HttpHeader*));
+        (*headers)[numHeaders++] = header;
+        (*headers)[numHeaders] = NULL;
+    }
+    free(line);
+    free_array_of_headers(*headers);
+    return false;
+}
+
+/**
+ * read_http_body()
+ * -------------------
+ *  Reads the body of an HTTP response, passing it on as it arrives. Chunked
+ *  bodies are decoded, and bodies with neither a length nor chunking run to
+ *  the end of the connection.
+ *
+ *  FILE* from: the fd for reading the HTTP response from
+ *  HttpHeader** headers: the headers of the response
+ *  int to: the fd to write the body to, or -1 to discard it
+ *  unsigned long* len: where to store the number of bytes in the body
+ *
+ *  Returns: true if the whole body was read, false if the connection ended
+ *  early or the chunking was malformed
+ */
+bool read_http_body(
+        FILE* from, HttpHeader** headers, int to, unsigned long* len)
+{
+    *len = 0;
+    const char* encoding = find_header(headers, "Transfer-Encoding");
+    if (encoding != NULL && strcasecmp(encoding, "chunked") == 0) {
+        char* line = NULL;
+        size_t size = 0;
+        bool read = false;
+        while (getline(&line, &size, from) > 0) {
+            char* end;
+            unsigned long chunk = strtoul(line, &end, HEX_BASE);
+            if (end == line) {
+                break;
+            }
+            if (chunk == 0) {
+                // Skip any trailers up to the empty line ending the body
+                while (getline(&line, &size, from) > 0
+                        && strcmp(line, "\r\n") != 0) {
+                }
+                read = !ferror(from) && !feof(from);
+                break;
+            }
+            if (!copy_http_body(from, chunk, to, len)
+                    || getline(&line, &size, from) < 0
+                    || strcmp(line, "\r\n") != 0) {
+                break;
+            }
+        }
+        free(line);
+        return read;
+    }
+    const char* length = find_header(headers, "Content-Length");
+    if (length == NULL) {
+        copy_http_body(from, ULONG_MAX, to, len);
+        return !ferror(from);
+    }
+    return copy_http_body(from, strtoul(length, NULL, BASE10), to, len);
+}
+
+/**
+ * copy_http_body()
+ * -------------------
+ *  Copies part of a response body from the connection to an fd
+ *
+ *  FILE* from: the fd for reading the HTTP response from
+ *  unsigned long count: the number of bytes to copy
+ *  int to: the fd to write the bytes to, or -1 to discard them
+ *  unsigned long* len: the count of body bytes, increased by those copied
+ *
+ *  Returns: true if all of the bytes were copied, false if the connection
+ *  ended first
+ */
+bool copy_http_body(
+        FILE* from, unsigned long count, int to, unsigned long* len)
+{
+    char buffer[BUFFER_SIZE];
+    while (count > 0) {
+        size_t numRead = fread(buffer, sizeof(char),
+                count < BUFFER_SIZE ? count : BUFFER_SIZE, from);
+        if (numRead == 0) {
+            return false;
+        }
+        if (to >= 0 && write(to, buffer, numRead) < 0) {
+            fprintf(stderr, "uqimageclient: unable to write output\n");
+            exit(WRITE_FAIL);
+        }
+        count -= numRead;
+        *len += numRead;
+    }
+    return true;
+}
+
+/**
+ * find_header()
+ * ----------------
+ *  Finds the value of a header, ignoring the case of its name
+ *
+ *  HttpHeader** headers: the NULL terminated headers to search
+ *  const char* name: the name of the header
+ *
+ *  Returns: the value of the header, or NULL if it is not present
+ */
+const char* find_header(HttpHeader** headers, const char* name)
+{
+    for (int i = 0; headers[i] != NULL; i++) {
+        if (strcasecmp(headers[i]->name, name) == 0) {
+            return headers[i]->value;
+        }
+    }
+    return NULL;
+}
+
 /**
  * free_command_parameters()
  * -----------------------------
@@ -737,4 +1256,17 @@ void free_command_parameters(CommandParameters* params)
     if (params->outputFile) {
         free(params->outputName);
     }
+    if (params->etag) {
+        free(params->etagValue);
+    }
+    if (params->saveEtag) {
+        free(params->saveEtagName);
+    }
+    for (int i = 0; i < params->numRenditions; i++) {
+        free(params->renditionChains[i]);
+        free(params->renditionNames[i]);
+    }
+    free(params->renditionChains);
+    free(params->renditionNames);
+    free(params->renditionFds);
 }
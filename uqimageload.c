@@ -0,0 +1,904 @@
+// uqimageload builds its requests with uqimageclient's request construction
+#define UQIMAGECLIENT_NO_MAIN
+#include "uqimageclient.c"
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define LOAD_CONNECTIONS "--connections"
+#define LOAD_RATE "--rate"
+#define LOAD_DURATION "--duration"
+#define LOAD_WARMUP "--warmup"
+#define LOAD_JSON "--json"
+#define LOAD_REPLAY "--replay"
+#define LOAD_SPEED "--speed"
+#define LOAD_BODIES "--bodies"
+#define LOAD_USAGE_ERROR 2
+#define LOAD_MIX_ERROR 3
+#define LOAD_CONNECT_ERROR 4
+#define DEFAULT_LOAD_CONNECTIONS 8
+#define MAX_LOAD_CONNECTIONS 10000
+#define DEFAULT_LOAD_SECONDS 10
+#define MAX_LOAD_SECONDS 86400
+#define MAX_MIX_LINE 4096
+#define NS_PER_SECOND 1000000000ULL
+#define NS_PER_MICROSECOND 1000.0
+#define MIX_SEED 0x9E3779B97F4A7C15ULL
+#define INITIAL_SAMPLES 1024
+#define SHA256_BYTES 32
+
+#define CAPTURE_MAGIC 0x55514350 // "UQCP"
+#define CAPTURE_RECORD_MAGIC 0x55514352 // "UQCR"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HAS_BODY 0x1
+#define MAX_CAPTURE_FIELD 65536
+#define MAX_CAPTURE_BODY (1ULL << 30)
+
+/**
+ * A struct storing the header at the start of a capture file written by
+ * uqimageproc --capture
+ */
+typedef struct {
+    uint32_t magic; // CAPTURE_MAGIC
+    uint32_t version; // CAPTURE_VERSION
+} CaptureFileHeader;
+
+/**
+ * A struct storing the header of a captured request, followed by its method,
+ * path, headers and (if flags has CAPTURE_HAS_BODY) body. This must match
+ * the layout in uqimageproc.c for the same CAPTURE_VERSION.
+ */
+typedef struct {
+    uint32_t magic; // CAPTURE_RECORD_MAGIC
+    uint32_t flags; // CAPTURE_HAS_BODY if the body follows
+    uint64_t offsetNs; // When the request arrived, relative to the capture
+    uint64_t bodyLength; // The length of the request body
+    uint32_t methodLength; // The length of the method
+    uint32_t pathLength; // The length of the path
+    uint32_t headersLength; // The length of the headers
+    uint32_t reserved; // Zero
+    unsigned char bodyHash[SHA256_BYTES]; // The SHA-256 of the body
+} CaptureRecordHeader;
+
+/**
+ * A struct storing one entry of the request mix, with its request built
+ * ahead of time so that sending it costs only the write
+ */
+typedef struct {
+    unsigned int weight; // The relative frequency of this entry
+    char* image; // The image file sent as the body
+    char* path; // The operation path, e.g. /rotate,90/flip,h
+    unsigned char* request; // The complete HTTP request
+    int requestSize; // The number of bytes in request
+    uint64_t offsetNs; // When a replayed request is due, from the start
+} MixEntry;
+
+/**
+ * A struct storing the command line parameters and request mix of a run
+ */
+typedef struct {
+    const char* port; // The port of the server
+    int connections; // The number of keep-alive connections
+    double rate; // Requests per second for an open loop, or 0 for a closed one
+    int durationSeconds; // How long to measure for
+    int warmupSeconds; // How long to run before measuring
+    bool json; // Whether to print the results as JSON
+    MixEntry* mix; // The request mix
+    int mixSize; // The number of entries in mix
+    unsigned int totalWeight; // The sum of the entries' weights
+    bool replay; // Whether the mix is a capture, replayed in order
+    double speed; // The replay speed-up, or 0 to replay as fast as possible
+    const char* bodies; // The directory of bodies missing from the capture
+    int skipped; // Captured requests skipped as their body was missing
+} LoadParameters;
+
+/**
+ * A struct storing the state shared by the connection threads
+ */
+typedef struct {
+    LoadParameters* params; // The parameters of the run
+    uint64_t startNs; // When the run began
+    uint64_t measureNs; // When measurement begins, after the warmup
+    uint64_t endNs; // When the run ends
+    uint64_t nextRequest; // The index of the next request to send
+} LoadState;
+
+/**
+ * A struct storing the results of one connection thread
+ */
+typedef struct {
+    LoadState* state; // The shared state
+    uint64_t* latencyNs; // The latency of each measured success
+    size_t numLatencies; // The number of latencies recorded
+    size_t capacity; // The capacity of latencyNs
+    uint64_t failures; // Measured responses that were not 200 OK
+    uint64_t reconnects; // Times the connection had to be re-established
+    uint64_t bytesReceived; // Response body bytes received while measuring
+} ConnectionResults;
+
+/*******************************DECLARATIONS***********************************/
+LoadParameters load_arguments(int argc, char** argv);
+int load_number(char* numberString, int min, int max);
+void load_usage_error();
+void read_mix(LoadParameters* params, const char* mixFile);
+void build_mix_request(MixEntry* entry, const char* mixFile, int lineNumber);
+void mix_error(const char* mixFile, int lineNumber, const char* problem);
+void read_capture(LoadParameters* params, const char* captureFile);
+bool read_captured_request(
+        FILE* file, LoadParameters* params, CaptureRecordHeader* record);
+unsigned char* read_captured_body(
+        LoadParameters* params, CaptureRecordHeader* record);
+void capture_error(const char* captureFile, const char* problem);
+
+FILE* open_connection(const char* port, int* fd);
+void* connection_thread(void* arg);
+MixEntry* choose_entry(LoadParameters* params, uint64_t index);
+bool send_request(int fd, FILE* from, MixEntry* entry, int* status,
+        unsigned long* bodyBytes);
+void record_latency(ConnectionResults* results, uint64_t latencyNs);
+
+void report_results(LoadParameters* params, ConnectionResults* results,
+        uint64_t elapsedNs);
+uint64_t percentile(uint64_t* sorted, size_t count, double fraction);
+int compare_latency(const void* a, const void* b);
+uint64_t clock_ns();
+void sleep_until(uint64_t wakeNs);
+
+/******************************************************************************/
+
+/**
+ * main()
+ * ------------
+ *  Drives the server over keep-alive connections for the warmup and duration,
+ *  then reports the throughput and latency of the measured requests
+ *
+ *  int argc: the number of command line parameters
+ *  char** argv: the command line parameters
+ *
+ *  Returns: 0 on successful exit of program
+ */
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    LoadParameters params = load_arguments(argc, argv);
+    LoadState state;
+    state.params = &params;
+    state.startNs = clock_ns();
+    state.measureNs = state.startNs + params.warmupSeconds * NS_PER_SECOND;
+    state.endNs = params.replay
+            ? UINT64_MAX
+            : state.measureNs + params.durationSeconds * NS_PER_SECOND;
+    state.nextRequest = 0;
+    ConnectionResults* results
+            = calloc(params.connections, sizeof(ConnectionResults));
+    pthread_t* threads = malloc(params.connections * sizeof(pthread_t));
+    for (int i = 0; i < params.connections; i++) {
+        results[i].state = &state;
+        pthread_create(&threads[i], NULL, connection_thread, &results[i]);
+    }
+    for (int i = 0; i < params.connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsedNs = params.replay ? clock_ns() - state.startNs
+                                       : state.endNs - state.measureNs;
+    report_results(&params, results, elapsedNs);
+    return 0;
+}
+
+/**
+ * load_arguments()
+ * -------------------
+ *  Parses the command line: a port and a mix file, then optionally the
+ *  number of connections, an arrival rate (open loop; without one each
+ *  connection sends its next request as soon as the last is answered), the
+ *  measured duration and a warmup, all in seconds. Instead of a mix file,
+ *  --replay gives a capture to send once, in order, at --speed times the
+ *  recorded rate.
+ *
+ *  int argc: the number of command line parameters
+ *  char** argv: the command line parameters
+ *
+ *  Returns: the parameters of the run
+ */
+LoadParameters load_arguments(int argc, char** argv)
+{
+    LoadParameters params = {NULL, DEFAULT_LOAD_CONNECTIONS, 0,
+            DEFAULT_LOAD_SECONDS, 0, false, NULL, 0, 0, false, 1, NULL, 0};
+    if (argc < 3) {
+        load_usage_error();
+    }
+    params.port = argv[1];
+    int first = 3;
+    if (strcmp(argv[2], LOAD_REPLAY) == 0) {
+        if (argc < 4) {
+            load_usage_error();
+        }
+        params.replay = true;
+        first = 4;
+    }
+    bool durationGiven = false;
+    for (int i = first; i < argc; i++) {
+        if (strcmp(argv[i], LOAD_CONNECTIONS) == 0 && i + 1 < argc) {
+            params.connections
+                    = load_number(argv[++i], 1, MAX_LOAD_CONNECTIONS);
+        } else if (strcmp(argv[i], LOAD_RATE) == 0 && i + 1 < argc) {
+            char* endPtr;
+            params.rate = strtod(argv[++i], &endPtr);
+            if (*argv[i] == '\0' || *endPtr != '\0' || !(params.rate > 0)) {
+                load_usage_error();
+            }
+        } else if (strcmp(argv[i], LOAD_DURATION) == 0 && i + 1 < argc) {
+            params.durationSeconds
+                    = load_number(argv[++i], 1, MAX_LOAD_SECONDS);
+            durationGiven = true;
+        } else if (strcmp(argv[i], LOAD_WARMUP) == 0 && i + 1 < argc) {
+            params.warmupSeconds = load_number(argv[++i], 0, MAX_LOAD_SECONDS);
+        } else if (strcmp(argv[i], LOAD_SPEED) == 0 && i + 1 < argc) {
+            char* endPtr;
+            params.speed = strtod(argv[++i], &endPtr);
+            if (*argv[i] == '\0' || *endPtr != '\0' || !(params.speed >= 0)) {
+                load_usage_error();
+            }
+        } else if (strcmp(argv[i], LOAD_BODIES) == 0 && i + 1 < argc) {
+            params.bodies = argv[++i];
+        } else if (strcmp(argv[i], LOAD_JSON) == 0) {
+            params.json = true;
+        } else {
+            load_usage_error();
+        }
+    }
+    if (params.replay) {
+        // A replay's pace and length come from the capture
+        if (params.rate > 0 || durationGiven || params.warmupSeconds > 0) {
+            load_usage_error();
+        }
+        read_capture(&params, argv[3]);
+    } else {
+        if (params.speed != 1 || params.bodies != NULL) {
+            load_usage_error();
+        }
+        read_mix(&params, argv[2]);
+    }
+    return params;
+}
+
+/**
+ * load_number()
+ * ----------------
+ *  Converts a string to an integer, running load_usage_error() if it is not
+ *  a number within the given bounds
+ *
+ *  char* numberString: the string to convert
+ *  int min: the minimum bound
+ *  int max: the maximum bound
+ *
+ *  Returns: the converted integer
+ */
+int load_number(char* numberString, int min, int max)
+{
+    char* endPtr;
+    long int converted = strtol(numberString, &endPtr, BASE10);
+    if (*numberString == '\0' || *endPtr != '\0' || converted < min
+            || converted > max) {
+        load_usage_error();
+    }
+    return (int)converted;
+}
+
+/**
+ * load_usage_error()
+ * ---------------------
+ *  Prints the usage message to stderr and exits
+ */
+void load_usage_error()
+{
+    fprintf(stderr,
+            "Usage: uqimageload port mixfile [--connections n] "
+            "[--rate requests-per-second] [--duration seconds] "
+            "[--warmup seconds] [--json]\n"
+            "       uqimageload port --replay capturefile [--connections n] "
+            "[--speed factor] [--bodies directory] [--json]\n");
+    exit(LOAD_USAGE_ERROR);
+}
+
+/**
+ * read_mix()
+ * -------------
+ *  Reads the request mix. Each line is "weight image path", e.g.
+ *  "3 photo.jpg /scale,640,480/rotate,90"; blank lines and lines starting
+ *  with # are ignored.
+ *
+ *  LoadParameters* params: the parameters to store the mix in
+ *  const char* mixFile: the name of the mix file
+ */
+void read_mix(LoadParameters* params, const char* mixFile)
+{
+    FILE* file = fopen(mixFile, "r");
+    if (file == NULL) {
+        fprintf(stderr, "uqimageload: unable to open mix \"%s\"\n", mixFile);
+        exit(LOAD_MIX_ERROR);
+    }
+    char line[MAX_MIX_LINE];
+    for (int lineNumber = 1; fgets(line, sizeof(line), file) != NULL;
+            lineNumber++) {
+        char image[MAX_MIX_LINE];
+        char path[MAX_MIX_LINE];
+        unsigned int weight;
+        char extra;
+        if (sscanf(line, " %c", &extra) != 1 || extra == '#') {
+            continue;
+        }
+        if (sscanf(line, "%u %s %s %c", &weight, image, path, &extra) != 3
+                || weight == 0 || path[0] != '/') {
+            mix_error(mixFile, lineNumber, "expected \"weight image /path\"");
+        }
+        params->mix = realloc(
+                params->mix, (params->mixSize + 1) * sizeof(MixEntry));
+        MixEntry* entry = &params->mix[params->mixSize++];
+        entry->weight = weight;
+        entry->image = strdup(image);
+        entry->path = strdup(path);
+        build_mix_request(entry, mixFile, lineNumber);
+        params->totalWeight += weight;
+    }
+    fclose(file);
+    if (params->mixSize == 0) {
+        mix_error(mixFile, 0, "no requests");
+    }
+}
+
+/**
+ * build_mix_request()
+ * ----------------------
+ *  Reads a mix entry's image and builds its request the way uqimageclient
+ *  does, with the entry's operation path as the request target
+ *
+ *  MixEntry* entry: the entry
+ *  const char* mixFile: the name of the mix file, for errors
+ *  int lineNumber: the entry's line in the mix file, for errors
+ */
+void build_mix_request(MixEntry* entry, const char* mixFile, int lineNumber)
+{
+    FILE* imageFile = fopen(entry->image, "r");
+    if (imageFile == NULL) {
+        mix_error(mixFile, lineNumber, "unable to open image");
+    }
+    ImageData body = {NULL, 0};
+    unsigned char buffer[BUFFER_SIZE];
+    size_t numRead;
+    while ((numRead = fread(buffer, 1, sizeof(buffer), imageFile)) > 0) {
+        body.imageData = realloc(body.imageData, body.size + numRead);
+        memcpy(body.imageData + body.size, buffer, numRead);
+        body.size += numRead;
+    }
+    fclose(imageFile);
+    if (body.size == 0) {
+        mix_error(mixFile, lineNumber, "empty image");
+    }
+    // The request line, counted as uqimageclient counts it
+    int size = snprintf(NULL, 0, "POST %s HTTP/1.1\r\n", entry->path) + 1;
+    entry->request = malloc(size);
+    sprintf((char*)entry->request, "POST %s HTTP/1.1\r\n", entry->path);
+    entry->requestSize = size;
+    CommandParameters clientParams;
+    memset(&clientParams, 0, sizeof(clientParams));
+    construct_http_headers(
+            clientParams, body, &entry->request, &entry->requestSize);
+    construct_http_body(body, &entry->request, &entry->requestSize);
+    free(body.imageData);
+}
+
+/**
+ * mix_error()
+ * --------------
+ *  Reports a problem with the mix file and exits
+ *
+ *  const char* mixFile: the name of the mix file
+ *  int lineNumber: the line with the problem, or 0 for the whole file
+ *  const char* problem: a description of the problem
+ */
+void mix_error(const char* mixFile, int lineNumber, const char* problem)
+{
+    fprintf(stderr, "uqimageload: %s:%d: %s\n", mixFile, lineNumber, problem);
+    exit(LOAD_MIX_ERROR);
+}
+
+/**
+ * read_capture()
+ * -----------------
+ *  Reads a capture written by uqimageproc --capture into the mix, one entry
+ *  per captured request in arrival order. Captured requests without their
+ *  body are skipped unless --bodies names a directory holding it in a file
+ *  named by its SHA-256 in hex.
+ *
+ *  LoadParameters* params: the parameters to store the requests in
+ *  const char* captureFile: the name of the capture file
+ */
+void read_capture(LoadParameters* params, const char* captureFile)
+{
+    FILE* file = fopen(captureFile, "r");
+    if (file == NULL) {
+        capture_error(captureFile, "unable to open");
+    }
+    CaptureFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+            || header.magic != CAPTURE_MAGIC) {
+        capture_error(captureFile, "not a capture file");
+    }
+    if (header.version != CAPTURE_VERSION) {
+        capture_error(captureFile, "unsupported capture version");
+    }
+    CaptureRecordHeader record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.magic != CAPTURE_RECORD_MAGIC
+                || record.methodLength > MAX_CAPTURE_FIELD
+                || record.pathLength > MAX_CAPTURE_FIELD
+                || record.headersLength > MAX_CAPTURE_FIELD
+                || ((record.flags & CAPTURE_HAS_BODY)
+                        && record.bodyLength > MAX_CAPTURE_BODY)
+                || !read_captured_request(file, params, &record)) {
+            capture_error(captureFile, "truncated or corrupt record");
+        }
+    }
+    fclose(file);
+    if (params->mixSize == 0) {
+        capture_error(captureFile, "no requests to replay");
+    }
+}
+
+/**
+ * read_captured_request()
+ * --------------------------
+ *  Reads the rest of a captured request and, if its body is available, adds
+ *  the request to the mix as it was received. A body too large to replay
+ *  (over MAX_CAPTURE_BODY, only possible for one the server dropped) is
+ *  treated as unavailable.
+ *
+ *  FILE* file: the capture file, positioned after the record header
+ *  LoadParameters* params: the parameters to store the request in
+ *  CaptureRecordHeader* record: the record header
+ *
+ *  Returns: false if the capture file ended part way through the record
+ */
+bool read_captured_request(
+        FILE* file, LoadParameters* params, CaptureRecordHeader* record)
+{
+    size_t textLength = record->methodLength + 1 + record->pathLength
+            + sizeof(" HTTP/1.1\r\n") - 1 + record->headersLength + 2;
+    // Room for the body is only made once it is known to be available
+    unsigned char* request = malloc(textLength);
+    unsigned char* next = request;
+    if (fread(next, 1, record->methodLength, file) != record->methodLength) {
+        free(request);
+        return false;
+    }
+    next += record->methodLength;
+    *next++ = ' ';
+    if (fread(next, 1, record->pathLength, file) != record->pathLength) {
+        free(request);
+        return false;
+    }
+    next += record->pathLength;
+    memcpy(next, " HTTP/1.1\r\n", sizeof(" HTTP/1.1\r\n") - 1);
+    next += sizeof(" HTTP/1.1\r\n") - 1;
+    if (fread(next, 1, record->headersLength, file) != record->headersLength) {
+        free(request);
+        return false;
+    }
+    next += record->headersLength;
+    memcpy(next, "\r\n", 2);
+    unsigned char* body = NULL;
+    if (record->flags & CAPTURE_HAS_BODY) {
+        request = realloc(request, textLength + record->bodyLength);
+        if (fread(request + textLength, 1, record->bodyLength, file)
+                != record->bodyLength) {
+            free(request);
+            return false;
+        }
+    } else if (record->bodyLength > 0) {
+        body = record->bodyLength > MAX_CAPTURE_BODY
+                ? NULL
+                : read_captured_body(params, record);
+        if (body == NULL) {
+            params->skipped++;
+            free(request);
+            return true;
+        }
+        request = realloc(request, textLength + record->bodyLength);
+        memcpy(request + textLength, body, record->bodyLength);
+        free(body);
+    }
+    params->mix = realloc(
+            params->mix, (params->mixSize + 1) * sizeof(MixEntry));
+    MixEntry* entry = &params->mix[params->mixSize++];
+    memset(entry, 0, sizeof(MixEntry));
+    entry->weight = 1;
+    entry->request = request;
+    entry->requestSize = textLength + record->bodyLength;
+    entry->offsetNs = record->offsetNs;
+    return true;
+}
+
+/**
+ * read_captured_body()
+ * -----------------------
+ *  Reads the body of a request captured without it from the --bodies
+ *  directory
+ *
+ *  LoadParameters* params: the parameters naming the directory
+ *  CaptureRecordHeader* record: the record of the request
+ *
+ *  Returns: the body, or NULL if it is not available
+ */
+unsigned char* read_captured_body(
+        LoadParameters* params, CaptureRecordHeader* record)
+{
+    if (params->bodies == NULL) {
+        return NULL;
+    }
+    char name[strlen(params->bodies) + 1 + SHA256_BYTES * 2 + 1];
+    int length = sprintf(name, "%s/", params->bodies);
+    for (int i = 0; i < SHA256_BYTES; i++) {
+        length += sprintf(name + length, "%02x", record->bodyHash[i]);
+    }
+    FILE* file = fopen(name, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    unsigned char* body = malloc(record->bodyLength);
+    bool complete = fread(body, 1, record->bodyLength, file)
+                    == record->bodyLength
+            && fgetc(file) == EOF;
+    fclose(file);
+    if (!complete) {
+        free(body);
+        return NULL;
+    }
+    return body;
+}
+
+/**
+ * capture_error()
+ * ------------------
+ *  Reports a problem with the capture file and exits
+ *
+ *  const char* captureFile: the name of the capture file
+ *  const char* problem: a description of the problem
+ */
+void capture_error(const char* captureFile, const char* problem)
+{
+    fprintf(stderr, "uqimageload: %s: %s\n", captureFile, problem);
+    exit(LOAD_MIX_ERROR);
+}
+
+/**
+ * open_connection()
+ * --------------------
+ *  Connects to the server on localhost, exiting if it cannot
+ *
+ *  const char* port: the port of the server
+ *  int* fd: where to store the connected socket
+ *
+ *  Returns: a FILE* for reading responses from the socket
+ */
+FILE* open_connection(const char* port, int* fd)
+{
+    struct addrinfo* ai = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("localhost", port, &hints, &ai)) {
+        fprintf(stderr, "uqimageload: unable to connect to port \"%s\"\n",
+                port);
+        exit(LOAD_CONNECT_ERROR);
+    }
+    *fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (*fd < 0 || connect(*fd, ai->ai_addr, sizeof(struct sockaddr))) {
+        fprintf(stderr, "uqimageload: unable to connect to port \"%s\"\n",
+                port);
+        exit(LOAD_CONNECT_ERROR);
+    }
+    freeaddrinfo(ai);
+    return fdopen(*fd, "r");
+}
+
+/**
+ * connection_thread()
+ * ----------------------
+ *  Sends requests over one keep-alive connection until the run ends. In an
+ *  open loop, request k is due at start + k / rate whichever connection
+ *  sends it, and its latency is measured from when it was due rather than
+ *  when it was sent, so a stalled server is charged for the requests that
+ *  queued up behind it. In a closed loop latency is measured from the send.
+ *
+ *  void* arg: a pointer to the thread's ConnectionResults
+ *
+ *  Returns: Null pointer
+ */
+void* connection_thread(void* arg)
+{
+    ConnectionResults* results = arg;
+    LoadState* state = results->state;
+    LoadParameters* params = state->params;
+    int fd;
+    FILE* from = open_connection(params->port, &fd);
+    while (1) {
+        uint64_t index
+                = __atomic_fetch_add(&state->nextRequest, 1, __ATOMIC_RELAXED);
+        if (params->replay && index >= (uint64_t)params->mixSize) {
+            break;
+        }
+        uint64_t dueNs = clock_ns();
+        if (params->replay && params->speed > 0) {
+            dueNs = state->startNs
+                    + (uint64_t)(params->mix[index].offsetNs / params->speed);
+            sleep_until(dueNs);
+        } else if (params->rate > 0) {
+            dueNs = state->startNs + (uint64_t)(index * NS_PER_SECOND
+                                       / params->rate);
+            sleep_until(dueNs);
+        }
+        if (dueNs >= state->endNs) {
+            break;
+        }
+        int status;
+        unsigned long bodyBytes;
+        bool answered = send_request(
+                fd, from, choose_entry(params, index), &status, &bodyBytes);
+        uint64_t doneNs = clock_ns();
+        if (dueNs >= state->measureNs) {
+            if (answered && status == HTTP_OK) {
+                record_latency(results, doneNs - dueNs);
+                results->bytesReceived += bodyBytes;
+            } else {
+                results->failures++;
+            }
+        }
+        if (!answered) {
+            fclose(from);
+            from = open_connection(params->port, &fd);
+            results->reconnects++;
+        }
+    }
+    fclose(from);
+    return NULL;
+}
+
+/**
+ * choose_entry()
+ * -----------------
+ *  Picks the mix entry for a request by its weight, or in a replay takes
+ *  the captured requests in order. The choice depends only on the request's
+ *  index, so every run sends the same sequence.
+ *
+ *  LoadParameters* params: the parameters holding the mix
+ *  uint64_t index: the index of the request
+ *
+ *  Returns: the chosen entry
+ */
+MixEntry* choose_entry(LoadParameters* params, uint64_t index)
+{
+    if (params->replay) {
+        return &params->mix[index];
+    }
+    // The splitmix64 finaliser, to spread consecutive indices evenly
+    uint64_t hash = (index + 1) * MIX_SEED;
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    hash ^= hash >> 31;
+    unsigned int pick = hash % params->totalWeight;
+    for (int i = 0; i < params->mixSize; i++) {
+        if (pick < params->mix[i].weight) {
+            return &params->mix[i];
+        }
+        pick -= params->mix[i].weight;
+    }
+    return &params->mix[params->mixSize - 1];
+}
+
+/**
+ * send_request()
+ * -----------------
+ *  Sends a request and reads its response
+ *
+ *  int fd: the connected socket
+ *  FILE* from: the FILE* reading from the socket
+ *  MixEntry* entry: the mix entry to send
+ *  int* status: where to store the response status
+ *  unsigned long* bodyBytes: where to store the response body size
+ *
+ *  Returns: true if a response was received
+ */
+bool send_request(int fd, FILE* from, MixEntry* entry, int* status,
+        unsigned long* bodyBytes)
+{
+    int sent = 0;
+    while (sent < entry->requestSize) {
+        ssize_t numSent = send(fd, entry->request + sent,
+                entry->requestSize - sent, MSG_NOSIGNAL);
+        if (numSent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (numSent <= 0) {
+            return false;
+        }
+        sent += numSent;
+    }
+    HttpHeader** headers;
+    *bodyBytes = 0;
+    if (!read_http_head(from, status, &headers)) {
+        return false;
+    }
+    bool received = *status == HTTP_NOT_MODIFIED
+            || read_http_body(from, headers, -1, bodyBytes);
+    free_array_of_headers(headers);
+    return received;
+}
+
+/**
+ * record_latency()
+ * -------------------
+ *  Appends a latency to a connection's results
+ *
+ *  ConnectionResults* results: the connection's results
+ *  uint64_t latencyNs: the latency
+ */
+void record_latency(ConnectionResults* results, uint64_t latencyNs)
+{
+    if (results->numLatencies == results->capacity) {
+        results->capacity = results->capacity == 0 ? INITIAL_SAMPLES
+                                                   : results->capacity * 2;
+        results->latencyNs = realloc(
+                results->latencyNs, results->capacity * sizeof(uint64_t));
+    }
+    results->latencyNs[results->numLatencies++] = latencyNs;
+}
+
+/**
+ * report_results()
+ * -------------------
+ *  Merges the connections' results and prints the throughput, failures and
+ *  latency percentiles of the measured requests
+ *
+ *  LoadParameters* params: the parameters of the run
+ *  ConnectionResults* results: the results of each connection
+ *  uint64_t elapsedNs: the length of the measured period
+ */
+void report_results(LoadParameters* params, ConnectionResults* results,
+        uint64_t elapsedNs)
+{
+    size_t count = 0;
+    uint64_t failures = 0;
+    uint64_t reconnects = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < params->connections; i++) {
+        count += results[i].numLatencies;
+        failures += results[i].failures;
+        reconnects += results[i].reconnects;
+        bytes += results[i].bytesReceived;
+    }
+    uint64_t* all = malloc((count + 1) * sizeof(uint64_t));
+    size_t merged = 0;
+    for (int i = 0; i < params->connections; i++) {
+        memcpy(all + merged, results[i].latencyNs,
+                results[i].numLatencies * sizeof(uint64_t));
+        merged += results[i].numLatencies;
+        free(results[i].latencyNs);
+    }
+    qsort(all, count, sizeof(uint64_t), compare_latency);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += all[i];
+    }
+    double seconds = (double)elapsedNs / NS_PER_SECOND;
+    double throughput = count / seconds;
+    double meanUs = count == 0 ? 0 : sum / NS_PER_MICROSECOND / count;
+    double p50Us = percentile(all, count, 0.5) / NS_PER_MICROSECOND;
+    double p99Us = percentile(all, count, 0.99) / NS_PER_MICROSECOND;
+    double p999Us = percentile(all, count, 0.999) / NS_PER_MICROSECOND;
+    double maxUs = count == 0 ? 0 : all[count - 1] / NS_PER_MICROSECOND;
+    const char* mode = params->replay ? "replay"
+                                      : (params->rate > 0 ? "open" : "closed");
+    if (params->json) {
+        printf("{\"mode\":\"%s\",\"connections\":%d,\"rate\":%.3f,"
+               "\"seconds\":%.3f,\"requests\":%zu,\"failures\":%" PRIu64
+               ",\"reconnects\":%" PRIu64 ",\"skipped\":%d,\"throughput\":%.3f,"
+               "\"bytes_per_second\":%.1f,\"mean_us\":%.1f,\"p50_us\":%.1f,"
+               "\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+                mode, params->connections,
+                params->rate, seconds, count, failures, reconnects,
+                params->skipped, throughput,
+                bytes / seconds, meanUs, p50Us, p99Us, p999Us, maxUs);
+    } else {
+        printf("%s, %d connections", mode, params->connections);
+        if (params->rate > 0) {
+            printf(", %.1f requests/s offered", params->rate);
+        }
+        if (params->replay) {
+            printf(", speed %gx, %d requests skipped", params->speed,
+                    params->skipped);
+        }
+        printf("\nRequests: %zu ok, %" PRIu64 " failed, %" PRIu64
+               " reconnects in %.1fs\n",
+                count, failures, reconnects, seconds);
+        printf("Throughput: %.1f requests/s, %.1f MB/s\n", throughput,
+                bytes / seconds / 1e6);
+        printf("Latency (us): mean %.1f  p50 %.1f  p99 %.1f  p999 %.1f  "
+               "max %.1f\n",
+                meanUs, p50Us, p99Us, p999Us, maxUs);
+    }
+    free(all);
+}
+
+/**
+ * percentile()
+ * ---------------
+ *  Finds a percentile of sorted latencies by the nearest-rank method
+ *
+ *  uint64_t* sorted: the latencies in ascending order
+ *  size_t count: the number of latencies
+ *  double fraction: the percentile as a fraction, e.g. 0.99
+ *
+ *  Returns: the percentile, or 0 if there are no latencies
+ */
+uint64_t percentile(uint64_t* sorted, size_t count, double fraction)
+{
+    if (count == 0) {
+        return 0;
+    }
+    size_t rank = (size_t)(fraction * count + 0.999999);
+    return sorted[(rank == 0 ? 1 : rank) - 1];
+}
+
+/**
+ * compare_latency()
+ * --------------------
+ *  Compares two latencies for qsort()
+ *
+ *  const void* a, const void* b: pointers to the uint64_t latencies
+ *
+ *  Returns: negative, zero or positive as a is less than, equal to or greater
+ *  than b
+ */
+int compare_latency(const void* a, const void* b)
+{
+    uint64_t first = *(const uint64_t*)a;
+    uint64_t second = *(const uint64_t*)b;
+    return (first > second) - (first < second);
+}
+
+/**
+ * clock_ns()
+ * -------------
+ *  Reads the monotonic clock
+ *
+ *  Returns: the current time in nanoseconds
+ */
+uint64_t clock_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
+
+/**
+ * sleep_until()
+ * ----------------
+ *  Sleeps until the monotonic clock reaches a time, returning immediately if
+ *  it already has
+ *
+ *  uint64_t wakeNs: the time to wake at
+ */
+void sleep_until(uint64_t wakeNs)
+{
+    struct timespec wake = {wakeNs / NS_PER_SECOND, wakeNs % NS_PER_SECOND};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL)
+            == EINTR) {
+    }
+}
@@ -0,0 +1,570 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define TOLERANCE "--tolerance"
+#define UPDATE "--update"
+#define CONNECTIONS "--connections"
+#define DURATION "--duration"
+#define WARMUP "--warmup"
+#define COMMAND_LINE_ERROR 2
+#define FAILED_RUN 3
+#define REGRESSED 4
+#define UNUSABLE_BASELINE 5
+#define BASE10 10
+#define DEFAULT_TOLERANCE_PERCENT 10
+#define DEFAULT_CONNECTIONS 4
+#define DEFAULT_DURATION 10
+#define DEFAULT_WARMUP 2
+#define MAX_SECONDS 3600
+#define MAX_CONNECTIONS 1024
+#define PERCENT 100.0
+#define MICROSECONDS_PER_SECOND 1000000.0
+#define SERVER_PATH "./uqimageproc"
+#define LOAD_PATH "./uqimageload"
+#define MAX_OUTPUT 4096
+#define MAX_LINE 256
+
+/**
+ * An enum for the metrics compared against the baseline
+ */
+typedef enum {
+    METRIC_THROUGHPUT, // Successful requests per second
+    METRIC_P50, // Median latency in microseconds
+    METRIC_P99, // 99th percentile latency in microseconds
+    METRIC_P999, // 99.9th percentile latency in microseconds
+    METRIC_PEAK_RSS, // The server's peak resident set size in KiB
+    METRIC_CPU, // The server's CPU time per request in microseconds
+    NUM_METRICS
+} Metric;
+
+/**
+ * A struct storing information regarding command line parameters
+ */
+typedef struct {
+    const char* baseline; // The baseline JSON file
+    const char* mix; // The uqimageload mix file to run
+    double tolerance; // The fraction a metric may regress by
+    bool update; // Whether to write the results as the new baseline
+    int connections; // The number of load generator connections
+    int duration; // The measured duration in seconds
+    int warmup; // The warmup duration in seconds
+} CommandParameters;
+
+/**
+ * A struct storing the server started for the run
+ */
+typedef struct {
+    pid_t pid; // The process ID of the server
+    char port[MAX_LINE]; // The port it is listening on
+} Server;
+
+/**
+ * The names of the metrics, as they appear in the baseline and uqimageload's
+ * JSON output
+ */
+static const char* const metricNames[NUM_METRICS] = {"throughput", "p50_us",
+        "p99_us", "p999_us", "peak_rss_kib", "cpu_us_per_request"};
+
+/**
+ * Whether a higher value of each metric is better
+ */
+static const bool higherIsBetter[NUM_METRICS]
+        = {true, false, false, false, false, false};
+
+/*******************************DECLARATIONS***********************************/
+CommandParameters command_line_arguments(int argc, char** argv);
+int convert_to_int(char* intString, int min, int max);
+void command_line_error();
+
+Server start_server();
+void stop_server(Server* server);
+void run_load(CommandParameters params, Server* server, int seconds,
+        char* output, size_t outputSize);
+double server_cpu_seconds(pid_t pid);
+double server_peak_rss_kib(pid_t pid);
+bool json_number(const char* json, const char* name, double* value);
+char* read_file(const char* name);
+
+void read_baseline(CommandParameters params, double* expected);
+int compare_baseline(CommandParameters params, const double* expected,
+        const double* results);
+void write_baseline(CommandParameters params, const double* results);
+
+/******************************************************************************/
+
+/**
+ * main()
+ * ------------
+ *  Starts the server on an ephemeral port, warms it up, then measures it
+ *  under the load generator and compares the results with the baseline (or
+ *  replaces the baseline with them)
+ *
+ *  int argc: the number of command line parameters
+ *  char** argv: the command line parameters
+ *
+ *  Returns: 0 if no metric regressed beyond the tolerance
+ */
+int main(int argc, char** argv)
+{
+    CommandParameters params = command_line_arguments(argc, argv);
+    // Checked before the run, so that an unusable baseline fails fast
+    double expected[NUM_METRICS];
+    if (!params.update) {
+        read_baseline(params, expected);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    Server server = start_server();
+    char output[MAX_OUTPUT];
+    if (params.warmup > 0) {
+        run_load(params, &server, params.warmup, output, sizeof(output));
+    }
+    double cpuBefore = server_cpu_seconds(server.pid);
+    run_load(params, &server, params.duration, output, sizeof(output));
+    double cpu = server_cpu_seconds(server.pid) - cpuBefore;
+    double peakRss = server_peak_rss_kib(server.pid);
+    stop_server(&server);
+    double results[NUM_METRICS];
+    double requests;
+    double failures;
+    for (int m = METRIC_THROUGHPUT; m <= METRIC_P999; m++) {
+        if (!json_number(output, metricNames[m], &results[m])) {
+            fprintf(stderr, "uqimageperf: unexpected load generator output\n");
+            exit(FAILED_RUN);
+        }
+    }
+    if (!json_number(output, "requests", &requests)
+            || !json_number(output, "failures", &failures)) {
+        fprintf(stderr, "uqimageperf: unexpected load generator output\n");
+        exit(FAILED_RUN);
+    }
+    if (failures > 0 || requests == 0) {
+        fprintf(stderr, "uqimageperf: %.0f of %.0f requests failed\n",
+                failures, requests + failures);
+        exit(FAILED_RUN);
+    }
+    results[METRIC_PEAK_RSS] = peakRss;
+    results[METRIC_CPU] = cpu * MICROSECONDS_PER_SECOND / requests;
+    if (params.update) {
+        write_baseline(params, results);
+        return 0;
+    }
+    return compare_baseline(params, expected, results);
+}
+
+/**
+ * command_line_arguments()
+ * ----------------------------
+ *  Parses the command line arguments: the baseline and mix files, then
+ *  optionally the tolerance in percent, the load generator's connections,
+ *  duration and warmup in seconds, and --update
+ *
+ *  int argc: the number of parameters in the command line arguments
+ *  char** argv: the command line arguments
+ *
+ *  Returns: a CommandParameters struct storing the arguments
+ */
+CommandParameters command_line_arguments(int argc, char** argv)
+{
+    CommandParameters params = {NULL, NULL, DEFAULT_TOLERANCE_PERCENT / PERCENT,
+            false, DEFAULT_CONNECTIONS, DEFAULT_DURATION, DEFAULT_WARMUP};
+    if (argc < 3) {
+        command_line_error();
+    }
+    params.baseline = argv[1];
+    params.mix = argv[2];
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], TOLERANCE) == 0 && i + 1 < argc) {
+            params.tolerance
+                    = convert_to_int(argv[++i], 0, (int)PERCENT) / PERCENT;
+        } else if (strcmp(argv[i], CONNECTIONS) == 0 && i + 1 < argc) {
+            params.connections
+                    = convert_to_int(argv[++i], 1, MAX_CONNECTIONS);
+        } else if (strcmp(argv[i], DURATION) == 0 && i + 1 < argc) {
+            params.duration = convert_to_int(argv[++i], 1, MAX_SECONDS);
+        } else if (strcmp(argv[i], WARMUP) == 0 && i + 1 < argc) {
+            params.warmup = convert_to_int(argv[++i], 0, MAX_SECONDS);
+        } else if (strcmp(argv[i], UPDATE) == 0) {
+            params.update = true;
+        } else {
+            command_line_error();
+        }
+    }
+    return params;
+}
+
+/**
+ * convert_to_int()
+ * --------------------
+ *  Converts a string to an integer, running command_line_error() if it is
+ *  not a number within the given bounds
+ *
+ *  char* intString: the string to convert
+ *  int min: the minimum bound for the int
+ *  int max: the maximum bound for the int
+ *
+ *  Returns: the converted integer
+ */
+int convert_to_int(char* intString, int min, int max)
+{
+    char* endPtr;
+    long int converted = strtol(intString, &endPtr, BASE10);
+    if (*intString == '\0' || *endPtr != '\0' || converted < min
+            || converted > max) {
+        command_line_error();
+    }
+    return (int)converted;
+}
+
+/**
+ * command_line_error()
+ * -----------------------
+ *  Prints the usage message to stderr and exits
+ */
+void command_line_error()
+{
+    fprintf(stderr,
+            "Usage: uqimageperf baseline.json mixfile [--tolerance percent] "
+            "[--connections n] [--duration seconds] [--warmup seconds] "
+            "[--update]\n");
+    exit(COMMAND_LINE_ERROR);
+}
+
+/**
+ * start_server()
+ * -----------------
+ *  Starts uqimageproc from the current directory on an ephemeral port and
+ *  reads the port it chose from the first line of its stderr. The server is
+ *  listening by the time it prints the port.
+ *
+ *  Returns: the started server
+ */
+Server start_server()
+{
+    Server server;
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("uqimageperf: pipe");
+        exit(FAILED_RUN);
+    }
+    server.pid = fork();
+    if (server.pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[1]);
+        execl(SERVER_PATH, SERVER_PATH, "--port", "0", (char*)NULL);
+        _exit(FAILED_RUN);
+    }
+    close(fds[1]);
+    FILE* from = fdopen(fds[0], "r");
+    if (server.pid < 0 || fgets(server.port, sizeof(server.port), from) == NULL
+            || strspn(server.port, "0123456789") == 0) {
+        fprintf(stderr, "uqimageperf: unable to start %s\n", SERVER_PATH);
+        exit(FAILED_RUN);
+    }
+    server.port[strspn(server.port, "0123456789")] = '\0';
+    // The server has nothing more to say on stderr unless something is wrong
+    fclose(from);
+    return server;
+}
+
+/**
+ * stop_server()
+ * ----------------
+ *  Terminates the server and waits for it to exit
+ *
+ *  Server* server: the server to stop
+ */
+void stop_server(Server* server)
+{
+    kill(server->pid, SIGTERM);
+    waitpid(server->pid, NULL, 0);
+}
+
+/**
+ * run_load()
+ * -------------
+ *  Runs uqimageload from the current directory against the server in closed
+ *  loop for the given number of seconds, and collects its JSON report. The
+ *  server is stopped and the program exits if the load generator fails.
+ *
+ *  CommandParameters params: the command line parameters
+ *  Server* server: the server to load
+ *  int seconds: how long to run for
+ *  char* output: where to store the report
+ *  size_t outputSize: the size of output
+ */
+void run_load(CommandParameters params, Server* server, int seconds,
+        char* output, size_t outputSize)
+{
+    char connections[MAX_LINE];
+    char duration[MAX_LINE];
+    snprintf(connections, sizeof(connections), "%d", params.connections);
+    snprintf(duration, sizeof(duration), "%d", seconds);
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("uqimageperf: pipe");
+        stop_server(server);
+        exit(FAILED_RUN);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        execl(LOAD_PATH, LOAD_PATH, server->port, params.mix, "--connections",
+                connections, "--duration", duration, "--json", (char*)NULL);
+        _exit(FAILED_RUN);
+    }
+    close(fds[1]);
+    size_t length = 0;
+    ssize_t got;
+    while (length + 1 < outputSize
+            && (got = read(fds[0], output + length, outputSize - length - 1))
+                    > 0) {
+        length += got;
+    }
+    output[length] = '\0';
+    close(fds[0]);
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "uqimageperf: %s failed\n", LOAD_PATH);
+        stop_server(server);
+        exit(FAILED_RUN);
+    }
+}
+
+/**
+ * server_cpu_seconds()
+ * -----------------------
+ *  Reads the user and system CPU time the server has used so far
+ *
+ *  pid_t pid: the process ID of the server
+ *
+ *  Returns: the CPU time in seconds
+ */
+double server_cpu_seconds(pid_t pid)
+{
+    char name[MAX_LINE];
+    snprintf(name, sizeof(name), "/proc/%d/stat", (int)pid);
+    char* stat = read_file(name);
+    // Fields after the command name, which is in parentheses and may contain
+    // spaces; utime and stime are the 14th and 15th fields of the line
+    char* fields = stat == NULL ? NULL : strrchr(stat, ')');
+    unsigned long long utime;
+    unsigned long long stime;
+    if (fields == NULL
+            || sscanf(fields + 1,
+                       " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu "
+                       "%llu",
+                       &utime, &stime)
+                    != 2) {
+        fprintf(stderr, "uqimageperf: cannot read %s\n", name);
+        exit(FAILED_RUN);
+    }
+    free(stat);
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * server_peak_rss_kib()
+ * ------------------------
+ *  Reads the server's peak resident set size (VmHWM)
+ *
+ *  pid_t pid: the process ID of the server
+ *
+ *  Returns: the peak resident set size in KiB
+ */
+double server_peak_rss_kib(pid_t pid)
+{
+    char name[MAX_LINE];
+    snprintf(name, sizeof(name), "/proc/%d/status", (int)pid);
+    char* status = read_file(name);
+    char* line = status == NULL ? NULL : strstr(status, "VmHWM:");
+    unsigned long kib;
+    if (line == NULL || sscanf(line, "VmHWM: %lu kB", &kib) != 1) {
+        fprintf(stderr, "uqimageperf: cannot read %s\n", name);
+        exit(FAILED_RUN);
+    }
+    free(status);
+    return kib;
+}
+
+/**
+ * json_number()
+ * ----------------
+ *  Finds the number stored under a name in a flat JSON object, such as
+ *  uqimageload's report or the baseline
+ *
+ *  const char* json: the JSON text
+ *  const char* name: the name to look for
+ *  double* value: set to the number
+ *
+ *  Returns: false if the name is absent or its value is not a number (e.g.
+ *  null for a metric with no baseline yet)
+ */
+bool json_number(const char* json, const char* name, double* value)
+{
+    char key[MAX_LINE];
+    snprintf(key, sizeof(key), "\"%s\"", name);
+    const char* found = strstr(json, key);
+    if (found == NULL) {
+        return false;
+    }
+    found += strlen(key);
+    found += strspn(found, " \t\r\n");
+    if (*found != ':') {
+        return false;
+    }
+    char* endPtr;
+    *value = strtod(found + 1, &endPtr);
+    return endPtr != found + 1 && isfinite(*value);
+}
+
+/**
+ * read_file()
+ * --------------
+ *  Reads a whole text file, which may be a /proc file of unknown size
+ *
+ *  const char* name: the name of the file
+ *
+ *  Returns: the malloc'd contents, or NULL if it could not be read
+ */
+char* read_file(const char* name)
+{
+    FILE* file = fopen(name, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    size_t size = MAX_OUTPUT;
+    size_t length = 0;
+    char* contents = malloc(size);
+    size_t got;
+    while ((got = fread(contents + length, 1, size - length - 1, file)) > 0) {
+        length += got;
+        if (length + 1 == size) {
+            size *= 2;
+            contents = realloc(contents, size);
+        }
+    }
+    contents[length] = '\0';
+    fclose(file);
+    return contents;
+}
+
+/**
+ * read_baseline()
+ * ------------------
+ *  Reads the value of every metric from the baseline, exiting if the file
+ *  cannot be read, lacks a value for any metric (e.g. one never recorded
+ *  with --update) or was measured under a different workload
+ *
+ *  CommandParameters params: the command line parameters
+ *  double* expected: where to store the baseline value of each metric
+ */
+void read_baseline(CommandParameters params, double* expected)
+{
+    char* baseline = read_file(params.baseline);
+    if (baseline == NULL) {
+        fprintf(stderr, "uqimageperf: cannot read %s\n", params.baseline);
+        exit(FAILED_RUN);
+    }
+    const char* const workloadNames[] = {"connections", "duration", "warmup"};
+    const int workload[]
+            = {params.connections, params.duration, params.warmup};
+    for (int i = 0; i < (int)(sizeof(workload) / sizeof(workload[0])); i++) {
+        double value;
+        if (!json_number(baseline, workloadNames[i], &value)
+                || value != workload[i]) {
+            fprintf(stderr, "uqimageperf: %s: %s differs from this run\n",
+                    params.baseline, workloadNames[i]);
+            free(baseline);
+            exit(UNUSABLE_BASELINE);
+        }
+    }
+    for (int m = 0; m < NUM_METRICS; m++) {
+        if (!json_number(baseline, metricNames[m], &expected[m])
+                || expected[m] <= 0) {
+            fprintf(stderr, "uqimageperf: %s: no value for %s, record one "
+                            "with --update\n",
+                    params.baseline, metricNames[m]);
+            free(baseline);
+            exit(UNUSABLE_BASELINE);
+        }
+    }
+    free(baseline);
+}
+
+/**
+ * compare_baseline()
+ * ---------------------
+ *  Prints each metric against the baseline and whether it regressed by more
+ *  than the tolerance
+ *
+ *  CommandParameters params: the command line parameters
+ *  const double* expected: the baseline value of each metric
+ *  const double* results: the measured value of each metric
+ *
+ *  Returns: 0 if no metric regressed, REGRESSED otherwise
+ */
+int compare_baseline(CommandParameters params, const double* expected,
+        const double* results)
+{
+    int status = 0;
+    printf("%-20s %12s %12s %8s  %s\n", "metric", "baseline", "current",
+            "change", "result");
+    for (int m = 0; m < NUM_METRICS; m++) {
+        double change = (results[m] - expected[m]) / expected[m];
+        double worse = higherIsBetter[m] ? -change : change;
+        const char* result = "ok";
+        if (worse > params.tolerance) {
+            result = "REGRESSED";
+            status = REGRESSED;
+        } else if (worse < -params.tolerance) {
+            result = "improved";
+        }
+        printf("%-20s %12.1f %12.1f %+7.1f%%  %s\n", metricNames[m],
+                expected[m], results[m], change * PERCENT, result);
+    }
+    if (status != 0) {
+        printf("Regressed by more than %.0f%% against %s\n",
+                params.tolerance * PERCENT, params.baseline);
+    }
+    return status;
+}
+
+/**
+ * write_baseline()
+ * -------------------
+ *  Writes the results as the new baseline, along with the workload they
+ *  were measured under
+ *
+ *  CommandParameters params: the command line parameters
+ *  const double* results: the measured value of each metric
+ */
+void write_baseline(CommandParameters params, const double* results)
+{
+    FILE* file = fopen(params.baseline, "w");
+    if (file == NULL) {
+        fprintf(stderr, "uqimageperf: cannot write %s\n", params.baseline);
+        exit(FAILED_RUN);
+    }
+    fprintf(file, "{\n  \"mix\": \"%s\",\n  \"connections\": %d,\n"
+                  "  \"duration\": %d,\n  \"warmup\": %d",
+            params.mix, params.connections, params.duration, params.warmup);
+    for (int m = 0; m < NUM_METRICS; m++) {
+        fprintf(file, ",\n  \"%s\": %.1f", metricNames[m], results[m]);
+    }
+    fprintf(file, "\n}\n");
+    fclose(file);
+    printf("Wrote %s\n", params.baseline);
+}
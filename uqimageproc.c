@@ -1,3 +1,5 @@
+// For memfd_create()
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -8,6 +10,7 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <string.h>
+#include <strings.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <csse2310a4.h>
@@ -15,14 +18,64 @@
 #include <csse2310_freeimage.h>
 #include <semaphore.h>
 #include <signal.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <math.h>
+#include <limits.h>
+#include <time.h>
+#include <setjmp.h>
+#include <png.h>
+#include <jpeglib.h>
+#include <zlib.h>
+
+// Statically-defined tracing probes. With <sys/sdt.h> each probe compiles to a
+// single nop plus a note describing where its arguments live, for bpftrace or
+// perf to attach to; without it the probes compile to nothing.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+#ifdef DTRACE_PROBE
+#define PROBE0(name) DTRACE_PROBE(uqimageproc, name)
+#define PROBE1(name, a) DTRACE_PROBE1(uqimageproc, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(uqimageproc, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(uqimageproc, name, a, b, c)
+#else
+#define PROBE0(name)
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif
 
 #define PORT "--port"
 #define CONNECTIONS "--max"
+#define CACHE_DIR "--cache-dir"
+#define CACHE_DISK_BYTES "--cache-disk-bytes"
+#define REQUEST_BUDGET "--request-budget"
+#define MEMORY_BUDGET "--memory-budget"
+#define ADMISSION_QUEUE "--admission-queue"
+#define NO_TIMING_HEADERS "--no-timing-headers"
+#define ACCESS_LOG "--access-log"
+#define CAPTURE "--capture"
+#define CAPTURE_SAMPLE "--capture-sample"
+#define CAPTURE_BODIES "--capture-bodies"
+#define MAX_BODY "--max-body"
 #define MAX_CONNECTIONS 10000
 #define MIN_CONNECTIONS 0
 #define COMMAND_LINE_ERROR 15
 #define FAILED_LISTEN 3
+#define FAILED_CACHE 6
+#define FAILED_ACCESS_LOG 7
+#define FAILED_CAPTURE 8
 #define BASE10 10
+#define HEX_BASE 16
 
 #define PORT_MIN 1024
 #define PORT_MAX 65535
@@ -33,24 +86,115 @@
 #define METHOD_NOT_ALLOWED 405
 #define NOT_FOUND 404
 #define OK 200
+#define NOT_MODIFIED 304
 #define BAD_REQUEST 400
 #define PAYLOAD_TOO_LARGE 413
 #define UNPROCESSABLE_CONTENT 422
 #define FAILED_OPERATION 501
+#define SERVICE_UNAVAILABLE 503
 
 #define HTML_PATH "/local/courses/csse2310/resources/a4/home.html"
+#define METRICS_PATH "/metrics"
+#define RENDITIONS_PATH "/renditions?"
 #define ROTATE "rotate"
 #define FLIP "flip"
 #define SCALE "scale"
+#define CROP "crop"
 #define ROTATE_MIN (-359)
 #define ROTATE_MAX 359
 #define HORIZONTAL "h"
 #define VERTICAL "v"
 #define SCALE_MIN 1
 #define SCALE_MAX 10000
-#define LAST_SCALE_ARGUMENT 3
+#define MAX_OPERATION_VALUES 4
+#define MAX_NORMALIZED_STEP 64
 
 #define EIGHT_MIB 8388608
+#define HTTP_VERSION "HTTP/1.1"
+#define DEFAULT_MAX_BODY EIGHT_MIB
+#define MIN_MAX_BODY 1UL
+#define SPOOL_THRESHOLD 1048576UL
+#define SPOOL_BUFFER_SIZE 16384
+
+#define DEFAULT_REQUEST_BUDGET 268435456UL
+#define MIN_REQUEST_BUDGET 1048576UL
+#define MAX_PROBE_DIMENSION 16777216
+#define DEGREES_HALF_TURN 180
+#define DEGREES_RIGHT_ANGLE 90
+#define QUARTER_TURNS 4
+#define PNG_SIGNATURE_LENGTH 8
+#define PNG_IHDR_END 26
+#define PNG_IHDR_INTERLACE 28
+#define PNG_SCREEN_GAMMA 2.2
+#define MAX_JPEG_REDUCTION 8
+#define JPEG_BUFFERED_ROWS 16
+#define PNG_SINK_INITIAL 65536
+#define STREAM_CHUNK_BYTES 65536
+#define MAX_STREAM_KEPT EIGHT_MIB
+#define BMP_HEADER_END 26
+#define PNG_CHUNK_OVERHEAD 12
+#define PNG_IHDR_LENGTH 13
+#define APNG_ACTL_LENGTH 8
+#define APNG_FCTL_LENGTH 26
+#define APNG_DISPOSE_OP_BACKGROUND 1
+#define APNG_BLEND_OP_SOURCE 0
+#define DEFAULT_FRAME_MS 100
+#define MILLISECONDS_PER_SECOND 1000
+#define FRAME_OK (-1)
+#define FRAME_UNDECODABLE (-2)
+#define MAX_RENDITIONS 16
+#define BOUNDARY_KEY_BYTES 8
+#define GIF_HEADER_LENGTH 13
+#define MAX_COMMUTED_STEPS 3
+#define PLAN_UNIFORM_TOLERANCE 0.02
+#define EXPLAIN_HEADER "X-Explain"
+
+#define MIN_MEMORY_BUDGET 1048576UL
+#define DEFAULT_ADMISSION_QUEUE 64
+#define RETRY_AFTER_SECONDS "1"
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (62 * HISTOGRAM_SUB_BUCKETS)
+#define HISTOGRAM_FIRST_EXPORT 10 // 2^10ns, about 1us
+#define HISTOGRAM_LAST_EXPORT 36 // 2^36ns, about 69s
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+#define NANOSECONDS_PER_MILLISECOND 1000000.0
+#define MAX_TIMED_OPERATIONS 16
+
+#define ACCESS_LOG_RING_ENTRIES 256 // Per client thread, a power of two
+#define ACCESS_LOG_PATH_LENGTH 128
+#define ACCESS_LOG_METHOD_LENGTH 8
+#define ACCESS_LOG_FLUSH_NANOSECONDS 100000000L // 100ms
+
+#define CAPTURE_MAGIC 0x55514350 // "UQCP"
+#define CAPTURE_RECORD_MAGIC 0x55514352 // "UQCR"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HAS_BODY 0x1
+#define MIN_CAPTURE_SAMPLE 1UL
+
+#define STATS_SHM_PREFIX "/uqimageproc."
+#define STATS_MAGIC 0x55515354 // "UQST"
+#define STATS_VERSION 1
+#define STATS_PUBLISH_NANOSECONDS 100000000L // 100ms
+
+#define SHA256_BYTES 32
+#define SHA256_BLOCK 64
+#define ETAG_LENGTH (SHA256_BYTES * 2 + 2)
+
+#define CACHE_SEGMENT_FILE "segment"
+#define CACHE_INDEX_FILE "index"
+#define CACHE_INDEX_MAGIC 0x55514958 // "UQIX"
+#define CACHE_RECORD_MAGIC 0x55515243 // "UQRC"
+#define CACHE_VERSION 1
+#define DEFAULT_CACHE_DISK_BYTES 1073741824UL
+#define MIN_CACHE_DISK_BYTES 1048576UL
+#define CACHE_AVERAGE_ENTRY 16384
+#define CACHE_MIN_SLOTS 1024
+#define PNG_CONTENT 0
+#define JPEG_CONTENT 1
+
+#define IN_FLIGHT_BUCKETS 256
 
 /**
  * A struct to store information regarding the command line parameters
@@ -60,6 +204,26 @@ typedef struct {
     bool portGiven; // A boolean representing if the user specified a port
     int max; // An int representing the max number of connections
     bool maxGiven; // A boolean represnting if the user specified max conn
+    char* cacheDir; // The directory for the on-disk result cache
+    bool cacheDirGiven; // A boolean representing if a cache dir was specified
+    unsigned long cacheDiskBytes; // The maximum size of the cache segment
+    bool cacheDiskBytesGiven; // A boolean representing if a size was given
+    unsigned long requestBudget; // The most pixel memory one request may use
+    bool requestBudgetGiven; // A boolean representing if a budget was given
+    unsigned long memoryBudget; // The most pixel memory all requests may use
+    bool memoryBudgetGiven; // A boolean representing if a budget was given
+    int admissionQueue; // The most requests that may wait for memory
+    bool admissionQueueGiven; // A boolean representing if a length was given
+    bool noTimingHeaders; // A boolean representing if timing headers are off
+    char* accessLog; // The file to write the access log to
+    bool accessLogGiven; // A boolean representing if a log file was given
+    char* capture; // The file to capture sampled requests to
+    bool captureGiven; // A boolean representing if a capture file was given
+    unsigned long captureSample; // Capture one in this many requests
+    bool captureSampleGiven; // A boolean representing if a rate was given
+    bool captureBodies; // A boolean representing if bodies are captured
+    unsigned long maxBody; // The largest request body accepted
+    bool maxBodyGiven; // A boolean representing if a body limit was given
 } CommandParameters;
 
 /**
@@ -71,8 +235,23 @@ typedef struct {
     unsigned char* body; // An unsigned string to represent the body
     unsigned long len; // An integer to represent the size of the body (bytes)
     HttpHeader** headers; // A pointer to an array for storing headers
+    size_t mapped; // The length of the body's mapping, 0 if on the heap
 } HttpRequest;
 
+/**
+ * A struct storing a request body as it is read. Bodies start on the heap,
+ * move into an anonymous memory file once they pass SPOOL_THRESHOLD, and are
+ * dropped once they pass the limit.
+ */
+typedef struct {
+    unsigned char* data; // The body while it is on the heap
+    size_t len; // The number of body bytes read
+    size_t capacity; // The allocated size of data
+    int fd; // The memory file holding the body, -1 while on the heap
+    unsigned long limit; // The most bytes of body to keep
+    bool dropped; // Whether the body passed the limit and was dropped
+} BodySpool;
+
 /**
  * A struct to store information about the HTTP response constructed
  */
@@ -86,15 +265,147 @@ typedef struct {
 } HttpResponse;
 
 /**
- * A struct to store information about the operations
+ * An enum for the operations that can be performed on an image
+ */
+typedef enum {
+    OPERATION_END, // Marks the end of an operation program
+    OPERATION_ROTATE, // Rotate by value1 degrees
+    OPERATION_FLIP, // Flip in the FlipDirection value1
+    OPERATION_SCALE, // Scale to value1 by value2 pixels
+    OPERATION_CROP, // Crop to value3 by value4 pixels from (value1, value2)
+    NUM_OPERATION_KINDS
+} OperationKind;
+
+/**
+ * An enum for the directions an image can be flipped in
+ */
+typedef enum {
+    FLIP_HORIZONTAL, // Mirror left to right
+    FLIP_VERTICAL // Mirror top to bottom
+} FlipDirection;
+
+/**
+ * A struct to store one step of an operation program, the array of steps
+ * compiled from a request's path that ends with an OPERATION_END step
  */
 typedef struct {
-    char* operation; // A string representing the operation name
-    int value1; // An integer representing the first value (if needed)
-    int value2; // An integer representing the second value (if needed)
-    char* direction; // A string representing the flip direction (if needed)
+    OperationKind kind; // The operation to perform
+    int value1; // The angle, flip direction, new width or left edge
+    int value2; // The new height or top edge (if needed)
+    int value3; // The width of the region to crop to (if needed)
+    int value4; // The height of the region to crop to (if needed)
 } Operation;
 
+/**
+ * A struct storing an encoded image in memory as libpng reads through it
+ */
+typedef struct {
+    const unsigned char* data; // The encoded image
+    unsigned long len; // The number of bytes in the encoded image
+    unsigned long pos; // The number of bytes read so far
+} PngSource;
+
+/**
+ * A struct storing libjpeg's error handler and where to return to when it
+ * reports a fatal error
+ */
+typedef struct {
+    struct jpeg_error_mgr manager; // First, as libjpeg points to it
+    jmp_buf recover; // Where to return to
+} JpegErrors;
+
+/**
+ * A struct to store a rectangle of an image, such as the part a crop keeps
+ */
+typedef struct {
+    unsigned long long x; // The left edge in pixels
+    unsigned long long y; // The top edge in pixels
+    unsigned long long width; // The width in pixels, 0 if it is empty
+    unsigned long long height; // The height in pixels, 0 if it is empty
+} Region;
+
+/**
+ * An enum for the kinds of stage in a scanline pipeline
+ */
+typedef enum {
+    STREAM_PNG, // Decodes the rows of a PNG with libpng
+    STREAM_JPEG, // Decodes the rows of a JPEG with libjpeg
+    STREAM_CROP, // Keeps a region of its source's rows
+    STREAM_FLIP, // Mirrors its source's rows left to right
+    STREAM_SCALE // Resamples its source's rows to a new size
+} StreamKind;
+
+/**
+ * A struct to store the weights a bilinear resample gives the source pixels
+ * of each output pixel along one axis, computed as FreeImage computes them
+ */
+typedef struct {
+    unsigned long long* left; // The first source pixel of each output pixel
+    unsigned int* count; // The number of source pixels of each
+    double* weights; // windowSize weights for each output pixel
+    unsigned long long size; // The number of output pixels
+    unsigned int windowSize; // The most source pixels of any output pixel
+} ScaleWeights;
+
+/**
+ * A struct to store one stage of a scanline pipeline. Each stage produces
+ * the rows of its image top to bottom, pulling rows from its source only as
+ * it needs them, so no stage holds more than a few rows at a time.
+ */
+typedef struct StreamStage {
+    StreamKind kind; // What the stage does
+    struct StreamStage* source; // The stage before it (NULL for a decoder)
+    unsigned long long width; // The width of the rows it produces
+    unsigned long long height; // The number of rows it produces
+    unsigned int channels; // The bytes per pixel
+    unsigned long long nextRow; // The number of rows produced so far
+    unsigned long long bytes; // The bytes of rows it holds
+    Region region; // The region a decoder or crop keeps
+    unsigned int factor; // The factor a PNG decoder reduces by
+    unsigned char* row; // A row of its source, or of the encoded image
+    uint64_t* sums; // A PNG decoder's sums for box filtering
+    png_structp png; // A PNG decoder's libpng state
+    png_infop info; // A PNG decoder's image information
+    PngSource pngSource; // Where a PNG decoder reads from
+    struct jpeg_decompress_struct jpeg; // A JPEG decoder's libjpeg state
+    JpegErrors jpegErrors; // A JPEG decoder's error handler
+    JSAMPARRAY jpegRow; // A JPEG decoder's row of decoded MCUs
+    JDIMENSION jpegLeft; // The first column a JPEG decoder decodes
+    ScaleWeights columns; // A scale's weights along each row
+    ScaleWeights rows; // A scale's weights down each column
+    bool rowsFirst; // Whether a scale filters down the columns first
+    unsigned char* window; // A scale's ring of rows to filter between
+    double* totals; // A scale's sums for one filtered row
+    unsigned long long pulled; // The number of rows a scale has pulled
+} StreamStage;
+
+/**
+ * A struct storing the PNG being encoded as libpng writes it. With a
+ * connection to send to, it is sent in chunks as it grows, and is only held
+ * whole while it is small enough to be worth caching.
+ */
+typedef struct {
+    unsigned char* data; // The encoded bytes held
+    size_t len; // The number of encoded bytes held
+    size_t capacity; // The number of bytes allocated
+    FILE* to; // Where to send chunks to (NULL to hold the whole PNG)
+    const unsigned char* key; // The job key the ETag is derived from
+    size_t sent; // The number of held bytes that have been sent
+    bool chunked; // Whether a chunked response has been started
+    bool whole; // Whether every encoded byte is still held
+} PngSink;
+
+/**
+ * A struct describing how an operation is written in a request's path: its
+ * name, then the given number of comma-separated values
+ */
+typedef struct {
+    const char* name; // The operation's name
+    int numValues; // The number of values that follow the name
+    int min; // The smallest numeric value allowed
+    int max; // The largest numeric value allowed
+} OperationSyntax;
+
 /**
  * A struct to store information about the statistics generated
  */
@@ -106,6 +417,336 @@ typedef struct {
     unsigned int operations; // The number of successful performed operations
 } Statistics;
 
+/**
+ * An enum for the ways an image can be decoded. Only libpng and libjpeg can
+ * decode a region or a reduced size of an image without decoding the rest.
+ */
+typedef enum {
+    DECODER_FREEIMAGE, // FreeImage, a whole image at once
+    DECODER_PNG, // libpng, a scanline at a time
+    DECODER_JPEG // libjpeg-turbo, an MCU row at a time
+} Decoder;
+
+/**
+ * A struct to store the dimensions of an image read from its header, before
+ * any of it is decoded
+ */
+typedef struct {
+    unsigned long width; // The width of the image in pixels
+    unsigned long height; // The height of the image in pixels
+    unsigned int bytesPerPixel; // The bytes per pixel of the decoded bitmap
+    Decoder decoder; // The way the image can be decoded
+    unsigned long frames; // The frames of an animation or pages, else 1
+} ImageHeader;
+
+/**
+ * The request-handling stages whose latency is recorded
+ */
+typedef enum {
+    STAGE_REQUEST_READ, // Reading the request line, headers and body
+    STAGE_REQUEST_PARSE, // Validating and parsing the request and image header
+    STAGE_DECODE, // Decoding the image
+    STAGE_ROTATE, // Performing one rotate operation
+    STAGE_FLIP, // Performing one flip operation
+    STAGE_SCALE, // Performing one scale operation
+    STAGE_CROP, // Performing one crop operation
+    STAGE_ENCODE, // Encoding the resulting PNG
+    STAGE_SEND, // Sending the response
+    STAGE_QUEUE_WAIT, // Waiting for memory or for an identical in-flight job
+    STAGE_TOTAL, // The whole request, from its first byte to its response
+    NUM_STAGES
+} Stage;
+
+/**
+ * A struct to store a log-linear (HDR-style) latency histogram in
+ * nanoseconds. Each power of two is split into HISTOGRAM_SUB_BUCKETS linear
+ * buckets, so every recorded value is within 12.5% of its bucket. All fields
+ * are updated with atomic adds, so recording takes no lock.
+ */
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS]; // The number of values in each bucket
+    uint64_t count; // The total number of values recorded
+    uint64_t sum; // The sum of all values recorded
+} Histogram;
+
+/**
+ * A struct to store the metrics exposed on /metrics, all of which are
+ * updated with atomic operations
+ */
+typedef struct {
+    Histogram stages[NUM_STAGES]; // The latency of each request stage
+    int64_t inFlight; // The number of requests currently being handled
+    uint64_t notModified; // The number of 304 responses sent
+    uint64_t cacheHits; // The number of responses served from the cache
+    uint64_t coalesced; // The number of responses taken from another job
+} Metrics;
+
+/**
+ * An enum for how a request's result was produced, as recorded in the access
+ * log
+ */
+typedef enum {
+    CACHE_NONE, // The request did not ask for an image to be processed
+    CACHE_MISS, // The image was processed by this request
+    CACHE_HIT, // The result was sent from the disk cache
+    CACHE_NOT_MODIFIED, // The client's copy was still valid
+    CACHE_COALESCED, // The result was taken from an identical in-flight job
+    NUM_CACHE_OUTCOMES
+} CacheOutcome;
+
+/**
+ * A struct to store the time spent in, and resources used by, the request a
+ * client thread is currently handling, reported in its response headers and
+ * the access log
+ */
+typedef struct {
+    bool enabled; // Whether the headers are added to responses
+    uint64_t stageNs[NUM_STAGES]; // The time spent in each stage so far
+    Stage operations[MAX_TIMED_OPERATIONS]; // The stage of each operation
+    uint64_t operationNs[MAX_TIMED_OPERATIONS]; // The time of each operation
+    int numOperations; // The number of operations performed so far
+    uint64_t startNs; // The time when the request began
+    uint64_t cpuStartNs; // The thread CPU time when the request began
+    unsigned long long peakPixelBytes; // The most pixel memory held at once
+    int status; // The status code of the response
+    unsigned long long bytesOut; // The bytes sent in the response
+    CacheOutcome cacheOutcome; // How the result was produced
+} RequestUsage;
+
+/**
+ * A struct to store one access log entry. Entries are filled in by client
+ * threads and formatted by the access log writer thread.
+ */
+typedef struct {
+    struct timespec time; // The wall clock time the request began
+    struct in_addr peerAddress; // The address of the client
+    in_port_t peerPort; // The port of the client, in network byte order
+    char method[ACCESS_LOG_METHOD_LENGTH]; // The request method (truncated)
+    char path[ACCESS_LOG_PATH_LENGTH]; // The request path (truncated)
+    unsigned long bytesIn; // The bytes in the request body
+    unsigned long long bytesOut; // The bytes sent in the response
+    int status; // The status code of the response
+    CacheOutcome cacheOutcome; // How the result was produced
+    uint64_t stageNs[NUM_STAGES]; // The time spent in each stage
+} AccessLogEntry;
+
+/**
+ * A struct to store the access log entries of one client thread. The client
+ * thread is the only writer of head and the log writer thread the only writer
+ * of tail, so neither side ever waits on the other.
+ */
+typedef struct AccessLogRing {
+    AccessLogEntry entries[ACCESS_LOG_RING_ENTRIES]; // The entries
+    uint64_t head; // The number of entries ever added
+    uint64_t tail; // The number of entries ever written out
+    uint64_t dropped; // The number of entries dropped as the ring was full
+    bool retired; // Whether the client thread has finished with the ring
+    struct AccessLogRing* next; // The next ring in the log's list
+} AccessLogRing;
+
+/**
+ * A struct to store the access log, written to by its own thread
+ */
+typedef struct {
+    FILE* file; // The file the entries are written to
+    pthread_mutex_t mutex; // A mutex for the list of rings
+    AccessLogRing* rings; // The rings of the client threads
+    uint64_t dropped; // The number of entries dropped, from retired rings
+} AccessLog;
+
+/**
+ * A struct to store the running state of a SHA-256 digest
+ */
+typedef struct {
+    uint32_t state[8]; // The intermediate hash value
+    uint64_t bitLength; // The number of message bits processed so far
+    unsigned char block[SHA256_BLOCK]; // The partially filled message block
+    size_t blockLength; // The number of bytes in the partial block
+} Sha256;
+
+/**
+ * A struct stored at the start of the memory-mapped cache index file
+ */
+typedef struct {
+    uint32_t magic; // Identifies the file as a cache index
+    uint32_t version; // The on-disk format version
+    uint64_t slotCount; // The number of hash slots (a power of two)
+    uint64_t usedSlots; // The number of occupied hash slots
+    uint64_t segmentEnd; // The number of committed bytes in the segment
+} CacheIndexHeader;
+
+/**
+ * A struct representing one slot of the open-addressed cache index
+ */
+typedef struct {
+    unsigned char key[SHA256_BYTES]; // The job key of the cached result
+    uint64_t offset; // The offset of the encoded result in the segment
+    uint64_t length; // The length of the encoded result (0 if slot is empty)
+} CacheSlot;
+
+/**
+ * A struct written in front of every encoded result in the segment file, so
+ * that the index can be rebuilt by scanning the segment
+ */
+typedef struct {
+    uint32_t magic; // Identifies the start of a record
+    uint32_t contentType; // The content type of the encoded result
+    unsigned char key[SHA256_BYTES]; // The job key of the record
+    uint64_t length; // The length of the encoded result following
+} CacheRecordHeader;
+
+/**
+ * A struct to store the on-disk result cache: an append-only segment file of
+ * encoded results, and a memory-mapped hash index into it
+ */
+typedef struct {
+    int segmentFd; // The fd of the append-only segment file
+    char* segmentPath; // The path of the segment file
+    int indexFd; // The fd of the index file
+    CacheIndexHeader* index; // The memory-mapped index header
+    CacheSlot* slots; // The memory-mapped index slots
+    size_t mapSize; // The size of the index mapping
+    unsigned long maxBytes; // The maximum size of the segment
+    pthread_rwlock_t lock; // Readers send hits, writers append or wipe
+} DiskCache;
+
+/**
+ * A struct representing a job that some client thread is currently computing,
+ * which threads receiving an identical request wait on instead of redoing it
+ */
+typedef struct InFlightJob {
+    unsigned char key[SHA256_BYTES]; // The job key being computed
+    int references; // The number of threads holding this job
+    bool done; // Whether the computing thread has finished
+    unsigned char* data; // The encoded result (NULL if the job failed)
+    unsigned long numBytes; // The number of bytes in the encoded result
+    uint32_t contentType; // The content type of the encoded result
+    pthread_cond_t finished; // Signalled when the job is done
+    struct InFlightJob* next; // The next job in the same hash bucket
+} InFlightJob;
+
+/**
+ * A struct storing a hash table of all jobs currently in flight
+ */
+typedef struct {
+    pthread_mutex_t mutex; // A mutex for modifying the table and its jobs
+    InFlightJob* buckets[IN_FLIGHT_BUCKETS]; // The chained hash buckets
+} InFlightTable;
+
+/**
+ * A struct to store the global memory accountant, from which every request
+ * reserves its estimated pixel memory before decoding. Requests that do not
+ * fit wait in a bounded first-come first-served queue.
+ */
+typedef struct {
+    pthread_mutex_t mutex; // A mutex for modifying the accountant
+    pthread_cond_t released; // Signalled when memory or the queue head frees
+    unsigned long long budget; // The total bytes that may be reserved
+    unsigned long long reserved; // The bytes currently reserved
+    unsigned int reservations; // The number of current reservations
+    unsigned int waiting; // The number of requests queued for memory
+    unsigned int maxWaiting; // The most requests that may be queued
+    unsigned long nextTicket; // The ticket handed to the next queued request
+    unsigned long headTicket; // The ticket of the request at the queue head
+    unsigned int shed; // The number of requests turned away
+} MemoryAccountant;
+
+/**
+ * A struct to store the header at the start of a capture file
+ */
+typedef struct {
+    uint32_t magic; // CAPTURE_MAGIC
+    uint32_t version; // CAPTURE_VERSION
+} CaptureFileHeader;
+
+/**
+ * A struct to store the header of a captured request. It is followed by the
+ * method, path and headers (as "Name: value\r\n" lines) and, if flags has
+ * CAPTURE_HAS_BODY, the body.
+ */
+typedef struct {
+    uint32_t magic; // CAPTURE_RECORD_MAGIC
+    uint32_t flags; // CAPTURE_HAS_BODY if the body follows
+    uint64_t offsetNs; // When the request arrived, relative to the capture
+    uint64_t bodyLength; // The length of the request body
+    uint32_t methodLength; // The length of the method
+    uint32_t pathLength; // The length of the path
+    uint32_t headersLength; // The length of the headers
+    uint32_t reserved; // Zero
+    unsigned char bodyHash[SHA256_BYTES]; // The SHA-256 of the body
+} CaptureRecordHeader;
+
+/**
+ * A struct to store the state of request capture
+ */
+typedef struct {
+    int fd; // The capture file, opened for appending
+    uint64_t startNs; // When the capture began
+    unsigned long sample; // One in this many requests is captured
+    bool bodies; // Whether bodies are captured
+    uint64_t seen; // The number of requests seen, updated atomically
+    uint64_t captured; // The number of requests captured
+    uint64_t failed; // The number of sampled requests that failed to write
+    pthread_mutex_t mutex; // Serialises appends, so a short one can be undone
+    bool stopped; // Whether a partial record could not be undone
+} Capture;
+
+/**
+ * A struct to store the counters and gauges published in the shared memory
+ * statistics segment. uqimagestat has a copy of this layout; any change to it
+ * must bump STATS_VERSION in both.
+ */
+typedef struct {
+    uint64_t connected; // Currently connected clients
+    uint64_t serviced; // Clients that have disconnected
+    uint64_t success; // Successfully processed HTTP requests
+    uint64_t unSuccess; // Unsuccessful HTTP requests
+    uint64_t operations; // Operations on images completed
+    uint64_t notModified; // 304 responses sent
+    uint64_t cacheHits; // Responses served from the disk cache
+    uint64_t coalesced; // Responses taken from an identical in-flight job
+    int64_t inFlight; // Requests currently being handled
+    uint64_t memoryBudget; // The global memory budget, 0 if there is none
+    uint64_t memoryReserved; // Image memory currently reserved
+    uint64_t admissionWaiting; // Requests queued for memory
+    uint64_t shed; // Requests refused as the admission queue was full
+    uint64_t accessLogDropped; // Access log entries dropped
+} SharedCounters;
+
+/**
+ * A struct to store the shared memory statistics segment. The server is its
+ * only writer: sequence is odd while counters is being updated, so a reader
+ * retries its copy if sequence was odd or changed while it was copying.
+ */
+typedef struct {
+    uint32_t magic; // STATS_MAGIC
+    uint32_t version; // STATS_VERSION
+    uint32_t size; // The size of this struct
+    uint32_t sequence; // The seqlock sequence number
+    int64_t pid; // The process ID of the server
+    uint64_t updatedNs; // The CLOCK_MONOTONIC time of the last update
+    SharedCounters counters; // The published values
+} SharedStats;
+
+/**
+ * A struct to store the server-wide state shared by all client threads
+ */
+typedef struct {
+    DiskCache* cache; // The on-disk result cache (NULL if not configured)
+    InFlightTable* inFlight; // The table of jobs currently being computed
+    unsigned long requestBudget; // The most pixel memory one request may use
+    unsigned long maxBody; // The largest request body accepted
+    MemoryAccountant* memory; // The global accountant (NULL if unlimited)
+    Metrics* metrics; // The metrics exposed on /metrics
+    bool timingHeaders; // Whether Server-Timing headers are sent
+    AccessLog* accessLog; // The access log, or NULL if there is none
+    SharedStats* shared; // The shared memory statistics, or NULL if none
+    char* sharedName; // The name of the shared memory segment, or NULL
+    Capture* capture; // The request capture, or NULL if there is none
+    Statistics* stats; // The statistics printed on SIGHUP
+    pthread_mutex_t* statsMutex; // A mutex for modifying Statistics data
+} ServerState;
+
 /**
  * A struct to store information regarding the arguments passed to the client
  * thread
@@ -116,8 +757,81 @@ typedef struct {
     bool maxGiven; // Whether a max client limit was specified or not
     Statistics* stats; // A pointer to the struct for generating statistics
     pthread_mutex_t* statsMutex; // A mutex for modifying Statistics data
+    ServerState* server; // A pointer to the shared server state
+    struct sockaddr_in peer; // The address of the client
 } ThreadArgs;
 
+/**
+ * A struct storing one encoded frame of a multi-frame image
+ */
+typedef struct {
+    unsigned char* data; // The frame encoded as a PNG, NULL until it is done
+    unsigned long numBytes; // The number of bytes in data
+    unsigned long delayMs; // How long the frame is shown for
+} EncodedFrame;
+
+/**
+ * A struct storing the state shared by the threads processing the frames of
+ * a multi-frame image. FreeImage's multipage bitmaps are not thread safe, so
+ * frames are decoded one at a time under the mutex.
+ */
+typedef struct {
+    FIMULTIBITMAP* pages; // The multi-frame image
+    pthread_mutex_t mutex; // Guards pages, next and failedStep
+    int next; // The next frame to take
+    int count; // The number of frames
+    Operation* operations; // The operations to perform on every frame
+    ThreadArgs* args; // The arguments of the request's thread
+    unsigned long width; // The width of the canvas, the first frame's
+    unsigned long height; // The height of the canvas
+    unsigned long loops; // How many times the animation plays, 0 forever
+    EncodedFrame* frames; // The encoded frames, in order
+    int failedStep; // FRAME_OK, FRAME_UNDECODABLE or the failed operation
+    unsigned long long peakPixelBytes; // The sum of the threads' peaks
+} FrameJob;
+
+/**
+ * A struct storing one step of the tree the operation chains of a fan-out
+ * request are merged into. Chains starting with the same steps share the
+ * nodes for them, so those steps are performed once for all of the chains.
+ */
+typedef struct {
+    Operation operation; // The step, OPERATION_END for the root and once done
+    int firstChild; // The first node continuing from this one, or -1
+    int nextSibling; // The next node continuing from the same parent, or -1
+    bool output; // Whether a chain ends here
+    unsigned char* data; // The chain's result encoded as a PNG, once done
+    unsigned long numBytes; // The number of bytes in data
+} RenditionNode;
+
+/**
+ * A struct storing the state shared by the threads producing the renditions
+ * of a fan-out request
+ */
+typedef struct {
+    int numChains; // The number of chains requested
+    Operation** chains; // The planned chains, in the order requested
+    char** locations; // The chains as requested, normalized
+    int* outputs; // The node each chain ends at
+    RenditionNode* nodes; // The tree of steps, the root first
+    int numNodes; // The number of nodes in use
+    ThreadArgs* args; // The arguments of the request's thread
+    pthread_mutex_t mutex; // Guards failedNode and peakPixelBytes
+    int failedNode; // FRAME_OK, FRAME_UNDECODABLE or the failed step's node
+    unsigned long long peakPixelBytes; // The sum of the branch threads' peaks
+    bool decodedFirst; // Whether the decoder was given every chain's first step
+} RenditionJob;
+
+/**
+ * A struct storing the arguments of a thread producing one branch of the
+ * tree of renditions
+ */
+typedef struct {
+    RenditionJob* renditions; // The renditions the branch belongs to
+    int node; // The node the branch starts at
+    FIBITMAP* image; // The image before the node's step, owned by the branch
+} RenditionBranch;
+
 /**
  * A struct to store informationr regarding the arguments passed to the signal
  * thread
@@ -126,8 +840,36 @@ typedef struct {
     sigset_t set; // The sigset for setting up the signal
     Statistics* stats; // A pointer to the struct for generating statistics
     pthread_mutex_t* statsMutex; // A mutex for modifying Statistics data
+    ServerState* server; // A pointer to the shared server state
 } SignalArgs;
 
+/**
+ * The usage of the request this thread is handling. Client threads handle one
+ * request at a time, so this is where the response builders find it.
+ */
+static __thread RequestUsage requestUsage;
+
+/**
+ * The names of the request stages, as used in /metrics and the access log
+ */
+static const char* const stageNames[NUM_STAGES] = {"request_read",
+        "request_parse", "decode", "rotate", "flip", "scale", "crop", "encode",
+        "send", "queue_wait", "total"};
+
+/**
+ * The syntax of each operation, indexed by OperationKind. Flips take a
+ * direction (HORIZONTAL or VERTICAL) rather than a number.
+ */
+static const OperationSyntax operationSyntax[NUM_OPERATION_KINDS] = {
+        {NULL, 0, 0, 0}, {ROTATE, 1, ROTATE_MIN, ROTATE_MAX},
+        {FLIP, 1, 0, 0}, {SCALE, 2, SCALE_MIN, SCALE_MAX},
+        {CROP, 4, 0, MAX_PROBE_DIMENSION}};
+
+/**
+ * The MIME types of the encoded results, indexed by their content type
+ */
+static const char* const contentTypeNames[] = {"image/png", "image/jpeg"};
+
 /*******************************DECLARATIONS***********************************/
 void signal_pipe();
 
@@ -136,6 +878,7 @@ void check_empty_string(char* arg);
 void check_out_of_bounds(int num, int bound);
 void check_boolean(bool boolean);
 int convert_to_int(char* intString, int min, int max);
+unsigned long convert_to_ulong(char* intString, unsigned long min);
 void command_line_error();
 
 void check_port(CommandParameters params);
@@ -143,16 +886,32 @@ int open_listen(CommandParameters params);
 void connection_error(CommandParameters params);
 
 void print_port_num(int fdServer, CommandParameters params);
-void process_connections(int fdServer, CommandParameters params);
+ServerState init_server_state(CommandParameters params);
+void process_connections(
+        int fdServer, CommandParameters params, ServerState* server);
 
 void* client_thread(void* arg);
-void create_signal_thread(Statistics* stats, pthread_mutex_t* statsMutex);
+bool read_request(FILE* from, FILE* to, HttpRequest* request,
+        unsigned long maxBody, bool* unread);
+bool read_request_line(FILE* from, char** method, char** address);
+HttpHeader** read_request_headers(FILE* from);
+bool read_sized_body(FILE* from, BodySpool* spool, unsigned long length);
+bool read_chunked_body(FILE* from, BodySpool* spool);
+bool spool_bytes(FILE* from, BodySpool* spool, unsigned long count);
+bool skip_bytes(FILE* from, unsigned long count);
+bool finish_spool(BodySpool* spool, HttpRequest* request);
+void handle_request(ThreadArgs* args, HttpRequest* request, FILE* to);
+void handled_signals(sigset_t* set);
+void create_signal_thread(
+        Statistics* stats, pthread_mutex_t* statsMutex, ServerState* server);
 void create_client_thread(sem_t* semaphore, int fd, CommandParameters params,
-        Statistics* stats, pthread_mutex_t* statsMutex);
+        Statistics* stats, pthread_mutex_t* statsMutex, ServerState* server,
+        struct sockaddr_in peer);
 void* signal_thread(void* arg);
-void sighup_statistics(Statistics* stats);
+void sighup_statistics(Statistics* stats, ServerState* server);
 
-bool check_initial_validity(HttpRequest request, FILE* to, ThreadArgs args);
+bool check_initial_validity(HttpRequest request, FILE* to, ThreadArgs args,
+        Operation** operations);
 
 bool valid_method(HttpRequest request);
 void invalid_method_response(FILE* to);
@@ -161,39 +920,288 @@ bool valid_get(HttpRequest request);
 void invalid_get_response(FILE* to);
 void home_page_response(FILE* to);
 
-bool valid_operation(HttpRequest request);
-void free_check_operations(char*** op, char** addresses, char*** operations);
-bool check_operation(char* name);
+Operation* compile_operations(const char* address);
+bool compile_step(const char* step, const char* end, Operation* operation);
+bool compile_value(OperationKind kind, const char* field, const char* end,
+        int* value);
 void invalid_image(ThreadArgs* args, Operation** operations,
         HttpRequest* request, FILE* to);
-bool valid_operation_value(char* intString, int min, int max);
 void invalid_operation_response(FILE* to);
 
-bool valid_image_size(HttpRequest request);
+bool valid_image_size(HttpRequest request, unsigned long maxBody);
 void invalid_size_response(FILE* to, HttpRequest request);
 
 void invalid_image_response(FILE* to);
-Operation* get_operations(HttpRequest request);
 
 bool process_operations(
         FIBITMAP** image, Operation* operations, FILE* to, ThreadArgs args);
+int apply_operations(
+        FIBITMAP** image, Operation* operations, ThreadArgs* args);
 void failed_operation_response(FILE* to, Operation op);
+FIBITMAP* crop_image(FIBITMAP* image, Operation crop);
+Region crop_region(Operation crop, unsigned long long width,
+        unsigned long long height);
+
+FIBITMAP* decode_image(const unsigned char* data, unsigned long len,
+        ImageHeader header, Operation* operations, int* decodedSteps);
+unsigned int decode_reduction(ImageHeader header, Operation scale);
+StreamStage* open_decoder(const unsigned char* data, unsigned long len,
+        ImageHeader header, Region region, unsigned int reduction);
+FIBITMAP* decode_stream(StreamStage* stream);
+StreamStage* open_png_stream(const unsigned char* data, unsigned long len,
+        Region region, unsigned int factor);
+bool png_stream_row(StreamStage* stage, unsigned char* row);
+void box_filter_row(const unsigned char* in, unsigned long long width,
+        unsigned int channels, unsigned int factor, uint64_t* sums);
+void png_read_buffer(png_structp png, png_bytep out, png_size_t length);
+void png_decode_error(png_structp png, png_const_charp message);
+void png_decode_warning(png_structp png, png_const_charp message);
+StreamStage* open_jpeg_stream(const unsigned char* data, unsigned long len,
+        Region region, unsigned int scale);
+bool jpeg_stream_row(StreamStage* stage, unsigned char* row);
+void jpeg_decode_error(j_common_ptr cinfo);
+void jpeg_decode_message(j_common_ptr cinfo);
+
+bool serve_streaming(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, ImageHeader header, const unsigned char* key,
+        InFlightJob* job, FILE* to);
+bool streamable(ImageHeader header, Operation* operations);
+unsigned long long stream_peak_memory(
+        ImageHeader header, Operation* operations);
+StreamStage* open_pipeline(const unsigned char* data, unsigned long len,
+        ImageHeader header, Operation* operations);
+StreamStage* open_stream_stage(StreamStage* source, Operation operation);
+bool stream_next_row(StreamStage* stage, unsigned char* row);
+unsigned long long stream_bytes(StreamStage* stage);
+void close_stream(StreamStage* stage);
+void mirror_row(
+        unsigned char* row, unsigned long long width, unsigned int channels);
+bool scale_stream_row(StreamStage* stage, unsigned char* row);
+unsigned int scale_window(unsigned long long from, unsigned long long to);
+bool scale_rows_first(unsigned long long fromWidth,
+        unsigned long long fromHeight, unsigned long long toWidth,
+        unsigned long long toHeight);
+bool scale_weights(
+        ScaleWeights* weights, unsigned long long from, unsigned long long to);
+void free_scale_weights(ScaleWeights* weights);
+void resample_row(const unsigned char* in, unsigned char* out,
+        ScaleWeights* columns, unsigned int channels);
+void blend_rows(const unsigned char* window, unsigned long long rowBytes,
+        ScaleWeights* rows, unsigned long long row, double* totals,
+        unsigned char* out);
+bool encode_stream(StreamStage* stream, PngSink* sink);
+void png_write_buffer(png_structp png, png_bytep data, png_size_t length);
+void png_flush_buffer(png_structp png);
+bool send_png_chunk(PngSink* sink);
+bool finish_png_chunks(PngSink* sink);
+
+bool serve_lossless(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, ImageHeader header, const unsigned char* key,
+        InFlightJob* job, FILE* to);
+unsigned char* transform_jpeg(const unsigned char* data, unsigned long len,
+        ImageHeader header, Operation* operations, unsigned long* numBytes);
+bool compose_transform(
+        Operation* operations, FREE_IMAGE_JPEG_OPERATION* transform);
+
+bool serve_frames(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, ImageHeader header, const unsigned char* key,
+        InFlightJob* job, FILE* to);
+int frame_workers(unsigned long frames);
+void* frame_thread(void* arg);
+bool process_frame(FrameJob* frames, int index);
+unsigned long frame_tag(
+        FIBITMAP* page, const char* name, unsigned long fallback);
+unsigned char* assemble_apng(FrameJob* frames, unsigned long* numBytes);
+void write_png_chunk(FILE* out, const char* type, const unsigned char* data,
+        unsigned long length);
+void write_big_endian(unsigned char* data, unsigned long value, int numBytes);
+
+bool renditions_requested(HttpRequest request);
+void serve_renditions(ThreadArgs* args, HttpRequest* request, FILE* to);
+void reject_renditions(
+        ThreadArgs* args, RenditionJob* renditions, HttpRequest* request);
+bool compile_renditions(const char* query, RenditionJob* renditions);
+unsigned long long plan_renditions(
+        RenditionJob* renditions, ImageHeader header);
+int rendition_child(RenditionJob* renditions, int parent, Operation step);
+FIBITMAP* decode_renditions(
+        RenditionJob* renditions, HttpRequest* request, ImageHeader header);
+void* rendition_thread(void* arg);
+void run_rendition_branch(
+        RenditionJob* renditions, int node, FIBITMAP* image);
+void publish_renditions(ThreadArgs* args, RenditionJob* renditions,
+        HttpRequest* request, ImageHeader header, FILE* to);
+bool rendition_matches_single(
+        ImageHeader header, Operation* operations, bool decodedFirst);
+bool decoder_first_step(ImageHeader header, Operation* operations);
+void multipart_headers_response(
+        FILE* to, unsigned long numBytes, const char* boundary);
+void free_renditions(RenditionJob* renditions);
 
 void process_success(HttpRequest* request, Operation** operations,
-        ThreadArgs* args, FIBITMAP** image, FILE* to);
-void success_response(FILE* to, unsigned char* data, unsigned long numBytes);
+        ThreadArgs* args, FIBITMAP** image, FILE* to,
+        const unsigned char* key, InFlightJob* job);
+void publish_result(ThreadArgs* args, FILE* to, const unsigned char* key,
+        InFlightJob* job, unsigned char* data, unsigned long numBytes,
+        uint32_t contentType);
+void success_response(FILE* to, unsigned char* data, unsigned long numBytes,
+        const unsigned char* key, uint32_t contentType);
+void content_headers_response(FILE* to, unsigned long numBytes,
+        const unsigned char* key, uint32_t contentType);
+void chunked_headers_response(
+        FILE* to, const unsigned char* key, uint32_t contentType);
 void end_client_thread(ThreadArgs* args, FILE* from, FILE* to);
 
 void free_operations(Operation** operations);
 void free_request(HttpRequest* request);
 
+char* normalize_operations(Operation* operations);
+int format_operation(Operation operation, char* step);
+void compute_job_key(
+        HttpRequest request, Operation* operations, unsigned char* key);
+void chain_job_key(const unsigned char* inputHash, Operation* operations,
+        unsigned char* key);
+void sha256_init(Sha256* ctx);
+void sha256_update(Sha256* ctx, const unsigned char* data, size_t len);
+void sha256_final(Sha256* ctx, unsigned char* digest);
+void sha256_transform(Sha256* ctx, const unsigned char* block);
+
+bool serve_from_cache(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, const unsigned char* key, FILE* to);
+DiskCache* open_disk_cache(CommandParameters params);
+int open_cache_file(CommandParameters params, const char* name);
+bool cache_index_valid(DiskCache* cache, uint64_t slotCount);
+void cache_rebuild_index(DiskCache* cache, uint64_t slotCount);
+bool cache_wipe(DiskCache* cache);
+CacheSlot* cache_find_slot(DiskCache* cache, const unsigned char* key);
+bool cache_send_hit(DiskCache* cache, const unsigned char* key, FILE* to,
+        bool* complete);
+void cache_insert(DiskCache* cache, const unsigned char* key,
+        const unsigned char* data, unsigned long numBytes,
+        uint32_t contentType);
+bool write_all_at(int fd, const void* data, size_t len, off_t offset);
+void cache_error(CommandParameters params);
+
+bool join_in_flight(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, const unsigned char* key, FILE* to,
+        InFlightJob** job);
+InFlightTable* create_in_flight_table();
+InFlightJob* in_flight_acquire(
+        InFlightTable* table, const unsigned char* key, bool* leader);
+void in_flight_wait(InFlightTable* table, InFlightJob* job);
+void in_flight_finish(InFlightTable* table, InFlightJob* job,
+        const unsigned char* data, unsigned long numBytes,
+        uint32_t contentType);
+void in_flight_release(InFlightTable* table, InFlightJob* job);
+
+void format_etag(const unsigned char* key, char* etag);
+char* get_header(HttpHeader** headers, const char* name);
+bool etag_matches(const char* ifNoneMatch, const char* etag);
+bool serve_not_modified(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, const unsigned char* key, FILE* to);
+void not_modified_response(FILE* to, const char* etag);
+
+bool plan_request(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, FILE* to, ImageHeader* header);
+bool within_memory_budget(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, FILE* to, ImageHeader header,
+        unsigned long long* required);
+bool probe_image_header(
+        const unsigned char* data, unsigned long len, ImageHeader* header);
+bool probe_png(
+        const unsigned char* data, unsigned long len, ImageHeader* header);
+bool png_has_transparency(const unsigned char* data, unsigned long len);
+bool probe_jpeg(
+        const unsigned char* data, unsigned long len, ImageHeader* header);
+bool probe_gif(
+        const unsigned char* data, unsigned long len, ImageHeader* header);
+unsigned long count_gif_frames(
+        const unsigned char* data, unsigned long len, unsigned long pos);
+bool probe_bmp(
+        const unsigned char* data, unsigned long len, ImageHeader* header);
+bool probe_freeimage(
+        const unsigned char* data, unsigned long len, ImageHeader* header);
+unsigned long read_big_endian(const unsigned char* data, int numBytes);
+unsigned long read_little_endian(const unsigned char* data, int numBytes);
+unsigned long long estimate_peak_memory(
+        ImageHeader header, Operation* operations);
+void rotated_dimensions(
+        int angle, unsigned long long* width, unsigned long long* height);
+void memory_budget_response(FILE* to, unsigned long long required);
+
+void plan_operations(ImageHeader header, Operation** operations);
+int commute_steps(unsigned long long width, unsigned long long height,
+        Operation first, Operation second, Operation* swapped);
+int crop_before_mirror(unsigned long long width, unsigned long long height,
+        Operation mirror, Operation crop, Operation* swapped);
+int scale_before_rotation(unsigned long long width, unsigned long long height,
+        Operation rotate, Operation scale, Operation* swapped);
+unsigned long long operation_cost(Operation operation,
+        unsigned long long* width, unsigned long long* height,
+        unsigned int bytesPerPixel);
+unsigned long long program_cost(ImageHeader header, Operation* operations);
+bool explain_requested(HttpRequest request);
+void explain_plan(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, ImageHeader header, FILE* to);
+void write_plan(FILE* text, const char* label, ImageHeader header,
+        Operation* operations);
+void explain_response(FILE* to, const char* body, size_t bodySize);
+
+MemoryAccountant* create_memory_accountant(CommandParameters params);
+bool admit_request(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, InFlightJob* job, FILE* to,
+        unsigned long long* required);
+bool reserve_memory(MemoryAccountant* memory, unsigned long long bytes);
+void release_memory(MemoryAccountant* memory, unsigned long long bytes);
+void overloaded_response(FILE* to);
+
+uint64_t now_ns();
+void record_stage(Metrics* metrics, Stage stage, uint64_t start);
+void count_metric(uint64_t* counter);
+int histogram_bucket(uint64_t value);
+uint64_t histogram_bucket_limit(int bucket);
+uint64_t histogram_quantile(Histogram* histogram, double quantile);
+void metrics_response(FILE* to, ServerState* server);
+void write_metrics(FILE* text, ServerState* server);
+void write_histogram(FILE* text, const char* stage, Histogram* histogram);
+
+uint64_t thread_cpu_ns();
+void begin_request_usage(bool enabled);
+void note_pixel_bytes(unsigned long long bytes);
+unsigned long long bitmap_bytes(FIBITMAP* bitmap);
+void write_response(FILE* to, unsigned char* message, unsigned long len);
+void write_usage_headers(FILE* to);
+
+Capture* open_capture(CommandParameters params);
+void capture_request(Capture* capture, HttpRequest* request, uint64_t start);
+
+SharedStats* open_shared_stats(int fdServer, char** name);
+void remove_shared_stats(ServerState* server);
+void* stats_publisher_thread(void* arg);
+void publish_stats(ServerState* server);
+
+AccessLog* open_access_log(CommandParameters params);
+AccessLogRing* access_log_add_ring(AccessLog* log);
+AccessLogEntry* access_log_begin(
+        AccessLogRing* ring, ThreadArgs* args, HttpRequest* request);
+void access_log_commit(AccessLogRing* ring, AccessLogEntry* entry);
+uint64_t access_log_dropped(AccessLog* log);
+void* access_log_thread(void* arg);
+void access_log_drain(AccessLog* log);
+void access_log_write(FILE* file, AccessLogEntry* entry);
+void access_log_write_string(FILE* file, const char* string);
+
 /******************************************************************************/
 
+// uqimageprotobench includes this file to time its request handling, with its
+// own main()
+#ifndef UQIMAGEPROC_NO_MAIN
 /**
  * main()
  * -------------
- *  Executes main functionality of program. Constructs signal handler for
- *  ignoring SIGPIPE
+ *  Executes main functionality of program. Blocks the signals handled by the
+ *  signal thread before any other thread is created, so that none of them
+ *  takes one, and constructs signal handler for ignoring SIGPIPE
  *
  *  int argc: the number of command line arguments
  *  char** argv: the command line arguments
@@ -203,17 +1211,23 @@ void free_request(HttpRequest* request);
 int main(int argc, char** argv)
 {
     CommandParameters params = command_line_arguments(argc, argv);
+    sigset_t handled;
+    handled_signals(&handled);
+    pthread_sigmask(SIG_BLOCK, &handled, NULL);
+    ServerState server = init_server_state(params);
     check_port(params);
     int fdServer = open_listen(params);
     print_port_num(fdServer, params);
+    server.shared = open_shared_stats(fdServer, &server.sharedName);
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
     sa.sa_handler = signal_pipe;
     sa.sa_flags = SA_RESTART;
     sigaction(SIGPIPE, &sa, 0);
-    process_connections(fdServer, params);
+    process_connections(fdServer, params, &server);
     return 0;
 }
+#endif
 
 /**
  * signal_pipe()
@@ -238,7 +1252,12 @@ void signal_pipe()
  */
 CommandParameters command_line_arguments(int argc, char** argv)
 {
-    CommandParameters params = {"0", false, 0, false};
+    CommandParameters params
+            = {"0", false, 0, false, NULL, false, DEFAULT_CACHE_DISK_BYTES,
+                    false, DEFAULT_REQUEST_BUDGET, false, 0, false,
+                    DEFAULT_ADMISSION_QUEUE, false, false, NULL, false, NULL,
+                    false, MIN_CAPTURE_SAMPLE, false, false, DEFAULT_MAX_BODY,
+                    false};
     for (int i = 1; i < argc; i++) {
         // Check if any argument is the empty string
         check_empty_string(argv[i]);
@@ -257,10 +1276,95 @@ CommandParameters command_line_arguments(int argc, char** argv)
                     argv[i + 1], MIN_CONNECTIONS, MAX_CONNECTIONS);
             params.maxGiven = true;
             i++;
+        } else if (strcmp(argv[i], CACHE_DIR) == 0) {
+            check_boolean(params.cacheDirGiven);
+            check_out_of_bounds(i + 1, argc);
+            check_empty_string(argv[i + 1]);
+            params.cacheDir = argv[i + 1];
+            params.cacheDirGiven = true;
+            i++;
+        } else if (strcmp(argv[i], CACHE_DISK_BYTES) == 0) {
+            check_boolean(params.cacheDiskBytesGiven);
+            check_out_of_bounds(i + 1, argc);
+            check_empty_string(argv[i + 1]);
+            params.cacheDiskBytes
+                    = convert_to_ulong(argv[i + 1], MIN_CACHE_DISK_BYTES);
+            params.cacheDiskBytesGiven = true;
+            i++;
+        } else if (strcmp(argv[i], REQUEST_BUDGET) == 0) {
+            check_boolean(params.requestBudgetGiven);
+            check_out_of_bounds(i + 1, argc);
+            check_empty_string(argv[i + 1]);
+            params.requestBudget
+                    = convert_to_ulong(argv[i + 1], MIN_REQUEST_BUDGET);
+            params.requestBudgetGiven = true;
+            i++;
+        } else if (strcmp(argv[i], MEMORY_BUDGET) == 0) {
+            check_boolean(params.memoryBudgetGiven);
+            check_out_of_bounds(i + 1, argc);
+            check_empty_string(argv[i + 1]);
+            params.memoryBudget
+                    = convert_to_ulong(argv[i + 1], MIN_MEMORY_BUDGET);
+            params.memoryBudgetGiven = true;
+            i++;
+        } else if (strcmp(argv[i], ADMISSION_QUEUE) == 0) {
+            check_boolean(params.admissionQueueGiven);
+            check_out_of_bounds(i + 1, argc);
+            check_empty_string(argv[i + 1]);
+            params.admissionQueue = convert_to_int(
+                    argv[i + 1], MIN_CONNECTIONS, MAX_CONNECTIONS);
+            params.admissionQueueGiven = true;
+            i++;
+        } else if (strcmp(argv[i], ACCESS_LOG) == 0) {
+            check_boolean(params.accessLogGiven);
+            check_out_of_bounds(i + 1, argc);
+            check_empty_string(argv[i + 1]);
+            params.accessLog = argv[i + 1];
+            params.accessLogGiven = true;
+            i++;
+        } else if (strcmp(argv[i], CAPTURE) == 0) {
+            check_boolean(params.captureGiven);
+            check_out_of_bounds(i + 1, argc);
+            check_empty_string(argv[i + 1]);
+            params.capture = argv[i + 1];
+            params.captureGiven = true;
+            i++;
+        } else if (strcmp(argv[i], CAPTURE_SAMPLE) == 0) {
+            check_boolean(params.captureSampleGiven);
+            check_out_of_bounds(i + 1, argc);
+            check_empty_string(argv[i + 1]);
+            params.captureSample
+                    = convert_to_ulong(argv[i + 1], MIN_CAPTURE_SAMPLE);
+            params.captureSampleGiven = true;
+            i++;
+        } else if (strcmp(argv[i], CAPTURE_BODIES) == 0) {
+            check_boolean(params.captureBodies);
+            params.captureBodies = true;
+        } else if (strcmp(argv[i], MAX_BODY) == 0) {
+            check_boolean(params.maxBodyGiven);
+            check_out_of_bounds(i + 1, argc);
+            check_empty_string(argv[i + 1]);
+            params.maxBody = convert_to_ulong(argv[i + 1], MIN_MAX_BODY);
+            params.maxBodyGiven = true;
+            i++;
+        } else if (strcmp(argv[i], NO_TIMING_HEADERS) == 0) {
+            check_boolean(params.noTimingHeaders);
+            params.noTimingHeaders = true;
         } else {
             command_line_error();
         }
     }
+    // A cache size is meaningless without somewhere to put the cache
+    if (params.cacheDiskBytesGiven && !params.cacheDirGiven) {
+        command_line_error();
+    }
+    if (params.admissionQueueGiven && !params.memoryBudgetGiven) {
+        command_line_error();
+    }
+    if ((params.captureSampleGiven || params.captureBodies)
+            && !params.captureGiven) {
+        command_line_error();
+    }
     return params;
 }
 
@@ -331,6 +1435,30 @@ int convert_to_int(char* intString, int min, int max)
     return (int)converted;
 }
 
+/**
+ * convert_to_ulong()
+ * --------------------
+ * A helper function that converts a string representation of a byte count
+ * into an unsigned long, throwing errors if it is not a number or is below
+ * the minimum
+ *
+ * char* intString: a string representation of the number to convert
+ * unsigned long min: the minimum bound for the number
+ *
+ * Returns: the converted number
+ */
+unsigned long convert_to_ulong(char* intString, unsigned long min)
+{
+    char* endPtr;
+    errno = 0;
+    unsigned long long converted = strtoull(intString, &endPtr, BASE10);
+    if ((*endPtr != '\0') || (intString[0] == '-') || (errno == ERANGE)
+            || (converted < min)) {
+        command_line_error();
+    }
+    return (unsigned long)converted;
+}
+
 /**
  * command_line_error()
  * -----------------------
@@ -339,7 +1467,13 @@ int convert_to_int(char* intString, int min, int max)
  */
 void command_line_error()
 {
-    fprintf(stderr, "Usage: uqimageproc [--port port] [--max connections]\n");
+    fprintf(stderr,
+            "Usage: uqimageproc [--port port] [--max connections] "
+            "[--cache-dir directory [--cache-disk-bytes bytes]] "
+            "[--request-budget bytes] [--memory-budget bytes "
+            "[--admission-queue length]] [--no-timing-headers] "
+            "[--access-log file] [--capture file [--capture-sample n] "
+            "[--capture-bodies]] [--max-body bytes]\n");
     exit(COMMAND_LINE_ERROR);
 }
 
@@ -453,16 +1587,59 @@ void print_port_num(int fdServer, CommandParameters params)
     }
 }
 
+/**
+ * init_server_state()
+ * ----------------------
+ *  Sets up the state shared by every client thread, opening the on-disk
+ *  result cache if one was requested and creating the in-flight job table
+ *
+ *  CommandParameters params: the struct storing information regarding command
+ *  line arguments
+ *
+ *  Returns: the initialised server state
+ */
+ServerState init_server_state(CommandParameters params)
+{
+    ServerState server;
+    server.cache = NULL;
+    server.inFlight = create_in_flight_table();
+    server.requestBudget = params.requestBudget;
+    server.maxBody = params.maxBody;
+    server.memory = NULL;
+    if (params.memoryBudgetGiven) {
+        server.memory = create_memory_accountant(params);
+    }
+    server.metrics = calloc(1, sizeof(Metrics));
+    server.timingHeaders = !params.noTimingHeaders;
+    server.accessLog = NULL;
+    server.shared = NULL;
+    server.sharedName = NULL;
+    server.capture = NULL;
+    if (params.captureGiven) {
+        server.capture = open_capture(params);
+    }
+    if (params.accessLogGiven) {
+        server.accessLog = open_access_log(params);
+    }
+    if (params.cacheDirGiven) {
+        server.cache = open_disk_cache(params);
+    }
+    return server;
+}
+
 /**
  * process_connections()
  * ------------------------
  * Processes incoming connections
  *
  * int fdServer: the fd for the listen port
+ * CommandParameters params: the command line parameters struct
+ * ServerState* server: a pointer to the shared server state
  *
  * REF: man page for pthread_mutex_unlock to learn how to use pthread_mutex_t
  */
-void process_connections(int fdServer, CommandParameters params)
+void process_connections(
+        int fdServer, CommandParameters params, ServerState* server)
 {
     int fd;
     struct sockaddr_in fromAddr;
@@ -474,7 +1651,15 @@ void process_connections(int fdServer, CommandParameters params)
     Statistics stats = {0, 0, 0, 0, 0};
     pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
     pthread_mutex_unlock(&statsMutex);
-    create_signal_thread(&stats, &statsMutex);
+    server->stats = &stats;
+    server->statsMutex = &statsMutex;
+    create_signal_thread(&stats, &statsMutex, server);
+    if (server->shared != NULL) {
+        pthread_t publisherThread;
+        pthread_create(
+                &publisherThread, NULL, stats_publisher_thread, server);
+        pthread_detach(publisherThread);
+    }
     // Repeatedly accept connections
     while (1) {
         if (params.maxGiven) {
@@ -485,34 +1670,55 @@ void process_connections(int fdServer, CommandParameters params)
         fd = accept(fdServer, (struct sockaddr*)&fromAddr, &fromAddrSize);
         if (fd < 0) {
             fprintf(stderr, "Error Accepting Connection\n");
+            remove_shared_stats(server);
             exit(1);
         }
+        PROBE3(accept, fd, fromAddr.sin_addr.s_addr, ntohs(fromAddr.sin_port));
         char hostName[NI_MAXHOST];
         getnameinfo((struct sockaddr*)&fromAddr, fromAddrSize, hostName,
                 NI_MAXHOST, NULL, 0, 0);
-        create_client_thread(&semaphore, fd, params, &stats, &statsMutex);
+        create_client_thread(&semaphore, fd, params, &stats, &statsMutex,
+                server, fromAddr);
     }
 }
 
 /**
- * create_signal_thread()
- * -------------------------
- * Creates the signal thread for handling SIGHUP
+ * handled_signals()
+ * --------------------
+ *  Fills a set with the signals the signal thread waits for: SIGHUP, and
+ *  SIGTERM and SIGINT to shut the server down
  *
- * Statistics* stats: a pointer to the statistics structure
- * pthread_mutex_t* statsMutex: a pointer to the mutex for stats
+ *  sigset_t* set: the set to fill
+ */
+void handled_signals(sigset_t* set)
+{
+    sigemptyset(set);
+    sigaddset(set, SIGHUP);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGINT);
+}
+
+/**
+ * create_signal_thread()
+ * -------------------------
+ * Creates the signal thread for handling SIGHUP, SIGTERM and SIGINT, which
+ * main() has already blocked
+ *
+ * Statistics* stats: a pointer to the statistics structure
+ * pthread_mutex_t* statsMutex: a pointer to the mutex for stats
+ * ServerState* server: a pointer to the shared server state
  *
  * REF:https://pubs.opengroup.org/onlinepubs/009604599/functions/pthread_sigmask.html
  * Used for basis of SIGHUP handling
  */
-void create_signal_thread(Statistics* stats, pthread_mutex_t* statsMutex)
+void create_signal_thread(
+        Statistics* stats, pthread_mutex_t* statsMutex, ServerState* server)
 {
     SignalArgs* arg = malloc(sizeof(SignalArgs));
     arg->stats = stats;
     arg->statsMutex = statsMutex;
-    sigemptyset(&(arg->set));
-    sigaddset(&(arg->set), SIGHUP);
-    pthread_sigmask(SIG_BLOCK, &(arg->set), NULL);
+    arg->server = server;
+    handled_signals(&(arg->set));
     pthread_t sigThread;
     pthread_create(&sigThread, NULL, signal_thread, arg);
 }
@@ -527,9 +1733,12 @@ void create_signal_thread(Statistics* stats, pthread_mutex_t* statsMutex)
  *  CommandParameters params: the command line parameters struct
  *  Statistics* stats: a pointer to the statistics structure
  *  pthread_mutex_t* statsMutex: a pointer to the mutex for stats
+ *  ServerState* server: a pointer to the shared server state
+ *  struct sockaddr_in peer: the address of the client
  */
 void create_client_thread(sem_t* semaphore, int fd, CommandParameters params,
-        Statistics* stats, pthread_mutex_t* statsMutex)
+        Statistics* stats, pthread_mutex_t* statsMutex, ServerState* server,
+        struct sockaddr_in peer)
 {
     ThreadArgs* threads = malloc(sizeof(ThreadArgs));
     threads->semaphore = semaphore;
@@ -537,6 +1746,8 @@ void create_client_thread(sem_t* semaphore, int fd, CommandParameters params,
     threads->maxGiven = params.maxGiven;
     threads->stats = stats;
     threads->statsMutex = statsMutex;
+    threads->server = server;
+    threads->peer = peer;
     pthread_t threadID;
     pthread_create(&threadID, NULL, client_thread, threads);
     pthread_detach(threadID);
@@ -562,47 +1773,505 @@ void* client_thread(void* arg)
     int fd2 = dup(args.fd);
     FILE* from = fdopen(args.fd, "r");
     FILE* to = fdopen(fd2, "w");
+    Metrics* metrics = args.server->metrics;
+    AccessLogRing* ring = NULL;
+    if (args.server->accessLog != NULL) {
+        ring = access_log_add_ring(args.server->accessLog);
+    }
     while (1) {
-        HttpRequest request;
-        if (get_HTTP_request(from, &request.method, &request.address,
-                    &request.headers, &request.body, &request.len)
-                == 0) {
+        // Wait for the first byte of the next request, so that time spent
+        // idle between requests is not counted as time reading one
+        int next = fgetc(from);
+        if (next == EOF) {
             break;
         }
-        if (!check_initial_validity(request, to, args)) {
-            free_request(&request);
-            fflush(from);
-            continue;
-        }
-        // Initial checks passed
-        Operation* operations = get_operations(request);
-        FIBITMAP* image = fi_load_image_from_buffer(request.body, request.len);
-        if (image == NULL) {
-            invalid_image(&args, &operations, &request, to);
-            fflush(from);
-            continue;
+        ungetc(next, from);
+        begin_request_usage(args.server->timingHeaders);
+        uint64_t start = now_ns();
+        HttpRequest request;
+        bool unread = false;
+        if (!read_request(
+                    from, to, &request, args.server->maxBody, &unread)) {
+            break;
         }
-        if (!process_operations(&image, operations, to, args)) {
-            free_operations(&operations);
-            free_request(&request);
-            if (image != NULL) {
-                FreeImage_Unload(image);
-            }
-            fflush(from);
-            continue;
+        record_stage(metrics, STAGE_REQUEST_READ, start);
+        capture_request(args.server->capture, &request, start);
+        AccessLogEntry* entry = access_log_begin(ring, &args, &request);
+        __atomic_fetch_add(&metrics->inFlight, 1, __ATOMIC_RELAXED);
+        handle_request(&args, &request, to);
+        __atomic_fetch_sub(&metrics->inFlight, 1, __ATOMIC_RELAXED);
+        record_stage(metrics, STAGE_TOTAL, start);
+        PROBE3(response_sent, requestUsage.status, requestUsage.bytesOut,
+                requestUsage.cacheOutcome);
+        access_log_commit(ring, entry);
+        if (unread) {
+            // The body is still on its way, so the connection can not be
+            // read past it; finish sending and let the client see it close
+            fflush(to);
+            shutdown(fileno(to), SHUT_WR);
+            break;
         }
-        // Success
-        process_success(&request, &operations, &args, &image, to);
         fflush(from);
     }
+    if (ring != NULL) {
+        __atomic_store_n(&ring->retired, true, __ATOMIC_RELEASE);
+    }
     end_client_thread(&args, from, to);
     return NULL;
 }
 
+/**
+ * read_request()
+ * -----------------
+ *  Reads the next HTTP/1.1 request from a client. Bodies may be sent with a
+ *  Content-Length or chunked. Small bodies are read onto the heap, larger
+ *  ones are spooled into an anonymous memory file that is mapped for the
+ *  decoder, and bodies over the limit are read and dropped so the request
+ *  can still be answered. A client that asked whether to send a body over
+ *  the limit (Expect: 100-continue) is not told to, and its body is left
+ *  unread, so that it can be refused at once.
+ *
+ *  FILE* from: the fd for reading the request from
+ *  FILE* to: the fd for sending an interim 100 Continue to
+ *  HttpRequest* request: where to store the request, freed with
+ *  free_request()
+ *  unsigned long maxBody: the most bytes of body to keep
+ *  bool* unread: set to true if the body was left unread, in which case the
+ *  connection must be closed once the request is answered
+ *
+ *  Returns: true if a request was read, false if the connection closed or
+ *  the request was malformed
+ */
+bool read_request(FILE* from, FILE* to, HttpRequest* request,
+        unsigned long maxBody, bool* unread)
+{
+    if (!read_request_line(from, &request->method, &request->address)) {
+        return false;
+    }
+    request->headers = read_request_headers(from);
+    BodySpool spool = {NULL, 0, 0, -1, maxBody, false};
+    bool read = request->headers != NULL;
+    const char* encoding = get_header(request->headers, "Transfer-Encoding");
+    const char* length = get_header(request->headers, "Content-Length");
+    const char* expect = get_header(request->headers, "Expect");
+    bool chunked = encoding != NULL && strcasecmp(encoding, "chunked") == 0;
+    unsigned long declared = 0;
+    if (!chunked && length != NULL) {
+        char* end;
+        declared = strtoul(length, &end, BASE10);
+        read = read && end != length && *end == '\0';
+    }
+    if (read && expect != NULL && strcasecmp(expect, "100-continue") == 0) {
+        if (declared > maxBody) {
+            spool.dropped = true;
+            spool.len = declared;
+            *unread = true;
+        } else {
+            fputs(HTTP_VERSION " 100 Continue\r\n\r\n", to);
+            fflush(to);
+        }
+    }
+    // Other transfer codings are not supported
+    read = read && (encoding == NULL || chunked)
+            && (*unread
+                    || (chunked ? read_chunked_body(from, &spool)
+                                : read_sized_body(from, &spool, declared)))
+            && finish_spool(&spool, request);
+    if (!read) {
+        free(spool.data);
+        if (spool.fd >= 0) {
+            close(spool.fd);
+        }
+        free(request->method);
+        free(request->address);
+        if (request->headers != NULL) {
+            free_array_of_headers(request->headers);
+        }
+    }
+    return read;
+}
+
+/**
+ * read_request_line()
+ * ----------------------
+ *  Reads the first line of a request, which must be an HTTP/1.1 one
+ *
+ *  FILE* from: the fd for reading the request from
+ *  char** method: where to store the method
+ *  char** address: where to store the address
+ *
+ *  Returns: true if the line was read, false otherwise
+ */
+bool read_request_line(FILE* from, char** method, char** address)
+{
+    char* line = NULL;
+    size_t size = 0;
+    if (getline(&line, &size, from) < 0) {
+        free(line);
+        return false;
+    }
+    line[strcspn(line, "\r\n")] = '\0';
+    char* first = strchr(line, ' ');
+    char* last = strrchr(line, ' ');
+    if (first == NULL || first == last || first == line
+            || strcmp(last + 1, HTTP_VERSION) != 0) {
+        free(line);
+        return false;
+    }
+    *method = strndup(line, first - line);
+    *address = strndup(first + 1, last - first - 1);
+    free(line);
+    return true;
+}
+
+/**
+ * read_request_headers()
+ * -------------------------
+ *  Reads the headers of a request, up to the empty line that ends them
+ *
+ *  FILE* from: the fd for reading the request from
+ *
+ *  Returns: the NULL terminated array of headers, or NULL if they were
+ *  malformed or the connection closed
+ */
+HttpHeader** read_request_headers(FILE* from)
+{
+    int numHeaders = 0;
+    HttpHeader** headers = malloc(sizeof(HttpHeader*));
+    headers[0] = NULL;
+    char* line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, from) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            free(line);
+            return headers;
+        }
+        char* colon = strchr(line, ':');
+        if (colon == NULL || colon == line) {
+            break;
+        }
+        // Surrounding whitespace is not part of the value
+        char* value = colon + 1 + strspn(colon + 1, " \t");
+        size_t valueLength = strlen(value);
+        while (valueLength > 0
+                && (value[valueLength - 1] == ' '
+                        || value[valueLength - 1] == '\t')) {
+            valueLength--;
+        }
+        HttpHeader* header = malloc(sizeof(HttpHeader));
+        header->name = strndup(line, colon - line);
+        header->value = strndup(value, valueLength);
+        headers = realloc(headers, (numHeaders + 2) * sizeof(HttpHeader*));
+        headers[numHeaders++] = header;
+        headers[numHeaders] = NULL;
+    }
+    free(line);
+    free_array_of_headers(headers);
+    return NULL;
+}
+
+/**
+ * read_sized_body()
+ * --------------------
+ *  Reads a body whose length was given by its Content-Length. Bodies too
+ *  large for the heap are read straight into a mapped memory file.
+ *
+ *  FILE* from: the fd for reading the request from
+ *  BodySpool* spool: the spool to read the body into
+ *  unsigned long length: the length of the body
+ *
+ *  Returns: true if the whole body was read, false otherwise
+ */
+bool read_sized_body(FILE* from, BodySpool* spool, unsigned long length)
+{
+    if (length > spool->limit) {
+        spool->dropped = true;
+        spool->len = length;
+        return skip_bytes(from, length);
+    }
+    if (length <= SPOOL_THRESHOLD) {
+        spool->data = malloc(length + 1);
+        spool->len = length;
+        return fread(spool->data, sizeof(unsigned char), length, from)
+                == length;
+    }
+    spool->fd = memfd_create("uqimageproc-body", MFD_CLOEXEC);
+    if (spool->fd < 0 || ftruncate(spool->fd, length) < 0) {
+        return false;
+    }
+    void* map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+            spool->fd, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    size_t numRead = fread(map, sizeof(unsigned char), length, from);
+    munmap(map, length);
+    spool->len = numRead;
+    return numRead == length;
+}
+
+/**
+ * read_chunked_body()
+ * ----------------------
+ *  Reads a chunked body, spooling each chunk as it arrives, then skips any
+ *  trailers
+ *
+ *  FILE* from: the fd for reading the request from
+ *  BodySpool* spool: the spool to read the body into
+ *
+ *  Returns: true if the whole body was read, false if it was malformed or
+ *  the connection closed
+ */
+bool read_chunked_body(FILE* from, BodySpool* spool)
+{
+    char* line = NULL;
+    size_t size = 0;
+    bool read = false;
+    while (getline(&line, &size, from) > 0) {
+        char* end;
+        unsigned long chunk = strtoul(line, &end, HEX_BASE);
+        if (end == line) {
+            break;
+        }
+        if (chunk == 0) {
+            while (getline(&line, &size, from) > 0
+                    && line[strspn(line, "\r\n")] != '\0') {
+            }
+            read = !ferror(from) && !feof(from);
+            break;
+        }
+        if (!spool_bytes(from, spool, chunk)
+                || getline(&line, &size, from) < 0
+                || line[strspn(line, "\r\n")] != '\0') {
+            break;
+        }
+    }
+    free(line);
+    return read;
+}
+
+/**
+ * spool_bytes()
+ * ----------------
+ *  Appends bytes read from a connection to a spool. Once the spool outgrows
+ *  the heap it moves into a memory file, and once it passes the limit the
+ *  bytes are dropped and only counted.
+ *
+ *  FILE* from: the fd to read the bytes from
+ *  BodySpool* spool: the spool to append to
+ *  unsigned long count: the number of bytes
+ *
+ *  Returns: true if all of the bytes were read, false otherwise
+ */
+bool spool_bytes(FILE* from, BodySpool* spool, unsigned long count)
+{
+    if (spool->dropped || count > spool->limit - spool->len) {
+        spool->dropped = true;
+        spool->len += count;
+        return skip_bytes(from, count);
+    }
+    if (spool->fd < 0 && spool->len + count > SPOOL_THRESHOLD) {
+        spool->fd = memfd_create("uqimageproc-body", MFD_CLOEXEC);
+        if (spool->fd < 0
+                || write(spool->fd, spool->data, spool->len)
+                        != (ssize_t)spool->len) {
+            return false;
+        }
+        free(spool->data);
+        spool->data = NULL;
+    }
+    if (spool->fd < 0) {
+        if (spool->len + count > spool->capacity) {
+            spool->capacity = spool->len + count > 2 * spool->capacity
+                    ? spool->len + count
+                    : 2 * spool->capacity;
+            spool->data = realloc(spool->data, spool->capacity + 1);
+        }
+        size_t numRead = fread(
+                spool->data + spool->len, sizeof(unsigned char), count, from);
+        spool->len += numRead;
+        return numRead == count;
+    }
+    unsigned char buffer[SPOOL_BUFFER_SIZE];
+    while (count > 0) {
+        size_t numRead = fread(buffer, sizeof(unsigned char),
+                count < SPOOL_BUFFER_SIZE ? count : SPOOL_BUFFER_SIZE, from);
+        if (numRead == 0
+                || write(spool->fd, buffer, numRead) != (ssize_t)numRead) {
+            return false;
+        }
+        spool->len += numRead;
+        count -= numRead;
+    }
+    return true;
+}
+
+/**
+ * skip_bytes()
+ * ---------------
+ *  Reads and drops bytes from a connection
+ *
+ *  FILE* from: the fd to read the bytes from
+ *  unsigned long count: the number of bytes
+ *
+ *  Returns: true if all of the bytes were read, false otherwise
+ */
+bool skip_bytes(FILE* from, unsigned long count)
+{
+    unsigned char buffer[SPOOL_BUFFER_SIZE];
+    while (count > 0) {
+        size_t numRead = fread(buffer, sizeof(unsigned char),
+                count < SPOOL_BUFFER_SIZE ? count : SPOOL_BUFFER_SIZE, from);
+        if (numRead == 0) {
+            return false;
+        }
+        count -= numRead;
+    }
+    return true;
+}
+
+/**
+ * finish_spool()
+ * -----------------
+ *  Hands a spooled body to a request. A body in a memory file is mapped
+ *  read-only, so the decoder reads it where it lies. A dropped body leaves
+ *  the request with only its length.
+ *
+ *  BodySpool* spool: the spool holding the body
+ *  HttpRequest* request: the request to give the body to
+ *
+ *  Returns: true if the body was handed over, false if it could not be
+ *  mapped
+ */
+bool finish_spool(BodySpool* spool, HttpRequest* request)
+{
+    request->len = spool->len;
+    request->mapped = 0;
+    if (spool->dropped) {
+        free(spool->data);
+        spool->data = NULL;
+        if (spool->fd >= 0) {
+            close(spool->fd);
+            spool->fd = -1;
+        }
+        request->body = NULL;
+        return true;
+    }
+    if (spool->fd < 0) {
+        request->body = spool->data != NULL ? spool->data : malloc(1);
+        return true;
+    }
+    void* map = mmap(NULL, spool->len, PROT_READ, MAP_SHARED, spool->fd, 0);
+    close(spool->fd);
+    spool->fd = -1;
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    request->body = map;
+    request->mapped = spool->len;
+    return true;
+}
+
+/**
+ * handle_request()
+ * -------------------
+ *  Validates a request and produces its response: from a 304, the cache or
+ *  an identical in-flight job if possible, then by transforming a JPEG
+ *  losslessly if the operations allow it, otherwise by decoding the image,
+ *  performing the operations and encoding the result (frame by frame for
+ *  animations). Fan-out requests are handed to serve_renditions(). Frees the
+ *  request.
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  HttpRequest* request: a pointer to the HTTP request
+ *  FILE* to: the file descriptor for sending the response through to
+ */
+void handle_request(ThreadArgs* args, HttpRequest* request, FILE* to)
+{
+    Metrics* metrics = args->server->metrics;
+    uint64_t start = now_ns();
+    if (renditions_requested(*request)) {
+        serve_renditions(args, request, to);
+        return;
+    }
+    Operation* operations;
+    if (!check_initial_validity(*request, to, *args, &operations)) {
+        free_request(request);
+        return;
+    }
+    // Initial checks passed
+    ImageHeader header;
+    if (!plan_request(args, request, &operations, to, &header)) {
+        return;
+    }
+    if (explain_requested(*request)) {
+        explain_plan(args, request, &operations, header, to);
+        return;
+    }
+    unsigned long long required;
+    if (!within_memory_budget(
+                args, request, &operations, to, header, &required)) {
+        return;
+    }
+    unsigned char key[SHA256_BYTES];
+    compute_job_key(*request, operations, key);
+    record_stage(metrics, STAGE_REQUEST_PARSE, start);
+    PROBE2(request_parsed, request->address, request->len);
+    InFlightJob* job;
+    if (serve_not_modified(args, request, &operations, key, to)
+            || serve_from_cache(args, request, &operations, key, to)
+            || join_in_flight(args, request, &operations, key, to, &job)
+            || !admit_request(
+                    args, request, &operations, job, to, &required)) {
+        return;
+    }
+    requestUsage.cacheOutcome = CACHE_MISS;
+    if (serve_lossless(args, request, &operations, header, key, job, to)
+            || serve_streaming(args, request, &operations, header, key, job, to)
+            || serve_frames(args, request, &operations, header, key, job, to)) {
+        release_memory(args->server->memory, required);
+        return;
+    }
+    start = now_ns();
+    PROBE1(decode_start, request->len);
+    int decodedSteps;
+    FIBITMAP* image = decode_image(
+            request->body, request->len, header, operations, &decodedSteps);
+    PROBE1(decode_end, image);
+    record_stage(metrics, STAGE_DECODE, start);
+    note_pixel_bytes(bitmap_bytes(image));
+    if (image == NULL) {
+        release_memory(args->server->memory, required);
+        in_flight_finish(args->server->inFlight, job, NULL, 0, PNG_CONTENT);
+        invalid_image(args, &operations, request, to);
+        return;
+    }
+    pthread_mutex_lock(args->statsMutex);
+    args->stats->operations += decodedSteps;
+    pthread_mutex_unlock(args->statsMutex);
+    if (!process_operations(
+                &image, operations + decodedSteps, to, *args)) {
+        release_memory(args->server->memory, required);
+        in_flight_finish(args->server->inFlight, job, NULL, 0, PNG_CONTENT);
+        free_operations(&operations);
+        free_request(request);
+        if (image != NULL) {
+            FreeImage_Unload(image);
+        }
+        return;
+    }
+    // Success
+    process_success(request, &operations, args, &image, to, key, job);
+    release_memory(args->server->memory, required);
+}
+
 /**
  * signal_thread()
  * -----------------
- *  The thread for dealing with SIGHUP signals and processing statistics
+ *  The thread for dealing with SIGHUP signals and processing statistics. On
+ *  SIGTERM or SIGINT, it removes the shared memory statistics segment and
+ *  exits the server.
  *
  *  void* arg: a void pointer to the data for the thread
  *
@@ -617,8 +2286,11 @@ void* signal_thread(void* arg)
         sigwait(&(args.set), &sig);
         if (sig == SIGHUP) {
             pthread_mutex_lock(args.statsMutex);
-            sighup_statistics(args.stats);
+            sighup_statistics(args.stats, args.server);
             pthread_mutex_unlock(args.statsMutex);
+        } else if (sig == SIGTERM || sig == SIGINT) {
+            remove_shared_stats(args.server);
+            exit(0);
         }
     }
     return NULL;
@@ -627,11 +2299,13 @@ void* signal_thread(void* arg)
 /**
  * sighup_statistics()
  * ---------------------
- *  Prints all the statistics to stderr
+ *  Prints all the statistics to stderr, including the memory reservations if
+ *  a global memory budget is in force
  *
  *  Statistics* stats: a pointer to the Statistics structure
+ *  ServerState* server: a pointer to the shared server state
  */
-void sighup_statistics(Statistics* stats)
+void sighup_statistics(Statistics* stats, ServerState* server)
 {
     fprintf(stderr, "Connected clients: %u\n", stats->connected);
     fprintf(stderr, "Serviced clients: %u\n", stats->serviced);
@@ -639,6 +2313,27 @@ void sighup_statistics(Statistics* stats)
             stats->success);
     fprintf(stderr, "Unsuccessful HTTP requests: %u\n", stats->unSuccess);
     fprintf(stderr, "Operations on images completed: %u\n", stats->operations);
+    if (server->memory != NULL) {
+        MemoryAccountant* memory = server->memory;
+        pthread_mutex_lock(&memory->mutex);
+        fprintf(stderr, "Reserved image memory: %llu of %llu bytes\n",
+                memory->reserved, memory->budget);
+        fprintf(stderr, "Requests holding reservations: %u\n",
+                memory->reservations);
+        fprintf(stderr, "Requests queued for memory: %u\n", memory->waiting);
+        fprintf(stderr, "Requests shed: %u\n", memory->shed);
+        pthread_mutex_unlock(&memory->mutex);
+    }
+    if (server->capture != NULL) {
+        fprintf(stderr, "Requests captured: %" PRIu64 "\n",
+                __atomic_load_n(&server->capture->captured, __ATOMIC_RELAXED));
+        fprintf(stderr, "Requests that failed to capture: %" PRIu64 "\n",
+                __atomic_load_n(&server->capture->failed, __ATOMIC_RELAXED));
+    }
+    if (server->accessLog != NULL) {
+        fprintf(stderr, "Access log entries dropped: %" PRIu64 "\n",
+                access_log_dropped(server->accessLog));
+    }
 }
 
 /**
@@ -651,16 +2346,18 @@ void sighup_statistics(Statistics* stats)
  *  4. Valid Image Size
  *
  *  If any of these fail, creates and sends the appropriate HTTP response, and
- *  returns false.
+ *  returns false. Otherwise the operations are compiled into a program.
  *
  *  HttpRequest request: the request to check
  *  FILE* to: the fd for sending to the client
  *  ThreadArgs args: the thread arguments
+ *  Operation** operations: set to the compiled operation program on success
  *
  *  Returns: true if no errors, false if an error occured
  *
  */
-bool check_initial_validity(HttpRequest request, FILE* to, ThreadArgs args)
+bool check_initial_validity(HttpRequest request, FILE* to, ThreadArgs args,
+        Operation** operations)
 {
     if (!valid_method(request)) {
         invalid_method_response(to);
@@ -677,20 +2374,26 @@ bool check_initial_validity(HttpRequest request, FILE* to, ThreadArgs args)
             pthread_mutex_unlock(args.statsMutex);
             return false;
         }
-        home_page_response(to);
+        if (strcmp(request.address, METRICS_PATH) == 0) {
+            metrics_response(to, args.server);
+        } else {
+            home_page_response(to);
+        }
         pthread_mutex_lock(args.statsMutex);
         args.stats->success++;
         pthread_mutex_unlock(args.statsMutex);
         return false;
     }
-    if (!valid_operation(request)) {
+    *operations = compile_operations(request.address);
+    if (*operations == NULL) {
         invalid_operation_response(to);
         pthread_mutex_lock(args.statsMutex);
         args.stats->unSuccess++;
         pthread_mutex_unlock(args.statsMutex);
         return false;
     }
-    if (!valid_image_size(request)) {
+    if (!valid_image_size(request, args.server->maxBody)) {
+        free_operations(operations);
         invalid_size_response(to, request);
         pthread_mutex_lock(args.statsMutex);
         args.stats->unSuccess++;
@@ -753,8 +2456,7 @@ void invalid_method_response(FILE* to)
     unsigned char* message = construct_HTTP_response(response.status,
             response.statusExplanation, response.headers, response.body,
             response.bodySize, &response.len);
-    fwrite(message, sizeof(unsigned char), response.len, to);
-    fflush(to);
+    write_response(to, message, response.len);
     free(response.headers[1]->value);
     for (int i = 0; i < numHeaders; i++) {
         free(response.headers[i]);
@@ -766,7 +2468,7 @@ void invalid_method_response(FILE* to)
 /**
  * valid_get()
  * --------------
- *  Checks if the GET request is valid
+ *  Checks if the GET request is valid, i.e. for the home page or metrics
  *
  *  HttpRequest: the request
  *
@@ -774,7 +2476,8 @@ void invalid_method_response(FILE* to)
  */
 bool valid_get(HttpRequest request)
 {
-    if (strcmp(request.address, "/") == 0) {
+    if (strcmp(request.address, "/") == 0
+            || strcmp(request.address, METRICS_PATH) == 0) {
         return true;
     }
     return false;
@@ -813,8 +2516,7 @@ void invalid_get_response(FILE* to)
     unsigned char* message = construct_HTTP_response(response.status,
             response.statusExplanation, response.headers, response.body,
             response.bodySize, &response.len);
-    fwrite(message, sizeof(unsigned char), response.len, to);
-    fflush(to);
+    write_response(to, message, response.len);
     free(response.headers[1]->value);
     for (int i = 0; i < numHeaders; i++) {
         free(response.headers[i]);
@@ -865,8 +2567,7 @@ void home_page_response(FILE* to)
     unsigned char* message = construct_HTTP_response(response.status,
             response.statusExplanation, response.headers, response.body,
             response.bodySize, &response.len);
-    fwrite(message, sizeof(unsigned char), response.len, to);
-    fflush(to);
+    write_response(to, message, response.len);
     free(buffer);
     free(response.headers[1]->value);
     for (int i = 0; i < numHeaders; i++) {
@@ -877,124 +2578,129 @@ void home_page_response(FILE* to)
 }
 
 /**
- * valid_operation()
- * --------------------
- *  Check if the supplied operation list is valid
+ * compile_operations()
+ * -----------------------
+ *  Parses and validates the operations in a request's address in a single
+ *  pass, compiling them into a program of fixed-size steps. Each step is
+ *  written /name,value,... after the first '/'.
  *
- *  HttpRequest request: the request
+ *  const char* address: the request's address
  *
- *  Returns: true if valid, false if not
+ *  Returns: the malloc'd program ending with an OPERATION_END step, or NULL
+ *  if any operation is invalid
  */
-bool valid_operation(HttpRequest request)
+Operation* compile_operations(const char* address)
 {
-    char* addresses = strdup(request.address);
-    char** operations = split_by_char(addresses, '/', 0);
-    int i = 1;
-    while (operations[i] != NULL) {
-        char** op = split_by_char(operations[i], ',', 0);
-        // Check it is a supplied operation
-        if (!check_operation(op[0])) {
-            free_check_operations(&op, &addresses, &operations);
-            return false;
+    // Every step starts with a '/', so counting them bounds the program size
+    int maxSteps = 0;
+    for (const char* c = address; *c != '\0'; c++) {
+        maxSteps += *c == '/';
+    }
+    Operation* operations = malloc((maxSteps + 1) * sizeof(Operation));
+    int numSteps = 0;
+    const char* step = strchr(address, '/');
+    while (step != NULL) {
+        const char* end = ++step;
+        while (*end != '\0' && *end != '/') {
+            end++;
         }
-        if (strcmp(op[0], ROTATE) == 0) {
-            if (((op[1] == NULL)
-                        || (!valid_operation_value(
-                                op[1], ROTATE_MIN, ROTATE_MAX)))
-                    || (op[2] != NULL)) {
-                free_check_operations(&op, &addresses, &operations);
-                return false;
-            }
-        } else if (strcmp(op[0], FLIP) == 0) {
-            if ((op[1] == NULL)
-                    || ((strcmp(op[1], VERTICAL) != 0)
-                            && (strcmp(op[1], HORIZONTAL) != 0))
-                    || (op[2] != NULL)) {
-                free_check_operations(&op, &addresses, &operations);
-                return false;
-            }
-        } else if (strcmp(op[0], SCALE) == 0) {
-            if ((op[1] == NULL)
-                    || !valid_operation_value(op[1], SCALE_MIN, SCALE_MAX)) {
-                free_check_operations(&op, &addresses, &operations);
-                return false;
-            }
-            if ((op[2] == NULL)
-                    || !valid_operation_value(op[2], SCALE_MIN, SCALE_MAX)) {
-                free_check_operations(&op, &addresses, &operations);
-                return false;
-            }
-            if (op[LAST_SCALE_ARGUMENT] != NULL) {
-                free_check_operations(&op, &addresses, &operations);
-                return false;
-            }
+        if (!compile_step(step, end, &operations[numSteps++])) {
+            free(operations);
+            return NULL;
         }
-        free(op);
-        i++;
+        step = *end == '/' ? end : NULL;
     }
-    free(addresses);
-    free(operations);
-    return true;
-}
-
-/**
- * free_check_operations()
- * -------------------------
- *  Frees the memory associated with the variables needed in checking
- *  operations
- *
- *  char*** op: a pointer to the array of values of the operation
- *  char** addresses: a pointer to the string representing the address
- *  char*** operations: a pointer to the array of operations
- */
-void free_check_operations(char*** op, char** addresses, char*** operations)
-{
-    free(*op);
-    free(*addresses);
-    free(*operations);
+    operations[numSteps] = (Operation){OPERATION_END, 0, 0, 0, 0};
+    return operations;
 }
 
 /**
- * check_operation()
- * -------------------
- *  A helper function to check if an operation given is one of the
- *  available ones
+ * compile_step()
+ * -----------------
+ *  Compiles one step of an address: a known operation name followed by
+ *  exactly as many valid values as the operation takes
  *
- *  char* name: operation name
+ *  const char* step: the start of the step, after its '/'
+ *  const char* end: the end of the step
+ *  Operation* operation: the step of the program to fill in
  *
- *  Returns: true if valid, false else
+ *  Returns: true if the step is valid, false else
  */
-bool check_operation(char* name)
+bool compile_step(const char* step, const char* end, Operation* operation)
 {
-    if ((strcmp(name, ROTATE) == 0) || (strcmp(name, FLIP) == 0)
-            || (strcmp(name, SCALE) == 0)) {
-        return true;
+    const char* field = step;
+    while (field < end && *field != ',') {
+        field++;
     }
-    return false;
+    size_t nameLength = field - step;
+    OperationKind kind = OPERATION_ROTATE;
+    while (kind < NUM_OPERATION_KINDS
+            && (strlen(operationSyntax[kind].name) != nameLength
+                    || memcmp(operationSyntax[kind].name, step, nameLength)
+                            != 0)) {
+        kind++;
+    }
+    if (kind == NUM_OPERATION_KINDS) {
+        return false;
+    }
+    int values[MAX_OPERATION_VALUES] = {0};
+    for (int i = 0; i < operationSyntax[kind].numValues; i++) {
+        if (field == end) {
+            return false;
+        }
+        const char* fieldEnd = ++field;
+        while (fieldEnd < end && *fieldEnd != ',') {
+            fieldEnd++;
+        }
+        if (!compile_value(kind, field, fieldEnd, &values[i])) {
+            return false;
+        }
+        field = fieldEnd;
+    }
+    // A crop's offsets may be 0, but not its size
+    if (field != end
+            || (kind == OPERATION_CROP && (values[2] == 0 || values[3] == 0))) {
+        return false;
+    }
+    *operation = (Operation){kind, values[0], values[1], values[2], values[3]};
+    return true;
 }
 
 /**
- * valid_operation_value()
- * --------------------------
- *  Checks if the specified value is valid, i.e. an integer and within
- *  the bounds
+ * compile_value()
+ * ------------------
+ *  Checks one value of an operation is valid, i.e. an integer within the
+ *  operation's bounds or, for a flip, a direction, and converts it
  *
- *  char* intString: the integer as a string
- *  int min: the minimum bound
- *  int max: the maxmimum bound
+ *  OperationKind kind: the operation the value belongs to
+ *  const char* field: the start of the value
+ *  const char* end: the end of the value
+ *  int* value: set to the converted value
  *
  *  Returns: true if its valid, false else
  */
-bool valid_operation_value(char* intString, int min, int max)
+bool compile_value(OperationKind kind, const char* field, const char* end,
+        int* value)
 {
-    if ((intString == NULL)) {
-        return false;
+    if (kind == OPERATION_FLIP) {
+        if (end - field == 1 && *field == *HORIZONTAL) {
+            *value = FLIP_HORIZONTAL;
+        } else if (end - field == 1 && *field == *VERTICAL) {
+            *value = FLIP_VERTICAL;
+        } else {
+            return false;
+        }
+        return true;
     }
+    // Every value is followed by ',', '/' or the end of the address, none of
+    // which strtol() reads past
     char* endPtr;
-    long int converted = strtol(intString, &endPtr, BASE10);
-    if ((*endPtr != '\0') || (converted < min) || (converted > max)) {
+    long int converted = strtol(field, &endPtr, BASE10);
+    if ((endPtr != end) || (converted < operationSyntax[kind].min)
+            || (converted > operationSyntax[kind].max)) {
         return false;
     }
+    *value = (int)converted;
     return true;
 }
 
@@ -1031,8 +2737,7 @@ void invalid_operation_response(FILE* to)
     unsigned char* message = construct_HTTP_response(response.status,
             response.statusExplanation, response.headers, response.body,
             response.bodySize, &response.len);
-    fwrite(message, sizeof(unsigned char), response.len, to);
-    fflush(to);
+    write_response(to, message, response.len);
     free(response.headers[1]->value);
     for (int i = 0; i < numHeaders; i++) {
         free(response.headers[i]);
@@ -1044,15 +2749,17 @@ void invalid_operation_response(FILE* to)
 /**
  * valid_image_size()
  * ---------------------
- *  Check if an input image is less than 8Mib, the maxmimum
+ *  Check if an input image is within the body limit (8MiB unless --max-body
+ *  was given)
  *
  *  HttpRequest request: the request to check
+ *  unsigned long maxBody: the largest body accepted
  *
- *  Returns: true if smaller than 8Mib, false otherwise
+ *  Returns: true if within the limit, false otherwise
  */
-bool valid_image_size(HttpRequest request)
+bool valid_image_size(HttpRequest request, unsigned long maxBody)
 {
-    if (request.len > EIGHT_MIB) {
+    if (request.len > maxBody) {
         return false;
     }
     return true;
@@ -1097,8 +2804,7 @@ void invalid_size_response(FILE* to, HttpRequest request)
     unsigned char* message = construct_HTTP_response(response.status,
             response.statusExplanation, response.headers, response.body,
             response.bodySize, &response.len);
-    fwrite(message, sizeof(unsigned char), response.len, to);
-    fflush(to);
+    write_response(to, message, response.len);
     free(response.headers[1]->value);
     free((char*)response.body);
     for (int i = 0; i < numHeaders; i++) {
@@ -1140,8 +2846,7 @@ void invalid_image_response(FILE* to)
     unsigned char* message = construct_HTTP_response(response.status,
             response.statusExplanation, response.headers, response.body,
             response.bodySize, &response.len);
-    fwrite(message, sizeof(unsigned char), response.len, to);
-    fflush(to);
+    write_response(to, message, response.len);
     free(response.headers[1]->value);
     for (int i = 0; i < numHeaders; i++) {
         free(response.headers[i]);
@@ -1150,52 +2855,6 @@ void invalid_image_response(FILE* to)
     free(message);
 }
 
-/**
- * get_operations()
- * ------------------
- *  Only runs once this has been confirmed to be a valid set of operations.
- *  Gets all operations from the HTTP request and stores them in an array
- *  of Operation structs.
- *
- *  HttpRequest request: the HTTP request to process the operations from
- */
-Operation* get_operations(HttpRequest request)
-{
-    Operation* operations = malloc(sizeof(Operation));
-    char** addresses = split_by_char(request.address, '/', 0);
-    int i = 0;
-    while (addresses[i + 1] != NULL) {
-        char** op = split_by_char(addresses[i + 1], ',', 0);
-        operations = realloc(operations, sizeof(Operation) * (i + 1));
-        if (strcmp(op[0], ROTATE) == 0) {
-            operations[i].operation = strdup(ROTATE);
-            operations[i].value1
-                    = convert_to_int(op[1], ROTATE_MIN, ROTATE_MAX);
-            operations[i].value2 = 0;
-            operations[i].direction = NULL;
-        } else if (strcmp(op[0], FLIP) == 0) {
-            operations[i].operation = strdup(FLIP);
-            operations[i].value1 = 0;
-            operations[i].value2 = 0;
-            operations[i].direction = strdup(op[1]);
-        } else if (strcmp(op[0], SCALE) == 0) {
-            operations[i].operation = strdup(SCALE);
-            operations[i].value1 = convert_to_int(op[1], SCALE_MIN, SCALE_MAX);
-            operations[i].value2 = convert_to_int(op[2], SCALE_MIN, SCALE_MAX);
-            operations[i].direction = NULL;
-        }
-        i++;
-        free(op);
-    }
-    operations = realloc(operations, sizeof(Operation) * (i + 1));
-    operations[i].operation = NULL;
-    operations[i].value1 = 0;
-    operations[i].value2 = 0;
-    operations[i].direction = NULL;
-    free(addresses);
-    return operations;
-}
-
 /**
  * invalid_image()
  * ------------------
@@ -1234,36 +2893,81 @@ void invalid_image(ThreadArgs* args, Operation** operations,
  */
 bool process_operations(
         FIBITMAP** image, Operation* operations, FILE* to, ThreadArgs args)
+{
+    int failedStep = apply_operations(image, operations, &args);
+    if (failedStep != FRAME_OK) {
+        failed_operation_response(to, operations[failedStep]);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * apply_operations()
+ * ---------------------
+ *  Performs the operations on an image in turn, stopping at the first that
+ *  fails
+ *
+ *  FIBITMAP** image: a pointer to the image data to manipulate
+ *  Operation* operations: the array of operations to perform
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *
+ *  Returns: FRAME_OK if all were successful, or the index of the one that
+ *  failed
+ */
+int apply_operations(
+        FIBITMAP** image, Operation* operations, ThreadArgs* args)
 {
     // Process Operations
-    for (int i = 0; operations[i].operation != NULL; i++) {
-        if (strcmp(operations[i].operation, ROTATE) == 0) {
+    for (int i = 0; operations[i].kind != OPERATION_END; i++) {
+        FIBITMAP* previous = *image;
+        uint64_t start = now_ns();
+        PROBE2(operation_start, i, operationSyntax[operations[i].kind].name);
+        Stage stage = STAGE_SCALE;
+        bool flipped;
+        switch (operations[i].kind) {
+        case OPERATION_ROTATE:
+            stage = STAGE_ROTATE;
             *image = FreeImage_Rotate(
                     *image, (double)operations[i].value1, NULL);
-        } else if (strcmp(operations[i].operation, FLIP) == 0) {
-            if (strcmp(operations[i].direction, VERTICAL) == 0) {
-                if (FreeImage_FlipVertical(*image) == 0) {
-                    failed_operation_response(to, operations[i]);
-                    return false;
-                }
-            } else if (FreeImage_FlipHorizontal(*image) == 0) {
-                failed_operation_response(to, operations[i]);
-                return false;
+            note_pixel_bytes(bitmap_bytes(previous) + bitmap_bytes(*image));
+            FreeImage_Unload(previous);
+            break;
+        case OPERATION_FLIP:
+            stage = STAGE_FLIP;
+            flipped = operations[i].value1 == FLIP_VERTICAL
+                    ? FreeImage_FlipVertical(*image)
+                    : FreeImage_FlipHorizontal(*image);
+            if (!flipped) {
+                return i;
             }
-        } else if (strcmp(operations[i].operation, SCALE) == 0) {
+            break;
+        case OPERATION_SCALE:
             *image = FreeImage_Rescale(*image, operations[i].value1,
                     operations[i].value2, FILTER_BILINEAR);
+            note_pixel_bytes(bitmap_bytes(previous) + bitmap_bytes(*image));
+            FreeImage_Unload(previous);
+            break;
+        case OPERATION_CROP:
+            stage = STAGE_CROP;
+            *image = crop_image(*image, operations[i]);
+            note_pixel_bytes(bitmap_bytes(previous) + bitmap_bytes(*image));
+            FreeImage_Unload(previous);
+            break;
+        default:
+            break;
         }
         // Check if operation failed
         if (*image == NULL) {
-            failed_operation_response(to, operations[i]);
-            return false;
+            return i;
         }
-        pthread_mutex_lock(args.statsMutex);
-        args.stats->operations++;
-        pthread_mutex_unlock(args.statsMutex);
+        PROBE2(operation_end, i, operationSyntax[operations[i].kind].name);
+        record_stage(args->server->metrics, stage, start);
+        pthread_mutex_lock(args->statsMutex);
+        args->stats->operations++;
+        pthread_mutex_unlock(args->statsMutex);
     }
-    return true;
+    return FRAME_OK;
 }
 
 /**
@@ -1282,12 +2986,13 @@ void failed_operation_response(FILE* to, Operation op)
     response.status = FAILED_OPERATION;
     response.statusExplanation = "Not Implemented";
     // Body
-    int length = snprintf(
-            NULL, 0, "Operation did not complete: %s\n", op.operation);
+    const char* name = operationSyntax[op.kind].name;
+    int length
+            = snprintf(NULL, 0, "Operation did not complete: %s\n", name);
     // Allocate memory for the unsigned char* destination
     response.body = malloc(sizeof(unsigned char) * (length + 1));
     snprintf((char*)response.body, length + 1,
-            "Operation did not complete: %s\n", op.operation);
+            "Operation did not complete: %s\n", name);
     response.bodySize = strlen((const char*)response.body);
     // Construct Headers
     int numHeaders = 2;
@@ -1305,8 +3010,7 @@ void failed_operation_response(FILE* to, Operation op)
     unsigned char* message = construct_HTTP_response(response.status,
             response.statusExplanation, response.headers, response.body,
             response.bodySize, &response.len);
-    fwrite(message, sizeof(unsigned char), response.len, to);
-    fflush(to);
+    write_response(to, message, response.len);
     free(response.headers[1]->value);
     free((char*)response.body);
     for (int i = 0; i < numHeaders; i++) {
@@ -1317,48 +3021,4831 @@ void failed_operation_response(FILE* to, Operation op)
 }
 
 /**
- * process_success()
+ * crop_image()
+ * ---------------
+ *  Copies the part of an image a crop keeps into a new bitmap
+ *
+ *  FIBITMAP* image: the image to crop
+ *  Operation crop: the crop to perform
+ *
+ *  Returns: the cropped image, or NULL if the crop kept nothing
+ */
+FIBITMAP* crop_image(FIBITMAP* image, Operation crop)
+{
+    Region region = crop_region(
+            crop, FreeImage_GetWidth(image), FreeImage_GetHeight(image));
+    if (region.width == 0 || region.height == 0) {
+        return NULL;
+    }
+    return FreeImage_Copy(image, region.x, region.y, region.x + region.width,
+            region.y + region.height);
+}
+
+/**
+ * crop_region()
+ * ----------------
+ *  Finds the part of an image of the given size that a crop keeps. Regions
+ *  reaching past the edge of the image are cut short at it.
+ *
+ *  Operation crop: the crop to perform
+ *  unsigned long long width: the width of the image
+ *  unsigned long long height: the height of the image
+ *
+ *  Returns: the region kept, with a width and height of 0 if it is empty
+ */
+Region crop_region(Operation crop, unsigned long long width,
+        unsigned long long height)
+{
+    Region region = {crop.value1, crop.value2, 0, 0};
+    if (region.x < width && region.y < height) {
+        region.width = width - region.x < (unsigned long long)crop.value3
+                ? width - region.x
+                : (unsigned long long)crop.value3;
+        region.height = height - region.y < (unsigned long long)crop.value4
+                ? height - region.y
+                : (unsigned long long)crop.value4;
+    }
+    return region;
+}
+
+/**
+ * decode_image()
+ * -----------------
+ *  Decodes the image. If the first operation is a crop and the format allows
+ *  it, only the region the crop keeps is decoded, so that step is done. If
+ *  it is a scale to a fraction of the size, a reduced size is decoded
+ *  instead, so the scale has less to do.
+ *
+ *  const unsigned char* data: the encoded image
+ *  unsigned long len: the number of bytes in the encoded image
+ *  ImageHeader header: the dimensions of the image
+ *  Operation* operations: the operations to be performed
+ *  int* decodedSteps: set to the number of operations done while decoding
+ *
+ *  Returns: the decoded image, or NULL if it could not be decoded
+ */
+FIBITMAP* decode_image(const unsigned char* data, unsigned long len,
+        ImageHeader header, Operation* operations, int* decodedSteps)
+{
+    bool crop = operations[0].kind == OPERATION_CROP;
+    Region region = {0, 0, header.width, header.height};
+    unsigned int reduction = 1;
+    if (crop) {
+        region = crop_region(operations[0], header.width, header.height);
+    } else if (operations[0].kind == OPERATION_SCALE) {
+        reduction = decode_reduction(header, operations[0]);
+    }
+    FIBITMAP* image = NULL;
+    if (header.decoder == DECODER_FREEIMAGE || (!crop && reduction == 1)
+            || region.width == 0 || region.height == 0) {
+        // Nothing to save, or left for the crop to fail on
+    } else {
+        StreamStage* stream
+                = open_decoder(data, len, header, region, reduction);
+        image = stream == NULL ? NULL : decode_stream(stream);
+    }
+    if (image == NULL) {
+        *decodedSteps = 0;
+        return fi_load_image_from_buffer(data, len);
+    }
+    *decodedSteps = crop ? 1 : 0;
+    return image;
+}
+
+/**
+ * decode_reduction()
+ * ---------------------
+ *  Finds how many times smaller an image can be decoded when it is about to
+ *  be scaled down, while still being at least as large as the scale's
+ *  target, so that the scale itself only does the last small step. libjpeg
+ *  can reduce by 2, 4 or 8 as it decodes; a PNG can be box filtered by any
+ *  whole factor.
+ *
+ *  ImageHeader header: the dimensions of the image
+ *  Operation scale: the scale about to be performed
+ *
+ *  Returns: the factor to reduce by while decoding, 1 if none
+ */
+unsigned int decode_reduction(ImageHeader header, Operation scale)
+{
+    unsigned long reduceX = header.width / scale.value1;
+    unsigned long reduceY = header.height / scale.value2;
+    unsigned long reduction = reduceX < reduceY ? reduceX : reduceY;
+    if (header.decoder == DECODER_PNG) {
+        return reduction > 1 ? reduction : 1;
+    }
+    if (header.decoder != DECODER_JPEG) {
+        return 1;
+    }
+    unsigned int scaleDenominator = MAX_JPEG_REDUCTION;
+    while (scaleDenominator > reduction) {
+        scaleDenominator /= 2;
+    }
+    return scaleDenominator > 1 ? scaleDenominator : 1;
+}
+
+/**
+ * open_decoder()
+ * -----------------
+ *  Starts decoding a region of a PNG or JPEG a row at a time, reduced in
+ *  size by the given factor
+ *
+ *  const unsigned char* data: the encoded image
+ *  unsigned long len: the number of bytes in the encoded image
+ *  ImageHeader header: the dimensions and decoder of the image
+ *  Region region: the region to decode, which lies within the image
+ *  unsigned int reduction: the factor to reduce the region by, or 1
+ *
+ *  Returns: the decoder's stage, or NULL if the image is not of a kind this
+ *  handles or is corrupt
+ */
+StreamStage* open_decoder(const unsigned char* data, unsigned long len,
+        ImageHeader header, Region region, unsigned int reduction)
+{
+    if (header.decoder == DECODER_JPEG) {
+        // libjpeg takes the region in the coordinates of the reduced image
+        region.width = (region.width + reduction - 1) / reduction;
+        region.height = (region.height + reduction - 1) / reduction;
+        return open_jpeg_stream(data, len, region, reduction);
+    }
+    return open_png_stream(data, len, region, reduction);
+}
+
+/**
+ * decode_stream()
+ * ------------------
+ *  Pulls every row of a pipeline into a bitmap, then closes the pipeline
+ *
+ *  StreamStage* stream: the last stage of the pipeline
+ *
+ *  Returns: the rows as a bitmap laid out as FreeImage would decode it, or
+ *  NULL if the image is corrupt
+ */
+FIBITMAP* decode_stream(StreamStage* stream)
+{
+    FIBITMAP* image = FreeImage_Allocate(
+            stream->width, stream->height, stream->channels * 8, 0, 0, 0);
+    if (image != NULL) {
+        note_pixel_bytes(bitmap_bytes(image) + stream_bytes(stream));
+    }
+    for (unsigned long long y = 0; image != NULL && y < stream->height;
+            y++) {
+        // FreeImage stores the bottom row first
+        if (!stream_next_row(stream,
+                    FreeImage_GetScanLine(image, stream->height - 1 - y))) {
+            FreeImage_Unload(image);
+            image = NULL;
+        }
+    }
+    close_stream(stream);
+    return image;
+}
+
+/**
+ * open_png_stream()
+ * --------------------
+ *  Starts decoding a region of an 8 bit RGB or RGBA, non-interlaced PNG a
+ *  scanline at a time, averaging each factor by factor block of it into one
+ *  pixel. The rows above the region must still be decompressed, as each row
+ *  is filtered against the one before, but only a row of sums is kept
+ *  besides the row being read, and the rows below the region are never read.
+ *  A gAMA chunk is applied as FreeImage applies it, for a 2.2 display, so
+ *  the pixels match those of a full decode. A transparent colour (tRNS)
+ *  would be lost, so such images are refused and left to FreeImage.
+ *
+ *  const unsigned char* data: the encoded image
+ *  unsigned long len: the number of bytes in the encoded image
+ *  Region region: the region to decode, which lies within the image
+ *  unsigned int factor: the factor to reduce the region by, or 1
+ *
+ *  Returns: the decoder's stage, or NULL if the image is not of a kind this
+ *  handles or is corrupt
+ */
+StreamStage* open_png_stream(const unsigned char* data, unsigned long len,
+        Region region, unsigned int factor)
+{
+    // Read again after the error jump below, so kept out of registers
+    StreamStage* volatile stage = calloc(1, sizeof(StreamStage));
+    if (stage == NULL) {
+        return NULL;
+    }
+    stage->kind = STREAM_PNG;
+    stage->region = region;
+    stage->factor = factor;
+    stage->pngSource = (PngSource){data, len, 0};
+    stage->png = png_create_read_struct(
+            PNG_LIBPNG_VER_STRING, NULL, png_decode_error, png_decode_warning);
+    stage->info
+            = stage->png == NULL ? NULL : png_create_info_struct(stage->png);
+    if (stage->info == NULL || setjmp(png_jmpbuf(stage->png))) {
+        // libpng reports errors by jumping back here
+        close_stream(stage);
+        return NULL;
+    }
+    png_set_read_fn(stage->png, &stage->pngSource, png_read_buffer);
+    png_read_info(stage->png, stage->info);
+    int colourType = png_get_color_type(stage->png, stage->info);
+    if (png_get_bit_depth(stage->png, stage->info) != 8
+            || png_get_interlace_type(stage->png, stage->info)
+                    != PNG_INTERLACE_NONE
+            || (colourType != PNG_COLOR_TYPE_RGB
+                    && colourType != PNG_COLOR_TYPE_RGB_ALPHA)
+            || png_get_valid(stage->png, stage->info, PNG_INFO_tRNS)) {
+        png_error(stage->png, "not decodable by scanline");
+    }
+    if (FI_RGBA_BLUE == 0) {
+        png_set_bgr(stage->png);
+    }
+    double gamma;
+    if (png_get_gAMA(stage->png, stage->info, &gamma)) {
+        png_set_gamma(stage->png, PNG_SCREEN_GAMMA, gamma);
+    }
+    png_read_update_info(stage->png, stage->info);
+    stage->channels = png_get_channels(stage->png, stage->info);
+    stage->width = (region.width + factor - 1) / factor;
+    stage->height = (region.height + factor - 1) / factor;
+    unsigned long long rowBytes = png_get_rowbytes(stage->png, stage->info);
+    stage->row = malloc(rowBytes);
+    stage->sums = calloc(stage->width * stage->channels, sizeof(uint64_t));
+    if (stage->row == NULL || stage->sums == NULL) {
+        png_error(stage->png, "out of memory");
+    }
+    stage->bytes
+            = rowBytes + stage->width * stage->channels * sizeof(uint64_t);
+    return stage;
+}
+
+/**
+ * png_stream_row()
+ * -------------------
+ *  Decodes the next row of a PNG decoder's region, reading as many rows of
+ *  the image as are averaged into it
+ *
+ *  StreamStage* stage: the decoder
+ *  unsigned char* row: where to write the row
+ *
+ *  Returns: true if the row was decoded, false if the image is corrupt
+ */
+bool png_stream_row(StreamStage* stage, unsigned char* row)
+{
+    if (setjmp(png_jmpbuf(stage->png))) {
+        // libpng reports errors by jumping back here
+        return false;
+    }
+    Region region = stage->region;
+    unsigned int channels = stage->channels;
+    unsigned int factor = stage->factor;
+    if (stage->nextRow == 0) {
+        for (unsigned long long y = 0; y < region.y; y++) {
+            png_read_row(stage->png, stage->row, NULL);
+        }
+    }
+    unsigned long long first = stage->nextRow * factor;
+    unsigned long long rows
+            = region.height - first < factor ? region.height - first : factor;
+    for (unsigned long long y = 0; y < rows; y++) {
+        png_read_row(stage->png, stage->row, NULL);
+        if (factor == 1) {
+            memcpy(row, stage->row + region.x * channels,
+                    region.width * channels);
+        } else {
+            box_filter_row(stage->row + region.x * channels, region.width,
+                    channels, factor, stage->sums);
+        }
+    }
+    if (factor == 1) {
+        return true;
+    }
+    // The band of rows is complete, so average each block of it
+    uint64_t* sums = stage->sums;
+    for (unsigned long long x = 0; x < stage->width; x++) {
+        unsigned long long columns = region.width - x * factor < factor
+                ? region.width - x * factor
+                : factor;
+        uint64_t count = rows * columns;
+        for (unsigned int c = 0; c < channels; c++) {
+            row[x * channels + c]
+                    = (sums[x * channels + c] + count / 2) / count;
+            sums[x * channels + c] = 0;
+        }
+    }
+    return true;
+}
+
+/**
+ * box_filter_row()
+ * -------------------
+ *  Adds each pixel of a row to the sum for the block of factor pixels it
+ *  lies in
+ *
+ *  const unsigned char* in: the row of pixels
+ *  unsigned long long width: the number of pixels in the row
+ *  unsigned int channels: the bytes per pixel
+ *  unsigned int factor: the number of pixels in each block
+ *  uint64_t* sums: the sum of each channel of each block
+ */
+void box_filter_row(const unsigned char* in, unsigned long long width,
+        unsigned int channels, unsigned int factor, uint64_t* sums)
+{
+    unsigned int inBlock = 0;
+    for (unsigned long long x = 0; x < width; x++) {
+        for (unsigned int c = 0; c < channels; c++) {
+            sums[c] += in[c];
+        }
+        in += channels;
+        if (++inBlock == factor) {
+            inBlock = 0;
+            sums += channels;
+        }
+    }
+}
+
+/**
+ * png_read_buffer()
+ * --------------------
+ *  Supplies libpng with the next bytes of an encoded image held in memory
+ *
+ *  png_structp png: the PNG being read, whose I/O pointer is its source
+ *  png_bytep out: where to copy the bytes to
+ *  png_size_t length: the number of bytes to copy
+ */
+void png_read_buffer(png_structp png, png_bytep out, png_size_t length)
+{
+    PngSource* source = png_get_io_ptr(png);
+    if (length > source->len - source->pos) {
+        png_error(png, "truncated image");
+    }
+    memcpy(out, source->data + source->pos, length);
+    source->pos += length;
+}
+
+/**
+ * png_decode_error()
+ * ---------------------
+ *  Handles a fatal libpng error by jumping back to the PNG decoder or
+ *  encoder, without printing it, as the image is then decoded by FreeImage
+ *  instead or the request fails
+ *
+ *  png_structp png: the PNG being read or written
+ *  png_const_charp message: a description of the error
+ */
+void png_decode_error(png_structp png, png_const_charp message)
+{
+    (void)message;
+    png_longjmp(png, 1);
+}
+
+/**
+ * png_decode_warning()
+ * -----------------------
+ *  Discards libpng's warnings, which FreeImage would not print either
+ *
+ *  png_structp png: the PNG being read
+ *  png_const_charp message: a description of the problem
+ */
+void png_decode_warning(png_structp png, png_const_charp message)
+{
+    (void)png;
+    (void)message;
+}
+
+/**
+ * open_jpeg_stream()
+ * ---------------------
+ *  Starts decoding a region of a greyscale or colour JPEG a row at a time,
+ *  only decompressing the columns of MCUs the region lies in and skipping the
+ *  MCU rows above it. The rows below it are never read. The image may be
+ *  reduced by 2, 4 or 8 as it is decoded, by scaling down the inverse DCT of
+ *  each block.
+ *
+ *  const unsigned char* data: the encoded image
+ *  unsigned long len: the number of bytes in the encoded image
+ *  Region region: the region to decode, in the coordinates of the reduced
+ *          image, which lies within it
+ *  unsigned int scale: the factor to reduce the image by, or 1
+ *
+ *  Returns: the decoder's stage, or NULL if the image is not of a kind this
+ *  handles or is corrupt
+ */
+StreamStage* open_jpeg_stream(const unsigned char* data, unsigned long len,
+        Region region, unsigned int scale)
+{
+    // Read again after the error jump below, so kept out of registers
+    StreamStage* volatile stage = calloc(1, sizeof(StreamStage));
+    if (stage == NULL) {
+        return NULL;
+    }
+    stage->kind = STREAM_JPEG;
+    stage->region = region;
+    stage->width = region.width;
+    stage->height = region.height;
+    struct jpeg_decompress_struct* cinfo = &stage->jpeg;
+    cinfo->err = jpeg_std_error(&stage->jpegErrors.manager);
+    stage->jpegErrors.manager.error_exit = jpeg_decode_error;
+    stage->jpegErrors.manager.output_message = jpeg_decode_message;
+    if (setjmp(stage->jpegErrors.recover)) {
+        // libjpeg reports errors by jumping back here
+        close_stream(stage);
+        return NULL;
+    }
+    jpeg_create_decompress(cinfo);
+    jpeg_mem_src(cinfo, (unsigned char*)data, len);
+    jpeg_read_header(cinfo, TRUE);
+    if (cinfo->num_components != 1 && cinfo->num_components != 3) {
+        // FreeImage converts CMYK itself
+        longjmp(stage->jpegErrors.recover, 1);
+    }
+    cinfo->out_color_space = cinfo->num_components == 1 ? JCS_GRAYSCALE
+            : FI_RGBA_BLUE == 0                         ? JCS_EXT_BGR
+                                                        : JCS_RGB;
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = scale;
+    jpeg_start_decompress(cinfo);
+    // Chroma is upsampled from the neighbouring pixels, which must not be
+    // cut off at the edge of the region, so take one more on either side.
+    // libjpeg widens that to the edges of the MCUs it lies in.
+    JDIMENSION left = region.x > 0 ? region.x - 1 : 0;
+    JDIMENSION width = region.x + region.width + 1 - left;
+    if (left + width > cinfo->output_width) {
+        width = cinfo->output_width - left;
+    }
+    jpeg_crop_scanline(cinfo, &left, &width);
+    jpeg_skip_scanlines(cinfo, region.y);
+    stage->jpegLeft = left;
+    stage->channels = cinfo->output_components;
+    stage->jpegRow = (*cinfo->mem->alloc_sarray)(
+            (j_common_ptr)cinfo, JPOOL_IMAGE, width * stage->channels, 1);
+    // libjpeg also holds an MCU row of each component
+    stage->bytes = (unsigned long long)width * stage->channels
+            * (JPEG_BUFFERED_ROWS + 1);
+    return stage;
+}
+
+/**
+ * jpeg_stream_row()
+ * --------------------
+ *  Decodes the next row of a JPEG decoder's region
+ *
+ *  StreamStage* stage: the decoder
+ *  unsigned char* row: where to write the row
+ *
+ *  Returns: true if the row was decoded, false if the image is corrupt
+ */
+bool jpeg_stream_row(StreamStage* stage, unsigned char* row)
+{
+    if (setjmp(stage->jpegErrors.recover)) {
+        // libjpeg reports errors by jumping back here
+        return false;
+    }
+    jpeg_read_scanlines(&stage->jpeg, stage->jpegRow, 1);
+    memcpy(row,
+            stage->jpegRow[0]
+                    + (stage->region.x - stage->jpegLeft) * stage->channels,
+            stage->width * stage->channels);
+    return true;
+}
+
+/**
+ * jpeg_decode_error()
  * ----------------------
- *  Upon success, process the results accordingly and free memory when needed
+ *  Handles a fatal libjpeg error by jumping back to the JPEG decoder
+ *
+ *  j_common_ptr cinfo: the JPEG being decoded
+ */
+void jpeg_decode_error(j_common_ptr cinfo)
+{
+    longjmp(((JpegErrors*)cinfo->err)->recover, 1);
+}
+
+/**
+ * jpeg_decode_message()
+ * ------------------------
+ *  Discards libjpeg's warnings, which FreeImage would not print either
+ *
+ *  j_common_ptr cinfo: the JPEG being decoded
+ */
+void jpeg_decode_message(j_common_ptr cinfo)
+{
+    (void)cinfo;
+}
+
+/**
+ * serve_lossless()
+ * -------------------
+ *  If the operations can be done on the JPEG without decoding it, does them
+ *  that way and sends the resulting JPEG, so the image loses nothing more
+ *  to a second round of compression and is never held as pixels
  *
- *  HttpRequest* request: a pointer to the http request
- *  Operation** operations: a pointer to the array of operations
  *  ThreadArgs* args: a pointer to the thread arguments
- *  FIBITMAT** image: a pointer to the image
- *  FILE* to: the file descriptor for sending the success response
+ *  HttpRequest* request: a pointer to the HTTP request
+ *  Operation** operations: a pointer to the array of operations
+ *  ImageHeader header: the dimensions and decoder of the image
+ *  const unsigned char* key: the job key to store the result under
+ *  InFlightJob* job: the in-flight job to hand the result to (NULL if none)
+ *  FILE* to: the file descriptor for sending the response through to
+ *
+ *  Returns: true if the response was sent, false if the image must be decoded
  */
-void process_success(HttpRequest* request, Operation** operations,
-        ThreadArgs* args, FIBITMAP** image, FILE* to)
+bool serve_lossless(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, ImageHeader header, const unsigned char* key,
+        InFlightJob* job, FILE* to)
 {
+    uint64_t start = now_ns();
+    unsigned long numBytes;
+    unsigned char* data = transform_jpeg(
+            request->body, request->len, header, *operations, &numBytes);
+    if (data == NULL) {
+        return false;
+    }
+    record_stage(args->server->metrics, STAGE_ENCODE, start);
+    int steps = 0;
+    while ((*operations)[steps].kind != OPERATION_END) {
+        steps++;
+    }
+    pthread_mutex_lock(args->statsMutex);
+    args->stats->operations += steps;
+    pthread_mutex_unlock(args->statsMutex);
+    free_operations(operations);
     free_request(request);
+    publish_result(args, to, key, job, data, numBytes, JPEG_CONTENT);
+    return true;
+}
+
+/**
+ * transform_jpeg()
+ * -------------------
+ *  Performs a chain of right angle rotations and flips on a JPEG by
+ *  rearranging its blocks of DCT coefficients, as jpegtran does. A partial
+ *  block on the right or bottom edge can not be moved to the left or top
+ *  without changing the image, so such chains are refused and must be done
+ *  on the pixels instead.
+ *
+ *  const unsigned char* data: the encoded image
+ *  unsigned long len: the number of bytes in the encoded image
+ *  ImageHeader header: the dimensions and decoder of the image
+ *  Operation* operations: the operations to be performed
+ *  unsigned long* numBytes: set to the number of bytes in the result
+ *
+ *  Returns: the transformed JPEG, to be freed by the caller, or NULL if the
+ *  operations can not be done this way
+ */
+unsigned char* transform_jpeg(const unsigned char* data, unsigned long len,
+        ImageHeader header, Operation* operations, unsigned long* numBytes)
+{
+    FREE_IMAGE_JPEG_OPERATION transform;
+    if (header.decoder != DECODER_JPEG
+            || !compose_transform(operations, &transform)) {
+        return NULL;
+    }
+    FIMEMORY* source = FreeImage_OpenMemory((BYTE*)data, len);
+    FIMEMORY* destination = FreeImage_OpenMemory(NULL, 0);
+    unsigned char* result = NULL;
+    BYTE* bytes;
+    DWORD size;
+    // Perfect, so partial edge blocks fail rather than being trimmed off
+    if (FreeImage_JPEGTransformCombinedFromMemory(source, destination,
+                transform, NULL, NULL, NULL, NULL, TRUE)
+            && FreeImage_AcquireMemory(destination, &bytes, &size)
+            && size > 0) {
+        result = malloc(sizeof(unsigned char) * size);
+        memcpy(result, bytes, size);
+        *numBytes = size;
+    }
+    FreeImage_CloseMemory(destination);
+    FreeImage_CloseMemory(source);
+    return result;
+}
+
+/**
+ * compose_transform()
+ * ----------------------
+ *  Composes a chain of right angle rotations and flips into the one lossless
+ *  JPEG transform with the same effect. Any such chain is a mirror (or not)
+ *  followed by some anticlockwise quarter turns: a flip after turns undoes
+ *  them, and a vertical flip is a horizontal one and a half turn.
+ *
+ *  Operation* operations: the operations to be performed
+ *  FREE_IMAGE_JPEG_OPERATION* transform: set to the composed transform
+ *
+ *  Returns: true if all of the operations are right angle rotations or
+ *  flips and together they change the image, false otherwise. A chain that
+ *  leaves the image as it is (e.g. /rotate,0) must still be decoded, so that
+ *  the response is a PNG like any other.
+ */
+bool compose_transform(
+        Operation* operations, FREE_IMAGE_JPEG_OPERATION* transform)
+{
+    // Indexed by the quarter turns and whether it is mirrored first. Rotate
+    // turns anticlockwise, where libjpeg's rotations are clockwise.
+    static const FREE_IMAGE_JPEG_OPERATION transforms[QUARTER_TURNS][2] = {
+            {FIJPEG_OP_NONE, FIJPEG_OP_FLIP_H},
+            {FIJPEG_OP_ROTATE_270, FIJPEG_OP_TRANSPOSE},
+            {FIJPEG_OP_ROTATE_180, FIJPEG_OP_FLIP_V},
+            {FIJPEG_OP_ROTATE_90, FIJPEG_OP_TRANSVERSE}};
+    int turns = 0;
+    bool mirrored = false;
+    for (int i = 0; operations[i].kind != OPERATION_END; i++) {
+        if (operations[i].kind == OPERATION_ROTATE
+                && operations[i].value1 % DEGREES_RIGHT_ANGLE == 0) {
+            turns += operations[i].value1 / DEGREES_RIGHT_ANGLE;
+        } else if (operations[i].kind == OPERATION_FLIP) {
+            turns = (operations[i].value1 == FLIP_VERTICAL ? 2 : 0) - turns;
+            mirrored = !mirrored;
+        } else {
+            return false;
+        }
+        turns = (turns % QUARTER_TURNS + QUARTER_TURNS) % QUARTER_TURNS;
+    }
+    *transform = transforms[turns][mirrored];
+    return *transform != FIJPEG_OP_NONE;
+}
+
+/**
+ * serve_streaming()
+ * --------------------
+ *  If every operation works on rows independently of the rows below them,
+ *  decodes, processes and encodes the image as a pipeline of scanlines, so
+ *  only a few rows of it are held as pixels at any time. Once the PNG
+ *  outgrows a chunk, it is sent as a chunked response while it is encoded.
+ *  An image the scanline decoders reject before anything is sent is left to
+ *  be decoded whole, as decode_image() falls back to FreeImage for it.
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  HttpRequest* request: a pointer to the HTTP request
+ *  Operation** operations: a pointer to the array of operations
+ *  ImageHeader header: the dimensions and decoder of the image
+ *  const unsigned char* key: the job key to store the result under
+ *  InFlightJob* job: the in-flight job to hand the result to (NULL if none)
+ *  FILE* to: the file descriptor for sending the response through to
+ *
+ *  Returns: true if a response was sent, false if the image must be decoded
+ *  whole
+ */
+bool serve_streaming(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, ImageHeader header, const unsigned char* key,
+        InFlightJob* job, FILE* to)
+{
+    if (!streamable(header, *operations)) {
+        return false;
+    }
+    // Decoding, the operations and encoding are interleaved, so the whole
+    // pipeline is timed as the encode that drives it
+    uint64_t start = now_ns();
+    PROBE0(encode_start);
+    StreamStage* stream = open_pipeline(
+            request->body, request->len, header, *operations);
+    PngSink sink = {NULL, 0, 0, to, key, 0, false, true};
+    bool encoded = stream != NULL && encode_stream(stream, &sink)
+            && (!sink.chunked || finish_png_chunks(&sink));
+    PROBE1(encode_end, sink.len);
+    if (!encoded && !sink.chunked) {
+        free(sink.data);
+        return false;
+    }
+    record_stage(args->server->metrics, STAGE_ENCODE, start);
+    if (!encoded) {
+        free(sink.data);
+        in_flight_finish(args->server->inFlight, job, NULL, 0, PNG_CONTENT);
+        // Too late for an error status, so the client can only tell the
+        // response is incomplete by the connection closing
+        shutdown(fileno(to), SHUT_RDWR);
+        free_operations(operations);
+        free_request(request);
+        pthread_mutex_lock(args->statsMutex);
+        args->stats->unSuccess++;
+        pthread_mutex_unlock(args->statsMutex);
+        return true;
+    }
+    int steps = 0;
+    while ((*operations)[steps].kind != OPERATION_END) {
+        steps++;
+    }
+    pthread_mutex_lock(args->statsMutex);
+    args->stats->operations += steps;
+    pthread_mutex_unlock(args->statsMutex);
     free_operations(operations);
-    unsigned long numBytes;
-    unsigned char* data = fi_save_png_image_to_buffer(*image, &numBytes);
-    success_response(to, data, numBytes);
-    free(data);
-    FreeImage_Unload(*image);
+    free_request(request);
+    if (!sink.chunked) {
+        // It all fit in the first chunk, so it is sent as usual
+        publish_result(args, to, key, job, sink.data, sink.len, PNG_CONTENT);
+        return true;
+    }
+    if (sink.whole && args->server->cache != NULL) {
+        cache_insert(args->server->cache, key, sink.data, sink.len,
+                PNG_CONTENT);
+    }
+    // A PNG too large to hold was not kept, so anyone waiting for it makes
+    // their own
+    in_flight_finish(args->server->inFlight, job,
+            sink.whole ? sink.data : NULL, sink.len, PNG_CONTENT);
+    free(sink.data);
     pthread_mutex_lock(args->statsMutex);
     args->stats->success++;
     pthread_mutex_unlock(args->statsMutex);
+    return true;
+}
+
+/**
+ * streamable()
+ * ---------------
+ *  Checks whether an image can be processed as a pipeline of scanlines: it
+ *  must be decodable a row at a time, and every operation must make each
+ *  row from rows at or above it, so vertical flips and rotations can not be.
+ *  Crops that keep nothing are left to fail as usual.
+ *
+ *  ImageHeader header: the dimensions and decoder of the image
+ *  Operation* operations: the operations to be performed
+ *
+ *  Returns: true if the image can be streamed, false otherwise
+ */
+bool streamable(ImageHeader header, Operation* operations)
+{
+    if (header.decoder == DECODER_FREEIMAGE) {
+        return false;
+    }
+    unsigned long long width = header.width;
+    unsigned long long height = header.height;
+    for (int i = 0; operations[i].kind != OPERATION_END; i++) {
+        if (operations[i].kind == OPERATION_CROP) {
+            Region region = crop_region(operations[i], width, height);
+            if (region.width == 0 || region.height == 0) {
+                return false;
+            }
+            width = region.width;
+            height = region.height;
+        } else if (operations[i].kind == OPERATION_SCALE) {
+            width = operations[i].value1;
+            height = operations[i].value2;
+        } else if (operations[i].kind != OPERATION_FLIP
+                || operations[i].value1 != FLIP_HORIZONTAL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * stream_peak_memory()
+ * -----------------------
+ *  Estimates the memory a pipeline of scanlines needs: the rows each stage
+ *  holds, and as much of the encoded image as is held, which at worst is as
+ *  large as an uncompressed PNG
+ *
+ *  ImageHeader header: the dimensions and decoder of the image
+ *  Operation* operations: the operations to be performed, which must be
+ *  streamable()
+ *
+ *  Returns: the estimated peak number of bytes
+ */
+unsigned long long stream_peak_memory(
+        ImageHeader header, Operation* operations)
+{
+    unsigned long long bytesPerPixel = header.bytesPerPixel;
+    unsigned long long width = header.width;
+    unsigned long long height = header.height;
+    unsigned long long reduction = 1;
+    int first = 0;
+    if (operations[0].kind == OPERATION_CROP) {
+        Region region = crop_region(operations[0], width, height);
+        width = region.width;
+        height = region.height;
+        first = 1;
+    } else if (operations[0].kind == OPERATION_SCALE) {
+        reduction = decode_reduction(header, operations[0]);
+    }
+    unsigned long long peak;
+    if (header.decoder == DECODER_JPEG) {
+        width = (width + reduction - 1) / reduction;
+        height = (height + reduction - 1) / reduction;
+        peak = (width + 2) * bytesPerPixel * (JPEG_BUFFERED_ROWS + 1);
+    } else {
+        // PNG rows are read whole, with the sums of a reduced row
+        peak = header.width * bytesPerPixel;
+        width = (width + reduction - 1) / reduction;
+        height = (height + reduction - 1) / reduction;
+        peak += width * bytesPerPixel * sizeof(uint64_t);
+    }
+    for (int i = first; operations[i].kind != OPERATION_END; i++) {
+        if (operations[i].kind == OPERATION_CROP) {
+            peak += width * bytesPerPixel;
+            Region region = crop_region(operations[i], width, height);
+            width = region.width;
+            height = region.height;
+        } else if (operations[i].kind == OPERATION_SCALE) {
+            unsigned long long newWidth = operations[i].value1;
+            unsigned long long newHeight = operations[i].value2;
+            unsigned long long windowWidth
+                    = scale_rows_first(width, height, newWidth, newHeight)
+                    ? width
+                    : newWidth;
+            peak += width * bytesPerPixel
+                    + scale_window(height, newHeight) * windowWidth
+                            * bytesPerPixel
+                    + windowWidth * bytesPerPixel * sizeof(double);
+            width = newWidth;
+            height = newHeight;
+        }
+    }
+    // The encoded PNG is only held whole while it is small enough to cache
+    unsigned long long encoded = height * (width * bytesPerPixel + 1);
+    if (encoded > MAX_STREAM_KEPT + STREAM_CHUNK_BYTES) {
+        encoded = MAX_STREAM_KEPT + STREAM_CHUNK_BYTES;
+    }
+    return peak + width * bytesPerPixel + encoded;
+}
+
+/**
+ * open_pipeline()
+ * ------------------
+ *  Builds a pipeline of scanlines: a decoder, which does a leading crop or
+ *  reduces the image for a leading scale as decode_image() would, then a
+ *  stage for each other operation
+ *
+ *  const unsigned char* data: the encoded image
+ *  unsigned long len: the number of bytes in the encoded image
+ *  ImageHeader header: the dimensions and decoder of the image
+ *  Operation* operations: the operations to be performed, which must be
+ *  streamable()
+ *
+ *  Returns: the last stage of the pipeline, or NULL if the image is corrupt
+ */
+StreamStage* open_pipeline(const unsigned char* data, unsigned long len,
+        ImageHeader header, Operation* operations)
+{
+    Region region = {0, 0, header.width, header.height};
+    unsigned int reduction = 1;
+    int first = 0;
+    if (operations[0].kind == OPERATION_CROP) {
+        region = crop_region(operations[0], header.width, header.height);
+        first = 1;
+    } else if (operations[0].kind == OPERATION_SCALE) {
+        reduction = decode_reduction(header, operations[0]);
+    }
+    StreamStage* stream = open_decoder(data, len, header, region, reduction);
+    for (int i = first; stream != NULL && operations[i].kind != OPERATION_END;
+            i++) {
+        stream = open_stream_stage(stream, operations[i]);
+    }
+    return stream;
+}
+
+/**
+ * open_stream_stage()
+ * ----------------------
+ *  Adds a stage performing an operation to the end of a pipeline
+ *
+ *  StreamStage* source: the last stage of the pipeline
+ *  Operation operation: a crop, horizontal flip or scale
+ *
+ *  Returns: the new last stage, or NULL (having closed the pipeline) if
+ *  there is not enough memory for it
+ */
+StreamStage* open_stream_stage(StreamStage* source, Operation operation)
+{
+    StreamStage* stage = calloc(1, sizeof(StreamStage));
+    if (stage == NULL) {
+        close_stream(source);
+        return NULL;
+    }
+    stage->source = source;
+    stage->channels = source->channels;
+    stage->width = source->width;
+    stage->height = source->height;
+    unsigned long long sourceBytes = source->width * source->channels;
+    bool allocated = true;
+    if (operation.kind == OPERATION_CROP) {
+        stage->kind = STREAM_CROP;
+        stage->region = crop_region(operation, source->width, source->height);
+        stage->width = stage->region.width;
+        stage->height = stage->region.height;
+        stage->row = malloc(sourceBytes);
+        stage->bytes = sourceBytes;
+        allocated = stage->row != NULL;
+    } else if (operation.kind == OPERATION_FLIP) {
+        // Rows are mirrored where they are written
+        stage->kind = STREAM_FLIP;
+    } else {
+        stage->kind = STREAM_SCALE;
+        stage->width = operation.value1;
+        stage->height = operation.value2;
+        stage->rowsFirst = scale_rows_first(source->width, source->height,
+                stage->width, stage->height);
+        unsigned long long windowBytes
+                = (stage->rowsFirst ? source->width : stage->width)
+                * stage->channels;
+        allocated = scale_weights(&stage->columns, source->width, stage->width)
+                && scale_weights(&stage->rows, source->height, stage->height);
+        if (allocated) {
+            stage->row = malloc(sourceBytes);
+            stage->window = malloc(stage->rows.windowSize * windowBytes);
+            stage->totals = malloc(windowBytes * sizeof(double));
+            stage->bytes = sourceBytes + stage->rows.windowSize * windowBytes
+                    + windowBytes * sizeof(double);
+            allocated = stage->row != NULL && stage->window != NULL
+                    && stage->totals != NULL;
+        }
+    }
+    if (!allocated) {
+        close_stream(stage);
+        return NULL;
+    }
+    return stage;
+}
+
+/**
+ * stream_next_row()
+ * --------------------
+ *  Produces the next row of a stage, pulling rows from the stages before it
+ *  as needed
+ *
+ *  StreamStage* stage: the stage to produce a row of
+ *  unsigned char* row: where to write the row
+ *
+ *  Returns: true if a row was produced, false if the image is corrupt
+ */
+bool stream_next_row(StreamStage* stage, unsigned char* row)
+{
+    StreamStage* source = stage->source;
+    bool produced = stage->nextRow < stage->height;
+    if (!produced) {
+        return false;
+    }
+    switch (stage->kind) {
+    case STREAM_PNG:
+        produced = png_stream_row(stage, row);
+        break;
+    case STREAM_JPEG:
+        produced = jpeg_stream_row(stage, row);
+        break;
+    case STREAM_CROP:
+        // The rows above the region are pulled and dropped
+        while (produced
+                && source->nextRow <= stage->region.y + stage->nextRow) {
+            produced = stream_next_row(source, stage->row);
+        }
+        if (produced) {
+            memcpy(row, stage->row + stage->region.x * stage->channels,
+                    stage->width * stage->channels);
+        }
+        break;
+    case STREAM_FLIP:
+        produced = stream_next_row(source, row);
+        if (produced) {
+            mirror_row(row, stage->width, stage->channels);
+        }
+        break;
+    case STREAM_SCALE:
+        produced = scale_stream_row(stage, row);
+        break;
+    }
+    stage->nextRow += produced ? 1 : 0;
+    return produced;
+}
+
+/**
+ * stream_bytes()
+ * -----------------
+ *  Adds up the rows held by a pipeline
+ *
+ *  StreamStage* stage: the last stage of the pipeline
+ *
+ *  Returns: the number of bytes of rows held
+ */
+unsigned long long stream_bytes(StreamStage* stage)
+{
+    unsigned long long bytes = 0;
+    for (; stage != NULL; stage = stage->source) {
+        bytes += stage->bytes;
+    }
+    return bytes;
+}
+
+/**
+ * close_stream()
+ * -----------------
+ *  Frees every stage of a pipeline, abandoning its decoder
+ *
+ *  StreamStage* stage: the last stage of the pipeline (ignored if NULL)
+ */
+void close_stream(StreamStage* stage)
+{
+    while (stage != NULL) {
+        StreamStage* source = stage->source;
+        if (stage->kind == STREAM_PNG) {
+            png_destroy_read_struct(&stage->png, &stage->info, NULL);
+        } else if (stage->kind == STREAM_JPEG) {
+            jpeg_destroy_decompress(&stage->jpeg);
+        }
+        free(stage->row);
+        free(stage->sums);
+        free(stage->window);
+        free(stage->totals);
+        free_scale_weights(&stage->columns);
+        free_scale_weights(&stage->rows);
+        free(stage);
+        stage = source;
+    }
+}
+
+/**
+ * mirror_row()
+ * ---------------
+ *  Mirrors a row of pixels left to right in place
+ *
+ *  unsigned char* row: the row of pixels
+ *  unsigned long long width: the number of pixels in the row
+ *  unsigned int channels: the bytes per pixel
+ */
+void mirror_row(
+        unsigned char* row, unsigned long long width, unsigned int channels)
+{
+    unsigned char* left = row;
+    unsigned char* right = row + (width - 1) * channels;
+    for (; left < right; left += channels, right -= channels) {
+        for (unsigned int c = 0; c < channels; c++) {
+            unsigned char swap = left[c];
+            left[c] = right[c];
+            right[c] = swap;
+        }
+    }
+}
+
+/**
+ * scale_stream_row()
+ * ---------------------
+ *  Produces the next row of a scale, as FreeImage_Rescale() would with its
+ *  bilinear filter. Source rows are pulled into a ring just large enough for
+ *  the rows any output row is filtered from: filtered along the row first,
+ *  or, when the image shrinks more vertically than horizontally, as they
+ *  are, with the blend of them filtered along the row afterwards.
+ *
+ *  StreamStage* stage: the scale
+ *  unsigned char* row: where to write the row
+ *
+ *  Returns: true if the row was produced, false if the image is corrupt
+ */
+bool scale_stream_row(StreamStage* stage, unsigned char* row)
+{
+    ScaleWeights* rows = &stage->rows;
+    unsigned long long last = rows->left[stage->nextRow]
+            + rows->count[stage->nextRow];
+    unsigned long long windowBytes
+            = (stage->rowsFirst ? stage->source->width : stage->width)
+            * stage->channels;
+    for (; stage->pulled < last; stage->pulled++) {
+        unsigned char* slot = stage->window
+                + (stage->pulled % rows->windowSize) * windowBytes;
+        if (!stream_next_row(stage->source,
+                    stage->rowsFirst ? slot : stage->row)) {
+            return false;
+        }
+        if (!stage->rowsFirst) {
+            resample_row(stage->row, slot, &stage->columns, stage->channels);
+        }
+    }
+    if (!stage->rowsFirst) {
+        blend_rows(stage->window, windowBytes, rows, stage->nextRow,
+                stage->totals, row);
+        return true;
+    }
+    blend_rows(stage->window, windowBytes, rows, stage->nextRow,
+            stage->totals, stage->row);
+    resample_row(stage->row, row, &stage->columns, stage->channels);
+    return true;
+}
+
+/**
+ * scale_window()
+ * -----------------
+ *  Finds the most source pixels any output pixel of a bilinear resample is
+ *  filtered from. When shrinking, the filter is widened to cover every
+ *  source pixel.
+ *
+ *  unsigned long long from: the source size
+ *  unsigned long long to: the output size
+ *
+ *  Returns: the number of source pixels
+ */
+unsigned int scale_window(unsigned long long from, unsigned long long to)
+{
+    return 2 * (unsigned int)ceil(to < from ? (double)from / to : 1.0) + 1;
+}
+
+/**
+ * scale_rows_first()
+ * ---------------------
+ *  Decides whether FreeImage_Rescale() filters down the columns before
+ *  along the rows, which it does when that makes the intermediate smaller
+ *
+ *  unsigned long long fromWidth: the source width
+ *  unsigned long long fromHeight: the source height
+ *  unsigned long long toWidth: the output width
+ *  unsigned long long toHeight: the output height
+ *
+ *  Returns: true if the columns are filtered first
+ */
+bool scale_rows_first(unsigned long long fromWidth,
+        unsigned long long fromHeight, unsigned long long toWidth,
+        unsigned long long toHeight)
+{
+    return toWidth * fromHeight > fromWidth * toHeight;
+}
+
+/**
+ * scale_weights()
+ * ------------------
+ *  Computes the weights of a bilinear resample along one axis, as
+ *  FreeImage_Rescale() does: each output pixel is centred on its span of
+ *  the source, and given the normalised weights of a triangle filter there,
+ *  widened by the factor the axis shrinks by
+ *
+ *  ScaleWeights* weights: the weights to fill in
+ *  unsigned long long from: the source size
+ *  unsigned long long to: the output size
+ *
+ *  Returns: true if the weights were allocated, false otherwise
+ */
+bool scale_weights(
+        ScaleWeights* weights, unsigned long long from, unsigned long long to)
+{
+    double scale = (double)to / from;
+    double filterScale = scale < 1.0 ? scale : 1.0;
+    double width = 1.0 / filterScale;
+    weights->size = to;
+    weights->windowSize = scale_window(from, to);
+    weights->left = malloc(to * sizeof(unsigned long long));
+    weights->count = malloc(to * sizeof(unsigned int));
+    weights->weights = calloc(to * weights->windowSize, sizeof(double));
+    if (weights->left == NULL || weights->count == NULL
+            || weights->weights == NULL) {
+        return false;
+    }
+    for (unsigned long long u = 0; u < to; u++) {
+        double centre = u / scale + 0.5 / scale;
+        long long left = (long long)(centre - width + 0.5);
+        long long right = (long long)(centre + width + 0.5);
+        left = left > 0 ? left : 0;
+        right = right < (long long)from ? right : (long long)from;
+        double* weight = weights->weights + u * weights->windowSize;
+        double total = 0;
+        for (long long i = left; i < right; i++) {
+            double distance = fabs(filterScale * (i + 0.5 - centre));
+            weight[i - left]
+                    = distance < 1.0 ? filterScale * (1.0 - distance) : 0.0;
+            total += weight[i - left];
+        }
+        if (total > 0 && total != 1) {
+            for (long long i = left; i < right; i++) {
+                weight[i - left] /= total;
+            }
+        }
+        weights->left[u] = left;
+        weights->count[u] = right - left;
+    }
+    return true;
+}
+
+/**
+ * free_scale_weights()
+ * -----------------------
+ *  Frees the weights of a bilinear resample, if any were allocated
+ *
+ *  ScaleWeights* weights: the weights to free
+ */
+void free_scale_weights(ScaleWeights* weights)
+{
+    free(weights->left);
+    free(weights->count);
+    free(weights->weights);
+}
+
+/**
+ * resample_row()
+ * -----------------
+ *  Filters a row of pixels along its length to a new width
+ *
+ *  const unsigned char* in: the source row
+ *  unsigned char* out: where to write the filtered row
+ *  ScaleWeights* columns: the weights along the row
+ *  unsigned int channels: the bytes per pixel
+ */
+void resample_row(const unsigned char* in, unsigned char* out,
+        ScaleWeights* columns, unsigned int channels)
+{
+    for (unsigned long long x = 0; x < columns->size; x++) {
+        const unsigned char* pixel = in + columns->left[x] * channels;
+        const double* weight = columns->weights + x * columns->windowSize;
+        for (unsigned int c = 0; c < channels; c++) {
+            double value = 0;
+            for (unsigned int i = 0; i < columns->count[x]; i++) {
+                value += weight[i] * pixel[i * channels + c];
+            }
+            int rounded = (int)(value + 0.5);
+            *out++ = rounded < 0 ? 0
+                    : rounded > UCHAR_MAX ? UCHAR_MAX
+                                          : rounded;
+        }
+    }
+}
+
+/**
+ * blend_rows()
+ * ---------------
+ *  Filters down the columns of the rows in a scale's ring to make one row
+ *
+ *  const unsigned char* window: the ring of rows
+ *  unsigned long long rowBytes: the number of bytes in each row of the ring
+ *  ScaleWeights* rows: the weights down the columns
+ *  unsigned long long row: the output row to make
+ *  double* totals: rowBytes sums to filter into
+ *  unsigned char* out: where to write the row
+ */
+void blend_rows(const unsigned char* window, unsigned long long rowBytes,
+        ScaleWeights* rows, unsigned long long row, double* totals,
+        unsigned char* out)
+{
+    const double* weight = rows->weights + row * rows->windowSize;
+    memset(totals, 0, rowBytes * sizeof(double));
+    for (unsigned int i = 0; i < rows->count[row]; i++) {
+        const unsigned char* in = window
+                + ((rows->left[row] + i) % rows->windowSize) * rowBytes;
+        for (unsigned long long k = 0; k < rowBytes; k++) {
+            totals[k] += weight[i] * in[k];
+        }
+    }
+    for (unsigned long long k = 0; k < rowBytes; k++) {
+        int rounded = (int)(totals[k] + 0.5);
+        out[k] = rounded < 0 ? 0 : rounded > UCHAR_MAX ? UCHAR_MAX : rounded;
+    }
+}
+
+/**
+ * encode_stream()
+ * ------------------
+ *  Pulls every row of a pipeline through libpng into a sink, then closes the
+ *  pipeline
+ *
+ *  StreamStage* stream: the last stage of the pipeline
+ *  PngSink* sink: where to write the PNG, whose data the caller frees
+ *
+ *  Returns: true if the PNG was encoded, false if the image is corrupt or
+ *  the connection failed
+ */
+bool encode_stream(StreamStage* stream, PngSink* sink)
+{
+    png_structp png = png_create_write_struct(
+            PNG_LIBPNG_VER_STRING, NULL, png_decode_error, png_decode_warning);
+    png_infop info = png == NULL ? NULL : png_create_info_struct(png);
+    // Set between setjmp() and longjmp(), so kept out of registers
+    unsigned char* volatile row = NULL;
+    if (info == NULL || setjmp(png_jmpbuf(png))) {
+        // libpng reports errors by jumping back here
+        png_destroy_write_struct(&png, &info);
+        close_stream(stream);
+        free(row);
+        return false;
+    }
+    png_set_write_fn(png, sink, png_write_buffer, png_flush_buffer);
+    int colourType = stream->channels == 1 ? PNG_COLOR_TYPE_GRAY
+            : stream->channels == 3        ? PNG_COLOR_TYPE_RGB
+                                           : PNG_COLOR_TYPE_RGB_ALPHA;
+    png_set_IHDR(png, info, stream->width, stream->height, 8, colourType,
+            PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+            PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    if (FI_RGBA_BLUE == 0) {
+        png_set_bgr(png);
+    }
+    // The encoder's row is the last one the pipeline holds
+    stream->bytes += stream->width * stream->channels;
+    row = malloc(stream->width * stream->channels);
+    if (row == NULL) {
+        png_error(png, "out of memory");
+    }
+    for (unsigned long long y = 0; y < stream->height; y++) {
+        if (!stream_next_row(stream, row)) {
+            png_error(png, "corrupt image");
+        }
+        png_write_row(png, row);
+    }
+    free(row);
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+    note_pixel_bytes(stream_bytes(stream) + sink->capacity);
+    close_stream(stream);
+    return true;
+}
+
+/**
+ * png_write_buffer()
+ * ---------------------
+ *  Appends the next bytes libpng has encoded to a sink, sending a chunk of
+ *  the PNG once enough of it is held
+ *
+ *  png_structp png: the PNG being written, whose I/O pointer is its sink
+ *  png_bytep data: the encoded bytes
+ *  png_size_t length: the number of encoded bytes
+ */
+void png_write_buffer(png_structp png, png_bytep data, png_size_t length)
+{
+    PngSink* sink = png_get_io_ptr(png);
+    if (sink->len + length > sink->capacity) {
+        size_t capacity
+                = sink->capacity > 0 ? sink->capacity : PNG_SINK_INITIAL;
+        while (capacity < sink->len + length) {
+            capacity *= 2;
+        }
+        unsigned char* grown = realloc(sink->data, capacity);
+        if (grown == NULL) {
+            png_error(png, "out of memory");
+        }
+        sink->data = grown;
+        sink->capacity = capacity;
+    }
+    memcpy(sink->data + sink->len, data, length);
+    sink->len += length;
+    if (sink->to != NULL && sink->len - sink->sent >= STREAM_CHUNK_BYTES
+            && !send_png_chunk(sink)) {
+        png_error(png, "connection failed");
+    }
+}
+
+/**
+ * png_flush_buffer()
+ * ---------------------
+ *  Does nothing, as chunks are sent once they are large enough
+ *
+ *  png_structp png: the PNG being written
+ */
+void png_flush_buffer(png_structp png)
+{
+    (void)png;
+}
+
+/**
+ * send_png_chunk()
+ * -------------------
+ *  Sends the held bytes of a PNG that have not been sent yet as one chunk of
+ *  a chunked response, starting the response first if need be. Once the
+ *  PNG has grown too large to cache, sent bytes are no longer held.
+ *
+ *  PngSink* sink: the sink holding the PNG
+ *
+ *  Returns: true if the chunk was sent, false if the connection failed
+ */
+bool send_png_chunk(PngSink* sink)
+{
+    if (!sink->chunked) {
+        // Every client is HTTP/1.1, as the request parser accepts nothing
+        // else, and HTTP/1.1 clients must accept chunked responses
+        chunked_headers_response(sink->to, sink->key, PNG_CONTENT);
+        sink->chunked = true;
+    }
+    size_t length = sink->len - sink->sent;
+    int sizeLength = fprintf(sink->to, "%zx\r\n", length);
+    fwrite(sink->data + sink->sent, sizeof(unsigned char), length, sink->to);
+    fputs("\r\n", sink->to);
+    fflush(sink->to);
+    requestUsage.bytesOut += sizeLength + length + 2;
+    sink->sent = sink->len;
+    if (!sink->whole || sink->len > MAX_STREAM_KEPT) {
+        sink->whole = false;
+        sink->len = 0;
+        sink->sent = 0;
+    }
+    return !ferror(sink->to);
+}
+
+/**
+ * finish_png_chunks()
+ * ----------------------
+ *  Ends a chunked response: sends the rest of the PNG as a last chunk, then
+ *  the empty chunk that marks the end of the body
+ *
+ *  PngSink* sink: the sink holding the PNG
+ *
+ *  Returns: true if the response was ended, false if the connection failed
+ */
+bool finish_png_chunks(PngSink* sink)
+{
+    if (sink->len > sink->sent && !send_png_chunk(sink)) {
+        return false;
+    }
+    fputs("0\r\n\r\n", sink->to);
+    fflush(sink->to);
+    requestUsage.bytesOut += 5;
+    return !ferror(sink->to);
+}
+
+/**
+ * serve_frames()
+ * -----------------
+ *  If the image is an animated GIF or a multipage TIFF, performs the
+ *  operations on every frame and sends an animated PNG back. Frames are
+ *  decoded in order, one at a time, while a pool of threads performs the
+ *  operations on them and encodes them in parallel.
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  HttpRequest* request: a pointer to the HTTP request
+ *  Operation** operations: a pointer to the array of operations
+ *  ImageHeader header: the dimensions and frame count of the image
+ *  const unsigned char* key: the job key to store the result under
+ *  InFlightJob* job: the in-flight job to hand the result to (NULL if none)
+ *  FILE* to: the file descriptor for sending the response through to
+ *
+ *  Returns: true if a response was sent, false if the image has one frame
+ */
+bool serve_frames(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, ImageHeader header, const unsigned char* key,
+        InFlightJob* job, FILE* to)
+{
+    if (header.frames <= 1) {
+        return false;
+    }
+    uint64_t start = now_ns();
+    PROBE1(decode_start, request->len);
+    FIMEMORY* memory = FreeImage_OpenMemory(request->body, request->len);
+    FREE_IMAGE_FORMAT format = FreeImage_GetFileTypeFromMemory(memory, 0);
+    FrameJob frames = {NULL, PTHREAD_MUTEX_INITIALIZER, 1, 0, *operations,
+            args, 0, 0, 0, NULL, FRAME_OK, 0};
+    // Playback composites each GIF frame onto the ones before it
+    frames.pages = FreeImage_LoadMultiBitmapFromMemory(
+            format, memory, format == FIF_GIF ? GIF_PLAYBACK : 0);
+    frames.count = frames.pages == NULL ? 0
+                                        : FreeImage_GetPageCount(frames.pages);
+    frames.frames = calloc(frames.count + 1, sizeof(EncodedFrame));
+    // The first frame sets the size of the canvas for the rest
+    if (frames.count > 0 && process_frame(&frames, 0)) {
+        int workers = frame_workers(frames.count);
+        pthread_t* threads = malloc(workers * sizeof(pthread_t));
+        for (int i = 1; i < workers; i++) {
+            pthread_create(&threads[i], NULL, frame_thread, &frames);
+        }
+        frame_thread(&frames);
+        for (int i = 1; i < workers; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+        // The threads held their frames at once
+        note_pixel_bytes(frames.peakPixelBytes);
+    } else {
+        frames.failedStep = FRAME_UNDECODABLE;
+    }
+    if (frames.pages != NULL) {
+        FreeImage_CloseMultiBitmap(frames.pages, 0);
+    }
+    FreeImage_CloseMemory(memory);
+    unsigned long numBytes = 0;
+    unsigned char* data = NULL;
+    if (frames.failedStep == FRAME_OK) {
+        data = assemble_apng(&frames, &numBytes);
+    }
+    // Decoding, the operations and encoding overlap, so the frames are
+    // timed as one encode
+    PROBE1(encode_end, numBytes);
+    record_stage(args->server->metrics, STAGE_ENCODE, start);
+    for (int i = 0; i < frames.count; i++) {
+        free(frames.frames[i].data);
+    }
+    free(frames.frames);
+    pthread_mutex_destroy(&frames.mutex);
+    if (data != NULL) {
+        free_operations(operations);
+        free_request(request);
+        publish_result(args, to, key, job, data, numBytes, PNG_CONTENT);
+        return true;
+    }
+    in_flight_finish(args->server->inFlight, job, NULL, 0, PNG_CONTENT);
+    if (frames.failedStep < 0) {
+        invalid_image(args, operations, request, to);
+        return true;
+    }
+    failed_operation_response(to, (*operations)[frames.failedStep]);
+    free_operations(operations);
+    free_request(request);
+    return true;
+}
+
+/**
+ * frame_workers()
+ * ------------------
+ *  Finds how many threads process the frames of a multi-frame image: one per
+ *  online CPU, but no more than there are frames
+ *
+ *  unsigned long frames: the number of frames
+ *
+ *  Returns: the number of threads, including the request's own
+ */
+int frame_workers(unsigned long frames)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    return frames < (unsigned long)cpus ? (int)frames : (int)cpus;
+}
+
+/**
+ * frame_thread()
+ * -----------------
+ *  Takes frames of a multi-frame image in turn and processes them, until
+ *  there are none left or one has failed. The thread's peak pixel memory
+ *  over its frames is added to the job's, for the request's thread to
+ *  record, since the usage of a worker thread is its own.
+ *
+ *  void* arg: the FrameJob shared by the threads
+ *
+ *  Returns: Null pointer
+ */
+void* frame_thread(void* arg)
+{
+    FrameJob* frames = arg;
+    unsigned long long before = requestUsage.peakPixelBytes;
+    requestUsage.peakPixelBytes = 0;
+    while (1) {
+        pthread_mutex_lock(&frames->mutex);
+        int index = frames->next;
+        bool stop = index >= frames->count || frames->failedStep != FRAME_OK;
+        frames->next++;
+        pthread_mutex_unlock(&frames->mutex);
+        if (stop || !process_frame(frames, index)) {
+            break;
+        }
+    }
+    pthread_mutex_lock(&frames->mutex);
+    frames->peakPixelBytes += requestUsage.peakPixelBytes;
+    pthread_mutex_unlock(&frames->mutex);
+    requestUsage.peakPixelBytes = before;
+    return NULL;
+}
+
+/**
+ * process_frame()
+ * ------------------
+ *  Decodes one frame of a multi-frame image, performs the operations on it
+ *  and encodes it. Frames other than the first are cut down to the canvas
+ *  if they have come out larger than it.
+ *
+ *  FrameJob* frames: the state shared by the threads
+ *  int index: the frame to process
+ *
+ *  Returns: true if the frame was encoded, false if it failed
+ */
+bool process_frame(FrameJob* frames, int index)
+{
+    EncodedFrame* frame = &frames->frames[index];
+    pthread_mutex_lock(&frames->mutex);
+    FIBITMAP* page = FreeImage_LockPage(frames->pages, index);
+    FIBITMAP* image = NULL;
+    if (page != NULL) {
+        frame->delayMs = frame_tag(page, "FrameTime", DEFAULT_FRAME_MS);
+        if (index == 0) {
+            frames->loops = frame_tag(page, "Loop", 0);
+        }
+        // The page is freed when unlocked, so only a copy is taken here and
+        // the conversion is left until after
+        image = FreeImage_Clone(page);
+        FreeImage_UnlockPage(frames->pages, page, FALSE);
+    }
+    pthread_mutex_unlock(&frames->mutex);
+    if (image != NULL && FreeImage_GetBPP(image) != 32) {
+        // Every frame must have the same colour type in an animated PNG
+        FIBITMAP* converted = FreeImage_ConvertTo32Bits(image);
+        note_pixel_bytes(bitmap_bytes(image) + bitmap_bytes(converted));
+        FreeImage_Unload(image);
+        image = converted;
+    }
+    int failedStep = FRAME_UNDECODABLE;
+    if (image != NULL) {
+        failedStep
+                = apply_operations(&image, frames->operations, frames->args);
+    }
+    if (failedStep == FRAME_OK && index > 0
+            && (FreeImage_GetWidth(image) > frames->width
+                    || FreeImage_GetHeight(image) > frames->height)) {
+        unsigned long width = FreeImage_GetWidth(image);
+        unsigned long height = FreeImage_GetHeight(image);
+        FIBITMAP* clipped = FreeImage_Copy(image, 0, 0,
+                width < frames->width ? width : frames->width,
+                height < frames->height ? height : frames->height);
+        FreeImage_Unload(image);
+        image = clipped;
+        failedStep = image == NULL ? FRAME_UNDECODABLE : FRAME_OK;
+    }
+    if (failedStep == FRAME_OK) {
+        if (index == 0) {
+            frames->width = FreeImage_GetWidth(image);
+            frames->height = FreeImage_GetHeight(image);
+        }
+        frame->data = fi_save_png_image_to_buffer(image, &frame->numBytes);
+        failedStep = frame->data == NULL ? FRAME_UNDECODABLE : FRAME_OK;
+    }
+    if (image != NULL) {
+        FreeImage_Unload(image);
+    }
+    if (failedStep != FRAME_OK) {
+        pthread_mutex_lock(&frames->mutex);
+        // Report the failure of the earliest frame
+        if (frames->failedStep == FRAME_OK) {
+            frames->failedStep = failedStep;
+        }
+        pthread_mutex_unlock(&frames->mutex);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * frame_tag()
+ * --------------
+ *  Reads a number from the animation metadata of a frame
+ *
+ *  FIBITMAP* page: the frame
+ *  const char* name: the name of the metadata tag
+ *  unsigned long fallback: the value to use if the frame has no such tag
+ *
+ *  Returns: the value of the tag
+ */
+unsigned long frame_tag(FIBITMAP* page, const char* name,
+        unsigned long fallback)
+{
+    FITAG* tag = NULL;
+    if (!FreeImage_GetMetadata(FIMD_ANIMATION, page, name, &tag)
+            || tag == NULL || FreeImage_GetTagValue(tag) == NULL) {
+        return fallback;
+    }
+    return *(const uint32_t*)FreeImage_GetTagValue(tag);
+}
+
+/**
+ * assemble_apng()
+ * ------------------
+ *  Joins the encoded frames into one animated PNG: the first frame's IHDR,
+ *  an acTL, then each frame's fcTL and image data, the first frame's as its
+ *  IDAT chunks and the rest renumbered as fdAT chunks
+ *
+ *  FrameJob* frames: the state holding the encoded frames
+ *  unsigned long* numBytes: set to the number of bytes in the animated PNG
+ *
+ *  Returns: the animated PNG, or NULL if a frame was not a PNG like the first
+ */
+unsigned char* assemble_apng(FrameJob* frames, unsigned long* numBytes)
+{
+    char* apng;
+    size_t length;
+    FILE* out = open_memstream(&apng, &length);
+    unsigned long sequence = 0;
+    bool valid = true;
+    for (int i = 0; i < frames->count && valid; i++) {
+        const unsigned char* png = frames->frames[i].data;
+        unsigned long numBytes = frames->frames[i].numBytes;
+        unsigned long pos = PNG_SIGNATURE_LENGTH;
+        // Each frame must be a plain PNG with the first frame's pixel format
+        valid = numBytes >= pos + PNG_CHUNK_OVERHEAD + PNG_IHDR_LENGTH
+                && memcmp(png + pos + 4, "IHDR", 4) == 0
+                && memcmp(png + pos + 16, frames->frames[0].data + pos + 16,
+                           PNG_IHDR_LENGTH - 8)
+                        == 0;
+        if (!valid) {
+            break;
+        }
+        unsigned char control[APNG_FCTL_LENGTH];
+        if (i == 0) {
+            fwrite(png, sizeof(unsigned char),
+                    pos + PNG_CHUNK_OVERHEAD + PNG_IHDR_LENGTH, out);
+            write_big_endian(control, frames->count, 4);
+            write_big_endian(control + 4, frames->loops, 4);
+            write_png_chunk(out, "acTL", control, APNG_ACTL_LENGTH);
+        }
+        unsigned long delayMs = frames->frames[i].delayMs;
+        write_big_endian(control, sequence++, 4);
+        memcpy(control + 4, png + pos + 8, 8);
+        memset(control + 12, 0, 8);
+        write_big_endian(control + 20,
+                delayMs > UINT16_MAX ? UINT16_MAX : delayMs, 2);
+        write_big_endian(control + 22, MILLISECONDS_PER_SECOND, 2);
+        control[24] = APNG_DISPOSE_OP_BACKGROUND;
+        control[25] = APNG_BLEND_OP_SOURCE;
+        write_png_chunk(out, "fcTL", control, APNG_FCTL_LENGTH);
+        while (valid && pos + PNG_CHUNK_OVERHEAD <= numBytes) {
+            unsigned long chunk = read_big_endian(png + pos, 4);
+            valid = chunk <= numBytes - pos - PNG_CHUNK_OVERHEAD;
+            if (valid && memcmp(png + pos + 4, "IDAT", 4) == 0 && i == 0) {
+                fwrite(png + pos, sizeof(unsigned char),
+                        chunk + PNG_CHUNK_OVERHEAD, out);
+            } else if (valid && memcmp(png + pos + 4, "IDAT", 4) == 0) {
+                // An fdAT is an IDAT prefixed with its sequence number
+                unsigned char* frameData = malloc(chunk + 4);
+                write_big_endian(frameData, sequence++, 4);
+                memcpy(frameData + 4, png + pos + 8, chunk);
+                write_png_chunk(out, "fdAT", frameData, chunk + 4);
+                free(frameData);
+            }
+            pos += chunk + PNG_CHUNK_OVERHEAD;
+        }
+    }
+    write_png_chunk(out, "IEND", NULL, 0);
+    fclose(out);
+    if (!valid) {
+        free(apng);
+        return NULL;
+    }
+    *numBytes = length;
+    return (unsigned char*)apng;
+}
+
+/**
+ * write_png_chunk()
+ * --------------------
+ *  Writes a PNG chunk: its length, type, data and the CRC of the type and
+ *  data
+ *
+ *  FILE* out: where to write the chunk
+ *  const char* type: the four letter chunk type
+ *  const unsigned char* data: the chunk data (may be NULL if it is empty)
+ *  unsigned long length: the number of bytes of chunk data
+ */
+void write_png_chunk(FILE* out, const char* type, const unsigned char* data,
+        unsigned long length)
+{
+    unsigned char field[4];
+    write_big_endian(field, length, 4);
+    fwrite(field, sizeof(unsigned char), 4, out);
+    fwrite(type, sizeof(char), 4, out);
+    uLong crc = crc32(0L, (const Bytef*)type, 4);
+    if (length > 0) {
+        fwrite(data, sizeof(unsigned char), length, out);
+        crc = crc32(crc, data, length);
+    }
+    write_big_endian(field, crc, 4);
+    fwrite(field, sizeof(unsigned char), 4, out);
+}
+
+/**
+ * write_big_endian()
+ * ---------------------
+ *  Writes an unsigned big-endian integer
+ *
+ *  unsigned char* data: where to write the bytes of the integer
+ *  unsigned long value: the integer
+ *  int numBytes: the number of bytes in the integer
+ */
+void write_big_endian(unsigned char* data, unsigned long value, int numBytes)
+{
+    for (int i = numBytes - 1; i >= 0; i--) {
+        data[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+/**
+ * renditions_requested()
+ * -------------------------
+ *  Checks whether a request is for several renditions of one image, i.e. a
+ *  POST to /renditions with a query of operation chains
+ *
+ *  HttpRequest request: the request to check
+ *
+ *  Returns: true if it is a fan-out request, false otherwise
+ */
+bool renditions_requested(HttpRequest request)
+{
+    return strcmp(request.method, POST) == 0
+            && strncmp(request.address, RENDITIONS_PATH,
+                       strlen(RENDITIONS_PATH))
+            == 0;
+}
+
+/**
+ * serve_renditions()
+ * ---------------------
+ *  Produces every rendition a fan-out request asks for from one decode of
+ *  its image. The chains are merged into a tree, so that the steps they
+ *  start with in common are performed once, and each branch of the tree
+ *  runs on its own thread. The results are sent as one multipart response,
+ *  or if any chain fails, the request fails as a single chain would. Frees
+ *  the request.
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  HttpRequest* request: a pointer to the HTTP request
+ *  FILE* to: the file descriptor for sending the response through to
+ */
+void serve_renditions(ThreadArgs* args, HttpRequest* request, FILE* to)
+{
+    Metrics* metrics = args->server->metrics;
+    uint64_t start = now_ns();
+    RenditionJob renditions = {0, NULL, NULL, NULL, NULL, 0, args,
+            PTHREAD_MUTEX_INITIALIZER, FRAME_OK, 0, false};
+    if (!compile_renditions(
+                request->address + strlen(RENDITIONS_PATH), &renditions)) {
+        invalid_operation_response(to);
+        reject_renditions(args, &renditions, request);
+        return;
+    }
+    if (!valid_image_size(*request, args->server->maxBody)) {
+        invalid_size_response(to, *request);
+        reject_renditions(args, &renditions, request);
+        return;
+    }
+    ImageHeader header;
+    if (!probe_image_header(request->body, request->len, &header)) {
+        invalid_image_response(to);
+        reject_renditions(args, &renditions, request);
+        return;
+    }
+    unsigned long long required = plan_renditions(&renditions, header);
+    if (required > args->server->requestBudget) {
+        memory_budget_response(to, required);
+        reject_renditions(args, &renditions, request);
+        return;
+    }
+    record_stage(metrics, STAGE_REQUEST_PARSE, start);
+    Operation* operations = NULL;
+    if (!admit_request(args, request, &operations, NULL, to, &required)) {
+        free_renditions(&renditions);
+        return;
+    }
+    requestUsage.cacheOutcome = CACHE_MISS;
+    start = now_ns();
+    PROBE1(decode_start, request->len);
+    FIBITMAP* image = decode_renditions(&renditions, request, header);
+    PROBE1(decode_end, image);
+    record_stage(metrics, STAGE_DECODE, start);
+    note_pixel_bytes(bitmap_bytes(image));
+    if (image == NULL) {
+        renditions.failedNode = FRAME_UNDECODABLE;
+    } else {
+        run_rendition_branch(&renditions, 0, image);
+        // The other branches ran alongside this thread's
+        note_pixel_bytes(
+                requestUsage.peakPixelBytes + renditions.peakPixelBytes);
+    }
+    if (renditions.failedNode == FRAME_OK) {
+        publish_renditions(args, &renditions, request, header, to);
+        free_renditions(&renditions);
+        free_request(request);
+    } else if (renditions.failedNode == FRAME_UNDECODABLE) {
+        invalid_image_response(to);
+        reject_renditions(args, &renditions, request);
+    } else {
+        failed_operation_response(
+                to, renditions.nodes[renditions.failedNode].operation);
+        free_renditions(&renditions);
+        free_request(request);
+    }
+    release_memory(args->server->memory, required);
+}
+
+/**
+ * reject_renditions()
+ * ----------------------
+ *  Once a fan-out request has been answered with an error, frees it and
+ *  updates the statistics
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  RenditionJob* renditions: the renditions requested
+ *  HttpRequest* request: a pointer to the HTTP request
+ */
+void reject_renditions(
+        ThreadArgs* args, RenditionJob* renditions, HttpRequest* request)
+{
+    free_renditions(renditions);
+    free_request(request);
+    pthread_mutex_lock(args->statsMutex);
+    args->stats->unSuccess++;
+    pthread_mutex_unlock(args->statsMutex);
+}
+
+/**
+ * compile_renditions()
+ * -----------------------
+ *  Compiles the operation chains of a fan-out request's query. Each chain is
+ *  written as the address of a single request would be, and chains are
+ *  separated by '&', e.g. "/scale,200,200&/crop,0,0,64,64/flip,h".
+ *
+ *  const char* query: the query, after the '?'
+ *  RenditionJob* renditions: where to store the chains, freed with
+ *  free_renditions() whether or not they are valid
+ *
+ *  Returns: true if there are between 1 and MAX_RENDITIONS chains and all
+ *  are valid, false else
+ */
+bool compile_renditions(const char* query, RenditionJob* renditions)
+{
+    renditions->chains = calloc(MAX_RENDITIONS, sizeof(Operation*));
+    renditions->locations = calloc(MAX_RENDITIONS, sizeof(char*));
+    const char* chain = query;
+    while (1) {
+        size_t length = strcspn(chain, "&");
+        if (renditions->numChains == MAX_RENDITIONS || chain[0] != '/') {
+            return false;
+        }
+        char* address = strndup(chain, length);
+        Operation* operations = compile_operations(address);
+        free(address);
+        if (operations == NULL) {
+            return false;
+        }
+        renditions->chains[renditions->numChains] = operations;
+        renditions->locations[renditions->numChains++]
+                = normalize_operations(operations);
+        if (chain[length] == '\0') {
+            return true;
+        }
+        chain += length + 1;
+    }
+}
+
+/**
+ * plan_renditions()
+ * --------------------
+ *  Plans each chain of a fan-out request as a single request's would be,
+ *  then merges them into a tree whose root is the decoded image, so that a
+ *  step is shared by every chain that reaches it by the same steps
+ *
+ *  RenditionJob* renditions: the renditions requested
+ *  ImageHeader header: the dimensions of the image
+ *
+ *  Returns: the estimated peak pixel memory of producing every rendition
+ */
+unsigned long long plan_renditions(
+        RenditionJob* renditions, ImageHeader header)
+{
+    // The branches may all run at once and none of them is streamed, so
+    // count each chain as if it decoded the whole image itself
+    ImageHeader whole = header;
+    whole.decoder = DECODER_FREEIMAGE;
+    whole.frames = 1;
+    unsigned long long required = 0;
+    int maxNodes = 1;
+    for (int i = 0; i < renditions->numChains; i++) {
+        plan_operations(header, &renditions->chains[i]);
+        required += estimate_peak_memory(whole, renditions->chains[i]);
+        for (int j = 0; renditions->chains[i][j].kind != OPERATION_END; j++) {
+            maxNodes++;
+        }
+    }
+    renditions->nodes = malloc(maxNodes * sizeof(RenditionNode));
+    renditions->nodes[0] = (RenditionNode){
+            {OPERATION_END, 0, 0, 0, 0}, -1, -1, false, NULL, 0};
+    renditions->numNodes = 1;
+    renditions->outputs = malloc(renditions->numChains * sizeof(int));
+    for (int i = 0; i < renditions->numChains; i++) {
+        int node = 0;
+        for (int j = 0; renditions->chains[i][j].kind != OPERATION_END; j++) {
+            node = rendition_child(renditions, node, renditions->chains[i][j]);
+        }
+        renditions->nodes[node].output = true;
+        renditions->outputs[i] = node;
+    }
+    return required;
+}
+
+/**
+ * rendition_child()
+ * --------------------
+ *  Finds the node continuing from another with a given step, adding it if
+ *  no chain so far has taken that step from there
+ *
+ *  RenditionJob* renditions: the renditions requested
+ *  int parent: the node to continue from
+ *  Operation step: the step to continue with
+ *
+ *  Returns: the child's node
+ */
+int rendition_child(RenditionJob* renditions, int parent, Operation step)
+{
+    RenditionNode* nodes = renditions->nodes;
+    int* link = &nodes[parent].firstChild;
+    while (*link >= 0) {
+        Operation existing = nodes[*link].operation;
+        if (existing.kind == step.kind && existing.value1 == step.value1
+                && existing.value2 == step.value2
+                && existing.value3 == step.value3
+                && existing.value4 == step.value4) {
+            return *link;
+        }
+        link = &nodes[*link].nextSibling;
+    }
+    *link = renditions->numNodes;
+    nodes[renditions->numNodes]
+            = (RenditionNode){step, -1, -1, false, NULL, 0};
+    return renditions->numNodes++;
+}
+
+/**
+ * decode_renditions()
+ * ----------------------
+ *  Decodes the image of a fan-out request once for all of its renditions.
+ *  If every chain starts with the same step, the decoder may perform it, as
+ *  for a single request, in which case its node is marked done.
+ *
+ *  RenditionJob* renditions: the renditions requested
+ *  HttpRequest* request: a pointer to the HTTP request
+ *  ImageHeader header: the dimensions and decoder of the image
+ *
+ *  Returns: the decoded image, or NULL if it is invalid
+ */
+FIBITMAP* decode_renditions(
+        RenditionJob* renditions, HttpRequest* request, ImageHeader header)
+{
+    RenditionNode* nodes = renditions->nodes;
+    int first = nodes[0].firstChild;
+    Operation program[2] = {
+            {OPERATION_END, 0, 0, 0, 0}, {OPERATION_END, 0, 0, 0, 0}};
+    if (!nodes[0].output && first >= 0 && nodes[first].nextSibling < 0) {
+        program[0] = nodes[first].operation;
+    }
+    renditions->decodedFirst = program[0].kind != OPERATION_END;
+    int decodedSteps;
+    FIBITMAP* image = decode_image(
+            request->body, request->len, header, program, &decodedSteps);
+    if (image != NULL && decodedSteps > 0) {
+        nodes[first].operation.kind = OPERATION_END;
+        pthread_mutex_lock(renditions->args->statsMutex);
+        renditions->args->stats->operations += decodedSteps;
+        pthread_mutex_unlock(renditions->args->statsMutex);
+    }
+    return image;
+}
+
+/**
+ * rendition_thread()
+ * ---------------------
+ *  The thread producing one branch of the tree of renditions. Its peak
+ *  pixel memory is added to the job's, for the request's thread to record,
+ *  since the usage of a worker thread is its own.
+ *
+ *  void* arg: the malloc'd RenditionBranch to produce
+ *
+ *  Returns: Null pointer
+ */
+void* rendition_thread(void* arg)
+{
+    RenditionBranch branch = *(RenditionBranch*)arg;
+    free(arg);
+    run_rendition_branch(branch.renditions, branch.node, branch.image);
+    pthread_mutex_lock(&branch.renditions->mutex);
+    branch.renditions->peakPixelBytes += requestUsage.peakPixelBytes;
+    pthread_mutex_unlock(&branch.renditions->mutex);
+    return NULL;
+}
+
+/**
+ * run_rendition_branch()
+ * -------------------------
+ *  Performs a node's step on an image and encodes the result if a chain
+ *  ends there, then continues with every node after it. Each further branch
+ *  takes a copy of the image on a thread of its own, and the last carries
+ *  on with the image on this thread. Returns once the whole branch is done.
+ *
+ *  RenditionJob* renditions: the renditions requested
+ *  int node: the node to start at
+ *  FIBITMAP* image: the image before the node's step, which is freed
+ */
+void run_rendition_branch(RenditionJob* renditions, int node, FIBITMAP* image)
+{
+    RenditionNode* step = &renditions->nodes[node];
+    Operation program[2] = {step->operation, {OPERATION_END, 0, 0, 0, 0}};
+    if (apply_operations(&image, program, renditions->args) != FRAME_OK) {
+        pthread_mutex_lock(&renditions->mutex);
+        if (renditions->failedNode == FRAME_OK) {
+            renditions->failedNode = node;
+        }
+        pthread_mutex_unlock(&renditions->mutex);
+        if (image != NULL) {
+            FreeImage_Unload(image);
+        }
+        return;
+    }
+    if (step->output) {
+        uint64_t start = now_ns();
+        PROBE0(encode_start);
+        step->data = fi_save_png_image_to_buffer(image, &step->numBytes);
+        PROBE1(encode_end, step->numBytes);
+        record_stage(renditions->args->server->metrics, STAGE_ENCODE, start);
+    }
+    // Every node leads to at least one chain's end, so a node has no more
+    // children than there are chains
+    pthread_t threads[MAX_RENDITIONS];
+    int numThreads = 0;
+    int child = step->firstChild;
+    while (child >= 0 && renditions->nodes[child].nextSibling >= 0) {
+        RenditionBranch* branch = malloc(sizeof(RenditionBranch));
+        *branch = (RenditionBranch){
+                renditions, child, FreeImage_Clone(image)};
+        pthread_create(&threads[numThreads++], NULL, rendition_thread, branch);
+        child = renditions->nodes[child].nextSibling;
+    }
+    if (child >= 0) {
+        run_rendition_branch(renditions, child, image);
+    } else {
+        FreeImage_Unload(image);
+    }
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/**
+ * publish_renditions()
+ * -----------------------
+ *  Stores each rendition in the cache under the key a single request for
+ *  its chain would have, then sends them all as a multipart/mixed response.
+ *  Each part carries the chain it was produced by as its Content-Location,
+ *  and the ETag of that single request. A rendition that is not what the
+ *  single request would send is neither cached nor given its ETag.
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  RenditionJob* renditions: the renditions, all produced
+ *  HttpRequest* request: a pointer to the HTTP request
+ *  ImageHeader header: the dimensions, decoder and frame count of the image
+ *  FILE* to: the file descriptor for sending the response through to
+ */
+void publish_renditions(ThreadArgs* args, RenditionJob* renditions,
+        HttpRequest* request, ImageHeader header, FILE* to)
+{
+    Sha256 ctx;
+    unsigned char inputHash[SHA256_BYTES];
+    sha256_init(&ctx);
+    sha256_update(&ctx, request->body, request->len);
+    sha256_final(&ctx, inputHash);
+    // PNG data is binary, so a boundary of random-looking hex from the input's
+    // hash is as unlikely to turn up in it as any
+    char boundary[sizeof("uqimage-") + BOUNDARY_KEY_BYTES * 2];
+    int length = sprintf(boundary, "uqimage-");
+    for (int i = 0; i < BOUNDARY_KEY_BYTES; i++) {
+        length += sprintf(boundary + length, "%02x", inputHash[i]);
+    }
+    char* body;
+    size_t numBytes;
+    FILE* out = open_memstream(&body, &numBytes);
+    for (int i = 0; i < renditions->numChains; i++) {
+        RenditionNode* node = &renditions->nodes[renditions->outputs[i]];
+        fprintf(out,
+                "--%s\r\nContent-Type: %s\r\nContent-Length: %lu\r\n"
+                "Content-Location: %s\r\n",
+                boundary, contentTypeNames[PNG_CONTENT], node->numBytes,
+                renditions->locations[i]);
+        if (rendition_matches_single(header, renditions->chains[i],
+                    renditions->decodedFirst)) {
+            unsigned char key[SHA256_BYTES];
+            char etag[ETAG_LENGTH + 1];
+            chain_job_key(inputHash, renditions->chains[i], key);
+            format_etag(key, etag);
+            if (args->server->cache != NULL) {
+                cache_insert(args->server->cache, key, node->data,
+                        node->numBytes, PNG_CONTENT);
+            }
+            fprintf(out, "ETag: %s\r\n", etag);
+        }
+        fputs("\r\n", out);
+        fwrite(node->data, sizeof(unsigned char), node->numBytes, out);
+        fputs("\r\n", out);
+    }
+    fprintf(out, "--%s--\r\n", boundary);
+    fclose(out);
+    uint64_t start = now_ns();
+    multipart_headers_response(to, numBytes, boundary);
+    fwrite(body, sizeof(char), numBytes, to);
+    fflush(to);
+    requestUsage.bytesOut += numBytes;
+    record_stage(args->server->metrics, STAGE_SEND, start);
+    free(body);
+    pthread_mutex_lock(args->statsMutex);
+    args->stats->success++;
+    pthread_mutex_unlock(args->statsMutex);
+}
+
+/**
+ * rendition_matches_single()
+ * -----------------------------
+ *  Whether a rendition is the PNG a single request for its chain would be
+ *  sent. A single request for an animated image is sent every frame as an
+ *  animated PNG, and one that rotates or flips a JPEG may be sent the JPEG
+ *  transformed losslessly, while a rendition is always a PNG of the first
+ *  frame. A single request that can be streamed is encoded by its own
+ *  pipeline, and one whose first step the decoder does (a crop, or a scale
+ *  it can reduce for) gets different pixels unless the renditions' decode
+ *  did that step too.
+ *
+ *  ImageHeader header: the dimensions, decoder and frame count of the image
+ *  Operation* operations: the rendition's planned chain
+ *  bool decodedFirst: whether the decoder was given the first step of every
+ *  chain
+ *
+ *  Returns: true if the single request would be sent the same bytes, false
+ *  if it might not be
+ */
+bool rendition_matches_single(
+        ImageHeader header, Operation* operations, bool decodedFirst)
+{
+    FREE_IMAGE_JPEG_OPERATION transform;
+    if (header.frames > 1 || streamable(header, operations)
+            || (decoder_first_step(header, operations) && !decodedFirst)) {
+        return false;
+    }
+    return header.decoder != DECODER_JPEG
+            || !compose_transform(operations, &transform);
+}
+
+/**
+ * decoder_first_step()
+ * -----------------------
+ *  Whether decode_image() would have the decoder do some of the first
+ *  operation: a crop it decodes only the region of, or a scale it decodes a
+ *  reduced image for
+ *
+ *  ImageHeader header: the dimensions and decoder of the image
+ *  Operation* operations: the operations to be performed
+ *
+ *  Returns: true if the decoder would do some of the first operation, false
+ *  otherwise
+ */
+bool decoder_first_step(ImageHeader header, Operation* operations)
+{
+    if (header.decoder == DECODER_FREEIMAGE) {
+        return false;
+    }
+    if (operations[0].kind == OPERATION_CROP) {
+        return true;
+    }
+    return operations[0].kind == OPERATION_SCALE
+            && decode_reduction(header, operations[0]) > 1;
+}
+
+/**
+ * multipart_headers_response()
+ * -------------------------------
+ *  Sends the status line and headers of a multipart/mixed success response,
+ *  leaving the caller to send the numBytes bytes of parts that follow
+ *
+ *  FILE* to: the fd for sending data to the client
+ *  unsigned long numBytes: the number of bytes in the parts
+ *  const char* boundary: the boundary between the parts
+ */
+void multipart_headers_response(
+        FILE* to, unsigned long numBytes, const char* boundary)
+{
+    HttpResponse response;
+    // Status
+    response.status = OK;
+    response.statusExplanation = "OK";
+    // Construct Headers
+    int numHeaders = 2;
+    response.headers = malloc((numHeaders + 1) * sizeof(HttpHeader*));
+    for (int i = 0; i < numHeaders; i++) {
+        response.headers[i] = malloc(sizeof(HttpHeader));
+    }
+    response.headers[0]->name = "Content-Type";
+    int length = snprintf(NULL, 0, "multipart/mixed; boundary=%s", boundary);
+    response.headers[0]->value = malloc(sizeof(char) * (length + 1));
+    snprintf(response.headers[0]->value, length + 1,
+            "multipart/mixed; boundary=%s", boundary);
+    response.headers[1]->name = "Content-Length";
+    length = snprintf(NULL, 0, "%ld", numBytes);
+    response.headers[1]->value = malloc(sizeof(char) * (length + 1));
+    snprintf(response.headers[1]->value, length + 1, "%ld", numBytes);
+    response.headers[2] = NULL;
+    unsigned char* message = construct_HTTP_response(response.status,
+            response.statusExplanation, response.headers, NULL, 0,
+            &response.len);
+    write_response(to, message, response.len);
+    for (int i = 0; i < numHeaders; i++) {
+        free(response.headers[i]->value);
+        free(response.headers[i]);
+    }
+    free(response.headers);
+    free(message);
+}
+
+/**
+ * free_renditions()
+ * --------------------
+ *  Frees the memory associated with the renditions of a fan-out request
+ *
+ *  RenditionJob* renditions: the renditions to free
+ */
+void free_renditions(RenditionJob* renditions)
+{
+    for (int i = 0; i < renditions->numChains; i++) {
+        free(renditions->chains[i]);
+        free(renditions->locations[i]);
+    }
+    free(renditions->chains);
+    free(renditions->locations);
+    free(renditions->outputs);
+    for (int i = 0; i < renditions->numNodes; i++) {
+        free(renditions->nodes[i].data);
+    }
+    free(renditions->nodes);
+    pthread_mutex_destroy(&renditions->mutex);
+}
+
+/**
+ * process_success()
+ * ----------------------
+ *  Upon success, process the results accordingly and free memory when needed
+ *
+ *  HttpRequest* request: a pointer to the http request
+ *  Operation** operations: a pointer to the array of operations
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  FIBITMAT** image: a pointer to the image
+ *  FILE* to: the file descriptor for sending the success response
+ *  const unsigned char* key: the job key to store the result under
+ *  InFlightJob* job: the in-flight job to hand the result to (NULL if none)
+ */
+void process_success(HttpRequest* request, Operation** operations,
+        ThreadArgs* args, FIBITMAP** image, FILE* to,
+        const unsigned char* key, InFlightJob* job)
+{
+    free_request(request);
+    free_operations(operations);
+    Metrics* metrics = args->server->metrics;
+    unsigned long numBytes;
+    uint64_t start = now_ns();
+    PROBE0(encode_start);
+    unsigned char* data = fi_save_png_image_to_buffer(*image, &numBytes);
+    PROBE1(encode_end, numBytes);
+    record_stage(metrics, STAGE_ENCODE, start);
+    note_pixel_bytes(bitmap_bytes(*image) + numBytes);
+    FreeImage_Unload(*image);
+    publish_result(args, to, key, job, data, numBytes, PNG_CONTENT);
+}
+
+/**
+ * publish_result()
+ * -------------------
+ *  Stores an encoded result in the cache and hands it to any identical
+ *  requests waiting on it, then sends it to the client and frees it
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  FILE* to: the file descriptor for sending the success response
+ *  const unsigned char* key: the job key to store the result under
+ *  InFlightJob* job: the in-flight job to hand the result to (NULL if none)
+ *  unsigned char* data: the encoded result
+ *  unsigned long numBytes: the number of bytes in the encoded result
+ *  uint32_t contentType: the content type of the encoded result
+ */
+void publish_result(ThreadArgs* args, FILE* to, const unsigned char* key,
+        InFlightJob* job, unsigned char* data, unsigned long numBytes,
+        uint32_t contentType)
+{
+    // Publish the result before sending it, so waiting duplicates (and any
+    // request arriving after the job leaves the table) need not wait on us
+    if (args->server->cache != NULL) {
+        cache_insert(args->server->cache, key, data, numBytes, contentType);
+    }
+    in_flight_finish(args->server->inFlight, job, data, numBytes, contentType);
+    uint64_t start = now_ns();
+    success_response(to, data, numBytes, key, contentType);
+    record_stage(args->server->metrics, STAGE_SEND, start);
+    free(data);
+    pthread_mutex_lock(args->statsMutex);
+    args->stats->success++;
+    pthread_mutex_unlock(args->statsMutex);
+}
+
+/**
+ * success_response()
+ * ----------------------
+ *  If the server was successful in processing all operations on the image,
+ *  sends a response back to the client with the image data and the
+ *  appropriate request
+ *
+ *  FILE* to: the fd for sending data to the client
+ *  unsigned char* data: the raw binary image data
+ *  usigned long numBytes: the number of bytes in the image data
+ *  const unsigned char* key: the job key the ETag is derived from
+ *  uint32_t contentType: the content type of the image data
+ */
+void success_response(FILE* to, unsigned char* data, unsigned long numBytes,
+        const unsigned char* key, uint32_t contentType)
+{
+    content_headers_response(to, numBytes, key, contentType);
+    fwrite(data, sizeof(unsigned char), numBytes, to);
+    fflush(to);
+    requestUsage.bytesOut += numBytes;
+}
+
+/**
+ * content_headers_response()
+ * -----------------------------
+ *  Sends the status line and headers of a success response, leaving the
+ *  caller to send the numBytes bytes of image data that follow
+ *
+ *  FILE* to: the fd for sending data to the client
+ *  unsigned long numBytes: the number of bytes in the image data
+ *  const unsigned char* key: the job key the ETag is derived from
+ *  uint32_t contentType: the content type of the image data
+ */
+void content_headers_response(FILE* to, unsigned long numBytes,
+        const unsigned char* key, uint32_t contentType)
+{
+    HttpResponse response;
+    // Status
+    response.status = OK;
+    response.statusExplanation = "OK";
+    char etag[ETAG_LENGTH + 1];
+    format_etag(key, etag);
+    // Construct Headers
+    int numHeaders = 3;
+    response.headers = malloc((numHeaders + 1) * sizeof(HttpHeader*));
+    for (int i = 0; i < numHeaders; i++) {
+        response.headers[i] = malloc(sizeof(HttpHeader));
+    }
+    response.headers[0]->name = "Content-Type";
+    response.headers[0]->value = (char*)contentTypeNames[contentType];
+    response.headers[1]->name = "Content-Length";
+    int length = snprintf(NULL, 0, "%ld", numBytes);
+    response.headers[1]->value = malloc(sizeof(char) * (length + 1));
+    snprintf(response.headers[1]->value, length + 1, "%ld", numBytes);
+    response.headers[2]->name = "ETag";
+    response.headers[2]->value = etag;
+    response.headers[3] = NULL;
+    unsigned char* message = construct_HTTP_response(response.status,
+            response.statusExplanation, response.headers, NULL, 0,
+            &response.len);
+    write_response(to, message, response.len);
+    free(response.headers[1]->value);
+    for (int i = 0; i < numHeaders; i++) {
+        free(response.headers[i]);
+    }
+    free(response.headers);
+    free(message);
+}
+
+/**
+ * chunked_headers_response()
+ * -----------------------------
+ *  Sends the status line and headers of a success response whose body
+ *  follows in chunks, as it is produced
+ *
+ *  FILE* to: the fd for sending data to the client
+ *  const unsigned char* key: the job key the ETag is derived from
+ *  uint32_t contentType: the content type of the image data
+ */
+void chunked_headers_response(
+        FILE* to, const unsigned char* key, uint32_t contentType)
+{
+    HttpResponse response;
+    // Status
+    response.status = OK;
+    response.statusExplanation = "OK";
+    char etag[ETAG_LENGTH + 1];
+    format_etag(key, etag);
+    // Construct Headers
+    int numHeaders = 3;
+    response.headers = malloc((numHeaders + 1) * sizeof(HttpHeader*));
+    for (int i = 0; i < numHeaders; i++) {
+        response.headers[i] = malloc(sizeof(HttpHeader));
+    }
+    response.headers[0]->name = "Content-Type";
+    response.headers[0]->value = (char*)contentTypeNames[contentType];
+    response.headers[1]->name = "Transfer-Encoding";
+    response.headers[1]->value = "chunked";
+    response.headers[2]->name = "ETag";
+    response.headers[2]->value = etag;
+    response.headers[3] = NULL;
+    unsigned char* message = construct_HTTP_response(response.status,
+            response.statusExplanation, response.headers, NULL, 0,
+            &response.len);
+    write_response(to, message, response.len);
+    for (int i = 0; i < numHeaders; i++) {
+        free(response.headers[i]);
+    }
+    free(response.headers);
+    free(message);
+}
+
+/**
+ * end_client_thread()
+ * ---------------------
+ *  Upon exiting the client thread, close the descriptors and update the
+ *  statistics accordingly
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  FILE* from: the fd for reading the requests
+ *  FILE* to: the fd for sending the requests
+ */
+void end_client_thread(ThreadArgs* args, FILE* from, FILE* to)
+{
+    fclose(from);
+    fclose(to);
+    pthread_mutex_lock(args->statsMutex);
+    args->stats->connected--;
+    args->stats->serviced++;
+    pthread_mutex_unlock(args->statsMutex);
+    if (args->maxGiven) {
+        sem_post(args->semaphore);
+    }
+}
+
+/**
+ * free_operations()
+ * -------------------
+ *  Frees the memory associated with the operation program
+ *
+ *  Operation** operations: a pointer to the program to free
+ */
+void free_operations(Operation** operations)
+{
+    free(*operations);
+}
+
+/**
+ * free_request()
+ * -----------------
+ *  Frees the memory associated with the HttpRequest
+ *
+ *  HttpRequest* request: A pointer to the HTTP request to free the memory of
+ */
+void free_request(HttpRequest* request)
+{
+    free(request->method);
+    free(request->address);
+    if (request->mapped > 0) {
+        munmap(request->body, request->mapped);
+    } else {
+        free(request->body);
+    }
+    free_array_of_headers(request->headers);
+}
+
+/**
+ * normalize_operations()
+ * -------------------------
+ *  Renders the operation list back into a canonical address, so that requests
+ *  spelling the same chain differently (e.g. "rotate,+045") share a key
+ *
+ *  Operation* operations: the array of operations to render
+ *
+ *  Returns: a malloc'd string of the normalized chain
+ */
+char* normalize_operations(Operation* operations)
+{
+    int numSteps = 0;
+    while (operations[numSteps].kind != OPERATION_END) {
+        numSteps++;
+    }
+    // Steps are fixed-size, so each renders in at most MAX_NORMALIZED_STEP
+    char* chain = malloc(sizeof(char) * (numSteps * MAX_NORMALIZED_STEP + 1));
+    size_t length = 0;
+    chain[0] = '\0';
+    for (int i = 0; i < numSteps; i++) {
+        chain[length++] = '/';
+        length += format_operation(operations[i], chain + length);
+    }
+    return chain;
+}
+
+/**
+ * format_operation()
+ * ---------------------
+ *  Renders a single operation in its canonical form, without the leading '/'
+ *
+ *  Operation operation: the operation to render
+ *  char* step: the buffer of MAX_NORMALIZED_STEP to render into
+ *
+ *  Returns: the number of characters written
+ */
+int format_operation(Operation operation, char* step)
+{
+    switch (operation.kind) {
+    case OPERATION_ROTATE:
+        return snprintf(step, MAX_NORMALIZED_STEP - 1, "%s,%d", ROTATE,
+                operation.value1);
+    case OPERATION_FLIP:
+        return snprintf(step, MAX_NORMALIZED_STEP - 1, "%s,%s", FLIP,
+                operation.value1 == FLIP_VERTICAL ? VERTICAL : HORIZONTAL);
+    case OPERATION_CROP:
+        return snprintf(step, MAX_NORMALIZED_STEP - 1, "%s,%d,%d,%d,%d", CROP,
+                operation.value1, operation.value2, operation.value3,
+                operation.value4);
+    default:
+        return snprintf(step, MAX_NORMALIZED_STEP - 1, "%s,%d,%d", SCALE,
+                operation.value1, operation.value2);
+    }
+}
+
+/**
+ * compute_job_key()
+ * --------------------
+ *  Computes the key identifying the result of a request: the SHA-256 of the
+ *  SHA-256 of the input image followed by the normalized operation chain
+ *
+ *  HttpRequest request: the request holding the input image
+ *  Operation* operations: the operations to be performed on the image
+ *  unsigned char* key: the buffer of SHA256_BYTES to write the key to
+ */
+void compute_job_key(
+        HttpRequest request, Operation* operations, unsigned char* key)
+{
+    Sha256 ctx;
+    unsigned char inputHash[SHA256_BYTES];
+    sha256_init(&ctx);
+    sha256_update(&ctx, request.body, request.len);
+    sha256_final(&ctx, inputHash);
+    chain_job_key(inputHash, operations, key);
+}
+
+/**
+ * chain_job_key()
+ * ------------------
+ *  Computes the key identifying the result of an operation chain on an input
+ *  image whose hash is already known, as compute_job_key() does
+ *
+ *  const unsigned char* inputHash: the SHA-256 of the input image
+ *  Operation* operations: the operations to be performed on the image
+ *  unsigned char* key: the buffer of SHA256_BYTES to write the key to
+ */
+void chain_job_key(const unsigned char* inputHash, Operation* operations,
+        unsigned char* key)
+{
+    Sha256 ctx;
+    char* chain = normalize_operations(operations);
+    sha256_init(&ctx);
+    sha256_update(&ctx, inputHash, SHA256_BYTES);
+    sha256_update(&ctx, (const unsigned char*)chain, strlen(chain));
+    sha256_final(&ctx, key);
+    free(chain);
+}
+
+/**
+ * sha256_init()
+ * ---------------
+ *  Initialises a SHA-256 digest
+ *
+ *  Sha256* ctx: the digest state to initialise
+ *
+ *  REF: FIPS 180-4, section 5.3.3 for the initial hash value
+ */
+void sha256_init(Sha256* ctx)
+{
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+            0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->bitLength = 0;
+    ctx->blockLength = 0;
+}
+
+/**
+ * sha256_update()
+ * -----------------
+ *  Feeds more of the message into a SHA-256 digest
+ *
+ *  Sha256* ctx: the digest state
+ *  const unsigned char* data: the message bytes
+ *  size_t len: the number of message bytes
+ */
+void sha256_update(Sha256* ctx, const unsigned char* data, size_t len)
+{
+    while (len > 0) {
+        // Whole blocks are compressed in place rather than copied first
+        if (ctx->blockLength == 0 && len >= SHA256_BLOCK) {
+            sha256_transform(ctx, data);
+            ctx->bitLength += SHA256_BLOCK * 8;
+            data += SHA256_BLOCK;
+            len -= SHA256_BLOCK;
+            continue;
+        }
+        ctx->block[ctx->blockLength++] = *data++;
+        len--;
+        if (ctx->blockLength == SHA256_BLOCK) {
+            sha256_transform(ctx, ctx->block);
+            ctx->bitLength += SHA256_BLOCK * 8;
+            ctx->blockLength = 0;
+        }
+    }
+}
+
+/**
+ * sha256_final()
+ * ----------------
+ *  Pads the message and writes out the final SHA-256 digest
+ *
+ *  Sha256* ctx: the digest state
+ *  unsigned char* digest: the buffer of SHA256_BYTES to write the digest to
+ */
+void sha256_final(Sha256* ctx, unsigned char* digest)
+{
+    uint64_t bitLength = ctx->bitLength + ctx->blockLength * 8;
+    unsigned char pad = 0x80;
+    sha256_update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->blockLength != SHA256_BLOCK - 8) {
+        sha256_update(ctx, &pad, 1);
+    }
+    for (int i = 7; i >= 0; i--) {
+        unsigned char byte = (unsigned char)(bitLength >> (i * 8));
+        sha256_update(ctx, &byte, 1);
+    }
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+/**
+ * sha256_transform()
+ * --------------------
+ *  Runs the SHA-256 compression function over one 64 byte block
+ *
+ *  Sha256* ctx: the digest state
+ *  const unsigned char* block: the block to compress
+ *
+ *  REF: FIPS 180-4, section 6.2.2
+ */
+void sha256_transform(Sha256* ctx, const unsigned char* block)
+{
+    static const uint32_t k[64] = {0x428a2f98, 0x71374491, 0xb5c0fbcf,
+            0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74,
+            0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+            0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc,
+            0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+            0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85,
+            0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb,
+            0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70,
+            0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3,
+            0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f,
+            0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+            0xc67178f2};
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24)
+                | ((uint32_t)block[i * 4 + 1] << 16)
+                | ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18)
+                ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19)
+                ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t v[8];
+    memcpy(v, ctx->state, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = ROTR(v[4], 6) ^ ROTR(v[4], 11) ^ ROTR(v[4], 25);
+        uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + ch + k[i] + w[i];
+        uint32_t s0 = ROTR(v[0], 2) ^ ROTR(v[0], 13) ^ ROTR(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        uint32_t t2 = s0 + maj;
+        memmove(v + 1, v, sizeof(uint32_t) * 7);
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+#undef ROTR
+    for (int i = 0; i < 8; i++) {
+        ctx->state[i] += v[i];
+    }
+}
+
+/**
+ * serve_from_cache()
+ * ---------------------
+ *  If the result of this request is already in the on-disk cache, sends it to
+ *  the client straight from the segment file, updates the statistics and
+ *  frees the request. If the response is cut short, the connection is shut
+ *  down, since the client can not tell where the next response would start.
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  HttpRequest* request: a pointer to the HTTP request
+ *  Operation** operations: a pointer to the array of operations
+ *  const unsigned char* key: the job key of the request
+ *  FILE* to: the file descriptor for sending the response through to
+ *
+ *  Returns: true if the response was served from the cache, false otherwise
+ */
+bool serve_from_cache(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, const unsigned char* key, FILE* to)
+{
+    uint64_t start = now_ns();
+    bool complete;
+    if (args->server->cache == NULL
+            || !cache_send_hit(args->server->cache, key, to, &complete)) {
+        return false;
+    }
+    record_stage(args->server->metrics, STAGE_SEND, start);
+    count_metric(&args->server->metrics->cacheHits);
+    requestUsage.cacheOutcome = CACHE_HIT;
+    free_operations(operations);
+    free_request(request);
+    if (!complete) {
+        shutdown(fileno(to), SHUT_RDWR);
+    }
+    pthread_mutex_lock(args->statsMutex);
+    if (complete) {
+        args->stats->success++;
+    } else {
+        args->stats->unSuccess++;
+    }
+    pthread_mutex_unlock(args->statsMutex);
+    return true;
+}
+
+/**
+ * open_disk_cache()
+ * --------------------
+ *  Opens (creating if needed) the on-disk result cache in the cache directory.
+ *  An index left behind by a previous run is reused as is, so the server
+ *  starts warm; if it is missing or does not match the segment, it is rebuilt
+ *  by scanning the segment's record headers.
+ *
+ *  CommandParameters params: the command line parameters struct
+ *
+ *  Returns: a pointer to the opened cache
+ */
+DiskCache* open_disk_cache(CommandParameters params)
+{
+    if (mkdir(params.cacheDir, S_IRWXU) < 0 && errno != EEXIST) {
+        cache_error(params);
+    }
+    DiskCache* cache = malloc(sizeof(DiskCache));
+    cache->maxBytes = params.cacheDiskBytes;
+    cache->segmentFd = open_cache_file(params, CACHE_SEGMENT_FILE);
+    int length = snprintf(
+            NULL, 0, "%s/%s", params.cacheDir, CACHE_SEGMENT_FILE);
+    cache->segmentPath = malloc(sizeof(char) * (length + 1));
+    snprintf(cache->segmentPath, length + 1, "%s/%s", params.cacheDir,
+            CACHE_SEGMENT_FILE);
+    cache->indexFd = open_cache_file(params, CACHE_INDEX_FILE);
+    // Two servers appending to the same segment would corrupt it
+    if (flock(cache->indexFd, LOCK_EX | LOCK_NB) < 0) {
+        cache_error(params);
+    }
+    uint64_t slotCount = CACHE_MIN_SLOTS;
+    while (slotCount < cache->maxBytes / CACHE_AVERAGE_ENTRY) {
+        slotCount *= 2;
+    }
+    cache->mapSize = sizeof(CacheIndexHeader) + slotCount * sizeof(CacheSlot);
+    struct stat indexStat;
+    fstat(cache->indexFd, &indexStat);
+    bool sizeMatches = (size_t)indexStat.st_size == cache->mapSize;
+    if (!sizeMatches && ftruncate(cache->indexFd, cache->mapSize) < 0) {
+        cache_error(params);
+    }
+    void* map = mmap(NULL, cache->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+            cache->indexFd, 0);
+    if (map == MAP_FAILED) {
+        cache_error(params);
+    }
+    cache->index = map;
+    cache->slots = (CacheSlot*)((char*)map + sizeof(CacheIndexHeader));
+    pthread_rwlock_init(&cache->lock, NULL);
+    if (!sizeMatches || !cache_index_valid(cache, slotCount)) {
+        cache_rebuild_index(cache, slotCount);
+    }
+    // Drop anything appended after the last committed record
+    if (ftruncate(cache->segmentFd, cache->index->segmentEnd) < 0) {
+        cache_error(params);
+    }
+    return cache;
+}
+
+/**
+ * open_cache_file()
+ * -------------------
+ *  Opens (creating if needed) a file within the cache directory
+ *
+ *  CommandParameters params: the command line parameters struct
+ *  const char* name: the name of the file within the cache directory
+ *
+ *  Returns: the fd of the opened file
+ */
+int open_cache_file(CommandParameters params, const char* name)
+{
+    int length = snprintf(NULL, 0, "%s/%s", params.cacheDir, name);
+    char* path = malloc(sizeof(char) * (length + 1));
+    snprintf(path, length + 1, "%s/%s", params.cacheDir, name);
+    int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    free(path);
+    if (fd < 0) {
+        cache_error(params);
+    }
+    return fd;
+}
+
+/**
+ * cache_index_valid()
+ * ----------------------
+ *  Checks that a mapped index was written by this version of the server for
+ *  the same number of slots, and describes no more data than the segment holds
+ *
+ *  DiskCache* cache: a pointer to the cache
+ *  uint64_t slotCount: the expected number of slots
+ *
+ *  Returns: true if the index can be used as is, false otherwise
+ */
+bool cache_index_valid(DiskCache* cache, uint64_t slotCount)
+{
+    struct stat segmentStat;
+    fstat(cache->segmentFd, &segmentStat);
+    return cache->index->magic == CACHE_INDEX_MAGIC
+            && cache->index->version == CACHE_VERSION
+            && cache->index->slotCount == slotCount
+            && cache->index->segmentEnd <= (uint64_t)segmentStat.st_size
+            && cache->index->segmentEnd <= cache->maxBytes;
+}
+
+/**
+ * cache_rebuild_index()
+ * ------------------------
+ *  Reinitialises the index and repopulates it by walking the records of the
+ *  segment, stopping at the first torn or unrecognised record
+ *
+ *  DiskCache* cache: a pointer to the cache
+ *  uint64_t slotCount: the number of slots in the index
+ */
+void cache_rebuild_index(DiskCache* cache, uint64_t slotCount)
+{
+    memset(cache->slots, 0, slotCount * sizeof(CacheSlot));
+    cache->index->magic = CACHE_INDEX_MAGIC;
+    cache->index->version = CACHE_VERSION;
+    cache->index->slotCount = slotCount;
+    cache->index->usedSlots = 0;
+    cache->index->segmentEnd = 0;
+    struct stat segmentStat;
+    fstat(cache->segmentFd, &segmentStat);
+    uint64_t segmentSize = (uint64_t)segmentStat.st_size;
+    if (segmentSize > cache->maxBytes) {
+        segmentSize = 0;
+    }
+    uint64_t offset = 0;
+    CacheRecordHeader record;
+    while (offset + sizeof(record) <= segmentSize
+            && pread(cache->segmentFd, &record, sizeof(record), offset)
+                    == sizeof(record)
+            && record.magic == CACHE_RECORD_MAGIC
+            && record.length <= segmentSize - offset - sizeof(record)
+            && (cache->index->usedSlots + 1) * 4 <= slotCount * 3) {
+        CacheSlot* slot = cache_find_slot(cache, record.key);
+        if (slot->length == 0) {
+            memcpy(slot->key, record.key, SHA256_BYTES);
+            cache->index->usedSlots++;
+        }
+        // A later record for the same key supersedes an earlier one
+        slot->offset = offset + sizeof(record);
+        slot->length = record.length;
+        offset += sizeof(record) + record.length;
+    }
+    cache->index->segmentEnd = offset;
+}
+
+/**
+ * cache_wipe()
+ * ---------------
+ *  Empties the cache once the segment or the index is full. Must be called
+ *  with the cache's write lock held. Hits may still be sending from the old
+ *  segment without the lock, so rather than being truncated and written
+ *  over, it is unlinked and replaced with a new file; their own fds keep it
+ *  until they are done.
+ *
+ *  DiskCache* cache: a pointer to the cache
+ *
+ *  Returns: true if the cache was emptied, false if no new segment could be
+ *  created, in which case it is left as it was
+ */
+bool cache_wipe(DiskCache* cache)
+{
+    if (unlink(cache->segmentPath) < 0) {
+        fprintf(stderr, "uqimageproc: unable to replace cache segment\n");
+        return false;
+    }
+    int fd = open(cache->segmentPath, O_RDWR | O_CREAT | O_EXCL,
+            S_IRUSR | S_IWUSR);
+    if (fd < 0 || dup2(fd, cache->segmentFd) < 0) {
+        // The old segment is gone from the directory, so anything it held
+        // would be lost on restart anyway; carry on in it
+        fprintf(stderr, "uqimageproc: unable to replace cache segment\n");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    close(fd);
+    memset(cache->slots, 0, cache->index->slotCount * sizeof(CacheSlot));
+    cache->index->usedSlots = 0;
+    cache->index->segmentEnd = 0;
+    return true;
+}
+
+/**
+ * cache_find_slot()
+ * --------------------
+ *  Linearly probes the index for the slot holding the given key. Must be
+ *  called with the cache's lock held.
+ *
+ *  DiskCache* cache: a pointer to the cache
+ *  const unsigned char* key: the job key to look for
+ *
+ *  Returns: the slot holding the key, or the empty slot where it would go
+ */
+CacheSlot* cache_find_slot(DiskCache* cache, const unsigned char* key)
+{
+    uint64_t mask = cache->index->slotCount - 1;
+    uint64_t hash;
+    memcpy(&hash, key, sizeof(hash));
+    for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+        CacheSlot* slot = &cache->slots[i];
+        if (slot->length == 0
+                || memcmp(slot->key, key, SHA256_BYTES) == 0) {
+            return slot;
+        }
+    }
+}
+
+/**
+ * cache_send_hit()
+ * -------------------
+ *  Looks up the key in the cache, and if present, sends a success response
+ *  whose body is copied by the kernel from the segment file to the socket.
+ *  Only the lookup is done under the lock: the record is sent from a
+ *  duplicate of the segment's fd, which a wipe replaces rather than
+ *  overwrites, so a slow client never holds up inserts.
+ *
+ *  DiskCache* cache: a pointer to the cache
+ *  const unsigned char* key: the job key to look up
+ *  FILE* to: the file descriptor for sending the response through to
+ *  bool* complete: set to whether the whole body was sent
+ *
+ *  Returns: true if the key was present and a response was started
+ */
+bool cache_send_hit(DiskCache* cache, const unsigned char* key, FILE* to,
+        bool* complete)
+{
+    pthread_rwlock_rdlock(&cache->lock);
+    CacheSlot* slot = cache_find_slot(cache, key);
+    CacheRecordHeader record;
+    if (slot->length == 0
+            || pread(cache->segmentFd, &record, sizeof(record),
+                       slot->offset - sizeof(record))
+                    != sizeof(record)
+            || record.magic != CACHE_RECORD_MAGIC
+            || memcmp(record.key, key, SHA256_BYTES) != 0
+            || record.contentType > JPEG_CONTENT) {
+        pthread_rwlock_unlock(&cache->lock);
+        return false;
+    }
+    off_t offset = slot->offset;
+    uint64_t length = slot->length;
+    int segmentFd = dup(cache->segmentFd);
+    pthread_rwlock_unlock(&cache->lock);
+    if (segmentFd < 0) {
+        return false;
+    }
+    content_headers_response(to, length, key, record.contentType);
+    uint64_t remaining = length;
+    while (remaining > 0) {
+        ssize_t sent = sendfile(fileno(to), segmentFd, &offset, remaining);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            break;
+        }
+        remaining -= sent;
+    }
+    close(segmentFd);
+    requestUsage.bytesOut += length - remaining;
+    *complete = remaining == 0;
+    return true;
+}
+
+/**
+ * cache_insert()
+ * -----------------
+ *  Appends an encoded result to the segment and publishes it in the index,
+ *  wiping the cache first if it has no room left
+ *
+ *  DiskCache* cache: a pointer to the cache
+ *  const unsigned char* key: the job key of the result
+ *  const unsigned char* data: the encoded result
+ *  unsigned long numBytes: the number of bytes in the encoded result
+ *  uint32_t contentType: the content type of the encoded result
+ */
+void cache_insert(DiskCache* cache, const unsigned char* key,
+        const unsigned char* data, unsigned long numBytes,
+        uint32_t contentType)
+{
+    CacheRecordHeader record;
+    uint64_t recordSize = sizeof(record) + numBytes;
+    if (numBytes == 0 || recordSize > cache->maxBytes) {
+        return;
+    }
+    pthread_rwlock_wrlock(&cache->lock);
+    if (cache_find_slot(cache, key)->length != 0) {
+        pthread_rwlock_unlock(&cache->lock);
+        return;
+    }
+    if (cache->index->segmentEnd + recordSize > cache->maxBytes
+            || (cache->index->usedSlots + 1) * 4
+                    > cache->index->slotCount * 3) {
+        if (!cache_wipe(cache)) {
+            pthread_rwlock_unlock(&cache->lock);
+            return;
+        }
+    }
+    memset(&record, 0, sizeof(record));
+    record.magic = CACHE_RECORD_MAGIC;
+    record.contentType = contentType;
+    memcpy(record.key, key, SHA256_BYTES);
+    record.length = numBytes;
+    uint64_t offset = cache->index->segmentEnd;
+    // The record must be fully written before the index points at it
+    if (write_all_at(cache->segmentFd, &record, sizeof(record), offset)
+            && write_all_at(cache->segmentFd, data, numBytes,
+                    offset + sizeof(record))) {
+        CacheSlot* slot = cache_find_slot(cache, key);
+        memcpy(slot->key, key, SHA256_BYTES);
+        slot->offset = offset + sizeof(record);
+        slot->length = numBytes;
+        cache->index->usedSlots++;
+        cache->index->segmentEnd = offset + recordSize;
+    }
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+/**
+ * write_all_at()
+ * -----------------
+ *  Writes the whole buffer to the given offset of a file, retrying short
+ *  writes
+ *
+ *  int fd: the file to write to
+ *  const void* data: the data to write
+ *  size_t len: the number of bytes to write
+ *  off_t offset: the offset in the file to write at
+ *
+ *  Returns: true if everything was written, false otherwise
+ */
+bool write_all_at(int fd, const void* data, size_t len, off_t offset)
+{
+    const char* bytes = data;
+    while (len > 0) {
+        ssize_t written = pwrite(fd, bytes, len, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        len -= written;
+        offset += written;
+    }
+    return true;
+}
+
+/**
+ * cache_error()
+ * ----------------
+ *  If the cache directory cannot be opened or set up, print the appropriate
+ *  message to stderr and exit with the appropriate code
+ *
+ *  CommandParameters params: the command line parameters struct
+ */
+void cache_error(CommandParameters params)
+{
+    fprintf(stderr, "uqimageproc: unable to use cache directory \"%s\"\n",
+            params.cacheDir);
+    exit(FAILED_CACHE);
+}
+
+/**
+ * join_in_flight()
+ * -------------------
+ *  Registers this request's job in the in-flight table. If an identical job
+ *  is already being computed by another thread, waits for it instead, and
+ *  sends its result to the client. If that job failed, this thread computes
+ *  the request itself so the client gets the appropriate error response.
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  HttpRequest* request: a pointer to the HTTP request
+ *  Operation** operations: a pointer to the array of operations
+ *  const unsigned char* key: the job key of the request
+ *  FILE* to: the file descriptor for sending the response through to
+ *  InFlightJob** job: set to the job this thread must finish (NULL if none)
+ *
+ *  Returns: true if the response was served from another thread's job
+ */
+bool join_in_flight(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, const unsigned char* key, FILE* to,
+        InFlightJob** job)
+{
+    bool leader;
+    InFlightJob* found = in_flight_acquire(args->server->inFlight, key, &leader);
+    if (leader) {
+        *job = found;
+        return false;
+    }
+    *job = NULL;
+    uint64_t start = now_ns();
+    in_flight_wait(args->server->inFlight, found);
+    record_stage(args->server->metrics, STAGE_QUEUE_WAIT, start);
+    if (found->data == NULL) {
+        in_flight_release(args->server->inFlight, found);
+        return false;
+    }
+    free_operations(operations);
+    free_request(request);
+    success_response(
+            to, found->data, found->numBytes, key, found->contentType);
+    in_flight_release(args->server->inFlight, found);
+    count_metric(&args->server->metrics->coalesced);
+    requestUsage.cacheOutcome = CACHE_COALESCED;
+    pthread_mutex_lock(args->statsMutex);
+    args->stats->success++;
+    pthread_mutex_unlock(args->statsMutex);
+    return true;
+}
+
+/**
+ * create_in_flight_table()
+ * ---------------------------
+ *  Creates an empty table of in-flight jobs
+ *
+ *  Returns: a pointer to the new table
+ */
+InFlightTable* create_in_flight_table()
+{
+    InFlightTable* table = malloc(sizeof(InFlightTable));
+    pthread_mutex_init(&table->mutex, NULL);
+    memset(table->buckets, 0, sizeof(table->buckets));
+    return table;
+}
+
+/**
+ * in_flight_acquire()
+ * ----------------------
+ *  Finds the in-flight job for the key, or creates one if there is none, and
+ *  takes a reference to it
+ *
+ *  InFlightTable* table: a pointer to the in-flight table
+ *  const unsigned char* key: the job key to look up
+ *  bool* leader: set to true if the job was created, meaning this thread must
+ *  compute it and call in_flight_finish()
+ *
+ *  Returns: a pointer to the job
+ */
+InFlightJob* in_flight_acquire(
+        InFlightTable* table, const unsigned char* key, bool* leader)
+{
+    uint64_t hash;
+    memcpy(&hash, key, sizeof(hash));
+    InFlightJob** bucket = &table->buckets[hash % IN_FLIGHT_BUCKETS];
+    pthread_mutex_lock(&table->mutex);
+    for (InFlightJob* job = *bucket; job != NULL; job = job->next) {
+        if (memcmp(job->key, key, SHA256_BYTES) == 0) {
+            job->references++;
+            pthread_mutex_unlock(&table->mutex);
+            *leader = false;
+            return job;
+        }
+    }
+    InFlightJob* job = malloc(sizeof(InFlightJob));
+    memcpy(job->key, key, SHA256_BYTES);
+    job->references = 1;
+    job->done = false;
+    job->data = NULL;
+    job->numBytes = 0;
+    job->contentType = PNG_CONTENT;
+    pthread_cond_init(&job->finished, NULL);
+    job->next = *bucket;
+    *bucket = job;
+    pthread_mutex_unlock(&table->mutex);
+    *leader = true;
+    return job;
+}
+
+/**
+ * in_flight_wait()
+ * -------------------
+ *  Blocks until the computing thread has finished the job
+ *
+ *  InFlightTable* table: a pointer to the in-flight table
+ *  InFlightJob* job: the job to wait on
+ */
+void in_flight_wait(InFlightTable* table, InFlightJob* job)
+{
+    pthread_mutex_lock(&table->mutex);
+    while (!job->done) {
+        pthread_cond_wait(&job->finished, &table->mutex);
+    }
+    pthread_mutex_unlock(&table->mutex);
+}
+
+/**
+ * in_flight_finish()
+ * ---------------------
+ *  Removes a job from the table, hands a copy of its result to any waiting
+ *  threads, and drops the computing thread's reference
+ *
+ *  InFlightTable* table: a pointer to the in-flight table
+ *  InFlightJob* job: the job to finish (ignored if NULL)
+ *  const unsigned char* data: the encoded result (NULL if the job failed)
+ *  unsigned long numBytes: the number of bytes in the encoded result
+ *  uint32_t contentType: the content type of the encoded result
+ */
+void in_flight_finish(InFlightTable* table, InFlightJob* job,
+        const unsigned char* data, unsigned long numBytes,
+        uint32_t contentType)
+{
+    if (job == NULL) {
+        return;
+    }
+    uint64_t hash;
+    memcpy(&hash, job->key, sizeof(hash));
+    pthread_mutex_lock(&table->mutex);
+    InFlightJob** link = &table->buckets[hash % IN_FLIGHT_BUCKETS];
+    while (*link != job) {
+        link = &(*link)->next;
+    }
+    *link = job->next;
+    // Only copy the result if someone is waiting for it
+    if (data != NULL && job->references > 1) {
+        job->data = malloc(sizeof(unsigned char) * numBytes);
+        memcpy(job->data, data, numBytes);
+        job->numBytes = numBytes;
+        job->contentType = contentType;
+    }
+    job->done = true;
+    pthread_cond_broadcast(&job->finished);
+    pthread_mutex_unlock(&table->mutex);
+    in_flight_release(table, job);
+}
+
+/**
+ * in_flight_release()
+ * ----------------------
+ *  Drops a reference to a finished job, freeing it once no thread holds it
+ *
+ *  InFlightTable* table: a pointer to the in-flight table
+ *  InFlightJob* job: the job to release
+ */
+void in_flight_release(InFlightTable* table, InFlightJob* job)
+{
+    pthread_mutex_lock(&table->mutex);
+    bool last = --job->references == 0;
+    pthread_mutex_unlock(&table->mutex);
+    if (last) {
+        pthread_cond_destroy(&job->finished);
+        free(job->data);
+        free(job);
+    }
+}
+
+/**
+ * format_etag()
+ * ----------------
+ *  Formats the strong ETag for a job key: the key in hex, in double quotes
+ *
+ *  const unsigned char* key: the job key
+ *  char* etag: a buffer of at least ETAG_LENGTH + 1 chars to write to
+ */
+void format_etag(const unsigned char* key, char* etag)
+{
+    etag[0] = '"';
+    for (int i = 0; i < SHA256_BYTES; i++) {
+        snprintf(etag + 1 + i * 2, 3, "%02x", key[i]);
+    }
+    etag[ETAG_LENGTH - 1] = '"';
+    etag[ETAG_LENGTH] = '\0';
+}
+
+/**
+ * get_header()
+ * --------------
+ *  Finds the value of a header in a request, ignoring the case of its name
+ *
+ *  HttpHeader** headers: the NULL terminated array of request headers
+ *  const char* name: the name of the header to find
+ *
+ *  Returns: the value of the first matching header, or NULL if there is none
+ */
+char* get_header(HttpHeader** headers, const char* name)
+{
+    for (int i = 0; headers != NULL && headers[i] != NULL; i++) {
+        if (strcasecmp(headers[i]->name, name) == 0) {
+            return headers[i]->value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * etag_matches()
+ * -----------------
+ *  Checks whether an If-None-Match list contains the given ETag. Weak tags
+ *  (W/"...") are compared by their opaque value, as If-None-Match requires,
+ *  and a value of "*" matches any ETag.
+ *
+ *  const char* ifNoneMatch: the comma separated list of entity tags, or "*"
+ *  const char* etag: the strong ETag to look for
+ *
+ *  Returns: true if the ETag is in the list, false otherwise
+ */
+bool etag_matches(const char* ifNoneMatch, const char* etag)
+{
+    const char* tag = ifNoneMatch + strspn(ifNoneMatch, " \t");
+    if (*tag == '*' && tag[1 + strspn(tag + 1, " \t")] == '\0') {
+        return true;
+    }
+    while (*tag != '\0') {
+        while (*tag == ' ' || *tag == '\t' || *tag == ',') {
+            tag++;
+        }
+        if (strncmp(tag, "W/", 2) == 0) {
+            tag += 2;
+        }
+        size_t length = strcspn(tag, ", \t");
+        if (length == ETAG_LENGTH && strncmp(tag, etag, ETAG_LENGTH) == 0) {
+            return true;
+        }
+        tag += length;
+    }
+    return false;
+}
+
+/**
+ * serve_not_modified()
+ * -----------------------
+ *  If the request's If-None-Match header names the ETag its result would
+ *  have, sends a 304 response without decoding the image, updates the
+ *  statistics and frees the request
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  HttpRequest* request: a pointer to the HTTP request
+ *  Operation** operations: a pointer to the array of operations
+ *  const unsigned char* key: the job key of the request
+ *  FILE* to: the file descriptor for sending the response through to
+ *
+ *  Returns: true if a 304 response was sent, false otherwise
+ */
+bool serve_not_modified(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, const unsigned char* key, FILE* to)
+{
+    char* ifNoneMatch = get_header(request->headers, "If-None-Match");
+    char etag[ETAG_LENGTH + 1];
+    format_etag(key, etag);
+    if (ifNoneMatch == NULL || !etag_matches(ifNoneMatch, etag)) {
+        return false;
+    }
+    free_operations(operations);
+    free_request(request);
+    not_modified_response(to, etag);
+    count_metric(&args->server->metrics->notModified);
+    requestUsage.cacheOutcome = CACHE_NOT_MODIFIED;
+    pthread_mutex_lock(args->statsMutex);
+    args->stats->success++;
+    pthread_mutex_unlock(args->statsMutex);
+    return true;
+}
+
+/**
+ * not_modified_response()
+ * --------------------------
+ *  Sends a 304 Not Modified response carrying the ETag, with no body
+ *
+ *  FILE* to: the fd for sending data to the client
+ *  const char* etag: the ETag of the result the client already holds
+ */
+void not_modified_response(FILE* to, const char* etag)
+{
+    HttpResponse response;
+    // Status
+    response.status = NOT_MODIFIED;
+    response.statusExplanation = "Not Modified";
+    // Construct Headers
+    int numHeaders = 1;
+    response.headers = malloc((numHeaders + 1) * sizeof(HttpHeader*));
+    response.headers[0] = malloc(sizeof(HttpHeader));
+    response.headers[0]->name = "ETag";
+    response.headers[0]->value = (char*)etag;
+    response.headers[1] = NULL;
+    unsigned char* message = construct_HTTP_response(response.status,
+            response.statusExplanation, response.headers, NULL, 0,
+            &response.len);
+    write_response(to, message, response.len);
+    free(response.headers[0]);
+    free(response.headers);
+    free(message);
+}
+
+/**
+ * plan_request()
+ * -----------------
+ *  Reads the dimensions of the image from its header and plans the cheapest
+ *  order to perform the operations in for an image of that size. If the
+ *  header cannot be read, sends the appropriate response, updates the
+ *  statistics and frees the request.
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  HttpRequest* request: a pointer to the HTTP request
+ *  Operation** operations: a pointer to the array of operations, replaced by
+ *          the planned array
+ *  FILE* to: the file descriptor for sending the response through to
+ *  ImageHeader* header: set to the dimensions of the image
+ *
+ *  Returns: true if the request may go ahead, false if it was rejected
+ */
+bool plan_request(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, FILE* to, ImageHeader* header)
+{
+    if (!probe_image_header(request->body, request->len, header)) {
+        invalid_image(args, operations, request, to);
+        return false;
+    }
+    plan_operations(*header, operations);
+    return true;
+}
+
+/**
+ * within_memory_budget()
+ * -------------------------
+ *  Estimates the peak pixel memory of decoding the image and performing every
+ *  operation on it. If the estimate exceeds the per-request budget, sends the
+ *  appropriate response, updates the statistics and frees the request, all
+ *  before any pixel memory is allocated.
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  HttpRequest* request: a pointer to the HTTP request
+ *  Operation** operations: a pointer to the array of operations
+ *  FILE* to: the file descriptor for sending the response through to
+ *  ImageHeader header: the dimensions of the image
+ *  unsigned long long* required: set to the estimated peak pixel memory
+ *
+ *  Returns: true if the request may go ahead, false if it was rejected
+ */
+bool within_memory_budget(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, FILE* to, ImageHeader header,
+        unsigned long long* required)
+{
+    *required = estimate_peak_memory(header, *operations);
+    if (*required <= args->server->requestBudget) {
+        return true;
+    }
+    free_operations(operations);
+    free_request(request);
+    memory_budget_response(to, *required);
+    pthread_mutex_lock(args->statsMutex);
+    args->stats->unSuccess++;
+    pthread_mutex_unlock(args->statsMutex);
+    return false;
+}
+
+/**
+ * probe_image_header()
+ * -----------------------
+ *  Reads the dimensions of an image without decoding it, parsing the headers
+ *  of the common formats directly and asking FreeImage for a pixel-less load
+ *  of anything else
+ *
+ *  const unsigned char* data: the encoded image
+ *  unsigned long len: the number of bytes in the encoded image
+ *  ImageHeader* header: the struct to fill in
+ *
+ *  Returns: true if the dimensions were read, false if the image is invalid
+ */
+bool probe_image_header(
+        const unsigned char* data, unsigned long len, ImageHeader* header)
+{
+    bool found;
+    header->decoder = DECODER_FREEIMAGE;
+    header->frames = 1;
+    if (len >= PNG_SIGNATURE_LENGTH
+            && memcmp(data, "\x89PNG\r\n\x1a\n", PNG_SIGNATURE_LENGTH) == 0) {
+        found = probe_png(data, len, header);
+    } else if (len >= 2 && data[0] == 0xFF && data[1] == 0xD8) {
+        found = probe_jpeg(data, len, header);
+    } else if (len >= 6
+            && (memcmp(data, "GIF87a", 6) == 0
+                    || memcmp(data, "GIF89a", 6) == 0)) {
+        found = probe_gif(data, len, header);
+    } else if (len >= 2 && data[0] == 'B' && data[1] == 'M') {
+        found = probe_bmp(data, len, header);
+    } else {
+        found = probe_freeimage(data, len, header);
+    }
+    return found && header->width > 0 && header->height > 0
+            && header->width <= MAX_PROBE_DIMENSION
+            && header->height <= MAX_PROBE_DIMENSION;
+}
+
+/**
+ * probe_png()
+ * -------------
+ *  Reads the dimensions of a PNG image from its IHDR chunk. An RGB image
+ *  with a transparent colour (a tRNS chunk) is decoded by FreeImage with an
+ *  alpha channel, so it is counted as RGBA and never decoded by scanline.
+ *
+ *  const unsigned char* data: the encoded image
+ *  unsigned long len: the number of bytes in the encoded image
+ *  ImageHeader* header: the struct to fill in
+ *
+ *  Returns: true if the dimensions were read, false otherwise
+ */
+bool probe_png(
+        const unsigned char* data, unsigned long len, ImageHeader* header)
+{
+    // Channels FreeImage decodes each colour type to (gray+alpha -> RGBA)
+    static const unsigned int channels[] = {1, 0, 3, 1, 4, 0, 4};
+    if (len < PNG_IHDR_END || memcmp(data + 12, "IHDR", 4) != 0) {
+        return false;
+    }
+    unsigned int bitDepth = data[24];
+    unsigned int colourType = data[25];
+    if (colourType >= sizeof(channels) / sizeof(channels[0])
+            || channels[colourType] == 0) {
+        return false;
+    }
+    header->width = read_big_endian(data + 16, 4);
+    header->height = read_big_endian(data + 20, 4);
+    header->bytesPerPixel = channels[colourType];
+    bool transparentColour
+            = colourType == 2 && png_has_transparency(data, len);
+    if (transparentColour) {
+        header->bytesPerPixel = 4;
+    }
+    if (bitDepth == 16 && colourType != 3) {
+        header->bytesPerPixel *= 2;
+    }
+    // See open_png_stream()
+    if (len > PNG_IHDR_INTERLACE && bitDepth == 8
+            && (colourType == 2 || colourType == 6)
+            && data[PNG_IHDR_INTERLACE] == 0 && !transparentColour) {
+        header->decoder = DECODER_PNG;
+    }
+    return true;
+}
+
+/**
+ * png_has_transparency()
+ * -------------------------
+ *  Checks whether a PNG has a tRNS chunk, which must come before its first
+ *  IDAT chunk
+ *
+ *  const unsigned char* data: the encoded image
+ *  unsigned long len: the number of bytes in the encoded image
+ *
+ *  Returns: true if a tRNS chunk was found, false otherwise
+ */
+bool png_has_transparency(const unsigned char* data, unsigned long len)
+{
+    unsigned long pos = PNG_SIGNATURE_LENGTH;
+    while (pos + PNG_CHUNK_OVERHEAD <= len) {
+        unsigned long chunk = read_big_endian(data + pos, 4);
+        if (memcmp(data + pos + 4, "tRNS", 4) == 0) {
+            return true;
+        }
+        if (memcmp(data + pos + 4, "IDAT", 4) == 0
+                || chunk > len - pos - PNG_CHUNK_OVERHEAD) {
+            return false;
+        }
+        pos += chunk + PNG_CHUNK_OVERHEAD;
+    }
+    return false;
+}
+
+/**
+ * probe_jpeg()
+ * --------------
+ *  Reads the dimensions of a JPEG image by walking its marker segments to the
+ *  first start-of-frame marker
+ *
+ *  const unsigned char* data: the encoded image
+ *  unsigned long len: the number of bytes in the encoded image
+ *  ImageHeader* header: the struct to fill in
+ *
+ *  Returns: true if the dimensions were read, false otherwise
+ */
+bool probe_jpeg(
+        const unsigned char* data, unsigned long len, ImageHeader* header)
+{
+    unsigned long pos = 2;
+    while (pos + 4 <= len) {
+        if (data[pos] != 0xFF) {
+            return false;
+        }
+        unsigned char marker = data[pos + 1];
+        if (marker == 0xFF) {
+            // Fill byte
+            pos++;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            // Standalone markers carry no length
+            pos += 2;
+            continue;
+        }
+        unsigned long segmentLength = read_big_endian(data + pos + 2, 2);
+        bool startOfFrame = marker >= 0xC0 && marker <= 0xCF
+                && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+        if (startOfFrame) {
+            if (pos + 10 > len) {
+                return false;
+            }
+            header->height = read_big_endian(data + pos + 5, 2);
+            header->width = read_big_endian(data + pos + 7, 2);
+            // Greyscale has one component, CMYK (or YCCK) four
+            unsigned int components = data[pos + 9];
+            header->bytesPerPixel
+                    = components == 1 || components == 4 ? components : 3;
+            // See open_jpeg_stream()
+            if (components == 1 || components == 3) {
+                header->decoder = DECODER_JPEG;
+            }
+            return true;
+        }
+        if (marker == 0xD9 || marker == 0xDA || segmentLength < 2) {
+            return false;
+        }
+        pos += 2 + segmentLength;
+    }
+    return false;
+}
+
+/**
+ * probe_gif()
+ * -------------
+ *  Reads the dimensions of a GIF image: the larger of its logical screen and
+ *  its first frame, since a frame may claim to be bigger than the screen.
+ *  The frames are counted by skipping over their data.
+ *
+ *  const unsigned char* data: the encoded image
+ *  unsigned long len: the number of bytes in the encoded image
+ *  ImageHeader* header: the struct to fill in
+ *
+ *  Returns: true if the dimensions were read, false otherwise
+ */
+bool probe_gif(
+        const unsigned char* data, unsigned long len, ImageHeader* header)
+{
+    if (len < GIF_HEADER_LENGTH) {
+        return false;
+    }
+    header->width = read_little_endian(data + 6, 2);
+    header->height = read_little_endian(data + 8, 2);
+    // Frames may be composited into a 32 bit screen
+    header->bytesPerPixel = 4;
+    unsigned long pos = GIF_HEADER_LENGTH;
+    if (data[10] & 0x80) {
+        pos += 3UL << ((data[10] & 0x07) + 1);
+    }
+    while (pos < len && data[pos] == 0x21) {
+        // Skip the extension label, then its data sub-blocks
+        pos += 2;
+        while (pos < len && data[pos] != 0) {
+            pos += data[pos] + 1;
+        }
+        pos++;
+    }
+    if (pos + 9 > len || data[pos] != 0x2C) {
+        return false;
+    }
+    unsigned long frameWidth = read_little_endian(data + pos + 5, 2);
+    unsigned long frameHeight = read_little_endian(data + pos + 7, 2);
+    header->width = frameWidth > header->width ? frameWidth : header->width;
+    header->height
+            = frameHeight > header->height ? frameHeight : header->height;
+    header->frames = count_gif_frames(data, len, pos);
+    return true;
+}
+
+/**
+ * count_gif_frames()
+ * ---------------------
+ *  Counts the frames of a GIF image by walking its blocks up to the trailer
+ *  or the end of the data
+ *
+ *  const unsigned char* data: the encoded image
+ *  unsigned long len: the number of bytes in the encoded image
+ *  unsigned long pos: the offset of the first image descriptor
+ *
+ *  Returns: the number of frames, at least 1
+ */
+unsigned long count_gif_frames(
+        const unsigned char* data, unsigned long len, unsigned long pos)
+{
+    unsigned long frames = 0;
+    while (pos < len && data[pos] != 0x3B) {
+        if (data[pos] == 0x2C) {
+            if (pos + 10 > len) {
+                break;
+            }
+            frames++;
+            unsigned char flags = data[pos + 9];
+            pos += 10;
+            if (flags & 0x80) {
+                pos += 3UL << ((flags & 0x07) + 1);
+            }
+            // The LZW minimum code size comes before the image data
+            pos++;
+        } else if (data[pos] == 0x21) {
+            pos += 2;
+        } else {
+            break;
+        }
+        while (pos < len && data[pos] != 0) {
+            pos += data[pos] + 1;
+        }
+        pos++;
+    }
+    return frames > 0 ? frames : 1;
+}
+
+/**
+ * probe_bmp()
+ * -------------
+ *  Reads the dimensions of a BMP image from its DIB header
+ *
+ *  const unsigned char* data: the encoded image
+ *  unsigned long len: the number of bytes in the encoded image
+ *  ImageHeader* header: the struct to fill in
+ *
+ *  Returns: true if the dimensions were read, false otherwise
+ */
+bool probe_bmp(
+        const unsigned char* data, unsigned long len, ImageHeader* header)
+{
+    if (len < BMP_HEADER_END) {
+        return false;
+    }
+    unsigned int bitsPerPixel;
+    if (read_little_endian(data + 14, 4) == 12) {
+        // OS/2 core header with 16 bit dimensions
+        header->width = read_little_endian(data + 18, 2);
+        header->height = read_little_endian(data + 20, 2);
+        bitsPerPixel = read_little_endian(data + 24, 2);
+    } else {
+        if (len < BMP_HEADER_END + 4) {
+            return false;
+        }
+        int32_t width = (int32_t)read_little_endian(data + 18, 4);
+        // A negative height means the rows are stored top-down
+        int32_t height = (int32_t)read_little_endian(data + 22, 4);
+        header->width = width < 0 ? 0 : (unsigned long)width;
+        header->height = height < 0 ? -(unsigned long)height
+                                    : (unsigned long)height;
+        bitsPerPixel = read_little_endian(data + 28, 2);
+    }
+    header->bytesPerPixel = bitsPerPixel <= 8 ? 1 : (bitsPerPixel + 7) / 8;
+    return true;
+}
+
+/**
+ * probe_freeimage()
+ * --------------------
+ *  Reads the dimensions of an image in a less common format by asking
+ *  FreeImage to load its header only, and the number of pages of a TIFF
+ *
+ *  const unsigned char* data: the encoded image
+ *  unsigned long len: the number of bytes in the encoded image
+ *  ImageHeader* header: the struct to fill in
+ *
+ *  Returns: true if the dimensions were read, false otherwise
+ */
+bool probe_freeimage(
+        const unsigned char* data, unsigned long len, ImageHeader* header)
+{
+    FIMEMORY* memory = FreeImage_OpenMemory((BYTE*)data, len);
+    FREE_IMAGE_FORMAT format = FreeImage_GetFileTypeFromMemory(memory, 0);
+    FIBITMAP* bitmap = NULL;
+    if (format != FIF_UNKNOWN) {
+        bitmap = FreeImage_LoadFromMemory(format, memory, FIF_LOAD_NOPIXELS);
+    }
+    FIMULTIBITMAP* pages = NULL;
+    if (bitmap != NULL && format == FIF_TIFF) {
+        pages = FreeImage_LoadMultiBitmapFromMemory(format, memory, 0);
+    }
+    if (pages != NULL) {
+        int count = FreeImage_GetPageCount(pages);
+        header->frames = count > 1 ? count : 1;
+        FreeImage_CloseMultiBitmap(pages, 0);
+    }
+    FreeImage_CloseMemory(memory);
+    if (bitmap == NULL) {
+        return false;
+    }
+    header->width = FreeImage_GetWidth(bitmap);
+    header->height = FreeImage_GetHeight(bitmap);
+    header->bytesPerPixel = (FreeImage_GetBPP(bitmap) + 7) / 8;
+    FreeImage_Unload(bitmap);
+    return true;
+}
+
+/**
+ * read_big_endian()
+ * --------------------
+ *  Reads an unsigned big-endian integer
+ *
+ *  const unsigned char* data: the bytes of the integer
+ *  int numBytes: the number of bytes in the integer
+ *
+ *  Returns: the integer
+ */
+unsigned long read_big_endian(const unsigned char* data, int numBytes)
+{
+    unsigned long value = 0;
+    for (int i = 0; i < numBytes; i++) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+/**
+ * read_little_endian()
+ * -----------------------
+ *  Reads an unsigned little-endian integer
+ *
+ *  const unsigned char* data: the bytes of the integer
+ *  int numBytes: the number of bytes in the integer
+ *
+ *  Returns: the integer
+ */
+unsigned long read_little_endian(const unsigned char* data, int numBytes)
+{
+    unsigned long value = 0;
+    for (int i = numBytes - 1; i >= 0; i--) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+/**
+ * estimate_peak_memory()
+ * -------------------------
+ *  Estimates the largest amount of pixel memory held at once while decoding
+ *  the image, performing each operation (which holds its input and output
+ *  bitmaps, plus any intermediate) and encoding the result. The frames of a
+ *  multi-frame image are 32 bit, and one is in progress on each thread.
+ *  Resampling (rotating or rescaling) a palettised or greyscale bitmap
+ *  gives a 24 or 32 bit one, so from the first resampling operation on,
+ *  fewer than 3 bytes per pixel are counted as 4.
+ *
+ *  ImageHeader header: the dimensions of the input image
+ *  Operation* operations: the operations to be performed
+ *
+ *  Returns: the estimated peak in bytes
+ */
+unsigned long long estimate_peak_memory(
+        ImageHeader header, Operation* operations)
+{
+    if (streamable(header, operations)) {
+        return stream_peak_memory(header, operations);
+    }
+    unsigned long long bytesPerPixel
+            = header.frames > 1 ? 4 : header.bytesPerPixel;
+    unsigned long long width = header.width;
+    unsigned long long height = header.height;
+    int first = 0;
+    if (operations[0].kind == OPERATION_CROP
+            && header.decoder != DECODER_FREEIMAGE) {
+        // Only the region is decoded, a scanline or an MCU row at a time
+        Region region = crop_region(operations[0], width, height);
+        width = region.width;
+        height = region.height;
+        first = 1;
+    } else if (operations[0].kind == OPERATION_SCALE) {
+        // The scale may start from a reduced decode
+        unsigned int reduction = decode_reduction(header, operations[0]);
+        width = (width + reduction - 1) / reduction;
+        height = (height + reduction - 1) / reduction;
+    }
+    unsigned long long current = width * height * bytesPerPixel;
+    unsigned long long peak = current;
+    for (int i = first; operations[i].kind != OPERATION_END; i++) {
+        unsigned long long step = current;
+        if ((operations[i].kind == OPERATION_ROTATE
+                    || operations[i].kind == OPERATION_SCALE)
+                && bytesPerPixel < 3) {
+            bytesPerPixel = 4;
+        }
+        if (operations[i].kind == OPERATION_ROTATE) {
+            rotated_dimensions(operations[i].value1, &width, &height);
+            if (operations[i].value1 % DEGREES_RIGHT_ANGLE != 0) {
+                // Arbitrary angles are rotated by shearing through an
+                // intermediate as large as the bounding box
+                step += width * height * bytesPerPixel;
+            }
+            current = width * height * bytesPerPixel;
+            step += current;
+        } else if (operations[i].kind == OPERATION_FLIP) {
+            // Flips are done in place with a one row buffer
+            step += width * bytesPerPixel;
+        } else if (operations[i].kind == OPERATION_CROP) {
+            Region region = crop_region(operations[i], width, height);
+            width = region.width;
+            height = region.height;
+            current = width * height * bytesPerPixel;
+            step += current;
+        } else if (operations[i].kind == OPERATION_SCALE) {
+            // Rescaling filters horizontally into an intermediate first
+            unsigned long long newWidth = operations[i].value1;
+            step += newWidth * height * bytesPerPixel;
+            width = newWidth;
+            height = operations[i].value2;
+            current = width * height * bytesPerPixel;
+            step += current;
+        }
+        peak = step > peak ? step : peak;
+    }
+    // Encoding holds the final image and, at worst, an uncompressed PNG
+    peak = current * 2 > peak ? current * 2 : peak;
+    return peak * frame_workers(header.frames);
+}
+
+/**
+ * rotated_dimensions()
+ * -----------------------
+ *  Finds the dimensions of an image after rotating it. Arbitrary angles give
+ *  the bounding box of the rotated image.
+ *
+ *  int angle: the angle to rotate by in degrees
+ *  unsigned long long* width: the width, updated in place
+ *  unsigned long long* height: the height, updated in place
+ */
+void rotated_dimensions(
+        int angle, unsigned long long* width, unsigned long long* height)
+{
+    if (angle % DEGREES_RIGHT_ANGLE != 0) {
+        double radians = angle * M_PI / DEGREES_HALF_TURN;
+        unsigned long long newWidth = (unsigned long long)ceil(
+                *width * fabs(cos(radians)) + *height * fabs(sin(radians)));
+        *height = (unsigned long long)ceil(
+                *width * fabs(sin(radians)) + *height * fabs(cos(radians)));
+        *width = newWidth;
+    } else if ((angle / DEGREES_RIGHT_ANGLE) % 2 != 0) {
+        unsigned long long swap = *width;
+        *width = *height;
+        *height = swap;
+    }
+}
+
+/**
+ * memory_budget_response()
+ * ---------------------------
+ *  If processing the image would need more pixel memory than a request may
+ *  use, construct the appropriate response to send to the client
+ *
+ *  FILE* to: the fd for sending the response to
+ *  unsigned long long required: the estimated pixel memory needed
+ */
+void memory_budget_response(FILE* to, unsigned long long required)
+{
+    HttpResponse response;
+    // Status
+    response.status = PAYLOAD_TOO_LARGE;
+    response.statusExplanation = "Payload Too Large";
+    // Body
+    int length = snprintf(NULL, 0,
+            "Image needs too much memory to process: %llu bytes\n", required);
+    // Allocate memory for the unsigned char* destination
+    response.body = malloc(sizeof(unsigned char) * (length + 1));
+    snprintf((char*)response.body, length + 1,
+            "Image needs too much memory to process: %llu bytes\n", required);
+    response.bodySize = strlen((const char*)response.body);
+    // Construct Headers
+    int numHeaders = 2;
+    response.headers = malloc((numHeaders + 1) * sizeof(HttpHeader*));
+    for (int i = 0; i < numHeaders; i++) {
+        response.headers[i] = malloc(sizeof(HttpHeader));
+    }
+    response.headers[0]->name = "Content-Type";
+    response.headers[0]->value = "text/plain";
+    response.headers[1]->name = "Content-Length";
+    length = snprintf(NULL, 0, "%ld", response.bodySize);
+    response.headers[1]->value = malloc(sizeof(char) * (length + 1));
+    snprintf(response.headers[1]->value, length + 1, "%ld", response.bodySize);
+    response.headers[2] = NULL;
+    unsigned char* message = construct_HTTP_response(response.status,
+            response.statusExplanation, response.headers, response.body,
+            response.bodySize, &response.len);
+    write_response(to, message, response.len);
+    free(response.headers[1]->value);
+    free((char*)response.body);
+    for (int i = 0; i < numHeaders; i++) {
+        free(response.headers[i]);
+    }
+    free(response.headers);
+    free(message);
+}
+
+/**
+ * plan_operations()
+ * --------------------
+ *  Reorders the operations so that, for an image of the given size, as few
+ *  pixel bytes as possible are touched, e.g. doing a downscale before the
+ *  flips and rotations instead of after them. Adjacent steps that commute
+ *  are swapped whenever doing so strictly lowers the cost, until no swap
+ *  does; every swap gives the same image as the order requested, up to
+ *  resampling.
+ *
+ *  ImageHeader header: the dimensions of the input image
+ *  Operation** operations: a pointer to the array of operations, reordered in
+ *          place and reallocated if a step must be added
+ */
+void plan_operations(ImageHeader header, Operation** operations)
+{
+    int numSteps = 0;
+    while ((*operations)[numSteps].kind != OPERATION_END) {
+        numSteps++;
+    }
+    unsigned int bytesPerPixel = header.bytesPerPixel;
+    bool improved = true;
+    // Each swap lowers the cost, so this ends anyway, but bound the passes
+    for (int pass = 0; improved && pass <= numSteps; pass++) {
+        improved = false;
+        unsigned long long width = header.width;
+        unsigned long long height = header.height;
+        for (int i = 0; i + 1 < numSteps; i++) {
+            Operation* program = *operations;
+            Operation swapped[MAX_COMMUTED_STEPS];
+            int numSwapped = commute_steps(
+                    width, height, program[i], program[i + 1], swapped);
+            unsigned long long pairWidth = width;
+            unsigned long long pairHeight = height;
+            unsigned long long before = operation_cost(
+                    program[i], &pairWidth, &pairHeight, bytesPerPixel);
+            before += operation_cost(
+                    program[i + 1], &pairWidth, &pairHeight, bytesPerPixel);
+            unsigned long long after = 0;
+            pairWidth = width;
+            pairHeight = height;
+            for (int j = 0; j < numSwapped; j++) {
+                after += operation_cost(
+                        swapped[j], &pairWidth, &pairHeight, bytesPerPixel);
+            }
+            if (numSwapped > 0 && after < before) {
+                if (numSwapped > 2) {
+                    // Room for the extra steps, and the end marker
+                    program = realloc(program,
+                            (numSteps + numSwapped - 1) * sizeof(Operation));
+                    memmove(program + i + numSwapped, program + i + 2,
+                            (numSteps - i - 1) * sizeof(Operation));
+                    numSteps += numSwapped - 2;
+                    *operations = program;
+                }
+                memcpy(program + i, swapped, numSwapped * sizeof(Operation));
+                improved = true;
+            }
+            operation_cost(program[i], &width, &height, bytesPerPixel);
+        }
+    }
+}
+
+/**
+ * commute_steps()
+ * ------------------
+ *  Finds steps giving the same image as an adjacent pair of steps with the
+ *  pair's order reversed. Flips commute with scales, and right-angle
+ *  rotations do too once the scale's sides are swapped. A scale after an
+ *  arbitrary rotation may move ahead of it only if it scales both sides
+ *  alike. A crop may move ahead of a flip or half turn.
+ *
+ *  unsigned long long width: the width of the image before the pair
+ *  unsigned long long height: the height of the image before the pair
+ *  Operation first: the first step of the pair
+ *  Operation second: the step after it
+ *  Operation* swapped: the buffer of MAX_COMMUTED_STEPS to write the steps to
+ *
+ *  Returns: the number of steps written, or 0 if the pair cannot be swapped
+ */
+int commute_steps(unsigned long long width, unsigned long long height,
+        Operation first, Operation second, Operation* swapped)
+{
+    if ((first.kind == OPERATION_FLIP && second.kind == OPERATION_SCALE)
+            || (first.kind == OPERATION_SCALE
+                    && second.kind == OPERATION_FLIP)) {
+        swapped[0] = second;
+        swapped[1] = first;
+        return 2;
+    }
+    if (second.kind == OPERATION_CROP) {
+        return crop_before_mirror(width, height, first, second, swapped);
+    }
+    if ((first.kind != OPERATION_ROTATE || second.kind != OPERATION_SCALE)
+            && (first.kind != OPERATION_SCALE
+                    || second.kind != OPERATION_ROTATE)) {
+        return 0;
+    }
+    Operation rotate = first.kind == OPERATION_ROTATE ? first : second;
+    Operation scale = first.kind == OPERATION_SCALE ? first : second;
+    if (rotate.value1 % DEGREES_RIGHT_ANGLE != 0) {
+        return first.kind == OPERATION_ROTATE
+                ? scale_before_rotation(width, height, rotate, scale, swapped)
+                : 0;
+    }
+    if ((rotate.value1 / DEGREES_RIGHT_ANGLE) % 2 != 0) {
+        int swap = scale.value1;
+        scale.value1 = scale.value2;
+        scale.value2 = swap;
+    }
+    swapped[0] = first.kind == OPERATION_ROTATE ? scale : rotate;
+    swapped[1] = first.kind == OPERATION_ROTATE ? rotate : scale;
+    return 2;
+}
+
+/**
+ * crop_before_mirror()
+ * -----------------------
+ *  Moves a crop ahead of the flip or half turn before it, mirroring the
+ *  region it keeps, so that the image is cropped as early as possible
+ *
+ *  unsigned long long width: the width of the image before the pair
+ *  unsigned long long height: the height of the image before the pair
+ *  Operation mirror: the flip or rotation
+ *  Operation crop: the crop after it
+ *  Operation* swapped: the buffer of MAX_COMMUTED_STEPS to write the steps to
+ *
+ *  Returns: the number of steps written, or 0 if the crop cannot be moved
+ */
+int crop_before_mirror(unsigned long long width, unsigned long long height,
+        Operation mirror, Operation crop, Operation* swapped)
+{
+    bool halfTurn = mirror.kind == OPERATION_ROTATE
+            && mirror.value1 % DEGREES_HALF_TURN == 0;
+    if (mirror.kind != OPERATION_FLIP && !halfTurn) {
+        return 0;
+    }
+    Region region = crop_region(crop, width, height);
+    if (region.width == 0 || region.height == 0) {
+        return 0;
+    }
+    // Turning by 0 or 360 degrees mirrors nothing
+    bool mirrorX = (mirror.kind == OPERATION_FLIP
+                           && mirror.value1 == FLIP_HORIZONTAL)
+            || (halfTurn && mirror.value1 % (DEGREES_HALF_TURN * 2) != 0);
+    bool mirrorY = (mirror.kind == OPERATION_FLIP
+                           && mirror.value1 == FLIP_VERTICAL)
+            || (halfTurn && mirror.value1 % (DEGREES_HALF_TURN * 2) != 0);
+    swapped[0] = (Operation){OPERATION_CROP,
+            mirrorX ? width - region.x - region.width : region.x,
+            mirrorY ? height - region.y - region.height : region.y,
+            region.width, region.height};
+    swapped[1] = mirror;
+    return 2;
+}
+
+/**
+ * scale_before_rotation()
+ * --------------------------
+ *  Moves a scale ahead of the arbitrary rotation before it, if it scales the
+ *  rotation's bounding box by the same factor (within PLAN_UNIFORM_TOLERANCE)
+ *  on both sides. The input is scaled by that factor instead, and as the
+ *  bounding box of the smaller image rounds differently, the rotation's
+ *  output is then scaled once more to exactly the size requested.
+ *
+ *  unsigned long long width: the width of the image before the rotation
+ *  unsigned long long height: the height of the image before the rotation
+ *  Operation rotate: the rotation
+ *  Operation scale: the scale after it
+ *  Operation* swapped: the buffer of MAX_COMMUTED_STEPS to write the steps to
+ *
+ *  Returns: the number of steps written, or 0 if the scale cannot be moved
+ */
+int scale_before_rotation(unsigned long long width, unsigned long long height,
+        Operation rotate, Operation scale, Operation* swapped)
+{
+    unsigned long long rotatedWidth = width;
+    unsigned long long rotatedHeight = height;
+    rotated_dimensions(rotate.value1, &rotatedWidth, &rotatedHeight);
+    double scaleX = (double)scale.value1 / rotatedWidth;
+    double scaleY = (double)scale.value2 / rotatedHeight;
+    if (fabs(scaleX - scaleY)
+            > PLAN_UNIFORM_TOLERANCE * (scaleX > scaleY ? scaleX : scaleY)) {
+        return 0;
+    }
+    double factor = (scaleX + scaleY) / 2;
+    long newWidth = lround(width * factor);
+    long newHeight = lround(height * factor);
+    if (newWidth < SCALE_MIN || newWidth > SCALE_MAX || newHeight < SCALE_MIN
+            || newHeight > SCALE_MAX) {
+        return 0;
+    }
+    swapped[0] = (Operation){OPERATION_SCALE, newWidth, newHeight, 0, 0};
+    swapped[1] = rotate;
+    swapped[2] = scale;
+    return 3;
+}
+
+/**
+ * operation_cost()
+ * -------------------
+ *  Estimates the pixel bytes an operation reads and writes, the planner's
+ *  measure of its work, and advances the dimensions past it
+ *
+ *  Operation operation: the operation to cost
+ *  unsigned long long* width: the width of its input, updated to its output
+ *  unsigned long long* height: the height of its input, updated to its output
+ *  unsigned int bytesPerPixel: the bytes per pixel of the image
+ *
+ *  Returns: the estimated bytes touched
+ */
+unsigned long long operation_cost(Operation operation,
+        unsigned long long* width, unsigned long long* height,
+        unsigned int bytesPerPixel)
+{
+    unsigned long long input = *width * *height * bytesPerPixel;
+    if (operation.kind == OPERATION_FLIP) {
+        // Flips read and write every pixel in place
+        return input * 2;
+    }
+    if (operation.kind == OPERATION_CROP) {
+        // Crops read and write only the region they keep
+        Region region = crop_region(operation, *width, *height);
+        *width = region.width;
+        *height = region.height;
+        return *width * *height * bytesPerPixel * 2;
+    }
+    if (operation.kind == OPERATION_ROTATE) {
+        rotated_dimensions(operation.value1, width, height);
+        unsigned long long output = *width * *height * bytesPerPixel;
+        // Arbitrary angles also write and read back the sheared intermediate
+        return operation.value1 % DEGREES_RIGHT_ANGLE != 0
+                ? input + output * 3
+                : input + output;
+    }
+    // Rescaling writes a horizontally filtered intermediate, then reads it
+    unsigned long long intermediate
+            = (unsigned long long)operation.value1 * *height * bytesPerPixel;
+    *width = operation.value1;
+    *height = operation.value2;
+    return input + intermediate * 2 + *width * *height * bytesPerPixel;
+}
+
+/**
+ * program_cost()
+ * -----------------
+ *  Estimates the pixel bytes every operation reads and writes in total
+ *
+ *  ImageHeader header: the dimensions of the input image
+ *  Operation* operations: the operations to be performed
+ *
+ *  Returns: the estimated bytes touched
+ */
+unsigned long long program_cost(ImageHeader header, Operation* operations)
+{
+    unsigned long long width = header.width;
+    unsigned long long height = header.height;
+    unsigned long long cost = 0;
+    for (int i = 0; operations[i].kind != OPERATION_END; i++) {
+        cost += operation_cost(
+                operations[i], &width, &height, header.bytesPerPixel);
+    }
+    return cost;
+}
+
+/**
+ * explain_requested()
+ * ----------------------
+ *  Checks whether the client asked for the plan rather than the image, with
+ *  an "X-Explain: 1" header
+ *
+ *  HttpRequest request: the HTTP request
+ *
+ *  Returns: true if the plan should be sent instead
+ */
+bool explain_requested(HttpRequest request)
+{
+    char* explain = get_header(request.headers, EXPLAIN_HEADER);
+    return explain != NULL && strcmp(explain, "1") == 0;
+}
+
+/**
+ * explain_plan()
+ * -----------------
+ *  Sends back how the request would be processed instead of processing it:
+ *  the dimensions of the input, the cost of the chain as requested and as
+ *  planned, with the dimensions and cost of each step, and the peak memory
+ *  of the plan. Updates the statistics and frees the request.
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  HttpRequest* request: a pointer to the HTTP request
+ *  Operation** operations: a pointer to the planned array of operations
+ *  ImageHeader header: the dimensions of the input image
+ *  FILE* to: the file descriptor for sending the response through to
+ */
+void explain_plan(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, ImageHeader header, FILE* to)
+{
+    // The request has been checked already, so this cannot fail
+    Operation* requested = compile_operations(request->address);
+    char* buffer;
+    size_t bufferSize;
+    FILE* text = open_memstream(&buffer, &bufferSize);
+    fprintf(text, "input: %lux%lu, %u bytes per pixel\n", header.width,
+            header.height, header.bytesPerPixel);
+    write_plan(text, "requested", header, requested);
+    write_plan(text, "planned", header, *operations);
+    fprintf(text, "peak memory: %llu bytes (budget %lu)\n",
+            estimate_peak_memory(header, *operations),
+            args->server->requestBudget);
+    fclose(text);
+    free_operations(&requested);
+    free_operations(operations);
+    free_request(request);
+    explain_response(to, buffer, bufferSize);
+    free(buffer);
+    pthread_mutex_lock(args->statsMutex);
+    args->stats->success++;
+    pthread_mutex_unlock(args->statsMutex);
+}
+
+/**
+ * write_plan()
+ * ---------------
+ *  Writes an operation chain's total cost, then each step with the
+ *  dimensions it takes the image between and its own cost
+ *
+ *  FILE* text: the stream to write to
+ *  const char* label: what the chain is
+ *  ImageHeader header: the dimensions of the input image
+ *  Operation* operations: the operations to be performed
+ */
+void write_plan(FILE* text, const char* label, ImageHeader header,
+        Operation* operations)
+{
+    fprintf(text, "%s: cost %llu bytes\n", label,
+            program_cost(header, operations));
+    unsigned long long width = header.width;
+    unsigned long long height = header.height;
+    for (int i = 0; operations[i].kind != OPERATION_END; i++) {
+        char step[MAX_NORMALIZED_STEP];
+        format_operation(operations[i], step);
+        unsigned long long inWidth = width;
+        unsigned long long inHeight = height;
+        unsigned long long cost = operation_cost(
+                operations[i], &width, &height, header.bytesPerPixel);
+        fprintf(text, "  %-20s %llux%llu -> %llux%llu  %llu bytes\n", step,
+                inWidth, inHeight, width, height, cost);
+    }
+}
+
+/**
+ * explain_response()
+ * ---------------------
+ *  Constructs the response holding an explained plan and sends it back to
+ *  the client
+ *
+ *  FILE* to: the fd for sending the response to
+ *  const char* body: the text of the plan
+ *  size_t bodySize: the number of bytes in the plan
+ */
+void explain_response(FILE* to, const char* body, size_t bodySize)
+{
+    HttpResponse response;
+    // Status
+    response.status = OK;
+    response.statusExplanation = "OK";
+    // Body
+    response.body = (const unsigned char*)body;
+    response.bodySize = bodySize;
+    // Construct Headers
+    int numHeaders = 2;
+    response.headers = malloc((numHeaders + 1) * sizeof(HttpHeader*));
+    for (int i = 0; i < numHeaders; i++) {
+        response.headers[i] = malloc(sizeof(HttpHeader));
+    }
+    response.headers[0]->name = "Content-Type";
+    response.headers[0]->value = "text/plain";
+    response.headers[1]->name = "Content-Length";
+    int length = snprintf(NULL, 0, "%ld", response.bodySize);
+    response.headers[1]->value = malloc(sizeof(char) * (length + 1));
+    snprintf(response.headers[1]->value, length + 1, "%ld", response.bodySize);
+    response.headers[2] = NULL;
+    unsigned char* message = construct_HTTP_response(response.status,
+            response.statusExplanation, response.headers, response.body,
+            response.bodySize, &response.len);
+    write_response(to, message, response.len);
+    free(response.headers[1]->value);
+    for (int i = 0; i < numHeaders; i++) {
+        free(response.headers[i]);
+    }
+    free(response.headers);
+    free(message);
+}
+
+/**
+ * create_memory_accountant()
+ * -----------------------------
+ *  Creates the global memory accountant with nothing reserved
+ *
+ *  CommandParameters params: the command line parameters struct
+ *
+ *  Returns: a pointer to the new accountant
+ */
+MemoryAccountant* create_memory_accountant(CommandParameters params)
+{
+    MemoryAccountant* memory = malloc(sizeof(MemoryAccountant));
+    pthread_mutex_init(&memory->mutex, NULL);
+    pthread_cond_init(&memory->released, NULL);
+    memory->budget = params.memoryBudget;
+    memory->reserved = 0;
+    memory->reservations = 0;
+    memory->waiting = 0;
+    memory->maxWaiting = params.admissionQueue;
+    memory->nextTicket = 0;
+    memory->headTicket = 0;
+    memory->shed = 0;
+    return memory;
+}
+
+/**
+ * admit_request()
+ * ------------------
+ *  Reserves the request's estimated pixel memory from the global budget,
+ *  waiting in the admission queue if need be. If the queue is full, sends a
+ *  503 response, finishes the in-flight job as failed, updates the
+ *  statistics and frees the request.
+ *
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  HttpRequest* request: a pointer to the HTTP request
+ *  Operation** operations: a pointer to the array of operations
+ *  InFlightJob* job: the in-flight job this thread is computing
+ *  FILE* to: the file descriptor for sending the response through to
+ *  unsigned long long* required: the estimated memory, clamped to the budget
+ *  so that a single large request can still run on its own
+ *
+ *  Returns: true if the memory was reserved, false if the request was shed
+ */
+bool admit_request(ThreadArgs* args, HttpRequest* request,
+        Operation** operations, InFlightJob* job, FILE* to,
+        unsigned long long* required)
+{
+    MemoryAccountant* memory = args->server->memory;
+    if (memory == NULL) {
+        return true;
+    }
+    if (*required > memory->budget) {
+        *required = memory->budget;
+    }
+    uint64_t start = now_ns();
+    bool reserved = reserve_memory(memory, *required);
+    record_stage(args->server->metrics, STAGE_QUEUE_WAIT, start);
+    if (reserved) {
+        return true;
+    }
+    in_flight_finish(args->server->inFlight, job, NULL, 0, PNG_CONTENT);
+    free_operations(operations);
+    free_request(request);
+    overloaded_response(to);
+    pthread_mutex_lock(args->statsMutex);
+    args->stats->unSuccess++;
+    pthread_mutex_unlock(args->statsMutex);
+    return false;
+}
+
+/**
+ * reserve_memory()
+ * -------------------
+ *  Reserves bytes from the accountant. If they do not fit, or others are
+ *  already queued, joins the back of the queue and blocks until this request
+ *  is at the head and the bytes fit.
+ *
+ *  MemoryAccountant* memory: a pointer to the accountant
+ *  unsigned long long bytes: the number of bytes to reserve
+ *
+ *  Returns: true if reserved, false if the queue was full
+ */
+bool reserve_memory(MemoryAccountant* memory, unsigned long long bytes)
+{
+    pthread_mutex_lock(&memory->mutex);
+    if (memory->waiting > 0 || memory->reserved + bytes > memory->budget) {
+        if (memory->waiting >= memory->maxWaiting) {
+            memory->shed++;
+            pthread_mutex_unlock(&memory->mutex);
+            return false;
+        }
+        unsigned long ticket = memory->nextTicket++;
+        memory->waiting++;
+        while (ticket != memory->headTicket
+                || memory->reserved + bytes > memory->budget) {
+            pthread_cond_wait(&memory->released, &memory->mutex);
+        }
+        memory->waiting--;
+        memory->headTicket++;
+        // The new head may fit in what is left
+        pthread_cond_broadcast(&memory->released);
+    }
+    memory->reserved += bytes;
+    memory->reservations++;
+    pthread_mutex_unlock(&memory->mutex);
+    return true;
+}
+
+/**
+ * release_memory()
+ * -------------------
+ *  Returns reserved bytes to the accountant and wakes the queue
+ *
+ *  MemoryAccountant* memory: a pointer to the accountant (ignored if NULL)
+ *  unsigned long long bytes: the number of bytes to release
+ */
+void release_memory(MemoryAccountant* memory, unsigned long long bytes)
+{
+    if (memory == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&memory->mutex);
+    memory->reserved -= bytes;
+    memory->reservations--;
+    pthread_cond_broadcast(&memory->released);
+    pthread_mutex_unlock(&memory->mutex);
+}
+
+/**
+ * overloaded_response()
+ * ------------------------
+ *  If the server has no memory to spare for the request and its admission
+ *  queue is full, construct the appropriate response to send to the client
+ *
+ *  FILE* to: the fd for sending the response to
+ */
+void overloaded_response(FILE* to)
+{
+    HttpResponse response;
+    // Status
+    response.status = SERVICE_UNAVAILABLE;
+    response.statusExplanation = "Service Unavailable";
+    // Body
+    response.body = (const unsigned char*)"Server is overloaded\n";
+    response.bodySize = strlen((const char*)response.body);
+    // Construct Headers
+    int numHeaders = 3;
+    response.headers = malloc((numHeaders + 1) * sizeof(HttpHeader*));
+    for (int i = 0; i < numHeaders; i++) {
+        response.headers[i] = malloc(sizeof(HttpHeader));
+    }
+    response.headers[0]->name = "Content-Type";
+    response.headers[0]->value = "text/plain";
+    response.headers[1]->name = "Content-Length";
+    int length = snprintf(NULL, 0, "%ld", response.bodySize);
+    response.headers[1]->value = malloc(sizeof(char) * (length + 1));
+    snprintf(response.headers[1]->value, length + 1, "%ld", response.bodySize);
+    response.headers[2]->name = "Retry-After";
+    response.headers[2]->value = RETRY_AFTER_SECONDS;
+    response.headers[3] = NULL;
+    unsigned char* message = construct_HTTP_response(response.status,
+            response.statusExplanation, response.headers, response.body,
+            response.bodySize, &response.len);
+    write_response(to, message, response.len);
+    free(response.headers[1]->value);
+    for (int i = 0; i < numHeaders; i++) {
+        free(response.headers[i]);
+    }
+    free(response.headers);
+    free(message);
+}
+
+/**
+ * now_ns()
+ * -----------
+ *  Reads the monotonic clock
+ *
+ *  Returns: the current monotonic time in nanoseconds
+ */
+uint64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NANOSECONDS_PER_SECOND + now.tv_nsec;
+}
+
+/**
+ * record_stage()
+ * -----------------
+ *  Records the time since start in the stage's histogram, without locking,
+ *  and in the usage of the request this thread is handling
+ *
+ *  Metrics* metrics: a pointer to the metrics
+ *  Stage stage: the stage that has just finished
+ *  uint64_t start: the monotonic time the stage started at
+ */
+void record_stage(Metrics* metrics, Stage stage, uint64_t start)
+{
+    uint64_t elapsed = now_ns() - start;
+    Histogram* histogram = &metrics->stages[stage];
+    __atomic_fetch_add(&histogram->counts[histogram_bucket(elapsed)], 1,
+            __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    requestUsage.stageNs[stage] += elapsed;
+    bool operation = stage == STAGE_ROTATE || stage == STAGE_FLIP
+            || stage == STAGE_SCALE || stage == STAGE_CROP;
+    if (operation && requestUsage.numOperations < MAX_TIMED_OPERATIONS) {
+        requestUsage.operations[requestUsage.numOperations] = stage;
+        requestUsage.operationNs[requestUsage.numOperations++] = elapsed;
+    }
+}
+
+/**
+ * count_metric()
+ * -----------------
+ *  Increments a metrics counter without locking
+ *
+ *  uint64_t* counter: the counter to increment
+ */
+void count_metric(uint64_t* counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * histogram_bucket()
+ * ---------------------
+ *  Finds the histogram bucket for a value: values below HISTOGRAM_SUB_BUCKETS
+ *  have a bucket each, and every power of two above is split linearly
+ *
+ *  uint64_t value: the value to find the bucket of
+ *
+ *  Returns: the bucket index
+ */
+int histogram_bucket(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (value >> (exponent - HISTOGRAM_SUB_BITS))
+            & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+/**
+ * histogram_bucket_limit()
+ * ---------------------------
+ *  Finds the exclusive upper limit of the values in a histogram bucket
+ *
+ *  int bucket: the bucket index
+ *
+ *  Returns: the smallest value above the bucket
+ */
+uint64_t histogram_bucket_limit(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t)bucket + 1;
+    }
+    int exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + sub + 1)
+            << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+/**
+ * histogram_quantile()
+ * -----------------------
+ *  Estimates a quantile of the recorded values as the upper limit of the
+ *  bucket it falls in
+ *
+ *  Histogram* histogram: the histogram
+ *  double quantile: the quantile, between 0 and 1
+ *
+ *  Returns: the estimated quantile, or 0 if nothing was recorded
+ */
+uint64_t histogram_quantile(Histogram* histogram, double quantile)
+{
+    uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    uint64_t rank = (uint64_t)ceil(quantile * count);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS && count > 0; i++) {
+        seen += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+        if (seen >= rank) {
+            return histogram_bucket_limit(i);
+        }
+    }
+    return 0;
 }
 
 /**
- * success_response()
- * ----------------------
- *  If the server was successful in processing all operations on the image,
- *  sends a response back to the client with the image data and the
- *  appropriate request
+ * metrics_response()
+ * ---------------------
+ *  Upon receiving a GET request for /metrics, constructs the response in the
+ *  Prometheus text exposition format and sends it back to the client
  *
- *  FILE* to: the fd for sending data to the client
- *  unsigned char* data: the raw binary image data
- *  usigned long numBytes: the number of bytes in the image data
+ *  FILE* to: a file descriptor to send information to the client
+ *  ServerState* server: a pointer to the shared server state
  */
-void success_response(FILE* to, unsigned char* data, unsigned long numBytes)
+void metrics_response(FILE* to, ServerState* server)
 {
     HttpResponse response;
     // Status
     response.status = OK;
     response.statusExplanation = "OK";
+    // Body
+    char* buffer;
+    size_t bufferSize;
+    FILE* text = open_memstream(&buffer, &bufferSize);
+    write_metrics(text, server);
+    fclose(text);
+    response.body = (const unsigned char*)buffer;
+    response.bodySize = bufferSize;
     // Construct Headers
     int numHeaders = 2;
     response.headers = malloc((numHeaders + 1) * sizeof(HttpHeader*));
@@ -1366,17 +7853,17 @@ void success_response(FILE* to, unsigned char* data, unsigned long numBytes)
         response.headers[i] = malloc(sizeof(HttpHeader));
     }
     response.headers[0]->name = "Content-Type";
-    response.headers[0]->value = "image/png";
+    response.headers[0]->value = "text/plain; version=0.0.4";
     response.headers[1]->name = "Content-Length";
-    int length = snprintf(NULL, 0, "%ld", numBytes);
+    int length = snprintf(NULL, 0, "%ld", response.bodySize);
     response.headers[1]->value = malloc(sizeof(char) * (length + 1));
-    snprintf(response.headers[1]->value, length + 1, "%ld", numBytes);
+    snprintf(response.headers[1]->value, length + 1, "%ld", response.bodySize);
     response.headers[2] = NULL;
     unsigned char* message = construct_HTTP_response(response.status,
-            response.statusExplanation, response.headers, data, numBytes,
-            &response.len);
-    fwrite(message, sizeof(unsigned char), response.len, to);
-    fflush(to);
+            response.statusExplanation, response.headers, response.body,
+            response.bodySize, &response.len);
+    write_response(to, message, response.len);
+    free(buffer);
     free(response.headers[1]->value);
     for (int i = 0; i < numHeaders; i++) {
         free(response.headers[i]);
@@ -1386,55 +7873,775 @@ void success_response(FILE* to, unsigned char* data, unsigned long numBytes)
 }
 
 /**
- * end_client_thread()
+ * write_metrics()
+ * ------------------
+ *  Writes every counter, gauge and stage histogram in the Prometheus text
+ *  exposition format
+ *
+ *  FILE* text: the stream to write to
+ *  ServerState* server: a pointer to the shared server state
+ */
+void write_metrics(FILE* text, ServerState* server)
+{
+    static const char* const quantileNames[] = {"0.5", "0.99", "0.999"};
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    Metrics* metrics = server->metrics;
+    pthread_mutex_lock(server->statsMutex);
+    Statistics stats = *server->stats;
+    pthread_mutex_unlock(server->statsMutex);
+    fprintf(text, "# TYPE uqimage_connected_clients gauge\n");
+    fprintf(text, "uqimage_connected_clients %u\n", stats.connected);
+    fprintf(text, "# TYPE uqimage_serviced_clients_total counter\n");
+    fprintf(text, "uqimage_serviced_clients_total %u\n", stats.serviced);
+    fprintf(text, "# TYPE uqimage_http_requests_total counter\n");
+    fprintf(text, "uqimage_http_requests_total{outcome=\"success\"} %u\n",
+            stats.success);
+    fprintf(text, "uqimage_http_requests_total{outcome=\"failure\"} %u\n",
+            stats.unSuccess);
+    fprintf(text, "# TYPE uqimage_operations_total counter\n");
+    fprintf(text, "uqimage_operations_total %u\n", stats.operations);
+    fprintf(text, "# TYPE uqimage_responses_reused_total counter\n");
+    fprintf(text, "uqimage_responses_reused_total{source=\"not_modified\"} "
+                  "%" PRIu64 "\n",
+            __atomic_load_n(&metrics->notModified, __ATOMIC_RELAXED));
+    fprintf(text, "uqimage_responses_reused_total{source=\"cache\"} %" PRIu64
+                  "\n",
+            __atomic_load_n(&metrics->cacheHits, __ATOMIC_RELAXED));
+    fprintf(text, "uqimage_responses_reused_total{source=\"coalesced\"} "
+                  "%" PRIu64 "\n",
+            __atomic_load_n(&metrics->coalesced, __ATOMIC_RELAXED));
+    fprintf(text, "# TYPE uqimage_requests_in_flight gauge\n");
+    fprintf(text, "uqimage_requests_in_flight %" PRId64 "\n",
+            __atomic_load_n(&metrics->inFlight, __ATOMIC_RELAXED));
+    if (server->accessLog != NULL) {
+        fprintf(text, "# TYPE uqimage_access_log_dropped_total counter\n");
+        fprintf(text, "uqimage_access_log_dropped_total %" PRIu64 "\n",
+                access_log_dropped(server->accessLog));
+    }
+    if (server->memory != NULL) {
+        pthread_mutex_lock(&server->memory->mutex);
+        unsigned int waiting = server->memory->waiting;
+        unsigned long long reserved = server->memory->reserved;
+        unsigned int shed = server->memory->shed;
+        pthread_mutex_unlock(&server->memory->mutex);
+        fprintf(text, "# TYPE uqimage_admission_queue_depth gauge\n");
+        fprintf(text, "uqimage_admission_queue_depth %u\n", waiting);
+        fprintf(text, "# TYPE uqimage_memory_reserved_bytes gauge\n");
+        fprintf(text, "uqimage_memory_reserved_bytes %llu\n", reserved);
+        fprintf(text, "# TYPE uqimage_requests_shed_total counter\n");
+        fprintf(text, "uqimage_requests_shed_total %u\n", shed);
+    }
+    fprintf(text, "# TYPE uqimage_stage_seconds histogram\n");
+    for (int i = 0; i < NUM_STAGES; i++) {
+        write_histogram(text, stageNames[i], &metrics->stages[i]);
+    }
+    fprintf(text, "# TYPE uqimage_stage_quantile_seconds gauge\n");
+    for (int i = 0; i < NUM_STAGES; i++) {
+        for (int q = 0; q < 3; q++) {
+            uint64_t value
+                    = histogram_quantile(&metrics->stages[i], quantiles[q]);
+            fprintf(text,
+                    "uqimage_stage_quantile_seconds{stage=\"%s\","
+                    "quantile=\"%s\"} %.9f\n",
+                    stageNames[i], quantileNames[q],
+                    (double)value / NANOSECONDS_PER_SECOND);
+        }
+    }
+}
+
+/**
+ * write_histogram()
+ * --------------------
+ *  Writes one stage histogram in the Prometheus text exposition format, with
+ *  cumulative buckets at each power of two nanoseconds
+ *
+ *  FILE* text: the stream to write to
+ *  const char* stage: the name of the stage
+ *  Histogram* histogram: the histogram to write
+ */
+void write_histogram(FILE* text, const char* stage, Histogram* histogram)
+{
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    for (int exponent = HISTOGRAM_FIRST_EXPORT;
+            exponent <= HISTOGRAM_LAST_EXPORT; exponent++) {
+        uint64_t limit = 1ULL << exponent;
+        while (bucket < HISTOGRAM_BUCKETS
+                && histogram_bucket_limit(bucket) <= limit) {
+            cumulative += __atomic_load_n(
+                    &histogram->counts[bucket], __ATOMIC_RELAXED);
+            bucket++;
+        }
+        fprintf(text,
+                "uqimage_stage_seconds_bucket{stage=\"%s\",le=\"%.9f\"} "
+                "%" PRIu64 "\n",
+                stage, (double)limit / NANOSECONDS_PER_SECOND, cumulative);
+    }
+    // Count from the buckets, not the total, so +Inf is never below the last
+    // bucket while a value is being recorded
+    uint64_t count = cumulative;
+    for (; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        count += __atomic_load_n(&histogram->counts[bucket], __ATOMIC_RELAXED);
+    }
+    fprintf(text,
+            "uqimage_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %" PRIu64
+            "\n",
+            stage, count);
+    fprintf(text, "uqimage_stage_seconds_sum{stage=\"%s\"} %.9f\n", stage,
+            (double)__atomic_load_n(&histogram->sum, __ATOMIC_RELAXED)
+                    / NANOSECONDS_PER_SECOND);
+    fprintf(text, "uqimage_stage_seconds_count{stage=\"%s\"} %" PRIu64 "\n",
+            stage, count);
+}
+
+/**
+ * thread_cpu_ns()
+ * ------------------
+ *  Reads the CPU time consumed by the calling thread
+ *
+ *  Returns: the thread's CPU time in nanoseconds
+ */
+uint64_t thread_cpu_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * NANOSECONDS_PER_SECOND + now.tv_nsec;
+}
+
+/**
+ * begin_request_usage()
+ * ------------------------
+ *  Resets this thread's request usage at the start of a new request
+ *
+ *  bool enabled: whether usage headers are to be added to responses
+ */
+void begin_request_usage(bool enabled)
+{
+    memset(&requestUsage, 0, sizeof(requestUsage));
+    requestUsage.enabled = enabled;
+    requestUsage.startNs = now_ns();
+    if (enabled) {
+        requestUsage.cpuStartNs = thread_cpu_ns();
+    }
+}
+
+/**
+ * note_pixel_bytes()
  * ---------------------
- *  Upon exiting the client thread, close the descriptors and update the
- *  statistics accordingly
+ *  Raises this thread's request peak pixel memory if bytes exceeds it
  *
- *  ThreadArgs* args: a pointer to the thread arguments
- *  FILE* from: the fd for reading the requests
- *  FILE* to: the fd for sending the requests
+ *  unsigned long long bytes: the pixel memory currently held
  */
-void end_client_thread(ThreadArgs* args, FILE* from, FILE* to)
+void note_pixel_bytes(unsigned long long bytes)
 {
-    fclose(from);
-    fclose(to);
-    pthread_mutex_lock(args->statsMutex);
-    args->stats->connected--;
-    args->stats->serviced++;
-    pthread_mutex_unlock(args->statsMutex);
-    if (args->maxGiven) {
-        sem_post(args->semaphore);
+    if (bytes > requestUsage.peakPixelBytes) {
+        requestUsage.peakPixelBytes = bytes;
     }
 }
 
 /**
- * free_operations()
+ * bitmap_bytes()
+ * -----------------
+ *  Finds the pixel memory of a bitmap
+ *
+ *  FIBITMAP* bitmap: the bitmap (may be NULL)
+ *
+ *  Returns: the bytes held by the bitmap's pixels, or 0 if it is NULL
+ */
+unsigned long long bitmap_bytes(FIBITMAP* bitmap)
+{
+    if (bitmap == NULL) {
+        return 0;
+    }
+    return (unsigned long long)FreeImage_GetPitch(bitmap)
+            * FreeImage_GetHeight(bitmap);
+}
+
+/**
+ * write_response()
  * -------------------
- *  Frees the memory associated with the Operation array
+ *  Sends a constructed HTTP response to the client, adding the Server-Timing
+ *  and X-Resource-Usage headers after its own headers if they are enabled,
+ *  and notes its status and size for the access log
  *
- *  Operation** operations: a pointer to the array of operations to free
+ *  FILE* to: the fd for sending the response to
+ *  unsigned char* message: the response from construct_HTTP_response()
+ *  unsigned long len: the number of bytes in the response
  */
-void free_operations(Operation** operations)
+void write_response(FILE* to, unsigned char* message, unsigned long len)
 {
-    for (int i = 0; (*operations)[i].operation != NULL; i++) {
-        free((*operations)[i].operation);
-        free((*operations)[i].direction);
+    sscanf((char*)message, "HTTP/%*s %d", &requestUsage.status);
+    requestUsage.bytesOut += len;
+    unsigned long headersEnd = 0;
+    while (headersEnd + 4 <= len
+            && memcmp(message + headersEnd, "\r\n\r\n", 4) != 0) {
+        headersEnd++;
     }
-    free(*operations);
+    if (!requestUsage.enabled || headersEnd + 4 > len) {
+        fwrite(message, sizeof(unsigned char), len, to);
+        fflush(to);
+        return;
+    }
+    // Keep the last header's line ending, then add ours before the blank line
+    fwrite(message, sizeof(unsigned char), headersEnd + 2, to);
+    write_usage_headers(to);
+    fwrite(message + headersEnd + 2, sizeof(unsigned char),
+            len - headersEnd - 2, to);
+    fflush(to);
 }
 
 /**
- * free_request()
+ * write_usage_headers()
+ * ------------------------
+ *  Writes the Server-Timing header, with an entry for each stage of this
+ *  thread's request that took any time, each operation and the time so far,
+ *  and the X-Resource-Usage header with its peak pixel memory and CPU time
+ *
+ *  FILE* to: the fd for sending the headers to
+ */
+void write_usage_headers(FILE* to)
+{
+    static const char* const timingNames[NUM_STAGES] = {"read", "parse",
+            "decode", "rotate", "flip", "scale", "crop", "encode", "send",
+            "queue", "total"};
+    static const Stage reported[] = {STAGE_QUEUE_WAIT, STAGE_REQUEST_PARSE,
+            STAGE_DECODE, STAGE_ENCODE};
+    fprintf(to, "Server-Timing: ");
+    const char* separator = "";
+    for (size_t i = 0; i < sizeof(reported) / sizeof(reported[0]); i++) {
+        if (requestUsage.stageNs[reported[i]] > 0) {
+            fprintf(to, "%s%s;dur=%.3f", separator, timingNames[reported[i]],
+                    requestUsage.stageNs[reported[i]]
+                            / NANOSECONDS_PER_MILLISECOND);
+            separator = ", ";
+        }
+    }
+    uint64_t timedNs = 0;
+    for (int i = 0; i < requestUsage.numOperations; i++) {
+        fprintf(to, "%sop%d-%s;dur=%.3f", separator, i + 1,
+                timingNames[requestUsage.operations[i]],
+                requestUsage.operationNs[i] / NANOSECONDS_PER_MILLISECOND);
+        separator = ", ";
+        timedNs += requestUsage.operationNs[i];
+    }
+    // Operations beyond the first MAX_TIMED_OPERATIONS are summed together
+    uint64_t operationNs = requestUsage.stageNs[STAGE_ROTATE]
+            + requestUsage.stageNs[STAGE_FLIP]
+            + requestUsage.stageNs[STAGE_SCALE]
+            + requestUsage.stageNs[STAGE_CROP];
+    if (operationNs > timedNs) {
+        fprintf(to, "%sop-rest;dur=%.3f", separator,
+                (operationNs - timedNs) / NANOSECONDS_PER_MILLISECOND);
+        separator = ", ";
+    }
+    fprintf(to, "%stotal;dur=%.3f", separator,
+            (now_ns() - requestUsage.startNs) / NANOSECONDS_PER_MILLISECOND);
+    fprintf(to, "\r\nX-Resource-Usage: peak-pixel-bytes=%llu, cpu-ms=%.3f\r\n",
+            requestUsage.peakPixelBytes,
+            (thread_cpu_ns() - requestUsage.cpuStartNs)
+                    / NANOSECONDS_PER_MILLISECOND);
+}
+
+/**
+ * open_access_log()
+ * --------------------
+ *  Opens the access log file for appending and starts the thread that writes
+ *  entries to it, exiting if the file cannot be opened
+ *
+ *  CommandParameters params: the struct storing information regarding command
+ *  line arguments
+ *
+ *  Returns: the access log
+ */
+AccessLog* open_access_log(CommandParameters params)
+{
+    AccessLog* log = calloc(1, sizeof(AccessLog));
+    log->file = fopen(params.accessLog, "a");
+    if (log->file == NULL) {
+        fprintf(stderr, "uqimageproc: unable to open access log \"%s\"\n",
+                params.accessLog);
+        exit(FAILED_ACCESS_LOG);
+    }
+    pthread_mutex_init(&log->mutex, NULL);
+    pthread_t logThread;
+    pthread_create(&logThread, NULL, access_log_thread, log);
+    pthread_detach(logThread);
+    return log;
+}
+
+/**
+ * access_log_add_ring()
+ * ------------------------
+ *  Creates the ring a new client thread adds its entries to. This is the only
+ *  time a client thread takes the log's mutex.
+ *
+ *  AccessLog* log: a pointer to the access log
+ *
+ *  Returns: the new ring
+ */
+AccessLogRing* access_log_add_ring(AccessLog* log)
+{
+    AccessLogRing* ring = calloc(1, sizeof(AccessLogRing));
+    pthread_mutex_lock(&log->mutex);
+    ring->next = log->rings;
+    log->rings = ring;
+    pthread_mutex_unlock(&log->mutex);
+    return ring;
+}
+
+/**
+ * access_log_begin()
+ * ---------------------
+ *  Claims the next free entry of a ring and fills in the details known before
+ *  the request is handled, or counts the entry as dropped if the ring is full
+ *
+ *  AccessLogRing* ring: the client thread's ring (may be NULL if there is no
+ *  access log)
+ *  ThreadArgs* args: a pointer to the thread arguments
+ *  HttpRequest* request: a pointer to the request about to be handled
+ *
+ *  Returns: the entry, or NULL if there is none to fill in
+ */
+AccessLogEntry* access_log_begin(
+        AccessLogRing* ring, ThreadArgs* args, HttpRequest* request)
+{
+    if (ring == NULL) {
+        return NULL;
+    }
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - tail >= ACCESS_LOG_RING_ENTRIES) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    AccessLogEntry* entry
+            = &ring->entries[ring->head & (ACCESS_LOG_RING_ENTRIES - 1)];
+    clock_gettime(CLOCK_REALTIME, &entry->time);
+    entry->peerAddress = args->peer.sin_addr;
+    entry->peerPort = args->peer.sin_port;
+    snprintf(entry->method, sizeof(entry->method), "%s", request->method);
+    snprintf(entry->path, sizeof(entry->path), "%s", request->address);
+    entry->bytesIn = request->len;
+    return entry;
+}
+
+/**
+ * access_log_commit()
+ * ----------------------
+ *  Completes an entry with the outcome of the request and publishes it to the
+ *  log writer thread
+ *
+ *  AccessLogRing* ring: the client thread's ring
+ *  AccessLogEntry* entry: the entry from access_log_begin() (may be NULL)
+ */
+void access_log_commit(AccessLogRing* ring, AccessLogEntry* entry)
+{
+    if (entry == NULL) {
+        return;
+    }
+    entry->bytesOut = requestUsage.bytesOut;
+    entry->status = requestUsage.status;
+    entry->cacheOutcome = requestUsage.cacheOutcome;
+    memcpy(entry->stageNs, requestUsage.stageNs, sizeof(entry->stageNs));
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * access_log_dropped()
+ * -----------------------
+ *  Counts the entries dropped so far because a ring was full
+ *
+ *  AccessLog* log: a pointer to the access log
+ *
+ *  Returns: the number of entries dropped
+ */
+uint64_t access_log_dropped(AccessLog* log)
+{
+    pthread_mutex_lock(&log->mutex);
+    uint64_t dropped = log->dropped;
+    for (AccessLogRing* ring = log->rings; ring != NULL; ring = ring->next) {
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&log->mutex);
+    return dropped;
+}
+
+/**
+ * access_log_thread()
+ * ----------------------
+ *  The thread that writes out the access log, draining every ring in a batch
+ *  each ACCESS_LOG_FLUSH_NANOSECONDS
+ *
+ *  void* arg: a void pointer to the access log
+ *
+ *  Returns: Null pointer
+ */
+void* access_log_thread(void* arg)
+{
+    AccessLog* log = arg;
+    struct timespec interval = {0, ACCESS_LOG_FLUSH_NANOSECONDS};
+    while (1) {
+        nanosleep(&interval, NULL);
+        access_log_drain(log);
+    }
+    return NULL;
+}
+
+/**
+ * access_log_drain()
+ * ---------------------
+ *  Writes every published entry of every ring to the log file and flushes it,
+ *  freeing the rings of client threads that have finished
+ *
+ *  AccessLog* log: a pointer to the access log
+ */
+void access_log_drain(AccessLog* log)
+{
+    pthread_mutex_lock(&log->mutex);
+    AccessLogRing** link = &log->rings;
+    while (*link != NULL) {
+        AccessLogRing* ring = *link;
+        // Read retired first: once it is set, head will not move again
+        bool retired = __atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (uint64_t i = ring->tail; i < head; i++) {
+            access_log_write(log->file,
+                    &ring->entries[i & (ACCESS_LOG_RING_ENTRIES - 1)]);
+        }
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+        if (retired) {
+            log->dropped += ring->dropped;
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&log->mutex);
+    fflush(log->file);
+}
+
+/**
+ * access_log_write()
+ * ---------------------
+ *  Writes an access log entry to the log file as one line of JSON
+ *
+ *  FILE* file: the log file
+ *  AccessLogEntry* entry: the entry to write
+ */
+void access_log_write(FILE* file, AccessLogEntry* entry)
+{
+    static const char* const outcomeNames[NUM_CACHE_OUTCOMES]
+            = {"none", "miss", "hit", "not_modified", "coalesced"};
+    struct tm utc;
+    gmtime_r(&entry->time.tv_sec, &utc);
+    char timestamp[sizeof("YYYY-MM-DDTHH:MM:SS")];
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &utc);
+    char peer[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &entry->peerAddress, peer, sizeof(peer));
+    fprintf(file, "{\"time\":\"%s.%06ldZ\",\"peer\":\"%s:%u\",\"method\":",
+            timestamp, entry->time.tv_nsec / 1000, peer,
+            ntohs(entry->peerPort));
+    access_log_write_string(file, entry->method);
+    fprintf(file, ",\"path\":");
+    access_log_write_string(file, entry->path);
+    fprintf(file,
+            ",\"bytes_in\":%lu,\"bytes_out\":%llu,\"status\":%d,"
+            "\"cache\":\"%s\",\"stages_ns\":{",
+            entry->bytesIn, entry->bytesOut, entry->status,
+            outcomeNames[entry->cacheOutcome]);
+    const char* separator = "";
+    for (int i = 0; i < NUM_STAGES; i++) {
+        if (entry->stageNs[i] > 0) {
+            fprintf(file, "%s\"%s\":%" PRIu64, separator, stageNames[i],
+                    entry->stageNs[i]);
+            separator = ",";
+        }
+    }
+    fprintf(file, "}}\n");
+}
+
+/**
+ * access_log_write_string()
+ * ----------------------------
+ *  Writes a string to the log file as a quoted JSON string
+ *
+ *  FILE* file: the log file
+ *  const char* string: the string to write
+ */
+void access_log_write_string(FILE* file, const char* string)
+{
+    fputc('"', file);
+    for (const unsigned char* c = (const unsigned char*)string; *c != '\0';
+            c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(file, "\\%c", *c);
+        } else if (*c < ' ' || *c >= 0x7f) {
+            fprintf(file, "\\u%04x", *c);
+        } else {
+            fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+/**
+ * open_shared_stats()
+ * ----------------------
+ *  Creates (or reuses, if a previous server on the same port left it behind)
+ *  the shared memory statistics segment, named after the listening port.
+ *  Statistics are still available through SIGHUP and /metrics if the segment
+ *  cannot be created.
+ *
+ *  int fdServer: the fd for the listen port
+ *  char** name: set to the malloc'd name of the segment if it was created,
+ *  for remove_shared_stats()
+ *
+ *  Returns: the mapped segment, or NULL if it could not be created
+ */
+SharedStats* open_shared_stats(int fdServer, char** name)
+{
+    struct sockaddr_in address;
+    socklen_t addressSize = sizeof(address);
+    getsockname(fdServer, (struct sockaddr*)&address, &addressSize);
+    char segment[sizeof(STATS_SHM_PREFIX) + NI_MAXSERV];
+    snprintf(segment, sizeof(segment), STATS_SHM_PREFIX "%u",
+            ntohs(address.sin_port));
+    int fd = shm_open(
+            segment, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(SharedStats)) < 0) {
+        close(fd);
+        shm_unlink(segment);
+        return NULL;
+    }
+    SharedStats* shared = mmap(NULL, sizeof(SharedStats),
+            PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        shm_unlink(segment);
+        return NULL;
+    }
+    // Readers ignore the segment until the magic number is published
+    __atomic_store_n(&shared->magic, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    shared->version = STATS_VERSION;
+    shared->size = sizeof(SharedStats);
+    shared->sequence = 0;
+    shared->pid = getpid();
+    shared->updatedNs = 0;
+    memset(&shared->counters, 0, sizeof(shared->counters));
+    __atomic_store_n(&shared->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    *name = strdup(segment);
+    return shared;
+}
+
+/**
+ * remove_shared_stats()
+ * ------------------------
+ *  Removes the shared memory statistics segment, if there is one, so that it
+ *  is not left behind once the server has stopped. The mapping itself stays
+ *  valid for the rest of the process.
+ *
+ *  ServerState* server: a pointer to the shared server state
+ */
+void remove_shared_stats(ServerState* server)
+{
+    if (server->sharedName != NULL) {
+        shm_unlink(server->sharedName);
+    }
+}
+
+/**
+ * stats_publisher_thread()
+ * ---------------------------
+ *  The thread that copies the statistics into the shared memory segment each
+ *  STATS_PUBLISH_NANOSECONDS
+ *
+ *  void* arg: a void pointer to the shared server state
+ *
+ *  Returns: Null pointer
+ */
+void* stats_publisher_thread(void* arg)
+{
+    ServerState* server = arg;
+    struct timespec interval = {0, STATS_PUBLISH_NANOSECONDS};
+    while (1) {
+        publish_stats(server);
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * publish_stats()
+ * ------------------
+ *  Gathers the current statistics and writes them to the shared memory
+ *  segment under its seqlock. Only the publisher thread calls this, so the
+ *  sequence number needs no lock of its own.
+ *
+ *  ServerState* server: a pointer to the shared server state
+ */
+void publish_stats(ServerState* server)
+{
+    SharedCounters counters;
+    memset(&counters, 0, sizeof(counters));
+    pthread_mutex_lock(server->statsMutex);
+    counters.connected = server->stats->connected;
+    counters.serviced = server->stats->serviced;
+    counters.success = server->stats->success;
+    counters.unSuccess = server->stats->unSuccess;
+    counters.operations = server->stats->operations;
+    pthread_mutex_unlock(server->statsMutex);
+    Metrics* metrics = server->metrics;
+    counters.notModified
+            = __atomic_load_n(&metrics->notModified, __ATOMIC_RELAXED);
+    counters.cacheHits = __atomic_load_n(&metrics->cacheHits, __ATOMIC_RELAXED);
+    counters.coalesced = __atomic_load_n(&metrics->coalesced, __ATOMIC_RELAXED);
+    counters.inFlight = __atomic_load_n(&metrics->inFlight, __ATOMIC_RELAXED);
+    if (server->memory != NULL) {
+        pthread_mutex_lock(&server->memory->mutex);
+        counters.memoryBudget = server->memory->budget;
+        counters.memoryReserved = server->memory->reserved;
+        counters.admissionWaiting = server->memory->waiting;
+        counters.shed = server->memory->shed;
+        pthread_mutex_unlock(&server->memory->mutex);
+    }
+    if (server->accessLog != NULL) {
+        counters.accessLogDropped = access_log_dropped(server->accessLog);
+    }
+    SharedStats* shared = server->shared;
+    uint32_t sequence = shared->sequence;
+    __atomic_store_n(&shared->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    shared->counters = counters;
+    shared->updatedNs = now_ns();
+    __atomic_store_n(&shared->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * open_capture()
  * -----------------
- *  Frees the memory associated with the HttpRequest
+ *  Creates (or truncates) the capture file and writes its header, exiting if
+ *  it cannot be created
  *
- *  HttpRequest* request: A pointer to the HTTP request to free the memory of
+ *  CommandParameters params: the struct storing information regarding command
+ *  line arguments
+ *
+ *  Returns: the capture state
  */
-void free_request(HttpRequest* request)
+Capture* open_capture(CommandParameters params)
 {
-    free(request->method);
-    free(request->address);
-    free(request->body);
-    free_array_of_headers(request->headers);
+    Capture* capture = calloc(1, sizeof(Capture));
+    capture->fd = open(params.capture, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+            S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    CaptureFileHeader header = {CAPTURE_MAGIC, CAPTURE_VERSION};
+    if (capture->fd < 0
+            || write(capture->fd, &header, sizeof(header)) != sizeof(header)) {
+        fprintf(stderr, "uqimageproc: unable to open capture \"%s\"\n",
+                params.capture);
+        exit(FAILED_CAPTURE);
+    }
+    capture->startNs = now_ns();
+    pthread_mutex_init(&capture->mutex, NULL);
+    capture->sample = params.captureSample;
+    capture->bodies = params.captureBodies;
+    return capture;
+}
+
+/**
+ * capture_request()
+ * --------------------
+ *  Appends a request to the capture file if it is one of the sampled ones.
+ *  Each record goes out in a single append. If only part of it is written
+ *  (e.g. the disk filled), the file is cut back to where the record began,
+ *  so that a reader never meets half a record followed by whole ones; the
+ *  appends are serialised so that no other record can be in between.
+ *  The body is recorded as it was once read, so the headers describing how
+ *  it was sent (chunked, or after a 100 Continue) are replaced by the
+ *  Content-Length of what was read.
+ *
+ *  Capture* capture: the capture state (may be NULL if there is no capture)
+ *  HttpRequest* request: a pointer to the request
+ *  uint64_t start: when the request began to arrive
+ */
+void capture_request(Capture* capture, HttpRequest* request, uint64_t start)
+{
+    if (capture == NULL
+            || __atomic_fetch_add(&capture->seen, 1, __ATOMIC_RELAXED)
+                            % capture->sample
+                    != 0) {
+        return;
+    }
+    char* headers;
+    size_t headersLength;
+    FILE* headerText = open_memstream(&headers, &headersLength);
+    bool sized = false;
+    for (int i = 0; request->headers[i] != NULL; i++) {
+        const char* name = request->headers[i]->name;
+        if (strcasecmp(name, "Transfer-Encoding") == 0
+                || strcasecmp(name, "Content-Length") == 0) {
+            sized = true;
+        } else if (strcasecmp(name, "Expect") != 0) {
+            fprintf(headerText, "%s: %s\r\n", name,
+                    request->headers[i]->value);
+        }
+    }
+    if (sized) {
+        fprintf(headerText, "Content-Length: %lu\r\n", request->len);
+    }
+    fclose(headerText);
+    CaptureRecordHeader record;
+    memset(&record, 0, sizeof(record));
+    record.magic = CAPTURE_RECORD_MAGIC;
+    // A body over the limit was dropped, so only its length is known
+    bool body = capture->bodies && request->body != NULL;
+    record.flags = body ? CAPTURE_HAS_BODY : 0;
+    record.offsetNs = start - capture->startNs;
+    record.bodyLength = request->len;
+    record.methodLength = strlen(request->method);
+    record.pathLength = strlen(request->address);
+    record.headersLength = headersLength;
+    Sha256 ctx;
+    sha256_init(&ctx);
+    if (request->body != NULL) {
+        sha256_update(&ctx, request->body, request->len);
+    }
+    sha256_final(&ctx, record.bodyHash);
+    size_t size = sizeof(record) + record.methodLength + record.pathLength
+            + headersLength + (body ? request->len : 0);
+    unsigned char* buffer = malloc(size);
+    unsigned char* next = buffer;
+    memcpy(next, &record, sizeof(record));
+    next += sizeof(record);
+    memcpy(next, request->method, record.methodLength);
+    next += record.methodLength;
+    memcpy(next, request->address, record.pathLength);
+    next += record.pathLength;
+    memcpy(next, headers, headersLength);
+    next += headersLength;
+    if (body && request->len > 0) {
+        memcpy(next, request->body, request->len);
+    }
+    // A failed write loses this sample, never the request
+    pthread_mutex_lock(&capture->mutex);
+    ssize_t written = -1;
+    off_t recordStart = lseek(capture->fd, 0, SEEK_END);
+    if (!capture->stopped && recordStart >= 0) {
+        written = write(capture->fd, buffer, size);
+    }
+    if (written > 0 && written < (ssize_t)size
+            && ftruncate(capture->fd, recordStart) < 0) {
+        // Nothing appended after the partial record could be read back
+        capture->stopped = true;
+    }
+    pthread_mutex_unlock(&capture->mutex);
+    if (written == (ssize_t)size) {
+        __atomic_fetch_add(&capture->captured, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&capture->failed, 1, __ATOMIC_RELAXED);
+    }
+    free(buffer);
+    free(headers);
 }
@@ -0,0 +1,458 @@
+// uqimageprotobench times uqimageproc's own request handling functions
+#define UQIMAGEPROC_NO_MAIN
+#include "uqimageproc.c"
+
+#define BENCH_MIN_TIME "--min-time"
+#define BENCH_JSON "--json"
+#define BENCH_ONLY "--only"
+#define BENCH_USAGE_ERROR 2
+#define DEFAULT_BENCH_MIN_TIME_MS 200
+#define MIN_BATCH_CALLS 1
+#define BENCH_NS_PER_MS 1000000ULL
+
+/**
+ * An enum for the request handling stages that are timed
+ */
+typedef enum {
+    BENCH_COMPILE, // compile_operations() then free_operations()
+    BENCH_KEY, // compute_job_key(), which normalizes the chain
+    BENCH_HANDLE, // All of the above and the success headers, as one request
+    BENCH_CONSTRUCT, // construct_HTTP_response() alone
+    BENCH_SUCCESS_HEADERS, // content_headers_response()
+    BENCH_INVALID_OPERATION, // invalid_operation_response()
+    BENCH_NOT_MODIFIED, // not_modified_response()
+    NUM_BENCH_STAGES
+} BenchStage;
+
+/**
+ * A struct describing an operation chain to benchmark: a step repeated some
+ * number of times, then a final suffix
+ */
+typedef struct {
+    const char* name; // The name of the chain, as reported
+    const char* step; // The step that is repeated
+    int repeats; // The number of times the step is repeated
+    const char* suffix; // Appended after the repeated steps
+    bool valid; // Whether compile_operations() accepts the chain
+} BenchChain;
+
+/**
+ * A struct storing the allocations made by the program so far, counted by
+ * the interposed allocator
+ */
+typedef struct {
+    uint64_t allocations; // Calls to malloc(), calloc() and realloc()
+    uint64_t bytes; // The bytes those calls asked for
+    uint64_t frees; // Calls to free() with a non-NULL pointer
+} AllocationCount;
+
+/**
+ * A struct storing the cost of one call of a stage
+ */
+typedef struct {
+    uint64_t calls; // The number of calls timed
+    double ns; // Nanoseconds per call
+    double allocations; // Allocations per call
+    double bytes; // Bytes allocated per call
+    double frees; // Frees per call
+} BenchResult;
+
+/**
+ * A struct storing information regarding command line parameters
+ */
+typedef struct {
+    uint64_t minTimeNs; // The minimum time to spend on each stage
+    bool json; // Whether to print JSON lines instead of a table
+    const char* only; // Only benchmark stages with this name, or NULL
+} BenchParameters;
+
+/**
+ * The names of the stages, as reported
+ */
+static const char* const benchStageNames[NUM_BENCH_STAGES] = {"compile",
+        "key", "handle", "construct", "success_headers", "invalid_operation",
+        "not_modified"};
+
+/**
+ * The chains benchmarked: typical requests, then pathological ones that are
+ * still within the request line limits
+ */
+static const BenchChain benchChains[] = {
+        {"single", "/rotate,90", 1, "", true},
+        {"typical", "/scale,640,480/rotate,90/flip,h", 1, "", true},
+        {"mixed_16", "/rotate,-45/flip,v/scale,800,600/flip,h", 4, "", true},
+        {"flips_500", "/flip,h", 500, "", true},
+        {"scales_100", "/scale,10000,10000", 100, "", true},
+        {"invalid_last_500", "/flip,h", 499, "/flip,x", false}};
+
+/**
+ * The allocations counted by the interposed allocator
+ */
+static AllocationCount allocationCount;
+
+/**
+ * The stream the response builders write to
+ */
+static FILE* benchSink;
+
+/*******************************DECLARATIONS***********************************/
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* pointer, size_t size);
+void __libc_free(void* pointer);
+
+BenchParameters bench_arguments(int argc, char** argv);
+void bench_usage_error();
+
+char* build_chain(const BenchChain* chain);
+void benchmark_stage(BenchParameters params, BenchStage stage,
+        const char* chainName, const char* path);
+BenchResult time_stage(BenchParameters params, BenchStage stage,
+        HttpRequest* request, const char* path, size_t pathLength);
+void run_stage(BenchStage stage, HttpRequest* request, const char* path,
+        size_t pathLength);
+void bench_report(BenchParameters params, BenchStage stage,
+        const char* chainName, size_t pathLength, BenchResult result);
+
+/******************************************************************************/
+
+/**
+ * malloc()
+ * -----------
+ *  Counts an allocation, then makes it with the C library's allocator. Being
+ *  defined in the executable, this also sees the allocations made inside
+ *  the C library and libcsse2310a4.
+ *
+ *  size_t size: the number of bytes to allocate
+ *
+ *  Returns: the allocated memory
+ */
+void* malloc(size_t size)
+{
+    allocationCount.allocations++;
+    allocationCount.bytes += size;
+    return __libc_malloc(size);
+}
+
+/**
+ * calloc()
+ * -----------
+ *  Counts a zeroed allocation, then makes it with the C library's allocator
+ *
+ *  size_t count: the number of elements
+ *  size_t size: the size of each element
+ *
+ *  Returns: the allocated memory
+ */
+void* calloc(size_t count, size_t size)
+{
+    allocationCount.allocations++;
+    allocationCount.bytes += count * size;
+    return __libc_calloc(count, size);
+}
+
+/**
+ * realloc()
+ * ------------
+ *  Counts a reallocation as an allocation of its new size, then makes it with
+ *  the C library's allocator
+ *
+ *  void* pointer: the memory to resize, or NULL
+ *  size_t size: the new size in bytes
+ *
+ *  Returns: the resized memory
+ */
+void* realloc(void* pointer, size_t size)
+{
+    allocationCount.allocations++;
+    allocationCount.bytes += size;
+    return __libc_realloc(pointer, size);
+}
+
+/**
+ * free()
+ * ---------
+ *  Counts a free of allocated memory, then frees it with the C library's
+ *  allocator
+ *
+ *  void* pointer: the memory to free, or NULL
+ */
+void free(void* pointer)
+{
+    if (pointer != NULL) {
+        allocationCount.frees++;
+    }
+    __libc_free(pointer);
+}
+
+/**
+ * main()
+ * ------------
+ *  Benchmarks the per-chain stages on every chain, then the response
+ *  builders, printing the time and allocations per call of each
+ *
+ *  int argc: the number of command line parameters
+ *  char** argv: the command line parameters
+ *
+ *  Returns: 0 on successful exit of program
+ */
+int main(int argc, char** argv)
+{
+    BenchParameters params = bench_arguments(argc, argv);
+    benchSink = fopen("/dev/null", "w");
+    if (!params.json) {
+        printf("%-17s %-17s %6s %10s %11s %9s %11s %9s\n", "chain", "stage",
+                "path", "calls", "ns/call", "allocs", "bytes", "frees");
+    }
+    int numChains = sizeof(benchChains) / sizeof(benchChains[0]);
+    for (int c = 0; c < numChains; c++) {
+        char* path = build_chain(&benchChains[c]);
+        for (int stage = BENCH_COMPILE; stage <= BENCH_HANDLE; stage++) {
+            // There is no key for a chain that does not compile
+            if (benchChains[c].valid || stage != BENCH_KEY) {
+                benchmark_stage(params, stage, benchChains[c].name, path);
+            }
+        }
+        free(path);
+    }
+    for (int stage = BENCH_CONSTRUCT; stage < NUM_BENCH_STAGES; stage++) {
+        benchmark_stage(params, stage, "-", "/");
+    }
+    fclose(benchSink);
+    return 0;
+}
+
+/**
+ * bench_arguments()
+ * --------------------
+ *  Parses the command line: optionally the minimum time per stage in
+ *  milliseconds, JSON output, and a single stage to benchmark
+ *
+ *  int argc: the number of parameters in the command line arguments
+ *  char** argv: the command line arguments
+ *
+ *  Returns: a BenchParameters struct storing the arguments
+ */
+BenchParameters bench_arguments(int argc, char** argv)
+{
+    BenchParameters params
+            = {DEFAULT_BENCH_MIN_TIME_MS * BENCH_NS_PER_MS, false, NULL};
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], BENCH_MIN_TIME) == 0 && i + 1 < argc) {
+            char* endPtr;
+            long minTime = strtol(argv[++i], &endPtr, BASE10);
+            if (*argv[i] == '\0' || *endPtr != '\0' || minTime < 1
+                    || minTime > INT32_MAX) {
+                bench_usage_error();
+            }
+            params.minTimeNs = minTime * BENCH_NS_PER_MS;
+        } else if (strcmp(argv[i], BENCH_JSON) == 0) {
+            params.json = true;
+        } else if (strcmp(argv[i], BENCH_ONLY) == 0 && i + 1 < argc) {
+            params.only = argv[++i];
+        } else {
+            bench_usage_error();
+        }
+    }
+    return params;
+}
+
+/**
+ * bench_usage_error()
+ * ----------------------
+ *  Prints the usage message to stderr and exits
+ */
+void bench_usage_error()
+{
+    fprintf(stderr,
+            "Usage: uqimageprotobench [--min-time milliseconds] [--json] "
+            "[--only stage]\n");
+    exit(BENCH_USAGE_ERROR);
+}
+
+/**
+ * build_chain()
+ * ----------------
+ *  Builds the request path of a chain
+ *
+ *  const BenchChain* chain: the chain to build
+ *
+ *  Returns: the malloc'd path
+ */
+char* build_chain(const BenchChain* chain)
+{
+    size_t stepLength = strlen(chain->step);
+    char* path = malloc(stepLength * chain->repeats + strlen(chain->suffix)
+            + 1);
+    for (int i = 0; i < chain->repeats; i++) {
+        memcpy(path + i * stepLength, chain->step, stepLength);
+    }
+    strcpy(path + stepLength * chain->repeats, chain->suffix);
+    return path;
+}
+
+/**
+ * benchmark_stage()
+ * --------------------
+ *  Times a stage on a request and reports it, unless --only names another
+ *
+ *  BenchParameters params: the command line parameters
+ *  BenchStage stage: the stage to time
+ *  const char* chainName: the name of the request's chain
+ *  const char* path: the request's path
+ */
+void benchmark_stage(BenchParameters params, BenchStage stage,
+        const char* chainName, const char* path)
+{
+    if (params.only != NULL
+            && strcmp(params.only, benchStageNames[stage]) != 0) {
+        return;
+    }
+    size_t pathLength = strlen(path);
+    HttpHeader* noHeaders[] = {NULL};
+    HttpRequest request
+            = {POST, malloc(pathLength + 1), NULL, 0, noHeaders, 0};
+    BenchResult result
+            = time_stage(params, stage, &request, path, pathLength);
+    free(request.address);
+    bench_report(params, stage, chainName, pathLength, result);
+}
+
+/**
+ * time_stage()
+ * ---------------
+ *  Runs a stage in batches, doubling the batch until one takes at least
+ *  params.minTimeNs, after one untimed call to warm the caches and the C
+ *  library's lazily allocated state. The calls are deterministic, so the
+ *  allocations of the last batch divide evenly between its calls.
+ *
+ *  BenchParameters params: the command line parameters
+ *  BenchStage stage: the stage to time
+ *  HttpRequest* request: the request to run the stage on
+ *  const char* path: the request's path
+ *  size_t pathLength: the length of path
+ *
+ *  Returns: the cost per call of the last batch
+ */
+BenchResult time_stage(BenchParameters params, BenchStage stage,
+        HttpRequest* request, const char* path, size_t pathLength)
+{
+    run_stage(stage, request, path, pathLength);
+    uint64_t calls = MIN_BATCH_CALLS;
+    while (1) {
+        AllocationCount before = allocationCount;
+        uint64_t start = now_ns();
+        for (uint64_t i = 0; i < calls; i++) {
+            run_stage(stage, request, path, pathLength);
+        }
+        uint64_t elapsedNs = now_ns() - start;
+        if (elapsedNs >= params.minTimeNs) {
+            BenchResult result;
+            result.calls = calls;
+            result.ns = (double)elapsedNs / calls;
+            result.allocations = (double)(allocationCount.allocations
+                                         - before.allocations)
+                    / calls;
+            result.bytes = (double)(allocationCount.bytes - before.bytes)
+                    / calls;
+            result.frees = (double)(allocationCount.frees - before.frees)
+                    / calls;
+            return result;
+        }
+        calls *= 2;
+    }
+}
+
+/**
+ * run_stage()
+ * --------------
+ *  Runs a stage once, calling the server's functions the way handle_request()
+ *  does. The path is copied into the request's address first, as a freshly
+ *  read request would have it, in case a stage modifies it. The handle stage
+ *  starts with begin_request_usage() as a client thread does for each
+ *  request, so its success headers carry the default Server-Timing and
+ *  X-Resource-Usage headers.
+ *
+ *  BenchStage stage: the stage to run
+ *  HttpRequest* request: the request to run it on
+ *  const char* path: the request's path
+ *  size_t pathLength: the length of path
+ */
+void run_stage(BenchStage stage, HttpRequest* request, const char* path,
+        size_t pathLength)
+{
+    memcpy(request->address, path, pathLength + 1);
+    unsigned char key[SHA256_BYTES] = {0};
+    char etag[ETAG_LENGTH + 1];
+    Operation* operations;
+    HttpHeader contentType = {"Content-Type", "text/plain"};
+    HttpHeader* headers[] = {&contentType, NULL};
+    unsigned long len;
+    switch (stage) {
+    case BENCH_COMPILE:
+        operations = compile_operations(request->address);
+        free_operations(&operations);
+        break;
+    case BENCH_KEY:
+        operations = compile_operations(request->address);
+        compute_job_key(*request, operations, key);
+        free_operations(&operations);
+        break;
+    case BENCH_HANDLE:
+        begin_request_usage(true);
+        operations = compile_operations(request->address);
+        if (operations == NULL) {
+            invalid_operation_response(benchSink);
+            break;
+        }
+        compute_job_key(*request, operations, key);
+        free_operations(&operations);
+        content_headers_response(benchSink, 0, key, PNG_CONTENT);
+        break;
+    case BENCH_CONSTRUCT:
+        free(construct_HTTP_response(OK, "OK", headers,
+                (const unsigned char*)"", 0, &len));
+        break;
+    case BENCH_SUCCESS_HEADERS:
+        content_headers_response(benchSink, 0, key, PNG_CONTENT);
+        break;
+    case BENCH_INVALID_OPERATION:
+        invalid_operation_response(benchSink);
+        break;
+    case BENCH_NOT_MODIFIED:
+        format_etag(key, etag);
+        not_modified_response(benchSink, etag);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * bench_report()
+ * -----------------
+ *  Prints the cost of a stage, as a table row or a JSON line
+ *
+ *  BenchParameters params: the command line parameters
+ *  BenchStage stage: the stage that was timed
+ *  const char* chainName: the name of the chain it ran on
+ *  size_t pathLength: the length of the request path
+ *  BenchResult result: its cost per call
+ */
+void bench_report(BenchParameters params, BenchStage stage,
+        const char* chainName, size_t pathLength, BenchResult result)
+{
+    if (params.json) {
+        printf("{\"chain\":\"%s\",\"stage\":\"%s\",\"path_bytes\":%zu,"
+               "\"calls\":%" PRIu64 ",\"ns_per_call\":%.1f,"
+               "\"allocs_per_call\":%.2f,\"bytes_per_call\":%.1f,"
+               "\"frees_per_call\":%.2f}\n",
+                chainName, benchStageNames[stage], pathLength, result.calls,
+                result.ns, result.allocations, result.bytes, result.frees);
+    } else {
+        printf("%-17s %-17s %6zu %10" PRIu64 " %11.1f %9.2f %11.1f %9.2f\n",
+                chainName, benchStageNames[stage], pathLength, result.calls,
+                result.ns, result.allocations, result.bytes, result.frees);
+    }
+    fflush(stdout);
+}
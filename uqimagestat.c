@@ -0,0 +1,330 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define COMMAND_LINE_ERROR 2
+#define NO_SERVER 3
+#define SERVER_EXITED 4
+#define BASE10 10
+#define PORT_MIN 1
+#define PORT_MAX 65535
+#define MIN_INTERVAL 1
+#define MAX_INTERVAL 3600
+#define FOREVER 0
+#define HEADER_EVERY 20
+#define BYTES_PER_MIB 1048576
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+#define STALE_SECONDS 5
+
+#define STATS_SHM_PREFIX "/uqimageproc."
+#define STATS_MAGIC 0x55515354 // "UQST"
+#define STATS_VERSION 1
+
+/**
+ * A struct storing the counters and gauges published by uqimageproc. This
+ * must match the layout in uqimageproc.c for the same STATS_VERSION.
+ */
+typedef struct {
+    uint64_t connected; // Currently connected clients
+    uint64_t serviced; // Clients that have disconnected
+    uint64_t success; // Successfully processed HTTP requests
+    uint64_t unSuccess; // Unsuccessful HTTP requests
+    uint64_t operations; // Operations on images completed
+    uint64_t notModified; // 304 responses sent
+    uint64_t cacheHits; // Responses served from the disk cache
+    uint64_t coalesced; // Responses taken from an identical in-flight job
+    int64_t inFlight; // Requests currently being handled
+    uint64_t memoryBudget; // The global memory budget, 0 if there is none
+    uint64_t memoryReserved; // Image memory currently reserved
+    uint64_t admissionWaiting; // Requests queued for memory
+    uint64_t shed; // Requests refused as the admission queue was full
+    uint64_t accessLogDropped; // Access log entries dropped
+} SharedCounters;
+
+/**
+ * A struct storing the shared memory statistics segment, protected by a
+ * seqlock whose sequence number is odd while the server is updating it
+ */
+typedef struct {
+    uint32_t magic; // STATS_MAGIC
+    uint32_t version; // STATS_VERSION
+    uint32_t size; // The size of this struct
+    uint32_t sequence; // The seqlock sequence number
+    int64_t pid; // The process ID of the server
+    uint64_t updatedNs; // The CLOCK_MONOTONIC time of the last update
+    SharedCounters counters; // The published values
+} SharedStats;
+
+/**
+ * A struct storing information regarding command line parameters
+ */
+typedef struct {
+    int port; // The port the server is listening on
+    int interval; // Seconds between reports
+    int count; // The number of reports, or FOREVER
+} CommandParameters;
+
+/*******************************DECLARATIONS***********************************/
+CommandParameters command_line_arguments(int argc, char** argv);
+int convert_to_int(char* intString, int min, int max);
+void command_line_error();
+
+const SharedStats* open_stats(int port);
+uint64_t read_counters(const SharedStats* shared, SharedCounters* counters);
+uint64_t now_ns();
+void print_header();
+void print_report(const SharedCounters* now, const SharedCounters* before,
+        double seconds);
+double rate(uint64_t now, uint64_t before, double seconds);
+
+/******************************************************************************/
+
+/**
+ * main()
+ * ------------
+ *  Prints a report of the server's statistics every interval seconds, each
+ *  giving the current gauges and the rates of the counters since the last
+ *  report. Exits if the server stops updating its statistics.
+ *
+ *  int argc: the number of command line parameters
+ *  char** argv: the command line parameters
+ *
+ *  Returns: 0 on successful exit of program
+ */
+int main(int argc, char** argv)
+{
+    CommandParameters params = command_line_arguments(argc, argv);
+    const SharedStats* shared = open_stats(params.port);
+    SharedCounters before;
+    read_counters(shared, &before);
+    struct timespec interval = {params.interval, 0};
+    double seconds = params.interval;
+    for (int report = 0; params.count == FOREVER || report < params.count;
+            report++) {
+        nanosleep(&interval, NULL);
+        SharedCounters now;
+        uint64_t updatedNs = read_counters(shared, &now);
+        if (now_ns() - updatedNs > STALE_SECONDS * NANOSECONDS_PER_SECOND) {
+            fprintf(stderr, "uqimagestat: server is no longer running\n");
+            exit(SERVER_EXITED);
+        }
+        if (report % HEADER_EVERY == 0) {
+            print_header();
+        }
+        print_report(&now, &before, seconds);
+        fflush(stdout);
+        before = now;
+    }
+    return 0;
+}
+
+/**
+ * command_line_arguments()
+ * ----------------------------
+ *  Parses the command line arguments: a port, then optionally an interval in
+ *  seconds (default 1) and a number of reports (default unlimited)
+ *
+ *  int argc: the number of parameters in the command line arguments
+ *  char** argv: the command line arguments
+ *
+ *  Returns: a CommandParameters struct storing the arguments
+ */
+CommandParameters command_line_arguments(int argc, char** argv)
+{
+    CommandParameters params = {0, MIN_INTERVAL, FOREVER};
+    if (argc < 2 || argc > 4) {
+        command_line_error();
+    }
+    params.port = convert_to_int(argv[1], PORT_MIN, PORT_MAX);
+    if (argc > 2) {
+        params.interval = convert_to_int(argv[2], MIN_INTERVAL, MAX_INTERVAL);
+    }
+    if (argc > 3) {
+        params.count = convert_to_int(argv[3], 1, INT32_MAX);
+    }
+    return params;
+}
+
+/**
+ * convert_to_int()
+ * --------------------
+ *  Converts a string to an integer, running command_line_error() if it is
+ *  not a number within the given bounds
+ *
+ *  char* intString: the string to convert
+ *  int min: the minimum bound for the int
+ *  int max: the maximum bound for the int
+ *
+ *  Returns: the converted integer
+ */
+int convert_to_int(char* intString, int min, int max)
+{
+    char* endPtr;
+    long int converted = strtol(intString, &endPtr, BASE10);
+    if (*intString == '\0' || *endPtr != '\0' || converted < min
+            || converted > max) {
+        command_line_error();
+    }
+    return (int)converted;
+}
+
+/**
+ * command_line_error()
+ * -----------------------
+ *  Prints the usage message to stderr and exits
+ */
+void command_line_error()
+{
+    fprintf(stderr, "Usage: uqimagestat port [interval [count]]\n");
+    exit(COMMAND_LINE_ERROR);
+}
+
+/**
+ * open_stats()
+ * ---------------
+ *  Maps the statistics segment of the server listening on the given port
+ *  read-only, exiting if there is none or it has an unknown layout
+ *
+ *  int port: the port the server is listening on
+ *
+ *  Returns: the mapped segment
+ */
+const SharedStats* open_stats(int port)
+{
+    char name[sizeof(STATS_SHM_PREFIX) + sizeof("65535")];
+    snprintf(name, sizeof(name), STATS_SHM_PREFIX "%d", port);
+    int fd = shm_open(name, O_RDONLY, 0);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0
+            || (size_t)info.st_size < sizeof(SharedStats)) {
+        fprintf(stderr, "uqimagestat: no server statistics for port %d\n",
+                port);
+        exit(NO_SERVER);
+    }
+    const SharedStats* shared
+            = mmap(NULL, sizeof(SharedStats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED
+            || __atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE)
+                    != STATS_MAGIC) {
+        fprintf(stderr, "uqimagestat: no server statistics for port %d\n",
+                port);
+        exit(NO_SERVER);
+    }
+    if (shared->version != STATS_VERSION
+            || shared->size != sizeof(SharedStats)) {
+        fprintf(stderr,
+                "uqimagestat: server statistics are version %" PRIu32
+                ", expected %d\n",
+                shared->version, STATS_VERSION);
+        exit(NO_SERVER);
+    }
+    return shared;
+}
+
+/**
+ * read_counters()
+ * ------------------
+ *  Takes a consistent copy of the published counters, retrying whenever the
+ *  server was part way through an update
+ *
+ *  const SharedStats* shared: the mapped segment
+ *  SharedCounters* counters: where to copy the counters to
+ *
+ *  Returns: the CLOCK_MONOTONIC time at which the counters were published
+ */
+uint64_t read_counters(const SharedStats* shared, SharedCounters* counters)
+{
+    while (1) {
+        uint32_t start = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+        if (start % 2 == 1) {
+            continue;
+        }
+        memcpy(counters, &shared->counters, sizeof(*counters));
+        uint64_t updatedNs = shared->updatedNs;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) == start) {
+            return updatedNs;
+        }
+    }
+}
+
+/**
+ * now_ns()
+ * -----------
+ *  Reads the monotonic clock the server stamps its updates with
+ *
+ *  Returns: the current time in nanoseconds
+ */
+uint64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NANOSECONDS_PER_SECOND + now.tv_nsec;
+}
+
+/**
+ * print_header()
+ * -----------------
+ *  Prints the two header lines naming the report's columns
+ */
+void print_header()
+{
+    printf("--clients-- ------requests/s------ ----reused/s---- "
+           "-----memory------ -log-\n");
+    printf(" conn inflt     ok   fail    ops    304    hit   coal "
+           "queue  shed    MiB  drop\n");
+}
+
+/**
+ * print_report()
+ * -----------------
+ *  Prints one line of the report
+ *
+ *  const SharedCounters* now: the counters now
+ *  const SharedCounters* before: the counters at the previous report
+ *  double seconds: the seconds between the two
+ */
+void print_report(const SharedCounters* now, const SharedCounters* before,
+        double seconds)
+{
+    printf("%5" PRIu64 " %5" PRId64 " %6.0f %6.0f %6.0f %6.0f %6.0f %6.0f "
+           "%5" PRIu64 " %5.0f %6.0f %5.0f\n",
+            now->connected, now->inFlight,
+            rate(now->success, before->success, seconds),
+            rate(now->unSuccess, before->unSuccess, seconds),
+            rate(now->operations, before->operations, seconds),
+            rate(now->notModified, before->notModified, seconds),
+            rate(now->cacheHits, before->cacheHits, seconds),
+            rate(now->coalesced, before->coalesced, seconds),
+            now->admissionWaiting, rate(now->shed, before->shed, seconds),
+            (double)now->memoryReserved / BYTES_PER_MIB,
+            rate(now->accessLogDropped, before->accessLogDropped, seconds));
+}
+
+/**
+ * rate()
+ * ---------
+ *  Finds the rate at which a counter increased. A counter that went backwards
+ *  belongs to a restarted server, so its whole value is counted.
+ *
+ *  uint64_t now: the counter now
+ *  uint64_t before: the counter at the previous report
+ *  double seconds: the seconds between the two
+ *
+ *  Returns: the increase per second
+ */
+double rate(uint64_t now, uint64_t before, double seconds)
+{
+    uint64_t increase = now >= before ? now - before : now;
+    return increase / seconds;
+}